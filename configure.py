@@ -169,6 +169,7 @@ else:
         ldflags.append('-pg')
     elif options.profile == 'pprof':
         libs.append('-lprofiler')
+    libs.append('-lpthread')
 
 def shell_escape(str):
     """Escape str such that it's interpreted as a single argument by the shell."""
@@ -263,33 +264,42 @@ else:
 n.newline()
 
 n.comment('Core source files all build into ninja library.')
-for name in ['build',
+for name in ['arena',
+             'build',
              'build_log',
              'clean',
              'depfile_parser',
+             'deps_log',
              'disk_interface',
              'edit_distance',
              'eval_env',
              'explain',
+             'file_monitor',
              'graph',
              'graphviz',
              'lexer',
+             'manifest_cache',
              'manifest_parser',
+             'mapped_file',
              'metrics',
              'state',
              'util']:
     objs += cxx(name)
 if platform in ('mingw', 'windows'):
-    for name in ['subprocess-win32',
+    for name in ['async_writer-win32',
+                 'subprocess-win32',
                  'includes_normalize-win32',
                  'msvc_helper-win32',
-                 'msvc_helper_main-win32']:
+                 'msvc_helper_main-win32',
+                 'thread_pool-win32']:
         objs += cxx(name)
     if platform == 'windows':
         objs += cxx('minidump-win32')
     objs += cc('getopt')
 else:
+    objs += cxx('async_writer-posix')
     objs += cxx('subprocess-posix')
+    objs += cxx('thread_pool-posix')
 if platform == 'windows':
     ninja_lib = n.build(built('ninja.lib'), 'ar', objs)
 else:
@@ -339,26 +349,31 @@ elif platform == 'windows':
 else:
     test_libs.extend(['-lgtest_main', '-lgtest'])
 
-for name in ['build_log_test',
+for name in ['arena_test',
+             'async_writer_test',
+             'build_log_test',
              'build_test',
              'clean_test',
              'depfile_parser_test',
+             'deps_log_test',
              'disk_interface_test',
              'edit_distance_test',
+             'file_monitor_test',
              'graph_test',
+             'hash_map_test',
              'lexer_test',
+             'manifest_cache_test',
              'manifest_parser_test',
+             'mapped_file_test',
              'state_test',
              'subprocess_test',
              'test',
+             'thread_pool_test',
              'util_test']:
     objs += cxx(name, variables=[('cflags', test_cflags)])
 if platform in ('windows', 'mingw'):
     for name in ['includes_normalize_test', 'msvc_helper_test']:
         objs += cxx(name, variables=[('cflags', test_cflags)])
-
-if platform != 'mingw' and platform != 'windows':
-    test_libs.append('-lpthread')
 ninja_test = n.build(binary('ninja_test'), 'link', objs, implicit=ninja_lib,
                      variables=[('ldflags', test_ldflags),
                                 ('libs', test_libs)])
@@ -370,6 +385,12 @@ n.comment('Ancillary executables.')
 objs = cxx('parser_perftest')
 all_targets += n.build(binary('parser_perftest'), 'link', objs,
                        implicit=ninja_lib, variables=[('libs', libs)])
+objs = cxx('manifest_read_perftest')
+all_targets += n.build(binary('manifest_read_perftest'), 'link', objs,
+                       implicit=ninja_lib, variables=[('libs', libs)])
+objs = cxx('manifest_perftest')
+all_targets += n.build(binary('manifest_perftest'), 'link', objs,
+                       implicit=ninja_lib, variables=[('libs', libs)])
 objs = cxx('build_log_perftest')
 all_targets += n.build(binary('build_log_perftest'), 'link', objs,
                        implicit=ninja_lib, variables=[('libs', libs)])
@@ -0,0 +1,36 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "arena.h"
+
+Arena::~Arena() {
+  for (vector<char*>::iterator i = blocks_.begin(); i != blocks_.end(); ++i)
+    delete [] *i;
+}
+
+void* Arena::AllocSlow(size_t size) {
+  // Give big allocations a block of their own, so the rest of the current
+  // block isn't wasted.
+  if (size > kBlockSize / 4) {
+    char* block = new char[size];
+    blocks_.push_back(block);
+    return block;
+  }
+
+  char* block = new char[kBlockSize];
+  blocks_.push_back(block);
+  ptr_ = block + size;
+  end_ = block + kBlockSize;
+  return block;
+}
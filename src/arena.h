@@ -0,0 +1,63 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef NINJA_ARENA_H_
+#define NINJA_ARENA_H_
+
+#include <stddef.h>
+
+#include <vector>
+using namespace std;
+
+/// A bump allocator.  Memory is carved out of large blocks, so objects
+/// allocated together sit together, and is only released, all at once,
+/// when the arena is destroyed.  Destructors of objects placed in the
+/// arena are up to the owner to run.
+struct Arena {
+  Arena() : ptr_(NULL), end_(NULL), bytes_allocated_(0) {}
+  ~Arena();
+
+  /// Return \a size bytes of memory, aligned for any object.
+  void* Alloc(size_t size) {
+    size = (size + kAlignment - 1) & ~(kAlignment - 1);
+    bytes_allocated_ += size;
+    if (size > (size_t)(end_ - ptr_))
+      return AllocSlow(size);
+    char* result = ptr_;
+    ptr_ += size;
+    return result;
+  }
+
+  /// The number of bytes handed out so far.
+  size_t bytes_allocated() const { return bytes_allocated_; }
+
+ private:
+  static const size_t kAlignment = sizeof(double) > sizeof(void*) ?
+      sizeof(double) : sizeof(void*);
+  static const size_t kBlockSize = 64 << 10;
+
+  /// Alloc() for when the current block is full.
+  void* AllocSlow(size_t size);
+
+  char* ptr_;
+  char* end_;
+  size_t bytes_allocated_;
+  vector<char*> blocks_;
+
+  // Not copyable.
+  Arena(const Arena&);
+  void operator=(const Arena&);
+};
+
+#endif  // NINJA_ARENA_H_
@@ -0,0 +1,39 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "arena.h"
+
+#include <string.h>
+
+#include <gtest/gtest.h>
+
+TEST(ArenaTest, Alloc) {
+  Arena arena;
+  vector<char*> ptrs;
+  // Enough small allocations to need several blocks, with a big one in
+  // between.
+  for (int i = 1; i < 5000; ++i) {
+    size_t size = i == 2000 ? 100000 : i % 64 + 1;
+    char* p = static_cast<char*>(arena.Alloc(size));
+    EXPECT_EQ(0u, (size_t)p % sizeof(void*));
+    memset(p, i & 0xff, size);
+    ptrs.push_back(p);
+  }
+  // Nothing was overwritten by a later allocation.
+  for (int i = 1; i < 5000; ++i) {
+    size_t size = i == 2000 ? 100000 : i % 64 + 1;
+    EXPECT_EQ((char)(i & 0xff), ptrs[i - 1][size - 1]);
+  }
+  EXPECT_GE(arena.bytes_allocated(), 100000u);
+}
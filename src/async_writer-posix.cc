@@ -0,0 +1,165 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "async_writer.h"
+
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "metrics.h"
+
+namespace {
+
+/// The writers that are open, all on the main thread, to be flushed at
+/// exit.
+vector<AsyncWriter*>* g_open_writers;
+
+void FlushOpenWriters() {
+  if (!g_open_writers)
+    return;
+  for (vector<AsyncWriter*>::iterator i = g_open_writers->begin();
+       i != g_open_writers->end(); ++i) {
+    (*i)->Flush();
+  }
+}
+
+}  // anonymous namespace
+
+AsyncWriter::AsyncWriter()
+    : file_(NULL), out_(NULL), sync_interval_ms_(0), last_sync_(0),
+      prologue_(NULL),
+      writing_(false), closing_(false) {
+  pthread_mutex_init(&mutex_, NULL);
+  pthread_cond_init(&work_cond_, NULL);
+  pthread_cond_init(&done_cond_, NULL);
+}
+
+AsyncWriter::~AsyncWriter() {
+  Close();
+  pthread_cond_destroy(&done_cond_);
+  pthread_cond_destroy(&work_cond_);
+  pthread_mutex_destroy(&mutex_);
+}
+
+void AsyncWriter::Open(FILE* file, int sync_interval_ms, Prologue* prologue) {
+  Close();
+  file_ = out_ = file;
+  sync_interval_ms_ = sync_interval_ms;
+  prologue_ = prologue;
+  last_sync_ = GetTimeMillis();
+  closing_ = false;
+  // The prologue counts as a batch being written, so Flush() waits for it.
+  writing_ = prologue != NULL;
+
+  // The thread must not take signals meant for the main thread, such as
+  // the SIGINT the build loop waits for, so it starts with all blocked.
+  sigset_t all, old;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  int ret = pthread_create(&thread_, NULL, WriterMain, this);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  if (ret != 0)
+    Fatal("pthread_create: %s", strerror(ret));
+
+  if (!g_open_writers) {
+    g_open_writers = new vector<AsyncWriter*>;
+    atexit(FlushOpenWriters);
+  }
+  g_open_writers->push_back(this);
+}
+
+void AsyncWriter::Write(const char* data, size_t len) {
+  pthread_mutex_lock(&mutex_);
+  pending_.append(data, len);
+  pthread_cond_signal(&work_cond_);
+  pthread_mutex_unlock(&mutex_);
+}
+
+void AsyncWriter::Flush() {
+  pthread_mutex_lock(&mutex_);
+  while (!pending_.empty() || writing_)
+    pthread_cond_wait(&done_cond_, &mutex_);
+  pthread_mutex_unlock(&mutex_);
+}
+
+void AsyncWriter::Close() {
+  if (!file_)
+    return;
+  pthread_mutex_lock(&mutex_);
+  closing_ = true;
+  pthread_cond_signal(&work_cond_);
+  pthread_mutex_unlock(&mutex_);
+  pthread_join(thread_, NULL);
+
+  g_open_writers->erase(find(g_open_writers->begin(), g_open_writers->end(),
+                             this));
+  if (sync_interval_ms_ > 0)
+    Sync();
+  fclose(out_);
+  file_ = out_ = NULL;
+}
+
+void AsyncWriter::WriteBatch(const char* data, size_t len) {
+  fwrite(data, 1, len, out_);
+  fflush(out_);
+  if (sync_interval_ms_ > 0 &&
+      GetTimeMillis() - last_sync_ >= sync_interval_ms_) {
+    Sync();
+  }
+}
+
+void AsyncWriter::Sync() {
+  fsync(fileno(out_));
+  last_sync_ = GetTimeMillis();
+}
+
+// static
+void* AsyncWriter::WriterMain(void* arg) {
+  static_cast<AsyncWriter*>(arg)->Run();
+  return NULL;
+}
+
+void AsyncWriter::Run() {
+  if (prologue_) {
+    out_ = prologue_->Write(file_);
+    fflush(out_);
+  }
+
+  string batch;
+  pthread_mutex_lock(&mutex_);
+  writing_ = false;
+  pthread_cond_broadcast(&done_cond_);
+  for (;;) {
+    while (pending_.empty() && !closing_)
+      pthread_cond_wait(&work_cond_, &mutex_);
+    // Everything queued is written before closing.
+    if (pending_.empty())
+      break;
+
+    batch.swap(pending_);
+    writing_ = true;
+    pthread_mutex_unlock(&mutex_);
+    WriteBatch(batch.data(), batch.size());
+    batch.clear();
+    pthread_mutex_lock(&mutex_);
+    writing_ = false;
+    pthread_cond_broadcast(&done_cond_);
+  }
+  pthread_mutex_unlock(&mutex_);
+}
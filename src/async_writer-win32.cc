@@ -0,0 +1,71 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "async_writer.h"
+
+#include <io.h>
+
+#include "metrics.h"
+
+// Without a writer thread (see thread_pool-win32.cc), data is written as
+// it comes, and the C runtime flushes the file at exit.
+
+AsyncWriter::AsyncWriter()
+    : file_(NULL), out_(NULL), sync_interval_ms_(0), last_sync_(0),
+      prologue_(NULL) {}
+
+AsyncWriter::~AsyncWriter() {
+  Close();
+}
+
+void AsyncWriter::Open(FILE* file, int sync_interval_ms, Prologue* prologue) {
+  Close();
+  file_ = out_ = file;
+  sync_interval_ms_ = sync_interval_ms;
+  last_sync_ = GetTimeMillis();
+  prologue_ = prologue;
+  if (prologue_) {
+    out_ = prologue_->Write(file_);
+    fflush(out_);
+  }
+}
+
+void AsyncWriter::Write(const char* data, size_t len) {
+  WriteBatch(data, len);
+}
+
+void AsyncWriter::Flush() {}
+
+void AsyncWriter::Close() {
+  if (!file_)
+    return;
+  if (sync_interval_ms_ > 0)
+    Sync();
+  fclose(out_);
+  file_ = out_ = NULL;
+}
+
+void AsyncWriter::WriteBatch(const char* data, size_t len) {
+  fwrite(data, 1, len, out_);
+  fflush(out_);
+  if (sync_interval_ms_ > 0 &&
+      GetTimeMillis() - last_sync_ >= sync_interval_ms_) {
+    Sync();
+  }
+}
+
+void AsyncWriter::Sync() {
+  _commit(_fileno(out_));
+  last_sync_ = GetTimeMillis();
+}
@@ -0,0 +1,106 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef NINJA_ASYNC_WRITER_H_
+#define NINJA_ASYNC_WRITER_H_
+
+#include <stdio.h>
+
+#include <string>
+using namespace std;
+
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+
+#include "util.h"  // int64_t
+
+/// Appends to a file from a background thread, so that whoever produces
+/// the data never waits for the disk.  Data passed to Write() reaches the
+/// file in order, grouped into as few writes as the thread can manage:
+/// whatever is queued while one batch is being written goes out with the
+/// next.  Open writers are flushed if the process exits without closing
+/// them.
+///
+/// On Windows there is no thread, and data is written as it comes.  The
+/// prologue, if any, is written by Open().
+struct AsyncWriter {
+  AsyncWriter();
+  /// Calls Close().
+  ~AsyncWriter();
+
+  /// Writes whatever has to come before the queued data, on the writer
+  /// thread.
+  struct Prologue {
+    virtual ~Prologue() {}
+    /// Write to \a file, and return the file to append the queued data
+    /// to: \a file, or another one opened in its place after closing it.
+    virtual FILE* Write(FILE* file) = 0;
+  };
+
+  /// Start appending to \a file, which the writer then owns.  If
+  /// \a sync_interval_ms is positive, the file is also synced to disk
+  /// after a batch whenever it hasn't been for that long, and on Close().
+  /// If \a prologue is given, it gets to write to the file first, while
+  /// Write() already queues; it must outlive the writer's Close().
+  void Open(FILE* file, int sync_interval_ms, Prologue* prologue = NULL);
+
+  bool is_open() const { return file_ != NULL; }
+
+  /// Queue \a len bytes at \a data to be written.
+  void Write(const char* data, size_t len);
+
+  /// Block until everything queued so far has been written.
+  void Flush();
+
+  /// Write everything queued, then close the file.
+  void Close();
+
+ private:
+  /// Write \a len bytes at \a data to file_, syncing if it's time to.
+  void WriteBatch(const char* data, size_t len);
+  /// Sync file_ to disk.
+  void Sync();
+
+  /// The file given to Open(), while open.
+  FILE* file_;
+  /// The file the data goes to: file_, unless the prologue replaced it.
+  FILE* out_;
+  int sync_interval_ms_;
+  int64_t last_sync_;
+  Prologue* prologue_;
+
+#ifndef _WIN32
+  static void* WriterMain(void* arg);
+  void Run();
+
+  pthread_t thread_;
+  pthread_mutex_t mutex_;
+  /// Signalled when data is queued or the writer is closing.
+  pthread_cond_t work_cond_;
+  /// Signalled when a batch has been written.
+  pthread_cond_t done_cond_;
+  /// Data queued but not yet picked up by the thread.
+  string pending_;
+  /// Whether the thread is writing a batch.
+  bool writing_;
+  bool closing_;
+#endif
+
+  // Not copyable.
+  AsyncWriter(const AsyncWriter&);
+  void operator=(const AsyncWriter&);
+};
+
+#endif  // NINJA_ASYNC_WRITER_H_
@@ -0,0 +1,78 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "async_writer.h"
+
+#include <gtest/gtest.h>
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+#include "util.h"
+
+namespace {
+
+const char kTestFilename[] = "AsyncWriterTest-tempfile";
+
+struct AsyncWriterTest : public testing::Test {
+  virtual void SetUp() { unlink(kTestFilename); }
+  virtual void TearDown() { unlink(kTestFilename); }
+};
+
+TEST_F(AsyncWriterTest, WritesInOrder) {
+  FILE* f = fopen(kTestFilename, "wb");
+  ASSERT_TRUE(f);
+  AsyncWriter writer;
+  writer.Open(f, 0);
+  EXPECT_TRUE(writer.is_open());
+
+  string expected;
+  for (int i = 0; i < 10000; ++i) {
+    char buf[32];
+    sprintf(buf, "line %d\n", i);
+    writer.Write(buf, strlen(buf));
+    expected += buf;
+  }
+
+  // Everything is in the file after a Flush(), and it stays open.
+  writer.Flush();
+  string contents, err;
+  ASSERT_EQ(0, ReadFile(kTestFilename, &contents, &err));
+  EXPECT_EQ(expected, contents);
+  EXPECT_TRUE(writer.is_open());
+
+  writer.Write("last\n", 5);
+  writer.Close();
+  EXPECT_FALSE(writer.is_open());
+  contents.clear();
+  ASSERT_EQ(0, ReadFile(kTestFilename, &contents, &err));
+  EXPECT_EQ(expected + "last\n", contents);
+}
+
+TEST_F(AsyncWriterTest, SyncsOnClose) {
+  FILE* f = fopen(kTestFilename, "wb");
+  ASSERT_TRUE(f);
+  {
+    AsyncWriter writer;
+    writer.Open(f, 1);
+    writer.Write("data", 4);
+    // Destroying the writer closes it.
+  }
+  string contents, err;
+  ASSERT_EQ(0, ReadFile(kTestFilename, &contents, &err));
+  EXPECT_EQ("data", contents);
+}
+
+}  // anonymous namespace
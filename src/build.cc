@@ -32,6 +32,8 @@
 #endif
 
 #include "build_log.h"
+#include "depfile_parser.h"
+#include "deps_log.h"
 #include "disk_interface.h"
 #include "graph.h"
 #include "state.h"
@@ -324,24 +326,50 @@ void BuildStatus::PrintStatus(Edge* edge) {
 Plan::Plan() : command_edges_(0), wanted_edges_(0) {}
 
 bool Plan::AddTarget(Node* node, string* err) {
-  vector<Node*> stack;
-  return AddSubTarget(node, &stack, err);
+  // Go depth first, with a stack of our own rather than the call stack,
+  // which very deep graphs would overflow.  Each edge's inputs are only
+  // added the first time one of its outputs comes up, which want_ records.
+  bool visit = false;
+  bool added = AddSubTarget(node, &visit, err);
+  if (visit) {
+    stack_.push_back(Visit(node));
+    on_stack_.insert(node);
+  }
+  while (!stack_.empty()) {
+    Node* input = NextInput(&stack_.back());
+    if (!input) {
+      on_stack_.erase(stack_.back().node);
+      stack_.pop_back();
+      continue;
+    }
+    visit = false;
+    if (!AddSubTarget(input, &visit, err) && !err->empty()) {
+      stack_.clear();
+      on_stack_.clear();
+      return false;
+    }
+    if (visit) {
+      stack_.push_back(Visit(input));
+      on_stack_.insert(input);
+    }
+  }
+  return added;
 }
 
-bool Plan::AddSubTarget(Node* node, vector<Node*>* stack, string* err) {
+bool Plan::AddSubTarget(Node* node, bool* visit, string* err) {
   Edge* edge = node->in_edge();
   if (!edge) {  // Leaf node.
     if (node->dirty()) {
       string referenced;
-      if (!stack->empty())
-        referenced = ", needed by '" + stack->back()->path() + "',";
+      if (!stack_.empty())
+        referenced = ", needed by '" + stack_.back().node->path() + "',";
       *err = "'" + node->path() + "'" + referenced + " missing "
              "and no known rule to make it";
     }
     return false;
   }
 
-  if (CheckDependencyCycle(node, stack, err))
+  if (CheckDependencyCycle(node, err))
     return false;
 
   if (edge->outputs_ready())
@@ -364,38 +392,45 @@ bool Plan::AddSubTarget(Node* node, vector<Node*>* stack, string* err) {
       ++command_edges_;
   }
 
-  if (!want_ins.second)
-    return true;  // We've already processed the inputs.
+  // The inputs only need adding the first time.
+  *visit = want_ins.second;
+  return true;
+}
 
-  stack->push_back(node);
-  for (vector<Node*>::iterator i = edge->inputs_.begin();
-       i != edge->inputs_.end(); ++i) {
-    if (!AddSubTarget(*i, stack, err) && !err->empty())
-      return false;
+Node* Plan::NextInput(Visit* visit) {
+  Edge* edge = visit->node->in_edge();
+  if (visit->input < edge->inputs_.size())
+    return edge->inputs_[visit->input++];
+  while (visit->dep_set < edge->dep_sets_.size()) {
+    DepSet* dep_set = edge->dep_sets_[visit->dep_set];
+    if (visit->dep == 0 && added_dep_sets_.count(dep_set)) {
+      ++visit->dep_set;
+      continue;
+    }
+    if (visit->dep < dep_set->size())
+      return dep_set->begin()[visit->dep++];
+    // Only once its nodes are done, so that cycles through it are found.
+    added_dep_sets_.insert(dep_set);
+    ++visit->dep_set;
+    visit->dep = 0;
   }
-  assert(stack->back() == node);
-  stack->pop_back();
-
-  return true;
+  return NULL;
 }
 
-bool Plan::CheckDependencyCycle(Node* node, vector<Node*>* stack, string* err) {
-  vector<Node*>::reverse_iterator ri =
-      find(stack->rbegin(), stack->rend(), node);
-  if (ri == stack->rend())
+bool Plan::CheckDependencyCycle(Node* node, string* err) {
+  if (!on_stack_.count(node))
     return false;
 
-  // Add this node onto the stack to make it clearer where the loop
-  // is.
-  stack->push_back(node);
-
-  vector<Node*>::iterator start = find(stack->begin(), stack->end(), node);
+  vector<Visit>::iterator start = stack_.begin();
+  while (start->node != node)
+    ++start;
   *err = "dependency cycle: ";
-  for (vector<Node*>::iterator i = start; i != stack->end(); ++i) {
-    if (i != start)
-      err->append(" -> ");
-    err->append((*i)->path());
+  for (vector<Visit>::iterator i = start; i != stack_.end(); ++i) {
+    err->append(i->node->path());
+    err->append(" -> ");
   }
+  // End with this node too, to make it clearer where the loop is.
+  err->append(node->path());
   return true;
 }
 
@@ -424,9 +459,15 @@ void Plan::EdgeFinished(Edge* edge) {
 }
 
 void Plan::NodeFinished(Node* node) {
-  // See if we we want any edges from this node.
-  for (vector<Edge*>::const_iterator i = node->out_edges().begin();
-       i != node->out_edges().end(); ++i) {
+  // See if we we want any edges from this node, whether it's their input
+  // or one of their depfile deps.
+  vector<Edge*> edges = node->out_edges();
+  for (vector<DepSet*>::const_iterator d = node->out_dep_sets().begin();
+       d != node->out_dep_sets().end(); ++d) {
+    edges.insert(edges.end(), (*d)->out_edges().begin(),
+                 (*d)->out_edges().end());
+  }
+  for (vector<Edge*>::iterator i = edges.begin(); i != edges.end(); ++i) {
     map<Edge*, bool>::iterator want_i = want_.find(*i);
     if (want_i == want_.end())
       continue;
@@ -449,49 +490,71 @@ void Plan::CleanNode(DependencyScan* scan, Node* node) {
 
   for (vector<Edge*>::const_iterator ei = node->out_edges().begin();
        ei != node->out_edges().end(); ++ei) {
-    // Don't process edges that we don't actually want.
-    map<Edge*, bool>::iterator want_i = want_.find(*ei);
-    if (want_i == want_.end() || !want_i->second)
-      continue;
+    CleanEdge(scan, *ei);
+  }
+  for (vector<DepSet*>::const_iterator d = node->out_dep_sets().begin();
+       d != node->out_dep_sets().end(); ++d) {
+    for (vector<Edge*>::const_iterator ei = (*d)->out_edges().begin();
+         ei != (*d)->out_edges().end(); ++ei) {
+      CleanEdge(scan, *ei);
+    }
+  }
+}
 
-    // If all non-order-only inputs for this edge are now clean,
-    // we might have changed the dirty state of the outputs.
-    vector<Node*>::iterator begin = (*ei)->inputs_.begin(),
-                            end = (*ei)->inputs_.end() - (*ei)->order_only_deps_;
-    if (find_if(begin, end, mem_fun(&Node::dirty)) == end) {
-      // Recompute most_recent_input and command.
-      Node* most_recent_input = NULL;
-      for (vector<Node*>::iterator ni = begin; ni != end; ++ni) {
-        if (!most_recent_input || (*ni)->mtime() > most_recent_input->mtime())
-          most_recent_input = *ni;
-      }
-      string command = (*ei)->EvaluateCommand(true);
-
-      // Now, recompute the dirty state of each output.
-      bool all_outputs_clean = true;
-      for (vector<Node*>::iterator ni = (*ei)->outputs_.begin();
-           ni != (*ei)->outputs_.end(); ++ni) {
-        if (!(*ni)->dirty())
-          continue;
-
-        if (scan->RecomputeOutputDirty(*ei, most_recent_input,
-                                       command, *ni)) {
-          (*ni)->MarkDirty();
-          all_outputs_clean = false;
-        } else {
-          CleanNode(scan, *ni);
-        }
-      }
+void Plan::CleanEdge(DependencyScan* scan, Edge* edge) {
+  // Don't process edges that we don't actually want.
+  map<Edge*, bool>::iterator want_i = want_.find(edge);
+  if (want_i == want_.end() || !want_i->second)
+    return;
 
-      // If we cleaned all outputs, mark the node as not wanted.
-      if (all_outputs_clean) {
-        want_i->second = false;
-        --wanted_edges_;
-        if (!(*ei)->is_phony())
-          --command_edges_;
-      }
+  // If all non-order-only inputs for this edge are now clean,
+  // we might have changed the dirty state of the outputs.
+  vector<Node*>::iterator begin = edge->inputs_.begin(),
+                          end = edge->inputs_.end() - edge->order_only_deps_;
+  if (find_if(begin, end, mem_fun(&Node::dirty)) != end)
+    return;
+  for (vector<DepSet*>::iterator d = edge->dep_sets_.begin();
+       d != edge->dep_sets_.end(); ++d) {
+    if (find_if((*d)->begin(), (*d)->end(), mem_fun(&Node::dirty)) !=
+        (*d)->end())
+      return;
+  }
+
+  // Recompute most_recent_input.
+  Node* most_recent_input = NULL;
+  for (vector<Node*>::iterator ni = begin; ni != end; ++ni) {
+    if (!most_recent_input || (*ni)->mtime() > most_recent_input->mtime())
+      most_recent_input = *ni;
+  }
+  for (vector<DepSet*>::iterator d = edge->dep_sets_.begin();
+       d != edge->dep_sets_.end(); ++d) {
+    for (Node** ni = (*d)->begin(); ni != (*d)->end(); ++ni) {
+      if (!most_recent_input || (*ni)->mtime() > most_recent_input->mtime())
+        most_recent_input = *ni;
+    }
+  }
+  // Now, recompute the dirty state of each output.
+  bool all_outputs_clean = true;
+  for (vector<Node*>::iterator ni = edge->outputs_.begin();
+       ni != edge->outputs_.end(); ++ni) {
+    if (!(*ni)->dirty())
+      continue;
+
+    if (scan->RecomputeOutputDirty(edge, most_recent_input, *ni)) {
+      (*ni)->MarkDirty();
+      all_outputs_clean = false;
+    } else {
+      CleanNode(scan, *ni);
     }
   }
+
+  // If we cleaned all outputs, mark the node as not wanted.
+  if (all_outputs_clean) {
+    want_i->second = false;
+    --wanted_edges_;
+    if (!edge->is_phony())
+      --command_edges_;
+  }
 }
 
 void Plan::Dump() {
@@ -568,9 +631,10 @@ Edge* RealCommandRunner::WaitForCommand(ExitStatus* status, string* output) {
 }
 
 Builder::Builder(State* state, const BuildConfig& config,
-                 BuildLog* log, DiskInterface* disk_interface)
+                 BuildLog* build_log, DepsLog* deps_log,
+                 DiskInterface* disk_interface)
     : state_(state), config_(config), disk_interface_(disk_interface),
-      scan_(state, log, disk_interface) {
+      scan_(state, build_log, deps_log, disk_interface) {
   status_ = new BuildStatus(config);
 }
 
@@ -787,6 +851,14 @@ void Builder::FinishEdge(Edge* edge, bool success, const string& output) {
           if (input_mtime > restat_mtime)
             restat_mtime = input_mtime;
         }
+        for (vector<DepSet*>::iterator d = edge->dep_sets_.begin();
+             d != edge->dep_sets_.end(); ++d) {
+          for (Node** i = (*d)->begin(); i != (*d)->end(); ++i) {
+            TimeStamp input_mtime = disk_interface_->Stat((*i)->path());
+            if (input_mtime > restat_mtime)
+              restat_mtime = input_mtime;
+          }
+        }
 
         if (restat_mtime != 0 && !edge->rule().depfile().empty()) {
           TimeStamp depfile_mtime = disk_interface_->Stat(edge->EvaluateDepFile());
@@ -804,6 +876,10 @@ void Builder::FinishEdge(Edge* edge, bool success, const string& output) {
     if (edge->HasRspFile())
       disk_interface_->RemoveFile(edge->GetRspFile());
 
+    if (scan_.deps_log() && !edge->rule().depfile().empty() &&
+        !config_.dry_run)
+      RecordDeps(edge);
+
     plan_.EdgeFinished(edge);
   }
 
@@ -816,3 +892,45 @@ void Builder::FinishEdge(Edge* edge, bool success, const string& output) {
     scan_.build_log()->RecordCommand(edge, start_time, end_time, restat_mtime);
 }
 
+void Builder::RecordDeps(Edge* edge) {
+  METRIC_RECORD("depfile ingest");
+  string path = edge->EvaluateDepFile();
+  string err;
+  string content = disk_interface_->ReadFile(path, &err);
+  // A command that didn't write its depfile leaves the output to be
+  // rebuilt next time, as the deps on record are now older than it.
+  if (content.empty()) {
+    if (!err.empty())
+      Warning("%s", err.c_str());
+    return;
+  }
+
+  DepfileParser depfile;
+  if (!depfile.Parse(&content, &err)) {
+    Warning("%s: %s", path.c_str(), err.c_str());
+    return;
+  }
+  Node* output = edge->outputs_[0];
+  if (depfile.out_ != StringPiece(output->path())) {
+    Warning("expected depfile '%s' to mention '%s', got '%s'", path.c_str(),
+            output->path().c_str(), depfile.out_.AsString().c_str());
+    return;
+  }
+
+  vector<Node*> nodes;
+  nodes.reserve(depfile.ins_.size());
+  for (vector<StringPiece>::iterator i = depfile.ins_.begin();
+       i != depfile.ins_.end(); ++i) {
+    if (!CanonicalizePath(const_cast<char*>(i->str_), &i->len_, &err)) {
+      Warning("%s: %s", path.c_str(), err.c_str());
+      return;
+    }
+    nodes.push_back(state_->GetNode(*i));
+  }
+
+  scan_.deps_log()->RecordDeps(output, disk_interface_->Stat(output->path()),
+                               nodes);
+  if (edge->rule().delete_depfile())
+    disk_interface_->RemoveFile(path);
+}
+
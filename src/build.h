@@ -34,6 +34,7 @@ struct DiskInterface;
 struct Edge;
 struct Node;
 struct State;
+struct ThreadPool;
 
 /// Plan stores the state of a build plan: what we intend to build,
 /// which steps we're ready to execute.
@@ -66,9 +67,29 @@ struct Plan {
   int command_edge_count() const { return command_edges_; }
 
 private:
-  bool AddSubTarget(Node* node, vector<Node*>* stack, string* err);
-  bool CheckDependencyCycle(Node* node, vector<Node*>* stack, string* err);
+  /// A node whose edge's inputs AddTarget() is adding, and the next one.
+  struct Visit {
+    explicit Visit(Node* node)
+        : node(node), input(0), dep_set(0), dep(0) {}
+    Node* node;
+    /// The next of the edge's inputs_, then of its dep_sets_, and of the
+    /// nodes in that.
+    size_t input;
+    size_t dep_set;
+    int dep;
+  };
+
+  /// Add \a node, needed by the last of stack_, to the plan, but not its
+  /// inputs.  Returns false if we don't need to build it, filling in
+  /// \a err on error; sets \a visit if its inputs are still to be added.
+  bool AddSubTarget(Node* node, bool* visit, string* err);
+  bool CheckDependencyCycle(Node* node, string* err);
+  /// The next input to add of the edge of \a visit, or NULL if there are
+  /// no more.
+  Node* NextInput(Visit* visit);
   void NodeFinished(Node* node);
+  /// Called by CleanNode() for each edge using a node it has cleaned.
+  void CleanEdge(DependencyScan* scan, Edge* edge);
 
   /// Keep track of which edges we want to build in this plan.  If this map does
   /// not contain an entry for an edge, we do not want to build the entry or its
@@ -79,6 +100,15 @@ private:
 
   set<Edge*> ready_;
 
+  /// The nodes whose inputs AddTarget() is adding, depth first, each
+  /// needed by the one before; and the same as a set.
+  vector<Visit> stack_;
+  set<Node*> on_stack_;
+
+  /// The depfile deps whose nodes are already in the plan.  Many edges
+  /// share them, and they only need adding once.
+  set<DepSet*> added_dep_sets_;
+
   /// Total number of edges that have commands (not phony).
   int command_edges_;
 
@@ -121,7 +151,8 @@ struct BuildConfig {
 /// Builder wraps the build process: starting commands, updating status.
 struct Builder {
   Builder(State* state, const BuildConfig& config,
-          BuildLog* log, DiskInterface* disk_interface);
+          BuildLog* build_log, DepsLog* deps_log,
+          DiskInterface* disk_interface);
   ~Builder();
 
   /// Clean up after interrupted commands by deleting output files.
@@ -148,6 +179,18 @@ struct Builder {
     scan_.set_build_log(log);
   }
 
+  /// Have PrepareScan() work on the threads of \a pool, or with NULL,
+  /// not at all.
+  void SetScanPool(ThreadPool* pool) {
+    scan_.set_scan_pool(pool);
+  }
+
+  /// Do the slow part of the scan of all of \a targets at once, ahead of
+  /// adding them; see DependencyScan::PrepareScan().
+  void PrepareScan(const vector<Node*>& targets) {
+    scan_.PrepareScan(targets);
+  }
+
   State* state_;
   const BuildConfig& config_;
   Plan plan_;
@@ -155,6 +198,9 @@ struct Builder {
   BuildStatus* status_;
 
  private:
+  /// Move the contents of \a edge's depfile into the deps log.
+  void RecordDeps(Edge* edge);
+
   DiskInterface* disk_interface_;
   DependencyScan scan_;
 
@@ -18,8 +18,13 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <algorithm>
+#include <new>
+
 #ifndef _WIN32
+#ifndef __STDC_FORMAT_MACROS
 #define __STDC_FORMAT_MACROS
+#endif
 #include <inttypes.h>
 #include <unistd.h>
 #endif
@@ -27,6 +32,8 @@
 #include "build.h"
 #include "graph.h"
 #include "metrics.h"
+#include "state.h"
+#include "thread_pool.h"
 #include "util.h"
 
 // Implementation details:
@@ -35,350 +42,809 @@
 // older runs.
 // Once the number of redundant entries exceeds a threshold, we write
 // out a new file and replace the existing one with it.
+//
+// A binary log starts with a BinaryHeader and the compacted entries: a
+// hash index of record numbers, the BinaryRecords themselves and a table
+// of their paths.  Records appended since follow, each with its path
+// inline.  Everything is in native byte order and padded to 8 bytes;
+// the log is never shared between machines.
 
 namespace {
 
 const char kFileSignature[] = "# ninja log v%d\n";
 const int kOldestSupportedVersion = 4;
-const int kCurrentVersion = 5;
-
-// 64bit MurmurHash2, by Austin Appleby
-#if defined(_MSC_VER)
-#define BIG_CONSTANT(x) (x)
-#else   // defined(_MSC_VER)
-#define BIG_CONSTANT(x) (x##LLU)
-#endif // !defined(_MSC_VER)
-inline
-uint64_t MurmurHash64A(const void* key, size_t len) {
-  static const uint64_t seed = 0xDECAFBADDECAFBADull;
-  const uint64_t m = BIG_CONSTANT(0xc6a4a7935bd1e995);
-  const int r = 47;
-  uint64_t h = seed ^ (len * m);
-  const uint64_t * data = (const uint64_t *)key;
-  const uint64_t * end = data + (len/8);
-  while(data != end) {
-    uint64_t k = *data++;
-    k *= m;
-    k ^= k >> r;
-    k *= m;
-    h ^= k;
-    h *= m;
-  }
-  const unsigned char* data2 = (const unsigned char*)data;
-  switch(len & 7)
-  {
-  case 7: h ^= uint64_t(data2[6]) << 48;
-  case 6: h ^= uint64_t(data2[5]) << 40;
-  case 5: h ^= uint64_t(data2[4]) << 32;
-  case 4: h ^= uint64_t(data2[3]) << 24;
-  case 3: h ^= uint64_t(data2[2]) << 16;
-  case 2: h ^= uint64_t(data2[1]) << 8;
-  case 1: h ^= uint64_t(data2[0]);
-          h *= m;
-  };
-  h ^= h >> r;
-  h *= m;
-  h ^= h >> r;
-  return h;
+const int kCurrentVersion = 7;
+
+const char kBinarySignature[] = "ninjalog";
+const uint32_t kOldestSupportedBinaryVersion = 6;
+const uint32_t kBinaryVersion = 8;
+
+/// Logs older than these versions have restat mtimes in seconds rather
+/// than nanoseconds.
+const int kNanosecondVersion = 6;
+const uint32_t kNanosecondBinaryVersion = 7;
+const TimeStamp kNanosecondsPerSecond = 1000000000;
+
+/// Logs older than these versions hash commands with MurmurHash64A(),
+/// which needs the length of a command before the command itself, rather
+/// than with MurmurHasher.
+const int kLengthLastVersion = 7;
+const uint32_t kLengthLastBinaryVersion = 8;
+
+const int kDefaultMinCompactionEntryCount = 100;
+const int kDefaultCompactionRatio = 3;
+
+/// Text lines at least this long are skipped, as they were back when the
+/// log was read through a buffer of this size.
+const size_t kMaxLineLength = 256 << 10;
+/// How much of a text log makes it worth parsing as a chunk of its own.
+const size_t kMinChunkSize = 1 << 20;
+/// Chunks per thread parsing a text log, to even out their finishing times.
+const size_t kChunksPerProcessor = 4;
+
+struct BinaryHeader {
+  char signature[sizeof(kBinarySignature) - 1];
+  uint32_t version;
+  uint32_t record_count;
+  /// A power of two greater than record_count, or 0 if there's no index.
+  uint32_t bucket_count;
+  /// The size of the path table, before padding.
+  uint32_t strings_size;
+};
+
+struct BinaryRecord {
+  uint64_t command_hash;
+  int64_t restat_mtime;
+  int32_t start_time;
+  int32_t end_time;
+  /// Where the path starts in the path table; unused in appended records.
+  uint32_t path_offset;
+  uint32_t path_len;
+};
+
+size_t Padded(size_t size) {
+  return (size + 7) & ~(size_t)7;
+}
+
+/// Whether the \a size bytes at \a data start a binary log.
+bool IsBinaryLog(const char* data, size_t size) {
+  return size >= sizeof(kBinarySignature) - 1 &&
+      memcmp(data, kBinarySignature, sizeof(kBinarySignature) - 1) == 0;
+}
+
+bool WriteBinaryHeader(FILE* f, uint32_t record_count, uint32_t bucket_count,
+                       uint32_t strings_size) {
+  BinaryHeader header;
+  memcpy(header.signature, kBinarySignature, sizeof(header.signature));
+  header.version = kBinaryVersion;
+  header.record_count = record_count;
+  header.bucket_count = bucket_count;
+  header.strings_size = strings_size;
+  return fwrite(&header, sizeof(header), 1, f) == 1;
 }
-#undef BIG_CONSTANT
 
+/// Start an empty log in \a f, in the binary format if \a binary.
+bool WriteLogHeader(FILE* f, bool binary) {
+  return binary ? WriteBinaryHeader(f, 0, 0, 0) :
+      fprintf(f, kFileSignature, kCurrentVersion) >= 0;
+}
 
 }  // namespace
 
 // static
 uint64_t BuildLog::LogEntry::HashCommand(StringPiece command) {
-  return MurmurHash64A(command.str_, command.len_);
+  MurmurHasher hasher;
+  hasher.Update(command.str_, command.len_);
+  return hasher.Finish();
 }
 
-BuildLog::LogEntry::LogEntry(const string& output)
+BuildLog::LogEntry::LogEntry(StringPiece output)
   : output(output) {}
 
-BuildLog::LogEntry::LogEntry(const string& output, uint64_t command_hash,
+BuildLog::LogEntry::LogEntry(StringPiece output, uint64_t command_hash,
   int start_time, int end_time, TimeStamp restat_mtime)
   : output(output), command_hash(command_hash),
     start_time(start_time), end_time(end_time), restat_mtime(restat_mtime)
 {}
 
-BuildLog::BuildLog()
-  : log_file_(NULL), needs_recompaction_(false) {}
+BuildLog::BuildLog(State* state)
+  : state_(state), needs_recompaction_(false), can_append_(false),
+    binary_format_(false), write_binary_(false), sync_interval_ms_(0),
+    min_compaction_entry_count_(kDefaultMinCompactionEntryCount),
+    compaction_ratio_(kDefaultCompactionRatio), compaction_(NULL),
+    replace_file_(ReplaceFile),
+    buckets_(NULL),
+    bucket_count_(0), records_(NULL), record_count_(0), strings_(NULL),
+    strings_size_(0), restat_mtime_scale_(1) {}
 
 BuildLog::~BuildLog() {
   Close();
 }
 
 bool BuildLog::OpenForWrite(const string& path, string* err) {
+  Close();
   if (needs_recompaction_) {
-    Close();
+#ifdef _WIN32
+    // A file that is open can't be replaced on Windows, so compact the log
+    // before appending to it.
     if (!Recompact(path, err))
       return false;
+#else
+    // Compact on the writer thread while the build goes on.  Should that
+    // fail, the records written meanwhile go to the log as it is instead,
+    // so a log that is being converted is compacted first.
+    if (can_append_)
+      return StartCompaction(path, err);
+    if (!Recompact(path, err))
+      return false;
+#endif
   }
 
-  log_file_ = fopen(path.c_str(), "ab");
-  if (!log_file_) {
+  FILE* file = fopen(path.c_str(), "a+b");
+  if (!file) {
     *err = strerror(errno);
     return false;
   }
-  setvbuf(log_file_, NULL, _IOLBF, BUFSIZ);
-  SetCloseOnExec(fileno(log_file_));
+  SetCloseOnExec(fileno(file));
 
   // Opening a file in append mode doesn't set the file pointer to the file's
   // end on Windows. Do that explicitly.
-  fseek(log_file_, 0, SEEK_END);
+  fseek(file, 0, SEEK_END);
 
-  if (ftell(log_file_) == 0) {
-    if (fprintf(log_file_, kFileSignature, kCurrentVersion) < 0) {
+  if (ftell(file) == 0) {
+    write_binary_ = binary_format_;
+    if (!WriteLogHeader(file, write_binary_) || fflush(file) != 0) {
       *err = strerror(errno);
+      fclose(file);
       return false;
     }
+  } else {
+    // Keep to the format of the existing log, even if it wasn't loaded
+    // and so couldn't be converted.
+    char signature[sizeof(kBinarySignature) - 1];
+    rewind(file);
+    write_binary_ = fread(signature, sizeof(signature), 1, file) == 1 &&
+        IsBinaryLog(signature, sizeof(signature));
+    fseek(file, 0, SEEK_END);
   }
 
+  log_writer_.Open(file, sync_interval_ms_);
   return true;
 }
 
 void BuildLog::RecordCommand(Edge* edge, int start_time, int end_time,
                              TimeStamp restat_mtime) {
-  string command = edge->EvaluateCommand(true);
-  uint64_t command_hash = LogEntry::HashCommand(command);
+  uint64_t command_hash = edge->GetCommandHash();
+  string record;
   for (vector<Node*>::iterator out = edge->outputs_.begin();
        out != edge->outputs_.end(); ++out) {
     const string& path = (*out)->path();
-    Entries::iterator i = entries_.find(path);
-    LogEntry* log_entry;
-    if (i != entries_.end()) {
-      log_entry = i->second;
-    } else {
-      log_entry = new LogEntry(path);
-      entries_.insert(Entries::value_type(log_entry->output, log_entry));
-    }
+    LogEntry* log_entry = LookupByOutput(path);
+    if (!log_entry)
+      log_entry = AddEntry(InternPath(path));
     log_entry->command_hash = command_hash;
     log_entry->start_time = start_time;
     log_entry->end_time = end_time;
     log_entry->restat_mtime = restat_mtime;
 
-    if (log_file_)
-      WriteEntry(log_file_, *log_entry);
+    if (log_writer_.is_open())
+      WriteEntry(*log_entry, write_binary_, &record);
   }
+  // The writer thread takes it from here, so builds don't wait on the disk.
+  if (!record.empty())
+    log_writer_.Write(record.data(), record.size());
 }
 
-void BuildLog::Close() {
-  if (log_file_)
-    fclose(log_file_);
-  log_file_ = NULL;
-}
-
-class LineReader {
- public:
-  explicit LineReader(FILE* file)
-    : file_(file), buf_end_(buf_), line_start_(buf_), line_end_(NULL) {
-      memset(buf_, 0, sizeof(buf_));
-  }
-
-  // Reads a \n-terminated line from the file passed to the constructor.
-  // On return, *line_start points to the beginning of the next line, and
-  // *line_end points to the \n at the end of the line. If no newline is seen
-  // in a fixed buffer size, *line_end is set to NULL. Returns false on EOF.
-  bool ReadLine(char** line_start, char** line_end) {
-    if (line_start_ >= buf_end_ || !line_end_) {
-      // Buffer empty, refill.
-      size_t size_read = fread(buf_, 1, sizeof(buf_), file_);
-      if (!size_read)
-        return false;
-      line_start_ = buf_;
-      buf_end_ = buf_ + size_read;
-    } else {
-      // Advance to next line in buffer.
-      line_start_ = line_end_ + 1;
-    }
-
-    line_end_ = (char*)memchr(line_start_, '\n', buf_end_ - line_start_);
-    if (!line_end_) {
-      // No newline. Move rest of data to start of buffer, fill rest.
-      size_t already_consumed = line_start_ - buf_;
-      size_t size_rest = (buf_end_ - buf_) - already_consumed;
-      memmove(buf_, line_start_, size_rest);
-
-      size_t read = fread(buf_ + size_rest, 1, sizeof(buf_) - size_rest, file_);
-      buf_end_ = buf_ + size_rest + read;
-      line_start_ = buf_;
-      line_end_ = (char*)memchr(line_start_, '\n', buf_end_ - line_start_);
-    }
-
-    *line_start = line_start_;
-    *line_end = line_end_;
-    return true;
-  }
-
- private:
-  FILE* file_;
-  char buf_[256 << 10];
-  char* buf_end_;  // Points one past the last valid byte in |buf_|.
-
-  char* line_start_;
-  // Points at the next \n in buf_ after line_start, or NULL.
-  char* line_end_;
+/// Parses a newline-aligned chunk of a text log.
+struct BuildLog::TextChunk : public ThreadPool::Task {
+  TextChunk(const char* chunk_start, const char* chunk_end, int log_version,
+            bool last_only)
+      : chunk_start(chunk_start), chunk_end(chunk_end),
+        log_version(log_version), last_only(last_only),
+        total_entry_count(0) {}
+
+  virtual void Run();
+
+  const char* chunk_start;
+  const char* chunk_end;
+  int log_version;
+  /// Whether to keep only the last entry for each output, which saves
+  /// merging the others.  Not worth it when nothing runs in parallel.
+  bool last_only;
+
+  /// The entries in the order they come in, pointing at their paths in
+  /// the chunk.
+  vector<LogEntry> entries;
+  /// With last_only, the position of each output's entry in entries.
+  ExternalStringHashMap<size_t>::Type positions;
+  int total_entry_count;
 };
 
-bool BuildLog::Load(const string& path, string* err) {
-  METRIC_RECORD(".ninja_log load");
-  FILE* file = fopen(path.c_str(), "r");
-  if (!file) {
-    if (errno == ENOENT)
-      return true;
-    *err = strerror(errno);
-    return false;
-  }
-
-  int log_version = 0;
-  int unique_entry_count = 0;
-  int total_entry_count = 0;
-
-  LineReader reader(file);
-  char* line_start = 0;
-  char* line_end = 0;
-  while (reader.ReadLine(&line_start, &line_end)) {
-    if (!log_version) {
-      sscanf(line_start, kFileSignature, &log_version);
-
-      if (log_version < kOldestSupportedVersion) {
-        *err = ("build log version invalid, perhaps due to being too old; "
-                "starting over");
-        fclose(file);
-        unlink(path.c_str());
-        // Don't report this as a failure.  An empty build log will cause
-        // us to rebuild the outputs anyway.
-        return true;
-      }
-    }
+void BuildLog::TextChunk::Run() {
+  const char kFieldSeparator = '\t';
 
-    // If no newline was found in this chunk, read the next.
+  const char* line_start = chunk_start;
+  while (line_start < chunk_end) {
+    const char* line_end =
+        (const char*)memchr(line_start, '\n', chunk_end - line_start);
+    // An unterminated last line is a partial write; ignore it.
     if (!line_end)
+      break;
+    const char* start = line_start;
+    line_start = line_end + 1;
+    if ((size_t)(line_end - start) >= kMaxLineLength)
       continue;
 
-    const char kFieldSeparator = '\t';
-
-    char* start = line_start;
-    char* end = (char*)memchr(start, kFieldSeparator, line_end - start);
+    // The numbers are parsed in place; atoi() and friends stop at the
+    // separator that follows them.
+    const char* end = (const char*)memchr(start, kFieldSeparator,
+                                          line_end - start);
     if (!end)
       continue;
-    *end = 0;
-
-    int start_time = 0, end_time = 0;
-    TimeStamp restat_mtime = 0;
-
-    start_time = atoi(start);
+    int start_time = atoi(start);
     start = end + 1;
 
-    end = (char*)memchr(start, kFieldSeparator, line_end - start);
+    end = (const char*)memchr(start, kFieldSeparator, line_end - start);
     if (!end)
       continue;
-    *end = 0;
-    end_time = atoi(start);
+    int end_time = atoi(start);
     start = end + 1;
 
-    end = (char*)memchr(start, kFieldSeparator, line_end - start);
+    end = (const char*)memchr(start, kFieldSeparator, line_end - start);
     if (!end)
       continue;
-    *end = 0;
-    restat_mtime = atol(start);
+    TimeStamp restat_mtime = strtoll(start, NULL, 10);
+    if (log_version < kNanosecondVersion)
+      restat_mtime *= kNanosecondsPerSecond;
     start = end + 1;
 
-    end = (char*)memchr(start, kFieldSeparator, line_end - start);
+    end = (const char*)memchr(start, kFieldSeparator, line_end - start);
     if (!end)
       continue;
-    string output = string(start, end - start);
+    StringPiece output(start, end - start);
 
     start = end + 1;
     end = line_end;
 
-    LogEntry* entry;
-    Entries::iterator i = entries_.find(output);
-    if (i != entries_.end()) {
-      entry = i->second;
+    uint64_t command_hash;
+    if (log_version >= 5) {
+      command_hash = (uint64_t)strtoull(start, NULL, 16);
     } else {
-      entry = new LogEntry(output);
-      entries_.insert(Entries::value_type(entry->output, entry));
-      ++unique_entry_count;
+      command_hash = LogEntry::HashCommand(StringPiece(start, end - start));
     }
+
     ++total_entry_count;
+    LogEntry entry(output, command_hash, start_time, end_time, restat_mtime);
+    if (last_only) {
+      pair<ExternalStringHashMap<size_t>::Type::iterator, bool> inserted =
+          positions.insert(make_pair(output, entries.size()));
+      if (!inserted.second) {
+        entries[inserted.first->second] = entry;
+        continue;
+      }
+    }
+    entries.push_back(entry);
+  }
+}
 
-    entry->start_time = start_time;
-    entry->end_time = end_time;
-    entry->restat_mtime = restat_mtime;
-    if (log_version >= 5) {
-      char c = *end; *end = '\0';
-      entry->command_hash = (uint64_t)strtoull(start, NULL, 16);
-      *end = c;
+bool BuildLog::Load(const string& path, string* err) {
+  METRIC_RECORD(".ninja_log load");
+  int ret = mapped_log_.Load(path, err);
+  if (ret < 0) {
+    if (ret == -ENOENT) {
+      err->clear();
+      return true;
+    }
+    return false;
+  }
+
+  if (IsBinaryLog(mapped_log_.data(), mapped_log_.size()))
+    return LoadBinary(path, err);
+  bool loaded = LoadText(path, err);
+  // Text entries keep copies of their paths.
+  mapped_log_.Clear();
+  return loaded;
+}
+
+bool BuildLog::LoadText(const string& path, string* err) {
+  const char* data = mapped_log_.data();
+  size_t size = mapped_log_.size();
+  if (!size)
+    return true;  // file was empty
+
+  // sscanf() may measure its whole input, so give it the first line only.
+  char first_line[64];
+  size_t first_line_len = min(size, sizeof(first_line) - 1);
+  memcpy(first_line, data, first_line_len);
+  first_line[first_line_len] = '\0';
+  int log_version = 0;
+  sscanf(first_line, kFileSignature, &log_version);
+  if (log_version < kOldestSupportedVersion) {
+    StartOver(path, "version invalid, perhaps due to being too old", err);
+    return true;
+  }
+
+  // Split the log at line boundaries into a few chunks per processor, as
+  // far as it is big enough to be worth it, and parse them on a thread
+  // each, the calling thread included.  The version line has no fields,
+  // so it is skipped like any other malformed line.
+  size_t processors = max(1, GetProcessorCount());
+  size_t num_chunks = max((size_t)1, min(processors * kChunksPerProcessor,
+                                         size / kMinChunkSize));
+  ThreadPool pool((int)min(processors, num_chunks) - 1);
+  vector<TextChunk*> chunks;
+  const char* begin = data;
+  for (size_t i = 1; i <= num_chunks; ++i) {
+    const char* end = max(begin, data + size / num_chunks * i);
+    if (i == num_chunks) {
+      end = data + size;
     } else {
-      entry->command_hash = LogEntry::HashCommand(StringPiece(start,
-                                                              end - start));
+      const char* newline = (const char*)memchr(end, '\n', data + size - end);
+      end = newline ? newline + 1 : data + size;
     }
+    chunks.push_back(new TextChunk(begin, end, log_version,
+                                   pool.size() > 0));
+    if (i > 1)
+      pool.Post(chunks.back());
+    begin = end;
   }
-  fclose(file);
 
-  if (!line_start) {
-    return true; // file was empty
+  // Merge the chunks in order, so the last entry for each output wins.
+  int unique_entry_count = 0;
+  int total_entry_count = 0;
+  for (vector<TextChunk*>::iterator i = chunks.begin(); i != chunks.end();
+       ++i) {
+    TextChunk* chunk = *i;
+    if (i == chunks.begin())
+      chunk->Run();
+    else
+      pool.Wait(chunk);
+
+    total_entry_count += chunk->total_entry_count;
+    for (vector<LogEntry>::iterator e = chunk->entries.begin();
+         e != chunk->entries.end(); ++e) {
+      LogEntry* entry;
+      Entries::iterator j = entries_.find(e->output);
+      if (j != entries_.end()) {
+        entry = j->second;
+      } else {
+        entry = AddEntry(InternPath(e->output));
+        ++unique_entry_count;
+      }
+      entry->command_hash = e->command_hash;
+      entry->start_time = e->start_time;
+      entry->end_time = e->end_time;
+      entry->restat_mtime = e->restat_mtime;
+    }
+    delete chunk;
   }
+  if (log_version < kLengthLastVersion)
+    UpgradeHashes();
 
   // Decide whether it's time to rebuild the log:
-  // - if we're upgrading versions
+  // - if we're upgrading versions or converting to the binary format
   // - if it's getting large
-  int kMinCompactionEntryCount = 100;
-  int kCompactionRatio = 3;
-  if (log_version < kCurrentVersion) {
+  can_append_ = log_version == kCurrentVersion && !binary_format_;
+  if (!can_append_) {
+    needs_recompaction_ = true;
+  } else if (WantsCompaction(total_entry_count, unique_entry_count)) {
+    needs_recompaction_ = true;
+  }
+
+  return true;
+}
+
+bool BuildLog::LoadBinary(const string& path, string* err) {
+  const char* data = mapped_log_.data();
+  size_t size = mapped_log_.size();
+  BinaryHeader header;
+  if (size < sizeof(header)) {
+    StartOver(path, "truncated", err);
+    return true;
+  }
+  memcpy(&header, data, sizeof(header));
+  if (header.version < kOldestSupportedBinaryVersion ||
+      header.version > kBinaryVersion) {
+    StartOver(path, "version invalid", err);
+    return true;
+  }
+  restat_mtime_scale_ = header.version < kNanosecondBinaryVersion ?
+      kNanosecondsPerSecond : 1;
+  uint64_t index_size = sizeof(header) +
+      (uint64_t)header.bucket_count * sizeof(uint32_t) +
+      (uint64_t)header.record_count * sizeof(BinaryRecord) +
+      Padded(header.strings_size);
+  bool bad_buckets = header.bucket_count ?
+      (header.bucket_count & (header.bucket_count - 1)) != 0 ||
+          header.record_count >= header.bucket_count :
+      header.record_count != 0;
+  if (bad_buckets || index_size > size) {
+    StartOver(path, "corrupt", err);
+    return true;
+  }
+
+  buckets_ = data + sizeof(header);
+  bucket_count_ = header.bucket_count;
+  records_ = buckets_ + bucket_count_ * sizeof(uint32_t);
+  record_count_ = header.record_count;
+  strings_ = records_ + record_count_ * sizeof(BinaryRecord);
+  strings_size_ = header.strings_size;
+
+  // Only the records appended since the last recompaction are read now;
+  // they override whatever the index says about their outputs.
+  int unique_entry_count = record_count_;
+  int total_entry_count = record_count_;
+  const char* p = data + index_size;
+  size_t left = size - index_size;
+  while (left >= sizeof(BinaryRecord)) {
+    BinaryRecord record;
+    memcpy(&record, p, sizeof(record));
+    // A record cut short by an interrupted write ends the log.
+    if (Padded(record.path_len) > left - sizeof(record))
+      break;
+    StringPiece output(p + sizeof(record), record.path_len);
+    p += sizeof(record) + Padded(record.path_len);
+    left -= sizeof(record) + Padded(record.path_len);
+
+    LogEntry* entry = LookupByOutput(output);
+    if (!entry) {
+      entry = AddEntry(output);
+      ++unique_entry_count;
+    }
+    ++total_entry_count;
+
+    entry->command_hash = record.command_hash;
+    entry->start_time = record.start_time;
+    entry->end_time = record.end_time;
+    entry->restat_mtime = record.restat_mtime * restat_mtime_scale_;
+  }
+
+  // Besides the usual reasons, rewrite the log if it ends in a partial
+  // record, so later records aren't appended after it, and fold the
+  // appended records into the index once they outnumber it, as they are
+  // all read on every load.
+  int appended_count = total_entry_count - (int)record_count_;
+  if (header.version < kLengthLastBinaryVersion)
+    UpgradeHashes();
+  can_append_ = binary_format_ && left == 0 &&
+      header.version == kBinaryVersion;
+  if (!can_append_) {
     needs_recompaction_ = true;
-  } else if (total_entry_count > kMinCompactionEntryCount &&
-             total_entry_count > unique_entry_count * kCompactionRatio) {
+  } else if (WantsCompaction(total_entry_count, unique_entry_count) ||
+             (appended_count > min_compaction_entry_count_ &&
+              appended_count > (int)record_count_)) {
     needs_recompaction_ = true;
   }
 
   return true;
 }
 
-BuildLog::LogEntry* BuildLog::LookupByOutput(const string& path) {
+void BuildLog::UpgradeHashes() {
+  METRIC_RECORD(".ninja_log hash upgrade");
+  if (!state_)
+    return;
+  ReadIndex();
+  for (Entries::iterator i = entries_.begin(); i != entries_.end(); ++i) {
+    LogEntry* entry = i->second;
+    Node* node = state_->LookupNode(entry->output);
+    Edge* edge = node ? node->in_edge() : NULL;
+    if (!edge || edge->is_phony())
+      continue;
+    // Only an entry for the command as it is now would have matched.
+    string command = edge->EvaluateCommand(true);
+    if (MurmurHash64A(command.data(), command.size()) == entry->command_hash)
+      entry->command_hash = edge->GetCommandHash();
+  }
+}
+
+void BuildLog::StartOver(const string& path, const char* reason,
+                         string* err) {
+  // Don't report this as a failure.  An empty build log will cause
+  // us to rebuild the outputs anyway.
+  *err = string("build log ") + reason + "; starting over";
+  buckets_ = records_ = strings_ = NULL;
+  bucket_count_ = record_count_ = strings_size_ = 0;
+  entries_.clear();
+  mapped_log_.Clear();
+  unlink(path.c_str());
+}
+
+BuildLog::LogEntry* BuildLog::LookupByOutput(StringPiece path) {
   Entries::iterator i = entries_.find(path);
   if (i != entries_.end())
     return i->second;
+  return LookupIndexed(path);
+}
+
+/// Read record \a number of \a records.  Returns false if its path isn't
+/// within a path table of \a strings_size bytes.
+static bool ReadRecord(const char* records, uint32_t number,
+                       uint32_t strings_size, BinaryRecord* record) {
+  memcpy(record, records + number * sizeof(*record), sizeof(*record));
+  return record->path_offset <= strings_size &&
+      record->path_len <= strings_size - record->path_offset;
+}
+
+BuildLog::LogEntry* BuildLog::LookupIndexed(StringPiece path) {
+  if (!bucket_count_)
+    return NULL;
+  uint32_t mask = bucket_count_ - 1;
+  uint32_t bucket = (uint32_t)MurmurHash64A(path.str_, path.len_) & mask;
+  for (uint32_t probes = 0; probes < bucket_count_; ++probes) {
+    uint32_t number;
+    memcpy(&number, buckets_ + bucket * sizeof(number), sizeof(number));
+    if (number == 0 || number > record_count_)
+      return NULL;
+    BinaryRecord record;
+    if (ReadRecord(records_, number - 1, strings_size_, &record) &&
+        record.path_len == path.len_ &&
+        memcmp(strings_ + record.path_offset, path.str_, path.len_) == 0) {
+      LogEntry* entry = AddEntry(StringPiece(strings_ + record.path_offset,
+                                             record.path_len));
+      entry->command_hash = record.command_hash;
+      entry->start_time = record.start_time;
+      entry->end_time = record.end_time;
+      entry->restat_mtime = record.restat_mtime * restat_mtime_scale_;
+      return entry;
+    }
+    bucket = (bucket + 1) & mask;
+  }
   return NULL;
 }
 
-void BuildLog::WriteEntry(FILE* f, const LogEntry& entry) {
-  fprintf(f, "%d\t%d\t%d\t%s\t%" PRIx64 "\n",
-          entry.start_time, entry.end_time, entry.restat_mtime,
-          entry.output.c_str(), entry.command_hash);
+void BuildLog::ReadIndex() {
+  for (uint32_t i = 0; i < record_count_; ++i) {
+    BinaryRecord record;
+    if (!ReadRecord(records_, i, strings_size_, &record))
+      continue;
+    StringPiece output(strings_ + record.path_offset, record.path_len);
+    if (entries_.find(output) != entries_.end())
+      continue;
+    LogEntry* entry = AddEntry(output);
+    entry->command_hash = record.command_hash;
+    entry->start_time = record.start_time;
+    entry->end_time = record.end_time;
+    entry->restat_mtime = record.restat_mtime * restat_mtime_scale_;
+  }
+  buckets_ = records_ = strings_ = NULL;
+  bucket_count_ = record_count_ = strings_size_ = 0;
 }
 
-bool BuildLog::Recompact(const string& path, string* err) {
-  METRIC_RECORD(".ninja_log recompact");
-  printf("Recompacting log...\n");
+StringPiece BuildLog::InternPath(StringPiece path) {
+  if (state_) {
+    State::Paths::iterator i = state_->paths_.find(path);
+    if (i != state_->paths_.end())
+      return i->second->path();
+  }
+  char* copy = static_cast<char*>(arena_.Alloc(path.len_));
+  memcpy(copy, path.str_, path.len_);
+  return StringPiece(copy, path.len_);
+}
 
-  string temp_path = path + ".recompact";
-  FILE* f = fopen(temp_path.c_str(), "wb");
-  if (!f) {
-    *err = strerror(errno);
+BuildLog::LogEntry* BuildLog::AddEntry(StringPiece output) {
+  // LogEntry has nothing to destroy, so the arena can simply drop it.
+  LogEntry* entry = new (arena_.Alloc(sizeof(LogEntry))) LogEntry(output);
+  entries_.insert(Entries::value_type(entry->output, entry));
+  return entry;
+}
+
+// static
+void BuildLog::WriteEntry(const LogEntry& entry, bool binary, string* out) {
+  if (!binary) {
+    char buf[64];
+    sprintf(buf, "%d\t%d\t%" PRId64 "\t",
+            entry.start_time, entry.end_time, entry.restat_mtime);
+    out->append(buf);
+    out->append(entry.output.str_, entry.output.len_);
+    sprintf(buf, "\t%" PRIx64 "\n", entry.command_hash);
+    out->append(buf);
+    return;
+  }
+  BinaryRecord record;
+  record.command_hash = entry.command_hash;
+  record.restat_mtime = entry.restat_mtime;
+  record.start_time = entry.start_time;
+  record.end_time = entry.end_time;
+  record.path_offset = 0;
+  record.path_len = entry.output.len_;
+  out->append((const char*)&record, sizeof(record));
+  out->append(entry.output.str_, entry.output.len_);
+  out->append(Padded(entry.output.len_) - entry.output.len_, '\0');
+}
+
+/// Write \a entries to \a f as a compacted binary log.
+static bool WriteBinaryLog(FILE* f,
+                           const vector<BuildLog::LogEntry>& entries) {
+  uint32_t bucket_count = 0;
+  if (!entries.empty()) {
+    bucket_count = 2;
+    while (bucket_count < 2 * entries.size())
+      bucket_count *= 2;
+  }
+  uint32_t mask = bucket_count - 1;
+  vector<uint32_t> buckets(bucket_count);
+  vector<BinaryRecord> records(entries.size());
+  string strings;
+  for (size_t i = 0; i < entries.size(); ++i) {
+    const BuildLog::LogEntry& entry = entries[i];
+    BinaryRecord* record = &records[i];
+    record->command_hash = entry.command_hash;
+    record->restat_mtime = entry.restat_mtime;
+    record->start_time = entry.start_time;
+    record->end_time = entry.end_time;
+    record->path_offset = strings.size();
+    record->path_len = entry.output.len_;
+    strings.append(entry.output.str_, entry.output.len_);
+
+    uint32_t bucket =
+        (uint32_t)MurmurHash64A(entry.output.str_, entry.output.len_) & mask;
+    while (buckets[bucket])
+      bucket = (bucket + 1) & mask;
+    buckets[bucket] = i + 1;
+  }
+  uint32_t strings_size = strings.size();
+  strings.resize(Padded(strings.size()));
+
+  if (!WriteBinaryHeader(f, records.size(), bucket_count, strings_size))
     return false;
+  if (!buckets.empty() &&
+      fwrite(&buckets[0], sizeof(buckets[0]), buckets.size(), f) !=
+          buckets.size())
+    return false;
+  if (!records.empty() &&
+      fwrite(&records[0], sizeof(records[0]), records.size(), f) !=
+          records.size())
+    return false;
+  return fwrite(strings.data(), 1, strings.size(), f) == strings.size();
+}
+
+/// Write \a entries to \a f as a text log.
+static bool WriteTextLog(FILE* f, const vector<BuildLog::LogEntry>& entries) {
+  if (fprintf(f, kFileSignature, kCurrentVersion) < 0)
+    return false;
+  string buf;
+  for (size_t i = 0; i < entries.size(); ++i) {
+    BuildLog::WriteEntry(entries[i], false, &buf);
+    if (buf.size() >= (64 << 10) || i + 1 == entries.size()) {
+      if (fwrite(buf.data(), 1, buf.size(), f) != buf.size())
+        return false;
+      buf.clear();
+    }
   }
+  return true;
+}
 
-  if (fprintf(f, kFileSignature, kCurrentVersion) < 0) {
+// static
+bool BuildLog::ReplaceFile(const string& from, const string& to,
+                           string* err) {
+#ifdef _WIN32
+  // rename() won't replace an existing file on Windows.
+  if (unlink(to.c_str()) < 0) {
+    *err = strerror(errno);
+    return false;
+  }
+#endif
+  if (rename(from.c_str(), to.c_str()) < 0) {
     *err = strerror(errno);
-    fclose(f);
     return false;
   }
+  return true;
+}
 
-  for (Entries::iterator i = entries_.begin(); i != entries_.end(); ++i) {
-    WriteEntry(f, *i->second);
+/// A snapshot of the entries of a log, to be written out as a compacted
+/// log.  When compacting during a build, it is written by the log's writer
+/// thread, which then moves it over the log and appends to it from then
+/// on.
+struct BuildLog::Compaction : public AsyncWriter::Prologue {
+  Compaction(const string& path, bool binary_format,
+             ReplaceFileFunction replace_file)
+      : path(path), temp_path(path + ".recompact"),
+        binary_format(binary_format), replace_file(replace_file) {}
+
+  /// Write the compacted log to \a f.
+  bool WriteLog(FILE* f) {
+    return binary_format ? WriteBinaryLog(f, entries) : WriteTextLog(f, entries);
   }
 
-  fclose(f);
-  if (unlink(path.c_str()) < 0) {
+  /// Write the compacted log to \a file, open on temp_path, and replace
+  /// the log with it.  If that fails, append to the log as it is instead,
+  /// which is in the same format, rather than to a copy that replaces
+  /// nothing.
+  virtual FILE* Write(FILE* file) {
+    if (!WriteLog(file) || fflush(file) != 0)
+      error = strerror(errno);
+    else if (replace_file(temp_path, path, &error))
+      return file;
+
+    FILE* log = fopen(path.c_str(), "ab");
+    if (!log) {
+      // Keep the records in the copy, at least.
+      error += string("; appending to the copy at ") + temp_path;
+      return file;
+    }
+    SetCloseOnExec(fileno(log));
+    fclose(file);
+    unlink(temp_path.c_str());
+    // The log may have gone meanwhile.
+    fseek(log, 0, SEEK_END);
+    if (ftell(log) == 0)
+      WriteLogHeader(log, binary_format);
+    return log;
+  }
+
+  string path;
+  string temp_path;
+  bool binary_format;
+  ReplaceFileFunction replace_file;
+  vector<LogEntry> entries;
+  /// What went wrong writing on the writer thread, if anything.
+  string error;
+};
+
+void BuildLog::Close() {
+  log_writer_.Close();
+  if (compaction_) {
+    if (!compaction_->error.empty())
+      Warning("recompacting build log: %s", compaction_->error.c_str());
+    delete compaction_;
+    compaction_ = NULL;
+  }
+}
+
+bool BuildLog::WantsCompaction(int total_entry_count,
+                               int unique_entry_count) const {
+  return compaction_ratio_ > 0 &&
+      total_entry_count > min_compaction_entry_count_ &&
+      total_entry_count > unique_entry_count * compaction_ratio_;
+}
+
+void BuildLog::TakeSnapshot(Compaction* compaction) {
+  // Every entry gets written out, so the index isn't needed anymore.
+  ReadIndex();
+  compaction->entries.reserve(entries_.size());
+  for (Entries::iterator i = entries_.begin(); i != entries_.end(); ++i)
+    compaction->entries.push_back(*i->second);
+}
+
+bool BuildLog::StartCompaction(const string& path, string* err) {
+  METRIC_RECORD(".ninja_log snapshot");
+  Compaction* compaction = new Compaction(path, binary_format_,
+                                          replace_file_);
+  TakeSnapshot(compaction);
+  FILE* file = fopen(compaction->temp_path.c_str(), "wb");
+  if (!file) {
     *err = strerror(errno);
+    delete compaction;
     return false;
   }
+  SetCloseOnExec(fileno(file));
 
-  if (rename(temp_path.c_str(), path.c_str()) < 0) {
+  compaction_ = compaction;
+  write_binary_ = binary_format_;
+  needs_recompaction_ = false;
+  log_writer_.Open(file, sync_interval_ms_, compaction_);
+  return true;
+}
+
+bool BuildLog::Recompact(const string& path, string* err) {
+  METRIC_RECORD(".ninja_log recompact");
+  printf("Recompacting log...\n");
+
+  Compaction compaction(path, binary_format_, replace_file_);
+  TakeSnapshot(&compaction);
+  FILE* f = fopen(compaction.temp_path.c_str(), "wb");
+  if (!f) {
     *err = strerror(errno);
     return false;
   }
+  bool ok = compaction.WriteLog(f);
+  if (fclose(f) != 0 || !ok) {
+    *err = strerror(errno);
+    return false;
+  }
+  if (!replace_file_(compaction.temp_path, path, err))
+    return false;
 
+  needs_recompaction_ = false;
   return true;
 }
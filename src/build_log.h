@@ -20,11 +20,15 @@
 #include <stdio.h>
 using namespace std;
 
+#include "arena.h"
+#include "async_writer.h"
 #include "hash_map.h"
+#include "mapped_file.h"
 #include "timestamp.h"
 #include "util.h"  // uint64_t
 
 struct Edge;
+struct State;
 
 /// Store a log of every command ran for every build.
 /// It has a few uses:
@@ -33,20 +37,67 @@ struct Edge;
 ///    when we need to rebuild due to the command changing
 /// 2) timing information, perhaps for generating reports
 /// 3) restat information
+///
+/// The log is kept either as text, one line per record, or in a binary
+/// format whose compacted part carries an on-disk hash index, so that
+/// loading it only maps the file and entries are read as they are looked
+/// up.  Logs in the other format are converted on the next write.
 struct BuildLog {
-  BuildLog();
+  /// If \a state is given, entries for paths it knows share the State's
+  /// copy of the path instead of storing their own; it must then outlive
+  /// the log.
+  explicit BuildLog(State* state = NULL);
   ~BuildLog();
 
+  /// Write new logs, and convert existing ones on recompaction, in the
+  /// binary format rather than as text.  Versions of Ninja before it
+  /// can't read binary logs and start over from an empty one.
+  void set_binary_format(bool binary_format) {
+    binary_format_ = binary_format;
+  }
+
+  /// Compact the log once it holds more than \a min_entries records and
+  /// more than \a ratio records per output; a \a ratio of 0 or less turns
+  /// that off.  Takes effect on Load().
+  void set_compaction_thresholds(int min_entries, int ratio) {
+    min_compaction_entry_count_ = min_entries;
+    compaction_ratio_ = ratio;
+  }
+
+  /// Moves the file at \a from over the one at \a to.
+  typedef bool (*ReplaceFileFunction)(const string& from, const string& to,
+                                      string* err);
+  /// Move compacted logs over the log with \a replace_file rather than
+  /// rename().  Used by tests.
+  void set_replace_file(ReplaceFileFunction replace_file) {
+    replace_file_ = replace_file;
+  }
+
+  /// Sync the log to disk after writing to it, at most every
+  /// \a sync_interval_ms milliseconds, and when closing it.  Off if not
+  /// positive, as it is by default.  Takes effect on OpenForWrite().
+  void set_sync_interval(int sync_interval_ms) {
+    sync_interval_ms_ = sync_interval_ms;
+  }
+
+  /// Open the log for appending.  If Load() found that the log needs
+  /// compacting, that happens on the writer thread, in the background,
+  /// unless the log is being converted to another format or version.
   bool OpenForWrite(const string& path, string* err);
+  /// Record a run of \a edge.  Writing it to the log happens on another
+  /// thread.
   void RecordCommand(Edge* edge, int start_time, int end_time,
                      TimeStamp restat_mtime = 0);
+  /// Finish writing the log and close it.
   void Close();
 
-  /// Load the on-disk log.
+  /// Load the on-disk log.  A large text log is parsed in chunks on as
+  /// many threads as there are processors.
   bool Load(const string& path, string* err);
 
   struct LogEntry {
-    string output;
+    /// Points at either a Node's path or a copy owned by the log.
+    StringPiece output;
     uint64_t command_hash;
     int start_time;
     int end_time;
@@ -61,26 +112,101 @@ struct BuildLog {
           restat_mtime == o.restat_mtime;
     }
 
-    explicit LogEntry(const string& output);
-    LogEntry(const string& output, uint64_t command_hash, int start_time, int end_time, TimeStamp restat_mtime);
+    explicit LogEntry(StringPiece output);
+    LogEntry(StringPiece output, uint64_t command_hash, int start_time, int end_time, TimeStamp restat_mtime);
   };
 
   /// Lookup a previously-run command by its output path.
-  LogEntry* LookupByOutput(const string& path);
+  LogEntry* LookupByOutput(StringPiece path);
 
-  /// Serialize an entry into a log file.
-  void WriteEntry(FILE* f, const LogEntry& entry);
+  /// Serialize an entry for a log file, in the format given by \a binary,
+  /// appending it to \a out.
+  static void WriteEntry(const LogEntry& entry, bool binary, string* out);
 
-  /// Rewrite the known log entries, throwing away old data.
+  /// Rewrite the known log entries, throwing away old data, right away.
   bool Recompact(const string& path, string* err);
 
   typedef ExternalStringHashMap<LogEntry*>::Type Entries;
+  /// The entries read so far.  Entries in the index of a binary log only
+  /// show up here once they have been looked up.
   const Entries& entries() const { return entries_; }
 
  private:
+  struct TextChunk;
+  struct Compaction;
+
+  /// Whether a log of \a total_entry_count records for
+  /// \a unique_entry_count outputs is worth compacting.
+  bool WantsCompaction(int total_entry_count, int unique_entry_count) const;
+  /// Copy all entries into \a compaction.
+  void TakeSnapshot(Compaction* compaction);
+  /// Start writing a compacted copy of the log at \a path in the
+  /// background, to be moved over it once written, and append new records
+  /// to the copy.
+  bool StartCompaction(const string& path, string* err);
+  /// The default ReplaceFileFunction.
+  static bool ReplaceFile(const string& from, const string& to, string* err);
+
+  /// Load the text log already mapped into mapped_log_.
+  bool LoadText(const string& path, string* err);
+  /// Load the binary log already mapped into mapped_log_.
+  bool LoadBinary(const string& path, string* err);
+  /// Rehash the entries of a log from before MurmurHasher whose outputs
+  /// are still built by the same commands, so they needn't be rebuilt.
+  /// Others, and all of them without a State, keep hashes that no command
+  /// matches anymore.
+  void UpgradeHashes();
+  /// Drop an unreadable log at \a path, leaving a warning in \a err.
+  void StartOver(const string& path, const char* reason, string* err);
+
+  /// Find \a path in the index of the binary log, adding an entry for it
+  /// if it is there.
+  LogEntry* LookupIndexed(StringPiece path);
+  /// Add entries for all of the index that hasn't been looked up yet, and
+  /// drop the index.
+  void ReadIndex();
+
+  /// Return a copy of \a path that lives as long as the log.
+  StringPiece InternPath(StringPiece path);
+
+  /// Add a new, empty entry for \a output, which must live as long as
+  /// the log.
+  LogEntry* AddEntry(StringPiece output);
+
+  State* state_;
   Entries entries_;
-  FILE* log_file_;
+  /// Holds the entries and the paths that aren't in state_.
+  Arena arena_;
+  /// Appends to the log file, if it is open for writing.
+  AsyncWriter log_writer_;
   bool needs_recompaction_;
+  /// Whether the loaded log is in the format and version records are
+  /// written in, so that they can be appended to it.
+  bool can_append_;
+  bool binary_format_;
+  /// Whether the log open for writing is a binary log.
+  bool write_binary_;
+  int sync_interval_ms_;
+  int min_compaction_entry_count_;
+  int compaction_ratio_;
+  /// The compaction being written along with the log, if any.
+  Compaction* compaction_;
+  ReplaceFileFunction replace_file_;
+
+  /// The loaded binary log, if any.  Entries read from it point at their
+  /// paths in the mapping.
+  MappedFile mapped_log_;
+  /// The index of mapped_log_: a power-of-two sized open-addressing hash
+  /// table of 1-based record numbers, or none if bucket_count_ is 0.
+  const char* buckets_;
+  uint32_t bucket_count_;
+  const char* records_;
+  uint32_t record_count_;
+  const char* strings_;
+  uint32_t strings_size_;
+  /// What the restat mtimes of mapped_log_ are multiplied by; older logs
+  /// have them in seconds.
+  TimeStamp restat_mtime_scale_;
 };
 
 #endif // NINJA_BUILD_LOG_H_
@@ -28,8 +28,12 @@
 
 const char kTestFilename[] = "BuildLogPerfTest-tempfile";
 
-bool WriteTestData(string* err) {
+const int kNumCommands = 30000;
+
+/// Write the test log, as text or in the binary format.
+bool WriteTestData(bool binary_format, string* err) {
   BuildLog log;
+  log.set_binary_format(binary_format);
 
   if (!log.OpenForWrite(kTestFilename, err))
     return false;
@@ -72,7 +76,6 @@ bool WriteTestData(string* err) {
 
   // Create build edges. Using ManifestParser is as fast as using the State api
   // for edge creation, so just use that.
-  const int kNumCommands = 30000;
   string build_rules;
   for (int i = 0; i < kNumCommands; ++i) {
     char buf[80];
@@ -89,40 +92,37 @@ bool WriteTestData(string* err) {
                       /*end_time=*/100 * i + 1,
                       /*restat_mtime=*/0);
   }
+  log.Close();
 
-  return true;
+  // Leave the log as it is after a recompaction, which for the binary
+  // format means indexed.
+  return log.Recompact(kTestFilename, err);
 }
 
-int main() {
-  vector<int> times;
+/// Load the test log, and with \a lookup, look up every output in it as
+/// a build would.  Returns the milliseconds it took.
+int Measure(bool lookup) {
+  int64_t start = GetTimeMillis();
+  BuildLog log;
   string err;
-
-  if (!WriteTestData(&err)) {
-    fprintf(stderr, "Failed to write test data: %s\n", err.c_str());
-    return 1;
+  if (!log.Load(kTestFilename, &err)) {
+    fprintf(stderr, "Failed to read test data: %s\n", err.c_str());
+    exit(1);
   }
-
-  {
-    // Read once to warm up disk cache.
-    BuildLog log;
-    if (!log.Load(kTestFilename, &err)) {
-      fprintf(stderr, "Failed to read test data: %s\n", err.c_str());
-      return 1;
+  if (lookup) {
+    for (int i = 0; i < kNumCommands; ++i) {
+      char buf[80];
+      sprintf(buf, "input%d.o", i);
+      if (!log.LookupByOutput(buf)) {
+        fprintf(stderr, "%s missing from log\n", buf);
+        exit(1);
+      }
     }
   }
-  const int kNumRepetitions = 5;
-  for (int i = 0; i < kNumRepetitions; ++i) {
-    int64_t start = GetTimeMillis();
-    BuildLog log;
-    if (!log.Load(kTestFilename, &err)) {
-      fprintf(stderr, "Failed to read test data: %s\n", err.c_str());
-      return 1;
-    }
-    int delta = (int)(GetTimeMillis() - start);
-    printf("%dms\n", delta);
-    times.push_back(delta);
-  }
+  return (int)(GetTimeMillis() - start);
+}
 
+void Report(const char* what, const vector<int>& times) {
   int min = times[0];
   int max = times[0];
   float total = 0;
@@ -134,11 +134,34 @@ int main() {
       max = times[i];
   }
 
-  printf("min %dms  max %dms  avg %.1fms\n",
-         min, max, total / times.size());
+  printf("%-26s min %dms  max %dms  avg %.1fms\n",
+         what, min, max, total / times.size());
+}
+
+int main() {
+  string err;
+  const int kNumRepetitions = 5;
+  for (int binary_format = 0; binary_format <= 1; ++binary_format) {
+    if (!WriteTestData(binary_format, &err)) {
+      fprintf(stderr, "Failed to write test data: %s\n", err.c_str());
+      return 1;
+    }
+
+    // Read once to warm up disk cache.
+    Measure(false);
+
+    vector<int> load_times, lookup_times;
+    for (int i = 0; i < kNumRepetitions; ++i) {
+      load_times.push_back(Measure(false));
+      lookup_times.push_back(Measure(true));
+    }
+
+    const char* format = binary_format ? "binary" : "text";
+    Report((string(format) + " load:").c_str(), load_times);
+    Report((string(format) + " load+lookup all:").c_str(), lookup_times);
+  }
 
   unlink(kTestFilename);
 
   return 0;
 }
-
@@ -14,6 +14,7 @@
 
 #include "build_log.h"
 
+#include "graph.h"
 #include "util.h"
 #include "test.h"
 
@@ -28,6 +29,9 @@
 
 const char kTestFilename[] = "BuildLogTest-tempfile";
 
+/// Logs before text version 6 have restat mtimes in seconds.
+const TimeStamp kSecond = 1000000000;
+
 struct BuildLogTest : public StateTestWithBuiltinRules {
   virtual void SetUp() {
     // In case a crashing test left a stale file behind.
@@ -63,7 +67,39 @@ TEST_F(BuildLogTest, WriteRead) {
   ASSERT_TRUE(e2);
   ASSERT_TRUE(*e1 == *e2);
   ASSERT_EQ(15, e1->start_time);
-  ASSERT_EQ("out", e1->output);
+  ASSERT_EQ("out", e1->output.AsString());
+}
+
+TEST_F(BuildLogTest, SharesStatePaths) {
+  AssertParse(&state_,
+"build out: cat mid\n"
+"build mid: cat in\n");
+
+  BuildLog log1;
+  string err;
+  EXPECT_TRUE(log1.OpenForWrite(kTestFilename, &err));
+  ASSERT_EQ("", err);
+  log1.RecordCommand(state_.edges_[0], 15, 18);
+  log1.Close();
+
+  // Append an entry for a path the graph doesn't know.
+  FILE* f = fopen(kTestFilename, "ab");
+  fprintf(f, "20\t25\t0\tgone\t123\n");
+  fclose(f);
+
+  BuildLog log2(&state_);
+  EXPECT_TRUE(log2.Load(kTestFilename, &err));
+  ASSERT_EQ("", err);
+
+  // The entry for a node points at the node's path rather than a copy.
+  BuildLog::LogEntry* e = log2.LookupByOutput("out");
+  ASSERT_TRUE(e);
+  EXPECT_EQ(state_.LookupNode("out")->path().data(), e->output.str_);
+
+  e = log2.LookupByOutput("gone");
+  ASSERT_TRUE(e);
+  EXPECT_EQ("gone", e->output.AsString());
+  EXPECT_EQ(20, e->start_time);
 }
 
 TEST_F(BuildLogTest, FirstWriteAddsSignature) {
@@ -96,6 +132,25 @@ TEST_F(BuildLogTest, FirstWriteAddsSignature) {
   EXPECT_EQ(kExpectedVersion, contents);
 }
 
+TEST_F(BuildLogTest, FirstWriteAddsBinaryHeader) {
+  BuildLog log;
+  log.set_binary_format(true);
+  string contents, err;
+
+  EXPECT_TRUE(log.OpenForWrite(kTestFilename, &err));
+  ASSERT_EQ("", err);
+  log.Close();
+  EXPECT_TRUE(log.OpenForWrite(kTestFilename, &err));
+  ASSERT_EQ("", err);
+  log.Close();
+
+  // One header, with no index.
+  ASSERT_EQ(0, ReadFile(kTestFilename, &contents, &err));
+  ASSERT_EQ("", err);
+  EXPECT_EQ(24u, contents.size());
+  EXPECT_EQ("ninjalog", contents.substr(0, 8));
+}
+
 TEST_F(BuildLogTest, DoubleEntry) {
   FILE* f = fopen(kTestFilename, "wb");
   fprintf(f, "# ninja log v4\n");
@@ -183,7 +238,7 @@ TEST_F(BuildLogTest, SpacesInOutputV4) {
   ASSERT_TRUE(e);
   ASSERT_EQ(123, e->start_time);
   ASSERT_EQ(456, e->end_time);
-  ASSERT_EQ(456, e->restat_mtime);
+  ASSERT_EQ(456 * kSecond, e->restat_mtime);
   ASSERT_NO_FATAL_FAILURE(AssertHash("command", e->command_hash));
 }
 
@@ -207,14 +262,14 @@ TEST_F(BuildLogTest, DuplicateVersionHeader) {
   ASSERT_TRUE(e);
   ASSERT_EQ(123, e->start_time);
   ASSERT_EQ(456, e->end_time);
-  ASSERT_EQ(456, e->restat_mtime);
+  ASSERT_EQ(456 * kSecond, e->restat_mtime);
   ASSERT_NO_FATAL_FAILURE(AssertHash("command", e->command_hash));
 
   e = log.LookupByOutput("out2");
   ASSERT_TRUE(e);
   ASSERT_EQ(456, e->start_time);
   ASSERT_EQ(789, e->end_time);
-  ASSERT_EQ(789, e->restat_mtime);
+  ASSERT_EQ(789 * kSecond, e->restat_mtime);
   ASSERT_NO_FATAL_FAILURE(AssertHash("command2", e->command_hash));
 }
 
@@ -242,10 +297,41 @@ TEST_F(BuildLogTest, VeryLongInputLine) {
   ASSERT_TRUE(e);
   ASSERT_EQ(456, e->start_time);
   ASSERT_EQ(789, e->end_time);
-  ASSERT_EQ(789, e->restat_mtime);
+  ASSERT_EQ(789 * kSecond, e->restat_mtime);
   ASSERT_NO_FATAL_FAILURE(AssertHash("command2", e->command_hash));
 }
 
+TEST_F(BuildLogTest, LargeTextLog) {
+  // Big enough to be parsed in several chunks.
+  const int kOutputs = 1000;
+  const int kRecords = 60000;
+  FILE* f = fopen(kTestFilename, "wb");
+  fprintf(f, "# ninja log v5\n");
+  for (int i = 0; i < kRecords; ++i) {
+    fprintf(f, "%d\t%d\t0\tsome/fairly/long/directory/name/out%d.o\t%x\n",
+            i, i + 1, i % kOutputs, i);
+  }
+  fclose(f);
+
+  string err;
+  BuildLog log;
+  EXPECT_TRUE(log.Load(kTestFilename, &err));
+  ASSERT_EQ("", err);
+
+  // The last record for each output wins.
+  ASSERT_EQ((size_t)kOutputs, log.entries().size());
+  for (int i = 0; i < kOutputs; ++i) {
+    char path[64];
+    sprintf(path, "some/fairly/long/directory/name/out%d.o", i);
+    BuildLog::LogEntry* e = log.LookupByOutput(path);
+    ASSERT_TRUE(e);
+    int last = kRecords - kOutputs + i;
+    EXPECT_EQ(last, e->start_time);
+    EXPECT_EQ(last + 1, e->end_time);
+    EXPECT_EQ((uint64_t)last, e->command_hash);
+  }
+}
+
 TEST_F(BuildLogTest, MultiTargetEdge) {
   AssertParse(&state_,
 "build out out.d: cat\n");
@@ -258,10 +344,328 @@ TEST_F(BuildLogTest, MultiTargetEdge) {
   ASSERT_TRUE(e1);
   BuildLog::LogEntry* e2 = log.LookupByOutput("out.d");
   ASSERT_TRUE(e2);
-  ASSERT_EQ("out", e1->output);
-  ASSERT_EQ("out.d", e2->output);
+  ASSERT_EQ("out", e1->output.AsString());
+  ASSERT_EQ("out.d", e2->output.AsString());
   ASSERT_EQ(21, e1->start_time);
   ASSERT_EQ(21, e2->start_time);
   ASSERT_EQ(22, e2->end_time);
   ASSERT_EQ(22, e2->end_time);
 }
+
+TEST_F(BuildLogTest, BinaryIndex) {
+  AssertParse(&state_,
+"build out: cat mid\n"
+"build mid: cat in\n"
+"build out2 out3: cat in\n");
+
+  string err;
+  {
+    BuildLog log;
+    log.set_binary_format(true);
+    EXPECT_TRUE(log.OpenForWrite(kTestFilename, &err));
+    ASSERT_EQ("", err);
+    log.RecordCommand(state_.edges_[0], 15, 18);
+    log.RecordCommand(state_.edges_[1], 20, 25, 1234);
+    log.RecordCommand(state_.edges_[2], 30, 35);
+    log.Close();
+    ASSERT_TRUE(log.Recompact(kTestFilename, &err));
+    ASSERT_EQ("", err);
+
+    // Append a newer run of one edge after the index.
+    EXPECT_TRUE(log.OpenForWrite(kTestFilename, &err));
+    ASSERT_EQ("", err);
+    log.RecordCommand(state_.edges_[0], 40, 45);
+    log.Close();
+  }
+
+  BuildLog log;
+  EXPECT_TRUE(log.Load(kTestFilename, &err));
+  ASSERT_EQ("", err);
+
+  // Only the appended record has been read so far.
+  EXPECT_EQ(1u, log.entries().size());
+  BuildLog::LogEntry* e = log.LookupByOutput("out");
+  ASSERT_TRUE(e);
+  EXPECT_EQ(40, e->start_time);
+  EXPECT_EQ(45, e->end_time);
+
+  e = log.LookupByOutput("mid");
+  ASSERT_TRUE(e);
+  EXPECT_EQ("mid", e->output.AsString());
+  EXPECT_EQ(20, e->start_time);
+  EXPECT_EQ(25, e->end_time);
+  EXPECT_EQ(1234, e->restat_mtime);
+  ASSERT_NO_FATAL_FAILURE(AssertHash("cat in > mid", e->command_hash));
+  EXPECT_EQ(e, log.LookupByOutput("mid"));
+  EXPECT_EQ(2u, log.entries().size());
+
+  EXPECT_TRUE(log.LookupByOutput("out3"));
+  EXPECT_FALSE(log.LookupByOutput("in"));
+  EXPECT_FALSE(log.LookupByOutput("out4"));
+}
+
+TEST_F(BuildLogTest, UpgradesHashes) {
+  AssertParse(&state_,
+"build out: cat mid\n"
+"build mid: cat in\n");
+
+  // A log from when commands were hashed with MurmurHash64A(), whose entry
+  // for mid is for another command.
+  string command = "cat mid > out";
+  FILE* f = fopen(kTestFilename, "wb");
+  fprintf(f, "# ninja log v6\n");
+  fprintf(f, "1\t2\t0\tout\t%llx\n", (unsigned long long)
+          MurmurHash64A(command.data(), command.size()));
+  fprintf(f, "1\t2\t0\tmid\t%llx\n", (unsigned long long)
+          MurmurHash64A(command.data(), command.size()));
+  fclose(f);
+
+  string err;
+  BuildLog log(&state_);
+  EXPECT_TRUE(log.Load(kTestFilename, &err));
+  ASSERT_EQ("", err);
+  BuildLog::LogEntry* e = log.LookupByOutput("out");
+  ASSERT_TRUE(e);
+  ASSERT_NO_FATAL_FAILURE(AssertHash("cat mid > out", e->command_hash));
+  EXPECT_EQ(state_.edges_[0]->GetCommandHash(), e->command_hash);
+  e = log.LookupByOutput("mid");
+  ASSERT_TRUE(e);
+  EXPECT_NE(state_.edges_[1]->GetCommandHash(), e->command_hash);
+}
+
+TEST_F(BuildLogTest, ConvertsFormats) {
+  FILE* f = fopen(kTestFilename, "wb");
+  fprintf(f, "# ninja log v5\n");
+  fprintf(f, "123\t456\t789\tout\t%llx\n",
+          (unsigned long long)BuildLog::LogEntry::HashCommand("command"));
+  fprintf(f, "234\t567\t0\tout2\t%llx\n",
+          (unsigned long long)BuildLog::LogEntry::HashCommand("command2"));
+  fclose(f);
+
+  string contents, err;
+  {
+    // A text log is rewritten in the binary format when opened for writing,
+    // if that is asked for.
+    BuildLog log;
+    log.set_binary_format(true);
+    EXPECT_TRUE(log.Load(kTestFilename, &err));
+    ASSERT_EQ("", err);
+    EXPECT_TRUE(log.OpenForWrite(kTestFilename, &err));
+    ASSERT_EQ("", err);
+    log.Close();
+  }
+  ASSERT_EQ(0, ReadFile(kTestFilename, &contents, &err));
+  EXPECT_EQ("ninjalog", contents.substr(0, 8));
+
+  {
+    // And back, as text is the default.
+    BuildLog log;
+    EXPECT_TRUE(log.Load(kTestFilename, &err));
+    ASSERT_EQ("", err);
+    EXPECT_TRUE(log.OpenForWrite(kTestFilename, &err));
+    ASSERT_EQ("", err);
+    log.Close();
+  }
+  contents.clear();
+  ASSERT_EQ(0, ReadFile(kTestFilename, &contents, &err));
+  EXPECT_EQ("# ninja log v7\n", contents.substr(0, 15));
+
+  BuildLog log;
+  EXPECT_TRUE(log.Load(kTestFilename, &err));
+  ASSERT_EQ("", err);
+  BuildLog::LogEntry* e = log.LookupByOutput("out");
+  ASSERT_TRUE(e);
+  EXPECT_EQ(123, e->start_time);
+  EXPECT_EQ(456, e->end_time);
+  EXPECT_EQ(789 * kSecond, e->restat_mtime);
+  ASSERT_NO_FATAL_FAILURE(AssertHash("command", e->command_hash));
+  e = log.LookupByOutput("out2");
+  ASSERT_TRUE(e);
+  ASSERT_NO_FATAL_FAILURE(AssertHash("command2", e->command_hash));
+}
+
+TEST_F(BuildLogTest, NanosecondRestatMtimes) {
+  AssertParse(&state_, "build out: cat in\n");
+  const TimeStamp kMtime = 1700000000123456789LL;
+  string err;
+  for (int binary = 0; binary < 2; ++binary) {
+    unlink(kTestFilename);
+    {
+      BuildLog log;
+      log.set_binary_format(binary);
+      EXPECT_TRUE(log.OpenForWrite(kTestFilename, &err));
+      ASSERT_EQ("", err);
+      log.RecordCommand(state_.edges_[0], 1, 2, kMtime);
+      log.Close();
+    }
+    BuildLog log;
+    log.set_binary_format(binary);
+    EXPECT_TRUE(log.Load(kTestFilename, &err));
+    ASSERT_EQ("", err);
+    BuildLog::LogEntry* e = log.LookupByOutput("out");
+    ASSERT_TRUE(e);
+    EXPECT_EQ(kMtime, e->restat_mtime);
+  }
+
+  // A binary log from before nanoseconds has its mtimes in seconds, and
+  // gets rewritten in the current version.
+  unlink(kTestFilename);
+  {
+    BuildLog log;
+    log.set_binary_format(true);
+    EXPECT_TRUE(log.OpenForWrite(kTestFilename, &err));
+    log.RecordCommand(state_.edges_[0], 1, 2, 5);
+    log.Close();
+  }
+  string contents;
+  ASSERT_EQ(0, ReadFile(kTestFilename, &contents, &err));
+  uint32_t version = 6;
+  contents.replace(8, sizeof(version), (const char*)&version,
+                   sizeof(version));
+  FILE* f = fopen(kTestFilename, "wb");
+  fwrite(contents.data(), 1, contents.size(), f);
+  fclose(f);
+  {
+    BuildLog log;
+    log.set_binary_format(true);
+    EXPECT_TRUE(log.Load(kTestFilename, &err));
+    ASSERT_EQ("", err);
+    BuildLog::LogEntry* e = log.LookupByOutput("out");
+    ASSERT_TRUE(e);
+    EXPECT_EQ(5 * kSecond, e->restat_mtime);
+    EXPECT_TRUE(log.OpenForWrite(kTestFilename, &err));
+    ASSERT_EQ("", err);
+    log.Close();
+  }
+  contents.clear();
+  ASSERT_EQ(0, ReadFile(kTestFilename, &contents, &err));
+  memcpy(&version, contents.data() + 8, sizeof(version));
+  EXPECT_EQ(8u, version);
+}
+
+TEST_F(BuildLogTest, CorruptBinaryLog) {
+  // A header claiming an index bigger than the file.
+  FILE* f = fopen(kTestFilename, "wb");
+  const uint32_t kHeader[] = { 7, 100, 256, 1000 };
+  fwrite("ninjalog", 1, 8, f);
+  fwrite(kHeader, sizeof(kHeader), 1, f);
+  fclose(f);
+
+  string err;
+  BuildLog log;
+  EXPECT_TRUE(log.Load(kTestFilename, &err));
+  EXPECT_NE(string::npos, err.find("starting over"));
+  EXPECT_FALSE(log.LookupByOutput("out"));
+}
+
+TEST_F(BuildLogTest, CompactsInBackground) {
+  AssertParse(&state_,
+"build out: cat mid\n"
+"build mid: cat in\n");
+
+  string err;
+  {
+    BuildLog log;
+    EXPECT_TRUE(log.OpenForWrite(kTestFilename, &err));
+    ASSERT_EQ("", err);
+    for (int i = 0; i < 10; ++i)
+      log.RecordCommand(state_.edges_[0], i, i + 1);
+    log.Close();
+  }
+
+  // Ten records for one output are too many with a ratio of 2, but not
+  // with a ratio of 0, which turns compaction off.
+  string before, after;
+  ASSERT_EQ(0, ReadFile(kTestFilename, &before, &err));
+  {
+    BuildLog log;
+    log.set_compaction_thresholds(5, 0);
+    EXPECT_TRUE(log.Load(kTestFilename, &err));
+    EXPECT_TRUE(log.OpenForWrite(kTestFilename, &err));
+    log.Close();
+  }
+  ASSERT_EQ(0, ReadFile(kTestFilename, &after, &err));
+  EXPECT_EQ(before, after);
+
+  {
+    BuildLog log;
+    log.set_compaction_thresholds(5, 2);
+    EXPECT_TRUE(log.Load(kTestFilename, &err));
+    EXPECT_TRUE(log.OpenForWrite(kTestFilename, &err));
+    ASSERT_EQ("", err);
+    // Records made while compacting end up after the compacted ones.
+    log.RecordCommand(state_.edges_[1], 20, 21);
+    log.RecordCommand(state_.edges_[0], 30, 31);
+    log.Close();
+  }
+
+  after.clear();
+  ASSERT_EQ(0, ReadFile(kTestFilename, &after, &err));
+  EXPECT_EQ("# ninja log v7\n", after.substr(0, 15));
+  EXPECT_LT(after.size(), before.size());
+  EXPECT_NE(0, access((string(kTestFilename) + ".recompact").c_str(), F_OK));
+
+  BuildLog log;
+  EXPECT_TRUE(log.Load(kTestFilename, &err));
+  ASSERT_EQ("", err);
+  BuildLog::LogEntry* e = log.LookupByOutput("out");
+  ASSERT_TRUE(e);
+  EXPECT_EQ(30, e->start_time);
+  e = log.LookupByOutput("mid");
+  ASSERT_TRUE(e);
+  EXPECT_EQ(20, e->start_time);
+}
+
+#ifndef _WIN32
+bool FailToReplace(const string& from, const string& to, string* err) {
+  *err = "no";
+  return false;
+}
+
+TEST_F(BuildLogTest, FailedCompactionAppendsToLog) {
+  AssertParse(&state_,
+"build out: cat mid\n"
+"build mid: cat in\n");
+
+  string err;
+  {
+    BuildLog log;
+    EXPECT_TRUE(log.OpenForWrite(kTestFilename, &err));
+    ASSERT_EQ("", err);
+    for (int i = 0; i < 10; ++i)
+      log.RecordCommand(state_.edges_[0], i, i + 1);
+    log.Close();
+  }
+  string before, after;
+  ASSERT_EQ(0, ReadFile(kTestFilename, &before, &err));
+
+  {
+    BuildLog log;
+    log.set_compaction_thresholds(5, 2);
+    log.set_replace_file(FailToReplace);
+    EXPECT_TRUE(log.Load(kTestFilename, &err));
+    EXPECT_TRUE(log.OpenForWrite(kTestFilename, &err));
+    ASSERT_EQ("", err);
+    log.RecordCommand(state_.edges_[1], 20, 21);
+    log.RecordCommand(state_.edges_[0], 30, 31);
+    log.Close();
+  }
+
+  // The records made meanwhile are appended to the log as it was, and the
+  // compacted copy is gone.
+  ASSERT_EQ(0, ReadFile(kTestFilename, &after, &err));
+  EXPECT_EQ(before, after.substr(0, before.size()));
+  EXPECT_GT(after.size(), before.size());
+  EXPECT_NE(0, access((string(kTestFilename) + ".recompact").c_str(), F_OK));
+
+  BuildLog log;
+  EXPECT_TRUE(log.Load(kTestFilename, &err));
+  ASSERT_EQ("", err);
+  BuildLog::LogEntry* e = log.LookupByOutput("out");
+  ASSERT_TRUE(e);
+  EXPECT_EQ(30, e->start_time);
+  e = log.LookupByOutput("mid");
+  ASSERT_TRUE(e);
+  EXPECT_EQ(20, e->start_time);
+}
+#endif  // !_WIN32
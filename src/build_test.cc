@@ -15,6 +15,7 @@
 #include "build.h"
 
 #include "build_log.h"
+#include "deps_log.h"
 #include "graph.h"
 #include "test.h"
 
@@ -176,10 +177,34 @@ TEST_F(PlanTest, DependencyCycle) {
   ASSERT_EQ("dependency cycle: out -> mid -> in -> pre -> out", err);
 }
 
+TEST_F(PlanTest, DeepChain) {
+  // Deep enough to overflow the stack if adding targets recursed.
+  const int kDepth = 100000;
+  string manifest;
+  char buf[64];
+  for (int i = 0; i < kDepth; ++i) {
+    sprintf(buf, "build n%d: cat n%d\n", i + 1, i);
+    manifest += buf;
+  }
+  AssertParse(&state_, manifest.c_str());
+  for (int i = 1; i <= kDepth; ++i) {
+    sprintf(buf, "n%d", i);
+    GetNode(buf)->MarkDirty();
+  }
+
+  string err;
+  EXPECT_TRUE(plan_.AddTarget(GetNode(buf), &err));
+  ASSERT_EQ("", err);
+  EXPECT_EQ(kDepth, plan_.command_edge_count());
+  Edge* edge = plan_.FindWork();
+  ASSERT_TRUE(edge);
+  EXPECT_EQ("n0", edge->inputs_[0]->path());
+}
+
 struct BuildTest : public StateTestWithBuiltinRules,
                    public CommandRunner {
   BuildTest() : config_(MakeConfig()),
-                builder_(&state_, config_, NULL, &fs_),
+                builder_(&state_, config_, NULL, NULL, &fs_),
                 now_(1), last_command_(NULL), status_(config_) {
     builder_.command_runner_.reset(this);
     AssertParse(&state_,
@@ -499,8 +524,9 @@ TEST_F(BuildTest, DepFileOK) {
   // Expect three new edges: one generating foo.o, and two more from
   // loading the depfile.
   ASSERT_EQ(orig_edges + 3, (int)state_.edges_.size());
-  // Expect our edge to now have three inputs: foo.c and two headers.
-  ASSERT_EQ(3u, edge->inputs_.size());
+  // Expect our edge to now have foo.c as input and two headers as deps.
+  ASSERT_EQ(1u, edge->inputs_.size());
+  ASSERT_EQ(2u, DepfileDeps(edge).size());
 
   // Expect the command line we generate to only use the original input.
   ASSERT_EQ("cc foo.c", edge->EvaluateCommand());
@@ -518,6 +544,33 @@ TEST_F(BuildTest, DepFileParseError) {
             err);
 }
 
+TEST_F(BuildTest, DepFileIngested) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"rule cc\n  command = cc $in\n  depfile = $out.d\n  deletedepfile = 1\n"
+"build foo.o: cc foo.c\n"));
+  fs_.Create("foo.c", now_, "");
+  DepsLog deps_log;
+  Builder builder(&state_, config_, NULL, &deps_log, &fs_);
+  builder.command_runner_.reset(this);
+
+  string err;
+  EXPECT_TRUE(builder.AddTarget("foo.o", &err));
+  ASSERT_EQ("", err);
+  // The command writes the depfile.
+  fs_.Create("foo.o.d", now_, "foo.o: blah.h bar.h\n");
+  EXPECT_TRUE(builder.Build(&err));
+  EXPECT_EQ("", err);
+  builder.command_runner_.release();
+
+  DepsLog::Deps* deps = deps_log.GetDeps(GetNode("foo.o"));
+  ASSERT_TRUE(deps);
+  EXPECT_EQ(now_, deps->mtime);
+  ASSERT_EQ(2, deps->node_count);
+  EXPECT_EQ("blah.h", deps->nodes[0]->path());
+  EXPECT_EQ("bar.h", deps->nodes[1]->path());
+  EXPECT_EQ(1u, fs_.files_removed_.count("foo.o.d"));
+}
+
 TEST_F(BuildTest, OrderOnlyDeps) {
   string err;
   ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
@@ -531,16 +584,16 @@ TEST_F(BuildTest, OrderOnlyDeps) {
   EXPECT_TRUE(builder_.AddTarget("foo.o", &err));
   ASSERT_EQ("", err);
 
-  // One explicit, two implicit, one order only.
-  ASSERT_EQ(4u, edge->inputs_.size());
-  EXPECT_EQ(2, edge->implicit_deps_);
+  // One explicit, one order only, and two implicit from the depfile.
+  ASSERT_EQ(2u, edge->inputs_.size());
+  EXPECT_EQ(0, edge->implicit_deps_);
   EXPECT_EQ(1, edge->order_only_deps_);
-  // Verify the inputs are in the order we expect
-  // (explicit then implicit then orderonly).
   EXPECT_EQ("foo.c", edge->inputs_[0]->path());
-  EXPECT_EQ("blah.h", edge->inputs_[1]->path());
-  EXPECT_EQ("bar.h", edge->inputs_[2]->path());
-  EXPECT_EQ("otherfile", edge->inputs_[3]->path());
+  EXPECT_EQ("otherfile", edge->inputs_[1]->path());
+  vector<Node*> deps = DepfileDeps(edge);
+  ASSERT_EQ(2u, deps.size());
+  EXPECT_EQ("blah.h", deps[0]->path());
+  EXPECT_EQ("bar.h", deps[1]->path());
 
   // Expect the command line we generate to only use the original input.
   ASSERT_EQ("cc foo.c", edge->EvaluateCommand());
@@ -18,22 +18,37 @@
 #include "util.h"
 #include "metrics.h"
 
-const char kPath[] =
+struct Input {
+  const char* description;
+  const char* path;
+};
+
+const Input kInputs[] = {
+  { "canonical",
     "../../third_party/WebKit/Source/WebCore/"
-    "platform/leveldb/LevelDBWriteBatch.cpp";
+    "platform/leveldb/LevelDBWriteBatch.cpp" },
+  { "canonical, short", "obj/base/base.string_util.o" },
+  { "non-canonical",
+    "./out/../third_party/WebKit/Source/WebCore//"
+    "platform/./leveldb/../leveldb/LevelDBWriteBatch.cpp" },
+  { "non-canonical, short", "obj/./base.o" },
+};
 
-int main() {
+/// Canonicalize \a input over and over, starting from a fresh copy each
+/// time so non-canonical inputs stay non-canonical.
+void Benchmark(const Input& input) {
   vector<int> times;
   string err;
 
   char buf[200];
-  size_t len = strlen(kPath);
-  strcpy(buf, kPath);
+  size_t input_len = strlen(input.path);
+  const int kNumRepetitions = 2000000;
 
   for (int j = 0; j < 5; ++j) {
-    const int kNumRepetitions = 2000000;
     int64_t start = GetTimeMillis();
     for (int i = 0; i < kNumRepetitions; ++i) {
+      memcpy(buf, input.path, input_len + 1);
+      size_t len = input_len;
       CanonicalizePath(buf, &len, &err);
     }
     int delta = (int)(GetTimeMillis() - start);
@@ -51,6 +66,13 @@ int main() {
       max = times[i];
   }
 
-  printf("min %dms  max %dms  avg %.1fms\n",
-         min, max, total / times.size());
+  double mb = (double)input_len * kNumRepetitions / (1 << 20);
+  printf("%-22s min %dms  max %dms  avg %.1fms  %.0f MB/s  %.1f ns/path\n",
+         input.description, min, max, total / times.size(),
+         min ? mb * 1000 / min : 0.0, min * 1e6 / kNumRepetitions);
+}
+
+int main() {
+  for (size_t i = 0; i < sizeof(kInputs) / sizeof(kInputs[0]); ++i)
+    Benchmark(kInputs[i]);
 }
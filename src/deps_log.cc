@@ -0,0 +1,370 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "deps_log.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <new>
+
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "graph.h"
+#include "mapped_file.h"
+#include "metrics.h"
+#include "state.h"
+#include "util.h"
+
+// Implementation details:
+// The log starts with kFileSignature and a version.  Each record after
+// that is a 32-bit size word followed by that many bytes.  The high bit
+// of the size word marks a deps record: the output's id, its 64-bit
+// mtime as two words, low first, and the ids of its dependencies, the
+// rest all 32-bit.  Other records are path
+// records: the path, NUL-padded to a multiple of 4 bytes, and the
+// complement of the id it gets, which catches records that were lost
+// or reordered.  A path record always comes before the first record
+// using its id.  Everything is in native byte order; the log is never
+// shared between machines.
+
+namespace {
+
+const char kFileSignature[] = "# ninjadeps\n";
+const int32_t kCurrentVersion = 2;
+
+const uint32_t kDepsRecordBit = 0x80000000u;
+
+const int kMinCompactionEntryCount = 100;
+const int kCompactionRatio = 3;
+
+void AppendInt(string* out, uint32_t value) {
+  out->append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+uint32_t ReadInt(const char* p) {
+  uint32_t value;
+  memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+/// Cut the file at \a path off after \a size bytes.
+bool Truncate(const string& path, size_t size, string* err) {
+#ifdef _WIN32
+  int fh = _open(path.c_str(), _O_RDWR | _O_BINARY);
+  if (fh < 0) {
+    *err = strerror(errno);
+    return false;
+  }
+  bool ok = _chsize(fh, (long)size) == 0;
+  if (!ok)
+    *err = strerror(errno);
+  _close(fh);
+  return ok;
+#else
+  if (truncate(path.c_str(), size) < 0) {
+    *err = strerror(errno);
+    return false;
+  }
+  return true;
+#endif
+}
+
+/// Whether the deps of \a node are still worth keeping: only outputs of
+/// edges with depfiles get them.
+bool IsDepsEntryLive(Node* node) {
+  Edge* edge = node->in_edge();
+  return edge && !edge->rule().depfile().empty() &&
+      edge->outputs_[0] == node;
+}
+
+}  // namespace
+
+DepsLog::DepsLog() : needs_recompaction_(false) {}
+
+DepsLog::~DepsLog() {
+  Close();
+}
+
+bool DepsLog::Load(const string& path, State* state, string* err) {
+  METRIC_RECORD(".ninja_deps load");
+  MappedFile file;
+  int ret = file.Load(path, err);
+  if (ret < 0) {
+    if (ret == -ENOENT) {
+      err->clear();
+      return true;
+    }
+    return false;
+  }
+
+  const char* data = file.data();
+  size_t size = file.size();
+  size_t header_size = sizeof(kFileSignature) - 1 + sizeof(int32_t);
+  if (size < header_size ||
+      memcmp(data, kFileSignature, sizeof(kFileSignature) - 1) != 0 ||
+      (int32_t)ReadInt(data + sizeof(kFileSignature) - 1) !=
+          kCurrentVersion) {
+    // Don't report this as a failure.  Without deps, outputs fall back
+    // to their depfiles, or get rebuilt if those are gone.
+    *err = size < header_size ? "deps log truncated" :
+        "deps log version invalid";
+    *err += "; starting over";
+    file.Clear();
+    unlink(path.c_str());
+    return true;
+  }
+
+  int unique_dep_record_count = 0;
+  int total_dep_record_count = 0;
+  size_t offset = header_size;
+  while (size - offset >= sizeof(uint32_t)) {
+    uint32_t size_word = ReadInt(data + offset);
+    bool is_deps = (size_word & kDepsRecordBit) != 0;
+    size_t record_size = size_word & ~kDepsRecordBit;
+    const char* record = data + offset + sizeof(uint32_t);
+    // A record cut short by an interrupted write, or otherwise garbled,
+    // ends the log.
+    if (record_size % 4 != 0 ||
+        record_size > size - offset - sizeof(uint32_t))
+      break;
+
+    if (is_deps) {
+      if (record_size < 3 * sizeof(uint32_t))
+        break;
+      int out_id = (int)ReadInt(record);
+      TimeStamp mtime = (TimeStamp)(ReadInt(record + 4) |
+                                    (uint64_t)ReadInt(record + 8) << 32);
+      int node_count = (int)(record_size / 4) - 3;
+      if (out_id < 0 || out_id >= (int)nodes_.size())
+        break;
+      Deps* deps = NewDeps(mtime, node_count);
+      bool ok = true;
+      for (int i = 0; i < node_count; ++i) {
+        int id = (int)ReadInt(record + 12 + i * 4);
+        if (id < 0 || id >= (int)nodes_.size()) {
+          ok = false;
+          break;
+        }
+        deps->nodes[i] = nodes_[id];
+      }
+      if (!ok)
+        break;
+
+      if (out_id >= (int)deps_.size() || !deps_[out_id])
+        ++unique_dep_record_count;
+      ++total_dep_record_count;
+      UpdateDeps(out_id, deps);
+    } else {
+      if (record_size < sizeof(uint32_t))
+        break;
+      size_t path_size = record_size - sizeof(uint32_t);
+      // Strip the padding.
+      while (path_size > 0 && record[path_size - 1] == '\0')
+        --path_size;
+      uint32_t checksum = ReadInt(record + record_size - sizeof(uint32_t));
+      int id = (int)nodes_.size();
+      if (path_size == 0 || checksum != ~(uint32_t)id)
+        break;
+      Node* node = state->GetNode(StringPiece(record, path_size));
+      node->set_id(id);
+      nodes_.push_back(node);
+    }
+    offset += sizeof(uint32_t) + record_size;
+  }
+
+  if (offset < size) {
+    // Drop the rest, so records appended from now on can be read back.
+    *err = "deps log ends in a partial record; dropping it";
+    file.Clear();
+    string truncate_err;
+    if (!Truncate(path, offset, &truncate_err)) {
+      *err = "deps log corrupt, and truncating it failed: " +
+          truncate_err + "; starting over";
+      for (vector<Node*>::iterator i = nodes_.begin(); i != nodes_.end(); ++i)
+        (*i)->set_id(-1);
+      nodes_.clear();
+      deps_.clear();
+      unlink(path.c_str());
+      return true;
+    }
+  }
+
+  if (total_dep_record_count > kMinCompactionEntryCount &&
+      total_dep_record_count > unique_dep_record_count * kCompactionRatio)
+    needs_recompaction_ = true;
+
+  return true;
+}
+
+DepsLog::Deps* DepsLog::GetDeps(Node* node) {
+  // Nodes the log hasn't seen have no id.
+  if (node->id() < 0 || node->id() >= (int)deps_.size())
+    return NULL;
+  return deps_[node->id()];
+}
+
+bool DepsLog::OpenForWrite(const string& path, string* err) {
+  Close();
+  if (needs_recompaction_) {
+    if (!Recompact(path, err))
+      return false;
+  }
+
+  FILE* file = fopen(path.c_str(), "ab");
+  if (!file) {
+    *err = strerror(errno);
+    return false;
+  }
+  SetCloseOnExec(fileno(file));
+
+  // Opening a file in append mode doesn't set the file pointer to the file's
+  // end on Windows. Do that explicitly.
+  fseek(file, 0, SEEK_END);
+
+  if (ftell(file) == 0) {
+    if (fwrite(kFileSignature, sizeof(kFileSignature) - 1, 1, file) < 1 ||
+        fwrite(&kCurrentVersion, sizeof(kCurrentVersion), 1, file) < 1 ||
+        fflush(file) != 0) {
+      *err = strerror(errno);
+      fclose(file);
+      return false;
+    }
+  }
+
+  log_writer_.Open(file, 0);
+  return true;
+}
+
+void DepsLog::RecordDeps(Node* node, TimeStamp mtime,
+                         const vector<Node*>& nodes) {
+  // Skip the write if nothing changed, as for an edge rebuilt only
+  // because its command changed.
+  Deps* deps = GetDeps(node);
+  if (deps && deps->mtime == mtime &&
+      deps->node_count == (int)nodes.size() &&
+      equal(nodes.begin(), nodes.end(), deps->nodes))
+    return;
+
+  deps = NewDeps(mtime, (int)nodes.size());
+  for (int i = 0; i < (int)nodes.size(); ++i)
+    deps->nodes[i] = nodes[i];
+  WriteDeps(node, deps);
+}
+
+void DepsLog::WriteDeps(Node* node, Deps* deps) {
+  string record;
+  if (node->id() < 0)
+    RecordId(node, &record);
+  for (int i = 0; i < deps->node_count; ++i) {
+    if (deps->nodes[i]->id() < 0)
+      RecordId(deps->nodes[i], &record);
+  }
+
+  if (log_writer_.is_open()) {
+    AppendInt(&record, (uint32_t)(3 + deps->node_count) * 4 | kDepsRecordBit);
+    AppendInt(&record, (uint32_t)node->id());
+    AppendInt(&record, (uint32_t)deps->mtime);
+    AppendInt(&record, (uint32_t)((uint64_t)deps->mtime >> 32));
+    for (int i = 0; i < deps->node_count; ++i)
+      AppendInt(&record, (uint32_t)deps->nodes[i]->id());
+    log_writer_.Write(record.data(), record.size());
+  }
+  UpdateDeps(node->id(), deps);
+}
+
+void DepsLog::Close() {
+  log_writer_.Close();
+}
+
+bool DepsLog::Recompact(const string& path, string* err) {
+  METRIC_RECORD(".ninja_deps recompact");
+  printf("Recompacting deps...\n");
+
+  Close();
+  string temp_path = path + ".recompact";
+  unlink(temp_path.c_str());
+
+  // Write the live deps out to a fresh log, numbering the nodes anew as
+  // they come up.
+  vector<Node*> old_nodes;
+  vector<Deps*> old_deps;
+  old_nodes.swap(nodes_);
+  old_deps.swap(deps_);
+  for (vector<Node*>::iterator i = old_nodes.begin(); i != old_nodes.end(); ++i)
+    (*i)->set_id(-1);
+
+  needs_recompaction_ = false;
+  if (!OpenForWrite(temp_path, err)) {
+    // Put the log back as it was.
+    nodes_.swap(old_nodes);
+    deps_.swap(old_deps);
+    for (size_t i = 0; i < nodes_.size(); ++i)
+      nodes_[i]->set_id((int)i);
+    return false;
+  }
+  for (size_t old_id = 0; old_id < old_deps.size(); ++old_id) {
+    Deps* deps = old_deps[old_id];
+    if (deps && IsDepsEntryLive(old_nodes[old_id]))
+      WriteDeps(old_nodes[old_id], deps);
+  }
+  Close();
+
+#ifdef _WIN32
+  // rename() won't replace an existing file on Windows.
+  unlink(path.c_str());
+#endif
+  if (rename(temp_path.c_str(), path.c_str()) < 0) {
+    *err = strerror(errno);
+    return false;
+  }
+  return true;
+}
+
+void DepsLog::RecordId(Node* node, string* record) {
+  int id = (int)nodes_.size();
+  node->set_id(id);
+  nodes_.push_back(node);
+
+  if (!log_writer_.is_open())
+    return;
+  const string& path = node->path();
+  size_t padded_size = (path.size() + 3) & ~(size_t)3;
+  AppendInt(record, (uint32_t)(padded_size + sizeof(uint32_t)));
+  record->append(path);
+  record->append(padded_size - path.size(), '\0');
+  AppendInt(record, ~(uint32_t)id);
+}
+
+void DepsLog::UpdateDeps(int out_id, Deps* deps) {
+  if (out_id >= (int)deps_.size())
+    deps_.resize(out_id + 1);
+  // The old deps stay in the arena until the log goes away.
+  deps_[out_id] = deps;
+}
+
+DepsLog::Deps* DepsLog::NewDeps(TimeStamp mtime, int node_count) {
+  void* deps = arena_.Alloc(sizeof(Deps));
+  Deps* result = new (deps) Deps(mtime, node_count);
+  result->nodes = static_cast<Node**>(
+      arena_.Alloc(node_count * sizeof(Node*)));
+  return result;
+}
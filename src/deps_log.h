@@ -0,0 +1,103 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef NINJA_DEPS_LOG_H_
+#define NINJA_DEPS_LOG_H_
+
+#include <string>
+#include <vector>
+using namespace std;
+
+#include "arena.h"
+#include "async_writer.h"
+#include "timestamp.h"
+
+struct Node;
+struct State;
+
+/// Keeps the dependencies found in depfiles, so that they don't have to
+/// be read and parsed again on every build.  After an edge that has a
+/// depfile finishes, its dependencies are recorded against the edge's
+/// first output, along with that output's mtime; the record is good for
+/// as long as the output isn't any newer.
+///
+/// The log is a binary file of records appended as edges finish.  A
+/// record either introduces a path, giving it the next free id, or lists
+/// the ids of an output's dependencies.  Nodes carry their ids (see
+/// Node::id()), so recording deps doesn't need a lookup.  Like the build
+/// log, the file is compacted once it holds far more records than it has
+/// outputs.
+struct DepsLog {
+  DepsLog();
+  ~DepsLog();
+
+  /// The dependencies of an output, as of its mtime.
+  struct Deps {
+    Deps(TimeStamp mtime, int node_count)
+        : mtime(mtime), node_count(node_count) {}
+    TimeStamp mtime;
+    int node_count;
+    /// node_count Nodes, allocated from the log's arena.
+    Node** nodes;
+  };
+
+  /// Load the log at \a path, adding the paths it mentions to \a state,
+  /// which must outlive the log.  A missing log is not an error; an
+  /// unreadable one is dropped, returning true with a warning in \a err.
+  bool Load(const string& path, State* state, string* err);
+
+  /// The deps recorded for \a node, or NULL if there are none.
+  Deps* GetDeps(Node* node);
+
+  /// Open the log for appending, compacting it first if Load() found
+  /// that it needs it.
+  bool OpenForWrite(const string& path, string* err);
+  /// Record that \a node, as of \a mtime, depends on \a nodes.  Nothing
+  /// is written if that's what the log says already.
+  void RecordDeps(Node* node, TimeStamp mtime, const vector<Node*>& nodes);
+  /// Finish writing the log and close it.
+  void Close();
+
+  /// Rewrite the log with only the current deps of outputs whose edges
+  /// still have depfiles, right away.
+  bool Recompact(const string& path, string* err);
+
+  /// The nodes known to the log, by id.
+  const vector<Node*>& nodes() const { return nodes_; }
+  /// The deps known to the log, by the id of their output; NULL where
+  /// there are none.
+  const vector<Deps*>& deps() const { return deps_; }
+
+ private:
+  /// Make \a deps the deps of \a node, queueing records of them and of
+  /// any paths the log doesn't know yet if it is open for writing.
+  void WriteDeps(Node* node, Deps* deps);
+  /// Give \a node the next id, and queue a record of its path if the
+  /// log is open for writing.
+  void RecordId(Node* node, string* record);
+  /// Make \a deps the deps of the node with id \a out_id.
+  void UpdateDeps(int out_id, Deps* deps);
+  /// Allocate Deps for \a node_count nodes from the arena.
+  Deps* NewDeps(TimeStamp mtime, int node_count);
+
+  vector<Node*> nodes_;
+  vector<Deps*> deps_;
+  /// Holds the Deps and their node arrays.
+  Arena arena_;
+  /// Appends to the log file, if it is open for writing.
+  AsyncWriter log_writer_;
+  bool needs_recompaction_;
+};
+
+#endif  // NINJA_DEPS_LOG_H_
@@ -0,0 +1,237 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "deps_log.h"
+
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#include <share.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "graph.h"
+#include "state.h"
+#include "util.h"
+#include "test.h"
+
+const char kTestFilename[] = "DepsLogTest-tempfile";
+
+struct DepsLogTest : public testing::Test {
+  virtual void SetUp() {
+    // In case a crashing test left a stale file behind.
+    unlink(kTestFilename);
+  }
+  virtual void TearDown() {
+    unlink(kTestFilename);
+  }
+};
+
+static vector<Node*> Nodes(State* state, const char* path1,
+                           const char* path2) {
+  vector<Node*> nodes;
+  nodes.push_back(state->GetNode(path1));
+  nodes.push_back(state->GetNode(path2));
+  return nodes;
+}
+
+static long FileSize(const char* path) {
+  struct stat st;
+  if (stat(path, &st) < 0)
+    return -1;
+  return (long)st.st_size;
+}
+
+TEST_F(DepsLogTest, WriteRead) {
+  State state1;
+  DepsLog log1;
+  string err;
+  EXPECT_TRUE(log1.OpenForWrite(kTestFilename, &err));
+  ASSERT_EQ("", err);
+  log1.RecordDeps(state1.GetNode("out.o"), 1,
+                  Nodes(&state1, "foo.h", "bar.h"));
+  log1.RecordDeps(state1.GetNode("out2.o"), 2,
+                  Nodes(&state1, "foo.h", "bar2.h"));
+  log1.Close();
+
+  State state2;
+  DepsLog log2;
+  EXPECT_TRUE(log2.Load(kTestFilename, &state2, &err));
+  ASSERT_EQ("", err);
+
+  ASSERT_EQ(log1.nodes().size(), log2.nodes().size());
+  for (int i = 0; i < (int)log1.nodes().size(); ++i) {
+    Node* node1 = log1.nodes()[i];
+    Node* node2 = log2.nodes()[i];
+    EXPECT_EQ(i, node1->id());
+    EXPECT_EQ(node1->id(), node2->id());
+    EXPECT_EQ(node1->path(), node2->path());
+  }
+
+  DepsLog::Deps* deps = log2.GetDeps(state2.GetNode("out2.o"));
+  ASSERT_TRUE(deps);
+  EXPECT_EQ(2, deps->mtime);
+  ASSERT_EQ(2, deps->node_count);
+  EXPECT_EQ("foo.h", deps->nodes[0]->path());
+  EXPECT_EQ("bar2.h", deps->nodes[1]->path());
+  EXPECT_FALSE(log2.GetDeps(state2.GetNode("foo.h")));
+}
+
+TEST_F(DepsLogTest, LaterRecordsWin) {
+  State state;
+  DepsLog log1;
+  string err;
+  EXPECT_TRUE(log1.OpenForWrite(kTestFilename, &err));
+  log1.RecordDeps(state.GetNode("out.o"), 1, Nodes(&state, "foo.h", "bar.h"));
+  log1.Close();
+  long size = FileSize(kTestFilename);
+
+  // Recording the same deps again writes nothing.
+  EXPECT_TRUE(log1.OpenForWrite(kTestFilename, &err));
+  log1.RecordDeps(state.GetNode("out.o"), 1, Nodes(&state, "foo.h", "bar.h"));
+  log1.Close();
+  EXPECT_EQ(size, FileSize(kTestFilename));
+
+  EXPECT_TRUE(log1.OpenForWrite(kTestFilename, &err));
+  log1.RecordDeps(state.GetNode("out.o"), 2, Nodes(&state, "foo.h", "baz.h"));
+  log1.Close();
+  EXPECT_GT(FileSize(kTestFilename), size);
+
+  State state2;
+  DepsLog log2;
+  EXPECT_TRUE(log2.Load(kTestFilename, &state2, &err));
+  ASSERT_EQ("", err);
+  DepsLog::Deps* deps = log2.GetDeps(state2.GetNode("out.o"));
+  ASSERT_TRUE(deps);
+  EXPECT_EQ(2, deps->mtime);
+  ASSERT_EQ(2, deps->node_count);
+  EXPECT_EQ("baz.h", deps->nodes[1]->path());
+}
+
+TEST_F(DepsLogTest, Recompact) {
+  const char kManifest[] =
+"rule cc\n"
+"  command = cc\n"
+"  depfile = $out.d\n"
+"build out.o: cc foo.c\n"
+"build other_out.o: cc bar.c\n";
+
+  // Record the same deps often enough to need compacting.
+  long size;
+  {
+    State state;
+    ASSERT_NO_FATAL_FAILURE(AssertParse(&state, kManifest));
+    DepsLog log;
+    string err;
+    ASSERT_TRUE(log.OpenForWrite(kTestFilename, &err));
+    for (int i = 1; i <= 200; ++i) {
+      log.RecordDeps(state.GetNode("out.o"), i,
+                     Nodes(&state, "foo.h", "bar.h"));
+    }
+    log.RecordDeps(state.GetNode("other_out.o"), 1,
+                   Nodes(&state, "foo.h", "baz.h"));
+    log.Close();
+    size = FileSize(kTestFilename);
+  }
+
+  // Without a depfile, other_out.o's deps are dropped.
+  {
+    State state;
+    ASSERT_NO_FATAL_FAILURE(AssertParse(&state,
+"rule cc\n"
+"  command = cc\n"
+"  depfile = $out.d\n"
+"build out.o: cc foo.c\n"
+"build other_out.o: phony bar.c\n"));
+    DepsLog log;
+    string err;
+    ASSERT_TRUE(log.Load(kTestFilename, &state, &err));
+    ASSERT_EQ("", err);
+    ASSERT_TRUE(log.OpenForWrite(kTestFilename, &err));
+    log.Close();
+    EXPECT_LT(FileSize(kTestFilename), size);
+
+    DepsLog::Deps* deps = log.GetDeps(state.GetNode("out.o"));
+    ASSERT_TRUE(deps);
+    EXPECT_EQ(200, deps->mtime);
+    EXPECT_FALSE(log.GetDeps(state.GetNode("other_out.o")));
+  }
+
+  State state;
+  DepsLog log;
+  string err;
+  ASSERT_TRUE(log.Load(kTestFilename, &state, &err));
+  ASSERT_EQ("", err);
+  DepsLog::Deps* deps = log.GetDeps(state.GetNode("out.o"));
+  ASSERT_TRUE(deps);
+  EXPECT_EQ(200, deps->mtime);
+  ASSERT_EQ(2, deps->node_count);
+  EXPECT_EQ("foo.h", deps->nodes[0]->path());
+  EXPECT_EQ("bar.h", deps->nodes[1]->path());
+  EXPECT_FALSE(log.GetDeps(state.GetNode("other_out.o")));
+}
+
+TEST_F(DepsLogTest, Truncated) {
+  // For all possible truncations of the log, loading recovers what's left
+  // of it, and what gets appended afterwards can be read back.
+  long size = -1;
+  for (long cut = 1; size < 0 || cut < size; ++cut) {
+    {
+      State state;
+      DepsLog log;
+      string err;
+      unlink(kTestFilename);
+      EXPECT_TRUE(log.OpenForWrite(kTestFilename, &err));
+      log.RecordDeps(state.GetNode("out.o"), 1,
+                     Nodes(&state, "foo.h", "bar.h"));
+      log.RecordDeps(state.GetNode("out2.o"), 2,
+                     Nodes(&state, "foo.h", "bar2.h"));
+      log.Close();
+      size = FileSize(kTestFilename);
+    }
+
+#ifndef _WIN32
+    ASSERT_EQ(0, truncate(kTestFilename, cut));
+#else
+    int fh;
+    fh = _sopen(kTestFilename, _O_RDWR | _O_CREAT, _SH_DENYNO, _S_IREAD | _S_IWRITE);
+    ASSERT_EQ(0, _chsize(fh, cut));
+    _close(fh);
+#endif
+
+    State state;
+    DepsLog log;
+    string err;
+    EXPECT_TRUE(log.Load(kTestFilename, &state, &err));
+    EXPECT_LE(FileSize(kTestFilename), cut);
+    EXPECT_FALSE(log.GetDeps(state.GetNode("out2.o")));
+    EXPECT_TRUE(log.OpenForWrite(kTestFilename, &err));
+    log.RecordDeps(state.GetNode("out2.o"), 3,
+                   Nodes(&state, "foo.h", "bar3.h"));
+    log.Close();
+
+    State state2;
+    DepsLog log2;
+    err.clear();
+    EXPECT_TRUE(log2.Load(kTestFilename, &state2, &err));
+    EXPECT_EQ("", err);
+    DepsLog::Deps* deps = log2.GetDeps(state2.GetNode("out2.o"));
+    ASSERT_TRUE(deps);
+    EXPECT_EQ(3, deps->mtime);
+    ASSERT_EQ(2, deps->node_count);
+    EXPECT_EQ("bar3.h", deps->nodes[1]->path());
+  }
+}
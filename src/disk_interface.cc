@@ -14,6 +14,7 @@
 
 #include "disk_interface.h"
 
+#include <ctype.h>
 #include <errno.h>
 #include <stdio.h>
 #include <string.h>
@@ -23,8 +24,15 @@
 #ifdef _WIN32
 #include <windows.h>
 #include <direct.h>  // _mkdir
+#else
+#include <dirent.h>
 #endif
 
+#include <algorithm>
+#include <vector>
+
+#include "hash_map.h"
+#include "mutex.h"
 #include "util.h"
 
 namespace {
@@ -52,30 +60,9 @@ int MakeDir(const string& path) {
 #endif
 }
 
-}  // namespace
-
-// DiskInterface ---------------------------------------------------------------
-
-bool DiskInterface::MakeDirs(const string& path) {
-  string dir = DirName(path);
-  if (dir.empty())
-    return true;  // Reached root; assume it's there.
-  TimeStamp mtime = Stat(dir);
-  if (mtime < 0)
-    return false;  // Error.
-  if (mtime > 0)
-    return true;  // Exists already; we're done.
-
-  // Directory doesn't exist.  Try creating its parent first.
-  bool success = MakeDirs(dir);
-  if (!success)
-    return false;
-  return MakeDir(dir);
-}
-
-// RealDiskInterface -----------------------------------------------------------
-
-TimeStamp RealDiskInterface::Stat(const string& path) {
+/// stat() \a path itself, as RealDiskInterface::Stat() does without the
+/// stat cache.
+TimeStamp StatSingleFile(const string& path) {
 #ifdef _WIN32
   // MSDN: "Naming Files, Paths, and Namespaces"
   // http://msdn.microsoft.com/en-us/library/windows/desktop/aa365247(v=vs.85).aspx
@@ -95,12 +82,12 @@ TimeStamp RealDiskInterface::Stat(const string& path) {
   const FILETIME& filetime = attrs.ftLastWriteTime;
   // FILETIME is in 100-nanosecond increments since the Windows epoch.
   // We don't much care about epoch correctness but we do want the
-  // resulting value to fit in an integer.
+  // resulting value to fit in a TimeStamp once in nanoseconds.
   uint64_t mtime = ((uint64_t)filetime.dwHighDateTime << 32) |
     ((uint64_t)filetime.dwLowDateTime);
-  mtime /= 1000000000LL / 100; // 100ns -> s.
-  mtime -= 12622770400LL;  // 1600 epoch -> 2000 epoch (subtract 400 years).
-  return (TimeStamp)mtime;
+  // 1600 epoch -> 2000 epoch (subtract 400 years).
+  mtime -= 12622770400LL * (1000000000LL / 100);
+  return (TimeStamp)mtime * 100;  // 100ns -> ns.
 #else
   struct stat st;
   if (stat(path.c_str(), &st) < 0) {
@@ -109,7 +96,210 @@ TimeStamp RealDiskInterface::Stat(const string& path) {
     Error("stat(%s): %s", path.c_str(), strerror(errno));
     return -1;
   }
-  return st.st_mtime;
+#if defined(__APPLE__) && !defined(_POSIX_C_SOURCE)
+  return (TimeStamp)st.st_mtimespec.tv_sec * 1000000000LL +
+      st.st_mtimespec.tv_nsec;
+#else
+  return (TimeStamp)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+#endif
+#endif
+}
+
+#ifndef _WIN32
+/// Files found missing in a directory before it gets listed.  Listing
+/// takes longer than a few stat()s, and only pays off for directories
+/// that many missing files are looked for in.
+const int kMissesBeforeListing = 4;
+
+/// Compare two names ignoring ASCII case: on case-insensitive file
+/// systems, a name that differs from an entry only in case is there.
+int CompareFolded(StringPiece a, StringPiece b) {
+  size_t len = min(a.len_, b.len_);
+  for (size_t i = 0; i < len; ++i) {
+    int ca = tolower((unsigned char)a.str_[i]);
+    int cb = tolower((unsigned char)b.str_[i]);
+    if (ca != cb)
+      return ca < cb ? -1 : 1;
+  }
+  return a.len_ < b.len_ ? -1 : a.len_ > b.len_ ? 1 : 0;
+}
+
+bool FoldedLess(const string& a, StringPiece b) {
+  return CompareFolded(a, b) < 0;
+}
+
+bool SortFoldedLess(const string& a, const string& b) {
+  return CompareFolded(a, b) < 0;
+}
+
+/// Read the names in the directory at \a path into \a names, sorted
+/// by CompareFolded().  Returns 0 on success and -errno on failure.
+int ListDirectory(const string& path, vector<string>* names) {
+  DIR* dir = opendir(path.c_str());
+  if (!dir)
+    return -errno;
+  int ret = 0;
+  for (;;) {
+    errno = 0;
+    struct dirent* entry = readdir(dir);
+    if (!entry) {
+      ret = -errno;
+      break;
+    }
+    const char* name = entry->d_name;
+    if (strcmp(name, ".") != 0 && strcmp(name, "..") != 0)
+      names->push_back(name);
+  }
+  closedir(dir);
+  sort(names->begin(), names->end(), SortFoldedLess);
+  return ret;
+}
+#endif  // _WIN32
+
+}  // namespace
+
+/// The directory listings RealDiskInterface::Stat() answers from.
+///
+/// Depfiles and include search paths make for many stats of files that
+/// don't exist, often in directories that don't either.  Once a few
+/// files have turned out missing in a directory, it gets listed, and
+/// files missing from the listing are known to be missing without a
+/// stat(), as is everything in a missing directory.  Files that are
+/// there are still statted one by one: their mtimes can't be had any
+/// cheaper, and fetching those of files nobody asks about (say, the
+/// depfiles next to the objects) would cost more than it saves.
+struct StatCache {
+  /// What is known of one directory.
+  struct Directory {
+    explicit Directory(StringPiece path)
+        : path(path.AsString()), misses(0), listed(false), missing(false) {}
+
+    string path;
+    /// Files found missing before the directory got listed.
+    int misses;
+    /// Whether the directory has been listed; names and missing don't
+    /// change after that.
+    bool listed;
+    /// Whether listing found that there is no such directory.
+    bool missing;
+    /// The directory's entries, sorted by CompareFolded().
+    vector<string> names;
+  };
+
+  ~StatCache() {
+    for (Directories::iterator i = directories_.begin();
+         i != directories_.end(); ++i)
+      delete i->second;
+  }
+
+  TimeStamp Stat(const string& path);
+
+  Mutex mutex_;
+  /// Keyed by Directory::path.
+  typedef ExternalStringHashMap<Directory*>::Type Directories;
+  Directories directories_;
+};
+
+#ifndef _WIN32
+TimeStamp StatCache::Stat(const string& path) {
+  string::size_type slash = path.rfind('/');
+  StringPiece dir_path = slash == string::npos ? StringPiece(".") :
+      StringPiece(path.data(), slash == 0 ? 1 : slash);
+  StringPiece name = slash == string::npos ? StringPiece(path) :
+      StringPiece(path.data() + slash + 1, path.size() - slash - 1);
+  if (name.len_ == 0)
+    return StatSingleFile(path);
+
+  Directory* dir;
+  bool listed;
+  {
+    MutexLock lock(&mutex_);
+    Directories::iterator i = directories_.find(dir_path);
+    if (i != directories_.end()) {
+      dir = i->second;
+    } else {
+      dir = new Directory(dir_path);
+      directories_.insert(make_pair(StringPiece(dir->path), dir));
+    }
+    listed = dir->listed;
+  }
+
+  if (!listed) {
+    TimeStamp mtime = StatSingleFile(path);
+    if (mtime != 0)
+      return mtime;
+    {
+      MutexLock lock(&mutex_);
+      // Only the thread whose miss tips the count lists the directory;
+      // others go on statting files one by one meanwhile.
+      if (++dir->misses != kMissesBeforeListing)
+        return mtime;
+    }
+    vector<string> names;
+    int ret = ListDirectory(dir->path, &names);
+    // Other errors leave the directory to stats of single files.
+    if (ret == 0 || ret == -ENOENT || ret == -ENOTDIR) {
+      MutexLock lock(&mutex_);
+      dir->names.swap(names);
+      dir->missing = ret != 0;
+      dir->listed = true;
+    }
+    return mtime;
+  }
+
+  if (dir->missing)
+    return 0;
+  vector<string>::const_iterator i = lower_bound(
+      dir->names.begin(), dir->names.end(), name, FoldedLess);
+  if (i == dir->names.end() || CompareFolded(*i, name) != 0)
+    return 0;
+  return StatSingleFile(path);
+}
+#endif  // _WIN32
+
+// DiskInterface ---------------------------------------------------------------
+
+bool DiskInterface::MakeDirs(const string& path) {
+  string dir = DirName(path);
+  if (dir.empty())
+    return true;  // Reached root; assume it's there.
+  TimeStamp mtime = Stat(dir);
+  if (mtime < 0)
+    return false;  // Error.
+  if (mtime > 0)
+    return true;  // Exists already; we're done.
+
+  // Directory doesn't exist.  Try creating its parent first.
+  bool success = MakeDirs(dir);
+  if (!success)
+    return false;
+  return MakeDir(dir);
+}
+
+// RealDiskInterface -----------------------------------------------------------
+
+RealDiskInterface::RealDiskInterface() : stat_cache_(NULL) {}
+
+RealDiskInterface::~RealDiskInterface() {
+  delete stat_cache_;
+}
+
+TimeStamp RealDiskInterface::Stat(const string& path) {
+#ifndef _WIN32
+  if (stat_cache_)
+    return stat_cache_->Stat(path);
+#endif
+  return StatSingleFile(path);
+}
+
+void RealDiskInterface::AllowStatCache(bool allow) {
+#ifndef _WIN32
+  if (allow && !stat_cache_) {
+    stat_cache_ = new StatCache;
+  } else if (!allow) {
+    delete stat_cache_;
+    stat_cache_ = NULL;
+  }
 #endif
 }
 
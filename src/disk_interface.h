@@ -20,6 +20,8 @@ using namespace std;
 
 #include "timestamp.h"
 
+struct StatCache;
+
 /// Interface for accessing the disk.
 ///
 /// Abstract so it can be mocked out for tests.  The real implementation
@@ -55,12 +57,29 @@ struct DiskInterface {
 
 /// Implementation of DiskInterface that actually hits the disk.
 struct RealDiskInterface : public DiskInterface {
-  virtual ~RealDiskInterface() {}
+  RealDiskInterface();
+  virtual ~RealDiskInterface();
+  /// Safe to call from several threads at once.
   virtual TimeStamp Stat(const string& path);
   virtual bool MakeDir(const string& path);
   virtual bool WriteFile(const string& path, const string& contents);
   virtual string ReadFile(const string& path, string* err);
   virtual int RemoveFile(const string& path);
+
+  /// Whether Stat() may answer from listings of whole directories, read
+  /// once a directory has come up often enough and kept from then on.
+  /// Only safe while nothing changes the files, as during the scan
+  /// before a build.  Disallowing it drops the listings.  Off by default;
+  /// has no effect on Windows.
+  void AllowStatCache(bool allow);
+
+ private:
+  /// Non-NULL while the stat cache is allowed.
+  StatCache* stat_cache_;
+
+  // Not copyable.
+  RealDiskInterface(const RealDiskInterface&);
+  void operator=(const RealDiskInterface&);
 };
 
 #endif  // NINJA_DISK_INTERFACE_H_
@@ -17,6 +17,8 @@
 #ifdef _WIN32
 #include <io.h>
 #include <windows.h>
+#else
+#include <sys/stat.h>
 #endif
 
 #include "disk_interface.h"
@@ -75,6 +77,39 @@ TEST_F(DiskInterfaceTest, StatExistingFile) {
   EXPECT_GT(disk_.Stat("file"), 1);
 }
 
+#ifndef _WIN32
+TEST_F(DiskInterfaceTest, StatCache) {
+  ASSERT_EQ(0, mkdir("dir", 0777));
+  const char* kFiles[] = { "dir/a", "dir/b", "dir/c", "dir/d", "dir/e" };
+  const int kFileCount = sizeof(kFiles) / sizeof(kFiles[0]);
+  for (int i = 0; i < kFileCount; ++i)
+    ASSERT_TRUE(Touch(kFiles[i]));
+  ASSERT_TRUE(Touch("notadir"));
+  TimeStamp mtime = disk_.Stat("dir/a");
+
+  // The cache gives the same answers, whether or not a directory has
+  // been listed yet.
+  disk_.AllowStatCache(true);
+  for (int pass = 0; pass < 2; ++pass) {
+    for (int i = 0; i < kFileCount; ++i)
+      EXPECT_EQ(mtime, disk_.Stat(kFiles[i]));
+    for (int i = 0; i < 5; ++i) {
+      EXPECT_EQ(0, disk_.Stat("dir/nosuchfile"));
+      EXPECT_EQ(0, disk_.Stat("nosuchdir/nosuchfile"));
+      EXPECT_EQ(0, disk_.Stat("notadir/nosuchfile"));
+    }
+    EXPECT_GT(disk_.Stat("dir"), 0);
+    EXPECT_GT(disk_.Stat("notadir"), 0);
+  }
+
+  // Once listed, a directory is not looked at again until the cache goes.
+  ASSERT_TRUE(Touch("dir/new"));
+  EXPECT_EQ(0, disk_.Stat("dir/new"));
+  disk_.AllowStatCache(false);
+  EXPECT_GT(disk_.Stat("dir/new"), 0);
+}
+#endif
+
 TEST_F(DiskInterfaceTest, ReadFile) {
   string err;
   EXPECT_EQ("", disk_.ReadFile("foobar", &err));
@@ -105,7 +140,7 @@ TEST_F(DiskInterfaceTest, RemoveFile) {
 
 struct StatTest : public StateTestWithBuiltinRules,
                   public DiskInterface {
-  StatTest() : scan_(&state_, NULL, this) {}
+  StatTest() : scan_(&state_, NULL, NULL, this) {}
 
   // DiskInterface implementation.
   virtual TimeStamp Stat(const string& path);
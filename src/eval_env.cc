@@ -14,50 +14,302 @@
 
 #include "eval_env.h"
 
-string BindingEnv::LookupVariable(const string& var) {
-  map<string, string>::iterator i = bindings_.find(var);
-  if (i != bindings_.end())
+#include <deque>
+
+#include "hash_map.h"
+#include "mutex.h"
+#include "util.h"
+
+namespace {
+
+/// The interned names, guarded by g_symbols_mutex.  The lexer interns
+/// names on ThreadPool workers while the parser looks them up.
+Mutex g_symbols_mutex;
+/// Names by symbol.  A deque, so the keys of g_symbols stay put.
+deque<string> g_symbol_names;
+ExternalStringHashMap<Symbol>::Type g_symbols;
+
+/// Puts the pieces together in a string.
+struct StringSink : public EvalSink {
+  explicit StringSink(string* result) : result_(result) {}
+  virtual void Append(StringPiece piece) {
+    result_->append(piece.str_, piece.len_);
+  }
+  string* result_;
+};
+
+}  // anonymous namespace
+
+const Symbol Symbols::kNone;
+
+// static
+Symbol Symbols::Intern(StringPiece name) {
+  MutexLock lock(&g_symbols_mutex);
+  ExternalStringHashMap<Symbol>::Type::iterator i = g_symbols.find(name);
+  if (i != g_symbols.end())
     return i->second;
-  if (parent_)
-    return parent_->LookupVariable(var);
-  return "";
+  Symbol symbol = (Symbol)g_symbol_names.size();
+  g_symbol_names.push_back(name.AsString());
+  g_symbols.insert(make_pair(StringPiece(g_symbol_names.back()), symbol));
+  return symbol;
 }
 
-void BindingEnv::AddBinding(const string& key, const string& val) {
-  bindings_[key] = val;
+// static
+Symbol Symbols::Find(StringPiece name) {
+  MutexLock lock(&g_symbols_mutex);
+  ExternalStringHashMap<Symbol>::Type::iterator i = g_symbols.find(name);
+  return i == g_symbols.end() ? kNone : i->second;
+}
+
+// static
+const string& Symbols::Name(Symbol symbol) {
+  MutexLock lock(&g_symbols_mutex);
+  return g_symbol_names[symbol];
 }
 
-string EvalString::Evaluate(Env* env) const {
+void Env::AppendVariable(Symbol var, string* result) {
+  StringSink sink(result);
+  AppendVariable(var, &sink);
+}
+
+string Env::LookupVariable(StringPiece var) {
   string result;
-  for (TokenList::const_iterator i = parsed_.begin(); i != parsed_.end(); ++i) {
-    if (i->second == RAW)
-      result.append(i->first);
-    else
-      result.append(env->LookupVariable(i->first));
-  }
+  Symbol symbol = Symbols::Find(var);
+  if (symbol != Symbols::kNone)
+    AppendVariable(symbol, &result);
   return result;
 }
 
+BindingEnv::BindingEnv(BindingEnv* parent)
+    : watchers_(NULL), first_child_(NULL), prev_sibling_(NULL),
+      next_sibling_(NULL), parent_(NULL) {
+  Link(parent);
+}
+
+BindingEnv::~BindingEnv() {
+  // Each child unlinks itself as it goes.
+  while (first_child_)
+    delete first_child_;
+  Unlink();
+  delete watchers_;
+}
+
+void BindingEnv::Link(BindingEnv* parent) {
+  parent_ = parent;
+  prev_sibling_ = NULL;
+  next_sibling_ = parent->first_child_;
+  if (next_sibling_)
+    next_sibling_->prev_sibling_ = this;
+  parent->first_child_ = this;
+}
+
+void BindingEnv::Unlink() {
+  if (!parent_)
+    return;
+  if (prev_sibling_)
+    prev_sibling_->next_sibling_ = next_sibling_;
+  else
+    parent_->first_child_ = next_sibling_;
+  if (next_sibling_)
+    next_sibling_->prev_sibling_ = prev_sibling_;
+  parent_ = NULL;
+}
+
+void BindingEnv::AppendVariable(Symbol var, EvalSink* sink) {
+  map<Symbol, string>::iterator i = bindings_.find(var);
+  if (i == bindings_.end() && !pending_.empty())
+    i = EvaluatePending(var);
+  if (i != bindings_.end())
+    sink->Append(i->second);
+  else if (parent_)
+    parent_->AppendVariable(var, sink);
+}
+
+void BindingEnv::AddBinding(Symbol key, const string& val) {
+  EvaluateWatchers(key);
+  for (size_t i = 0; i < pending_.size(); ++i) {
+    if (pending_[i].first == key)
+      pending_[i].first = Symbols::kNone;
+  }
+  bindings_[key] = val;
+}
+
+void BindingEnv::AddLazyBinding(Symbol key, EvalString* value) {
+  if (value->IsLiteral()) {
+    AddBinding(key, value->Evaluate(this));
+    return;
+  }
+  bindings_.erase(key);
+  pending_.push_back(make_pair(key, EvalString()));
+  pending_.back().second.swap(*value);
+  Watch(pending_.back().second, parent_);
+}
+
+void BindingEnv::Reparent(BindingEnv* parent) {
+  Unlink();
+  Link(parent);
+
+  // What is pending in here and beneath now depends on the new scopes
+  // outside too.
+  vector<BindingEnv*> stack(1, this);
+  while (!stack.empty()) {
+    BindingEnv* env = stack.back();
+    stack.pop_back();
+    for (size_t i = 0; i < env->pending_.size(); ++i) {
+      if (env->pending_[i].first != Symbols::kNone)
+        env->Watch(env->pending_[i].second, parent);
+    }
+    for (BindingEnv* child = env->first_child_; child;
+         child = child->next_sibling_)
+      stack.push_back(child);
+  }
+}
+
+uint64_t BindingEnv::HashScope() {
+  uint64_t hash = 0;
+  string entry;
+  for (BindingEnv* env = this; env; env = env->parent_) {
+    for (size_t i = 0; i < env->pending_.size(); ++i) {
+      if (env->pending_[i].first != Symbols::kNone)
+        env->EvaluatePending(env->pending_[i].first);
+    }
+    // Combine the bindings in a way that doesn't depend on their order,
+    // which follows the symbols' numbering.
+    for (map<Symbol, string>::iterator i = env->bindings_.begin();
+         i != env->bindings_.end(); ++i) {
+      entry = Symbols::Name(i->first);
+      entry.push_back('\0');
+      entry += i->second;
+      hash += MurmurHash64A(entry.data(), entry.size());
+    }
+    // Tell apart the same binding at different levels.
+    hash = hash * 31 + 1;
+  }
+  return hash;
+}
+
+map<Symbol, string>::iterator BindingEnv::EvaluatePending(Symbol var) {
+  // A later binding replaces an earlier one, so look from the back.
+  for (size_t i = pending_.size(); i-- > 0; ) {
+    if (pending_[i].first != var)
+      continue;
+    map<Symbol, string>::iterator binding =
+        bindings_.insert(make_pair(var, string())).first;
+    pending_[i].second.Evaluate(parent_, &binding->second);
+    for (; ; --i) {
+      if (pending_[i].first == var) {
+        pending_[i].first = Symbols::kNone;
+        pending_[i].second.Clear();
+      }
+      if (i == 0)
+        break;
+    }
+    return binding;
+  }
+  return bindings_.end();
+}
+
+void BindingEnv::Watch(const EvalString& value, BindingEnv* scope) {
+  for (vector<EvalString::Token>::const_iterator i = value.tokens_.begin();
+       i != value.tokens_.end(); ++i) {
+    if (i->type != EvalString::SPECIAL)
+      continue;
+    for (BindingEnv* env = scope; env; env = env->parent_) {
+      if (!env->watchers_)
+        env->watchers_ = new Watchers;
+      vector<BindingEnv*>& watchers = (*env->watchers_)[i->value];
+      if (watchers.empty() || watchers.back() != this)
+        watchers.push_back(this);
+    }
+  }
+}
+
+void BindingEnv::EvaluateWatchers(Symbol var) {
+  if (!watchers_)
+    return;
+  Watchers::iterator i = watchers_->find(var);
+  if (i == watchers_->end())
+    return;
+  // A pending binding may also depend on var through other pending ones
+  // it refers to.  The one of those that refers to var is evaluated here
+  // too, or already was, so they all see the value var has now.
+  vector<BindingEnv*>& watchers = i->second;
+  for (vector<BindingEnv*>::iterator w = watchers.begin();
+       w != watchers.end(); ++w) {
+    vector<pair<Symbol, EvalString> >& pending = (*w)->pending_;
+    for (size_t j = 0; j < pending.size(); ++j) {
+      if (pending[j].first != Symbols::kNone &&
+          pending[j].second.RefersTo(var))
+        (*w)->EvaluatePending(pending[j].first);
+    }
+  }
+  watchers_->erase(i);
+}
+
+void EvalString::Evaluate(Env* env, string* result) const {
+  StringSink sink(result);
+  Evaluate(env, &sink);
+}
+
+void EvalString::Evaluate(Env* env, EvalSink* sink) const {
+  const char* text = text_.data();
+  for (vector<Token>::const_iterator i = tokens_.begin();
+       i != tokens_.end(); ++i) {
+    if (i->type == RAW) {
+      sink->Append(StringPiece(text, i->value));
+      text += i->value;
+    } else {
+      env->AppendVariable(i->value, sink);
+    }
+  }
+}
+
+bool EvalString::IsLiteral() const {
+  for (vector<Token>::const_iterator i = tokens_.begin();
+       i != tokens_.end(); ++i) {
+    if (i->type == SPECIAL)
+      return false;
+  }
+  return true;
+}
+
+bool EvalString::RefersTo(Symbol var) const {
+  for (vector<Token>::const_iterator i = tokens_.begin();
+       i != tokens_.end(); ++i) {
+    if (i->type == SPECIAL && i->value == var)
+      return true;
+  }
+  return false;
+}
+
 void EvalString::AddText(StringPiece text) {
   // Add it to the end of an existing RAW token if possible.
-  if (!parsed_.empty() && parsed_.back().second == RAW) {
-    parsed_.back().first.append(text.str_, text.len_);
+  if (!tokens_.empty() && tokens_.back().type == RAW) {
+    tokens_.back().value += text.len_;
   } else {
-    parsed_.push_back(make_pair(text.AsString(), RAW));
+    Token token = { (int)text.len_, RAW };
+    tokens_.push_back(token);
   }
+  text_.append(text.str_, text.len_);
 }
 void EvalString::AddSpecial(StringPiece text) {
-  parsed_.push_back(make_pair(text.AsString(), SPECIAL));
+  Token token = { Symbols::Intern(text), SPECIAL };
+  tokens_.push_back(token);
 }
 
 string EvalString::Serialize() const {
   string result;
-  for (TokenList::const_iterator i = parsed_.begin();
-       i != parsed_.end(); ++i) {
+  const char* text = text_.data();
+  for (vector<Token>::const_iterator i = tokens_.begin();
+       i != tokens_.end(); ++i) {
     result.append("[");
-    if (i->second == SPECIAL)
+    if (i->type == SPECIAL) {
       result.append("$");
-    result.append(i->first);
+      result.append(Symbols::Name(i->value));
+    } else {
+      result.append(text, i->value);
+      text += i->value;
+    }
     result.append("]");
   }
   return result;
@@ -21,34 +21,73 @@
 using namespace std;
 
 #include "string_piece.h"
+#include "util.h"  // uint64_t
+
+/// A variable name, interned into a small integer so environments can
+/// look variables up without comparing or copying strings.
+typedef int Symbol;
+
+/// The table of interned variable names.  Safe to use from any thread.
+struct Symbols {
+  /// Return the symbol for \a name, interning it if needed.
+  static Symbol Intern(StringPiece name);
+
+  /// Return the symbol for \a name, or kNone if it was never interned
+  /// (so no variable of that name can be bound).
+  static Symbol Find(StringPiece name);
+
+  /// Return the name of \a symbol.
+  static const string& Name(Symbol symbol);
+
+  static const Symbol kNone = -1;
+};
+
+/// Takes the pieces of an evaluated string in order, for uses that don't
+/// need it put together in one place, such as hashing it.
+struct EvalSink {
+  virtual ~EvalSink() {}
+  virtual void Append(StringPiece piece) = 0;
+};
 
 /// An interface for a scope for variable (e.g. "$foo") lookups.
 struct Env {
   virtual ~Env() {}
-  virtual string LookupVariable(const string& var) = 0;
-};
 
-/// An Env which contains a mapping of variables to values
-/// as well as a pointer to a parent scope.
-struct BindingEnv : public Env {
-  BindingEnv() : parent_(NULL) {}
-  explicit BindingEnv(Env* parent) : parent_(parent) {}
-  virtual ~BindingEnv() {}
-  virtual string LookupVariable(const string& var);
-  void AddBinding(const string& key, const string& val);
+  /// Append the value of \a var to \a sink.
+  virtual void AppendVariable(Symbol var, EvalSink* sink) = 0;
+  /// Append the value of \a var to \a result.
+  void AppendVariable(Symbol var, string* result);
 
-private:
-  map<string, string> bindings_;
-  Env* parent_;
+  /// Return the value of the variable named \a var.
+  string LookupVariable(StringPiece var);
 };
 
 /// A tokenized string that contains variable references.
 /// Can be evaluated relative to an Env.
+///
+/// The text between variable references is kept in one string, and the
+/// references themselves are resolved to Symbols as they are added, so
+/// evaluating is a single pass that appends to the result.
 struct EvalString {
-  string Evaluate(Env* env) const;
+  /// Append the evaluation of the string in \a env to \a result.
+  void Evaluate(Env* env, string* result) const;
+  void Evaluate(Env* env, EvalSink* sink) const;
+  string Evaluate(Env* env) const {
+    string result;
+    Evaluate(env, &result);
+    return result;
+  }
 
-  void Clear() { parsed_.clear(); }
-  bool empty() const { return parsed_.empty(); }
+  void Clear() { text_.clear(); tokens_.clear(); }
+  bool empty() const { return tokens_.empty(); }
+  /// True if the string refers to no variables.
+  bool IsLiteral() const;
+  /// True if the string refers to \a var.
+  bool RefersTo(Symbol var) const;
+  void swap(EvalString& other) {
+    text_.swap(other.text_);
+    tokens_.swap(other.tokens_);
+  }
 
   void AddText(StringPiece text);
   void AddSpecial(StringPiece text);
@@ -58,9 +97,93 @@ struct EvalString {
   string Serialize() const;
 
 private:
+  friend struct BindingEnv;
+  friend struct ManifestCache;
+
   enum TokenType { RAW, SPECIAL };
-  typedef vector<pair<string, TokenType> > TokenList;
-  TokenList parsed_;
+  struct Token {
+    /// For RAW tokens, the length of the next run of text_; for SPECIAL
+    /// ones, the Symbol of the variable.
+    int value;
+    TokenType type;
+  };
+  string text_;
+  vector<Token> tokens_;
+};
+
+/// An Env which contains a mapping of variables to values
+/// as well as a pointer to a parent scope.  A scope owns the scopes
+/// nested in it, which must have been allocated with new.
+struct BindingEnv : public Env {
+  BindingEnv()
+      : watchers_(NULL), first_child_(NULL), prev_sibling_(NULL),
+        next_sibling_(NULL), parent_(NULL) {}
+  explicit BindingEnv(BindingEnv* parent);
+  virtual ~BindingEnv();
+  using Env::AppendVariable;
+  virtual void AppendVariable(Symbol var, EvalSink* sink);
+  void AddBinding(Symbol key, const string& val);
+  void AddBinding(StringPiece key, const string& val) {
+    AddBinding(Symbols::Intern(key), val);
+  }
+
+  /// Bind \a key to \a value evaluated in the parent scope, but only
+  /// evaluate it the first time it is looked up (unless it is literal
+  /// text, which is cheaper to keep evaluated).  Takes the contents of
+  /// \a value.  The result is the same as evaluating it right away:
+  /// binding a variable in an enclosing scope first evaluates whatever
+  /// is still pending beneath it and refers to that variable.
+  void AddLazyBinding(Symbol key, EvalString* value);
+
+  /// Move this scope under \a parent, as if it had been created there,
+  /// along with the ownership of it.  Its old parent must not be used
+  /// afterwards, other than to delete it.
+  void Reparent(BindingEnv* parent);
+
+  /// A hash of the variables bound in this scope and the scopes it is
+  /// nested in.  Scopes that bind the same values at every level hash
+  /// the same.
+  uint64_t HashScope();
+
+private:
+  friend struct ManifestCache;
+
+  /// Evaluate the pending binding of \a var, if there is one, and return
+  /// its entry in bindings_ (or bindings_.end()).
+  map<Symbol, string>::iterator EvaluatePending(Symbol var);
+
+  /// Have binding \a var in the scopes from \a scope outwards first
+  /// evaluate the pending bindings here that refer to it.
+  void Watch(const EvalString& value, BindingEnv* scope);
+
+  /// Evaluate the pending bindings in the scopes nested in this one that
+  /// refer to \a var, which is about to be bound here.
+  void EvaluateWatchers(Symbol var);
+
+  /// Add this scope to the children of \a parent, or remove it from
+  /// those of its parent.
+  void Link(BindingEnv* parent);
+  void Unlink();
+
+  map<Symbol, string> bindings_;
+  /// Bindings not evaluated yet, oldest first.  Evaluated or replaced
+  /// ones have their key set to Symbols::kNone.
+  vector<pair<Symbol, EvalString> > pending_;
+  /// For each variable, the nested scopes with pending bindings that
+  /// referred to it when added, which binding it here would change.
+  /// Allocated when first needed, as most scopes have nothing nested.
+  typedef map<Symbol, vector<BindingEnv*> > Watchers;
+  Watchers* watchers_;
+  /// The scopes nested in this one, as a list linked through
+  /// prev_sibling_ and next_sibling_.
+  BindingEnv* first_child_;
+  BindingEnv* prev_sibling_;
+  BindingEnv* next_sibling_;
+  BindingEnv* parent_;
+
+  // Not copyable.
+  BindingEnv(const BindingEnv&);
+  void operator=(const BindingEnv&);
 };
 
 #endif  // NINJA_EVAL_ENV_H_
@@ -0,0 +1,783 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "file_monitor.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#endif
+
+#include "explain.h"
+#include "graph.h"
+#include "hash_map.h"
+#include "mapped_file.h"
+#include "metrics.h"
+#include "state.h"
+
+// Implementation details:
+// A request is a list of NUL-terminated fields, sent in full before the
+// client shuts down its side of the connection; the reply is another,
+// after which the monitor closes the connection.  A query is
+//   "query" epoch seq dir...
+// and gets either
+//   "changes" epoch seq path...
+// listing the paths changed after the given token, or, if the epoch is
+// not the monitor's or some directory wasn't watched all along,
+//   "reset" epoch seq reason     or     "unwatched" epoch seq reason
+// where the latter means a directory could not be watched at all.  A
+// path is the name of a changed entry joined to the directory it is in,
+// which is itself reported as changed when entries come or go.
+//
+// The snapshot starts with kFileSignature, a version and the token.
+// Each record after that is a 32-bit path length, the path, and the
+// 64-bit mtime, in native byte order.
+
+namespace {
+
+const char kFileSignature[] = "# ninjamtimes\n";
+const int32_t kCurrentVersion = 2;
+const size_t kHeaderSize =
+    sizeof(kFileSignature) - 1 + sizeof(int32_t) + 2 * sizeof(uint64_t);
+/// A record's size besides its path.
+const size_t kRecordSize = sizeof(uint32_t) + sizeof(TimeStamp);
+
+/// Requests or replies bigger than this are refused.
+const size_t kMaxMessageSize = 256 << 20;
+
+/// How long to wait for the other end of a connection.
+const int kTimeoutSeconds = 5;
+
+/// How long to wait for a monitor just started to answer.
+const int kStartMillis = 1000;
+
+/// Past this many changes the monitor starts over, rather than keep a
+/// journal that never stops growing.
+const size_t kMaxJournalSize = 1 << 20;
+
+/// How often the monitor checks that its socket is still there, so that
+/// it doesn't outlive the build directory it was started for.
+const int kSocketCheckMillis = 1000;
+
+void AppendField(string* message, StringPiece field) {
+  message->append(field.str_, field.len_);
+  message->push_back('\0');
+}
+
+void AppendNumber(string* message, uint64_t value) {
+  char buf[32];
+  snprintf(buf, sizeof(buf), "%llu", (unsigned long long)value);
+  AppendField(message, buf);
+}
+
+/// Split \a message into its NUL-terminated fields.  Returns false if
+/// the last one isn't terminated.
+bool SplitFields(const string& message, vector<StringPiece>* fields) {
+  const char* p = message.data();
+  const char* end = p + message.size();
+  while (p < end) {
+    const char* nul = static_cast<const char*>(memchr(p, '\0', end - p));
+    if (!nul)
+      return false;
+    fields->push_back(StringPiece(p, nul - p));
+    p = nul + 1;
+  }
+  return true;
+}
+
+bool ParseNumber(StringPiece field, uint64_t* value) {
+  if (field.len_ == 0 || field.len_ > 20)
+    return false;
+  uint64_t result = 0;
+  for (size_t i = 0; i < field.len_; ++i) {
+    if (field.str_[i] < '0' || field.str_[i] > '9')
+      return false;
+    result = result * 10 + (field.str_[i] - '0');
+  }
+  *value = result;
+  return true;
+}
+
+void AppendInt(string* out, uint32_t value) {
+  out->append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+uint32_t ReadInt(const char* p) {
+  uint32_t value;
+  memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+/// The snapshot header for \a token.
+string Header(const MonitorToken& token) {
+  string header(kFileSignature, sizeof(kFileSignature) - 1);
+  header.append(reinterpret_cast<const char*>(&kCurrentVersion),
+                sizeof(kCurrentVersion));
+  header.append(reinterpret_cast<const char*>(&token.epoch),
+                sizeof(token.epoch));
+  header.append(reinterpret_cast<const char*>(&token.seq), sizeof(token.seq));
+  return header;
+}
+
+typedef ExternalStringHashMap<bool>::Type PathSet;
+
+/// Add the directory \a path is in, and those above it, to \a dirs.
+void AddDirs(StringPiece path, PathSet* seen, vector<StringPiece>* dirs) {
+  for (;;) {
+    size_t slash = path.len_;
+    while (slash > 0 && path.str_[slash - 1] != '/')
+      --slash;
+    StringPiece dir;
+    if (slash == 0)
+      dir = StringPiece(".", 1);
+    else if (slash == 1)
+      dir = StringPiece(path.str_, 1);
+    else
+      dir = StringPiece(path.str_, slash - 1);
+    if (!seen->insert(make_pair(dir, true)).second)
+      return;
+    dirs->push_back(dir);
+    if (slash <= 1)
+      return;
+    path = dir;
+  }
+}
+
+#ifdef __linux__
+
+/// Connect to the monitor listening on \a path.  Returns the socket, or
+/// -1 with errno set.
+int Connect(const string& path) {
+  sockaddr_un addr;
+  if (path.size() >= sizeof(addr.sun_path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    return -1;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path.c_str());
+  if (connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) {
+    int error = errno;
+    close(fd);
+    errno = error;
+    return -1;
+  }
+  return fd;
+}
+
+/// Give up on reads and writes that take longer than kTimeoutSeconds.
+void SetTimeouts(int fd) {
+  timeval timeout;
+  timeout.tv_sec = kTimeoutSeconds;
+  timeout.tv_usec = 0;
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+}
+
+bool SendAll(int fd, const string& message) {
+  const char* p = message.data();
+  size_t left = message.size();
+  while (left > 0) {
+    ssize_t ret = send(fd, p, left, MSG_NOSIGNAL);
+    if (ret < 0) {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+    p += ret;
+    left -= ret;
+  }
+  return true;
+}
+
+/// Read from \a fd until the other end shuts down.
+bool ReceiveAll(int fd, string* message) {
+  char buf[64 << 10];
+  for (;;) {
+    ssize_t ret = recv(fd, buf, sizeof(buf), 0);
+    if (ret < 0) {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+    if (ret == 0)
+      return true;
+    if (message->size() + ret > kMaxMessageSize) {
+      errno = EMSGSIZE;
+      return false;
+    }
+    message->append(buf, ret);
+  }
+}
+
+#endif  // __linux__
+
+}  // namespace
+
+FileMonitor::FileMonitor(const string& socket_path,
+                         const string& snapshot_path)
+    : socket_path_(socket_path), snapshot_path_(snapshot_path),
+      snapshot_records_(0), trusted_records_(0), snapshot_epoch_(0) {}
+
+int FileMonitor::LoadMtimes(State* state, bool start_monitor, string* err) {
+  METRIC_RECORD("file monitor load");
+  token_ = MonitorToken();
+  snapshot_records_ = 0;
+  trusted_records_ = 0;
+  snapshot_epoch_ = 0;
+
+  MappedFile file;
+  MonitorToken saved;
+  string load_err;
+  int ret = file.Load(snapshot_path_, &load_err);
+  if (ret == 0 && file.size() >= kHeaderSize &&
+      memcmp(file.data(), kFileSignature, sizeof(kFileSignature) - 1) == 0 &&
+      (int32_t)ReadInt(file.data() + sizeof(kFileSignature) - 1) ==
+          kCurrentVersion) {
+    const char* p = file.data() + sizeof(kFileSignature) - 1 +
+        sizeof(int32_t);
+    memcpy(&saved.epoch, p, sizeof(saved.epoch));
+    memcpy(&saved.seq, p + sizeof(saved.epoch), sizeof(saved.seq));
+  } else if (ret < 0 && ret != -ENOENT) {
+    *err = "loading mtimes: " + load_err;
+  }
+
+  // The monitor must watch the directories of all the files, and the
+  // ones above them, which a rename could swap out from under them.
+  PathSet seen;
+  vector<StringPiece> dirs;
+  for (State::Paths::const_iterator i = state->paths_.begin();
+       i != state->paths_.end(); ++i)
+    AddDirs(i->first, &seen, &dirs);
+
+  string reply, reason;
+  vector<StringPiece> changed;
+  Answer answer = Query(saved, dirs, start_monitor, &reply, &changed,
+                        &reason, err);
+  if (answer == FAILED)
+    return 0;
+  if (answer != CHANGES) {
+    EXPLAIN("file monitor: %s; stat()ing every file", reason.c_str());
+    if (answer == UNWATCHED)
+      *err = "file monitor: " + reason;
+    return 0;
+  }
+
+  PathSet changed_paths;
+  for (vector<StringPiece>::iterator i = changed.begin();
+       i != changed.end(); ++i)
+    changed_paths.insert(make_pair(*i, true));
+
+  // Only whole records are ever written; a garbled file is no use.
+  const char* data = file.data();
+  size_t size = file.size();
+  size_t offset = kHeaderSize;
+  while (size - offset >= kRecordSize) {
+    size_t path_size = ReadInt(data + offset);
+    if (path_size > size - offset - kRecordSize)
+      break;
+    offset += kRecordSize + path_size;
+  }
+  if (offset < size) {
+    *err = "mtimes snapshot corrupt; ignoring it";
+    return 0;
+  }
+
+  snapshot_epoch_ = saved.epoch;
+  for (offset = kHeaderSize; offset < size; ) {
+    size_t path_size = ReadInt(data + offset);
+    StringPiece path(data + offset + sizeof(uint32_t), path_size);
+    TimeStamp mtime;
+    memcpy(&mtime, path.str_ + path_size, sizeof(mtime));
+    offset += kRecordSize + path_size;
+    ++snapshot_records_;
+
+    if (mtime <= 0 || changed_paths.find(path) != changed_paths.end())
+      continue;
+    Node* node = state->LookupNode(path);
+    if (node && !node->status_known()) {
+      node->set_mtime(mtime);
+      ++trusted_records_;
+    }
+  }
+  return trusted_records_;
+}
+
+bool FileMonitor::SaveMtimes(const State& state, string* err) {
+  METRIC_RECORD("file monitor save");
+  if (token_.epoch == 0)
+    return true;
+
+  string record;
+  int count = 0;
+  for (State::Paths::const_iterator i = state.paths_.begin();
+       i != state.paths_.end(); ++i) {
+    if (i->second->mtime() > 0)
+      ++count;
+  }
+
+  // If every file there is came from the snapshot, only its token needs
+  // bringing up to date.
+  if (snapshot_epoch_ == token_.epoch && count == trusted_records_ &&
+      count == snapshot_records_) {
+    FILE* file = fopen(snapshot_path_.c_str(), "r+b");
+    if (file) {
+      string header = Header(token_);
+      bool ok = fwrite(header.data(), header.size(), 1, file) == 1;
+      if (fclose(file) == 0 && ok)
+        return true;
+    }
+  }
+
+  string temp_path = snapshot_path_ + ".tmp";
+  FILE* file = fopen(temp_path.c_str(), "wb");
+  if (!file) {
+    *err = "saving mtimes: " + string(strerror(errno));
+    return false;
+  }
+  string contents = Header(token_);
+  for (State::Paths::const_iterator i = state.paths_.begin();
+       i != state.paths_.end(); ++i) {
+    TimeStamp mtime = i->second->mtime();
+    if (mtime <= 0)
+      continue;
+    AppendInt(&contents, (uint32_t)i->first.len_);
+    contents.append(i->first.str_, i->first.len_);
+    contents.append(reinterpret_cast<const char*>(&mtime), sizeof(mtime));
+  }
+  bool ok = fwrite(contents.data(), 1, contents.size(), file) ==
+      contents.size();
+  if (fclose(file) != 0)
+    ok = false;
+#ifdef _WIN32
+  // rename() won't replace an existing file on Windows.
+  unlink(snapshot_path_.c_str());
+#endif
+  if (!ok || rename(temp_path.c_str(), snapshot_path_.c_str()) < 0) {
+    *err = "saving mtimes: " + string(strerror(errno));
+    unlink(temp_path.c_str());
+    return false;
+  }
+  return true;
+}
+
+bool FileMonitor::StopMonitor(string* err) {
+  string request, reply;
+  AppendField(&request, "stop");
+  return Send(request, false, &reply, err);
+}
+
+FileMonitor::Answer FileMonitor::Query(const MonitorToken& since,
+                                       const vector<StringPiece>& dirs,
+                                       bool start_monitor, string* reply,
+                                       vector<StringPiece>* changed,
+                                       string* reason, string* err) {
+  METRIC_RECORD("file monitor query");
+  string request;
+  AppendField(&request, "query");
+  AppendNumber(&request, since.epoch);
+  AppendNumber(&request, since.seq);
+  for (vector<StringPiece>::const_iterator i = dirs.begin();
+       i != dirs.end(); ++i)
+    AppendField(&request, *i);
+  if (!Send(request, start_monitor, reply, err))
+    return FAILED;
+
+  vector<StringPiece> fields;
+  MonitorToken token;
+  if (!SplitFields(*reply, &fields) || fields.size() < 3 ||
+      !ParseNumber(fields[1], &token.epoch) ||
+      !ParseNumber(fields[2], &token.seq) || token.epoch == 0) {
+    *err = "file monitor: garbled reply";
+    return FAILED;
+  }
+  token_ = token;
+  if (fields[0] == "changes") {
+    changed->assign(fields.begin() + 3, fields.end());
+    return CHANGES;
+  }
+  *reason = fields.size() > 3 ? fields[3].AsString() : "no reason given";
+  return fields[0] == "unwatched" ? UNWATCHED : RESET;
+}
+
+#ifdef __linux__
+
+bool FileMonitor::Send(const string& request, bool start_monitor,
+                       string* reply, string* err) {
+  int fd = Connect(socket_path_);
+  if (fd < 0 && start_monitor && (errno == ENOENT || errno == ECONNREFUSED)) {
+    if (!StartMonitor(err))
+      return false;
+    int64_t deadline = GetTimeMillis() + kStartMillis;
+    while ((fd = Connect(socket_path_)) < 0 &&
+           (errno == ENOENT || errno == ECONNREFUSED) &&
+           GetTimeMillis() < deadline)
+      usleep(5000);
+  }
+  if (fd < 0) {
+    *err = "file monitor: " + socket_path_ + ": " + strerror(errno);
+    return false;
+  }
+
+  SetTimeouts(fd);
+  bool ok = SendAll(fd, request) && shutdown(fd, SHUT_WR) == 0 &&
+      ReceiveAll(fd, reply);
+  if (!ok)
+    *err = "file monitor: " + string(strerror(errno));
+  close(fd);
+  return ok;
+}
+
+bool FileMonitor::StartMonitor(string* err) {
+  // Only async-signal-safe calls between fork() and exec(): other
+  // threads may hold locks.  The double fork leaves no zombie behind,
+  // and the new session keeps the monitor out of the terminal's signals.
+  const char* socket_path = socket_path_.c_str();
+  pid_t pid = fork();
+  if (pid < 0) {
+    *err = "file monitor: fork: " + string(strerror(errno));
+    return false;
+  }
+  if (pid == 0) {
+    setsid();
+    if (fork() != 0)
+      _exit(0);
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigprocmask(SIG_SETMASK, &mask, NULL);
+    int null_fd = open("/dev/null", O_RDWR);
+    if (null_fd >= 0) {
+      dup2(null_fd, 0);
+      dup2(null_fd, 1);
+      dup2(null_fd, 2);
+    }
+    execl("/proc/self/exe", "ninja", "-t", "monitor", socket_path,
+          (char*)NULL);
+    _exit(1);
+  }
+  while (waitpid(pid, NULL, 0) < 0 && errno == EINTR) {}
+  return true;
+}
+
+namespace {
+
+const uint32_t kWatchMask =
+    IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE |
+    IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR;
+
+/// Events that add or remove a directory entry, and so change the
+/// directory's own mtime too.
+const uint32_t kEntryMask = IN_CREATE | IN_DELETE | IN_MOVED_FROM |
+    IN_MOVED_TO;
+
+/// Events after which a watch no longer sees what's at its path.
+const uint32_t kGoneMask = IN_DELETE_SELF | IN_MOVE_SELF | IN_UNMOUNT |
+    IN_IGNORED;
+
+}  // namespace
+
+FileMonitorServer::FileMonitorServer()
+    : listen_fd_(-1), socket_dev_(0), socket_ino_(0), inotify_fd_(-1),
+      restarts_(0), stop_(false), answered_seq_(0) {}
+
+FileMonitorServer::~FileMonitorServer() {
+  if (listen_fd_ >= 0) {
+    close(listen_fd_);
+    // Leave alone whatever took the socket's place.
+    if (OwnsSocket())
+      unlink(socket_path_.c_str());
+  }
+  if (inotify_fd_ >= 0)
+    close(inotify_fd_);
+}
+
+bool FileMonitorServer::Start(const string& socket_path, string* err) {
+  sockaddr_un addr;
+  if (socket_path.size() >= sizeof(addr.sun_path)) {
+    *err = socket_path + ": path too long for a socket";
+    return false;
+  }
+  inotify_fd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (inotify_fd_ < 0) {
+    *err = "inotify_init1: " + string(strerror(errno));
+    return false;
+  }
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    *err = "socket: " + string(strerror(errno));
+    return false;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, socket_path.c_str());
+  int ret = bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
+  if (ret < 0 && errno == EADDRINUSE) {
+    // Take over the socket of a monitor that's gone, but not that of
+    // one that's still there.
+    int other = Connect(socket_path);
+    if (other >= 0) {
+      close(other);
+      close(fd);
+      *err = "a monitor is already listening on " + socket_path;
+      return false;
+    }
+    unlink(socket_path.c_str());
+    ret = bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
+  }
+  struct stat st;
+  if (ret < 0 || listen(fd, 16) < 0 || stat(socket_path.c_str(), &st) < 0) {
+    *err = socket_path + ": " + strerror(errno);
+    close(fd);
+    return false;
+  }
+  listen_fd_ = fd;
+  socket_dev_ = st.st_dev;
+  socket_ino_ = st.st_ino;
+  socket_path_ = socket_path;
+  signal(SIGPIPE, SIG_IGN);
+  Restart();
+  return true;
+}
+
+void FileMonitorServer::Serve(int idle_seconds) {
+  int64_t idle_until = GetTimeMillis() + idle_seconds * 1000LL;
+  while (!stop_) {
+    int64_t left = idle_until - GetTimeMillis();
+    if (left <= 0)
+      break;
+    if (!OwnsSocket()) {
+      // The build directory went, or another monitor took over.
+      break;
+    }
+    pollfd fds[2];
+    fds[0].fd = inotify_fd_;
+    fds[0].events = POLLIN;
+    fds[1].fd = listen_fd_;
+    fds[1].events = POLLIN;
+    if (poll(fds, 2, (int)min(left, (int64_t)kSocketCheckMillis)) < 0) {
+      if (errno == EINTR)
+        continue;
+      Error("poll: %s", strerror(errno));
+      break;
+    }
+    if (fds[0].revents)
+      ReadEvents();
+    if (fds[1].revents & POLLIN) {
+      int fd = accept4(listen_fd_, NULL, NULL, SOCK_CLOEXEC);
+      if (fd >= 0) {
+        Handle(fd);
+        close(fd);
+        idle_until = GetTimeMillis() + idle_seconds * 1000LL;
+      }
+    }
+  }
+}
+
+bool FileMonitorServer::OwnsSocket() const {
+  struct stat st;
+  return stat(socket_path_.c_str(), &st) == 0 &&
+      (uint64_t)st.st_dev == socket_dev_ &&
+      (uint64_t)st.st_ino == socket_ino_;
+}
+
+void FileMonitorServer::ReadEvents() {
+  char buf[64 << 10] __attribute__((aligned(__alignof__(inotify_event))));
+  for (;;) {
+    ssize_t len = read(inotify_fd_, buf, sizeof(buf));
+    if (len < 0 && errno == EINTR)
+      continue;
+    if (len <= 0)
+      return;
+    for (char* p = buf; p < buf + len; ) {
+      inotify_event* event = reinterpret_cast<inotify_event*>(p);
+      p += sizeof(inotify_event) + event->len;
+
+      if (event->mask & IN_Q_OVERFLOW) {
+        Restart();
+        continue;
+      }
+      map<int, vector<string> >::iterator dirs = watch_dirs_.find(event->wd);
+      if (dirs == watch_dirs_.end())
+        continue;
+      if (event->mask & kGoneMask) {
+        // Whatever comes to be at the path later must be watched anew.
+        for (vector<string>::iterator i = dirs->second.begin();
+             i != dirs->second.end(); ++i)
+          watches_.erase(*i);
+        watch_dirs_.erase(dirs);
+        if (!(event->mask & IN_IGNORED))
+          inotify_rm_watch(inotify_fd_, event->wd);
+        Restart();
+        continue;
+      }
+      if (event->len == 0)
+        continue;
+
+      // Copy the names; Restart() below may invalidate dirs.
+      vector<string> names = dirs->second;
+      for (vector<string>::iterator i = names.begin(); i != names.end(); ++i) {
+        string path;
+        if (*i == "/")
+          path = "/";
+        else if (*i != ".")
+          path = *i + "/";
+        path += event->name;
+        Record(path);
+        if (event->mask & kEntryMask) {
+          Record(*i);
+          // A watched directory replaced by another, as by swapping a
+          // symlink, doesn't hear about it itself.
+          if (watches_.count(path))
+            Restart();
+        }
+      }
+    }
+  }
+}
+
+void FileMonitorServer::Handle(int fd) {
+  SetTimeouts(fd);
+  string request;
+  vector<StringPiece> fields;
+  if (!ReceiveAll(fd, &request) || !SplitFields(request, &fields) ||
+      fields.empty())
+    return;
+  string reply;
+  Answer(fields, &reply);
+  SendAll(fd, reply);
+}
+
+void FileMonitorServer::Answer(const vector<StringPiece>& fields,
+                               string* reply) {
+  if (fields[0] == "stop") {
+    stop_ = true;
+    AppendField(reply, "ok");
+    return;
+  }
+  MonitorToken since;
+  if (fields[0] != "query" || fields.size() < 3 ||
+      !ParseNumber(fields[1], &since.epoch) ||
+      !ParseNumber(fields[2], &since.seq)) {
+    AppendField(reply, "error");
+    return;
+  }
+
+  // Catch up on the changes made before the request, then watch the
+  // directories that aren't yet.
+  ReadEvents();
+  string reason;
+  if (since.epoch != token_.epoch)
+    reason = since.epoch == 0 ? "no earlier scan" : "monitor started over";
+  bool failed = false;
+  for (size_t i = 3; i < fields.size(); ++i)
+    Watch(fields[i].AsString(), &reason, &failed);
+  // Anything that happened while adding the watches is news too.
+  ReadEvents();
+
+  answered_seq_ = token_.seq;
+  AppendField(reply, reason.empty() ? "changes" :
+                     failed ? "unwatched" : "reset");
+  AppendNumber(reply, token_.epoch);
+  AppendNumber(reply, token_.seq);
+  if (!reason.empty()) {
+    AppendField(reply, reason);
+    return;
+  }
+  for (uint64_t seq = since.seq; seq < journal_.size(); ++seq)
+    AppendField(reply, journal_[seq]);
+}
+
+void FileMonitorServer::Watch(const string& dir, string* reason,
+                              bool* failed) {
+  if (watches_.count(dir))
+    return;
+  int wd = inotify_add_watch(inotify_fd_, dir.c_str(), kWatchMask);
+  if (wd < 0) {
+    // Files in a directory that doesn't exist don't either, and missing
+    // files never come from the snapshot.
+    if (errno == ENOENT || errno == ENOTDIR)
+      return;
+    if (!*failed) {
+      *reason = "can't watch " + dir + ": " + strerror(errno);
+      *failed = true;
+    }
+    return;
+  }
+  watches_[dir] = wd;
+  watch_dirs_[wd].push_back(dir);
+  if (reason->empty())
+    *reason = "started watching " + dir;
+}
+
+void FileMonitorServer::Record(const string& path) {
+  map<string, uint64_t>::iterator i = latest_.find(path);
+  if (i != latest_.end() && i->second > answered_seq_)
+    return;
+  if (journal_.size() >= kMaxJournalSize) {
+    Restart();
+    return;
+  }
+  journal_.push_back(path);
+  token_.seq = journal_.size();
+  latest_[path] = token_.seq;
+}
+
+void FileMonitorServer::Restart() {
+  // Time and pid tell monitors apart; the count, restarts of one.
+  token_.epoch = ((uint64_t)time(NULL) << 32) ^
+      ((uint64_t)getpid() << 12) ^ (uint64_t)++restarts_;
+  token_.seq = 0;
+  answered_seq_ = 0;
+  journal_.clear();
+  latest_.clear();
+}
+
+#else  // !__linux__
+
+bool FileMonitor::Send(const string& request, bool start_monitor,
+                       string* reply, string* err) {
+  *err = "file monitor: not supported on this platform";
+  return false;
+}
+
+bool FileMonitor::StartMonitor(string* err) {
+  *err = "file monitor: not supported on this platform";
+  return false;
+}
+
+#endif  // __linux__
@@ -0,0 +1,156 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef NINJA_FILE_MONITOR_H_
+#define NINJA_FILE_MONITOR_H_
+
+#include <map>
+#include <string>
+#include <vector>
+using namespace std;
+
+#include "string_piece.h"
+#include "util.h"
+
+struct State;
+
+/// A point in the stream of changes a file monitor has seen: the changes
+/// numbered above \a seq came after it.  The epoch tells monitors apart,
+/// and changes when a monitor loses track of the file system, so that a
+/// point from before then is never taken to cover what happened since.
+struct MonitorToken {
+  MonitorToken() : epoch(0), seq(0) {}
+  uint64_t epoch;
+  uint64_t seq;
+};
+
+/// Lets a build skip stat()ing the files that haven't changed since the
+/// last one.  After the scan, SaveMtimes() writes the mtimes it found to
+/// a snapshot file, along with a token from a file monitor process (see
+/// FileMonitorServer); on the next build, LoadMtimes() asks the monitor
+/// which files changed since that token and gives every other node its
+/// mtime from the snapshot.  Only files found to exist are taken from
+/// the snapshot: a missing file's directory may not have been watched.
+struct FileMonitor {
+  FileMonitor(const string& socket_path, const string& snapshot_path);
+
+  /// Give the nodes of \a state that have no mtime yet the ones saved by
+  /// the last SaveMtimes(), unless the monitor says they changed since.
+  /// If no monitor answers and \a start_monitor is set, start one as a
+  /// background "ninja -t monitor".  Returns the number of nodes given
+  /// mtimes.  Failing that is not an error, as the nodes just get
+  /// stat()ed as usual; \a err gets a warning if something is amiss.
+  int LoadMtimes(State* state, bool start_monitor, string* err);
+
+  /// Save the mtimes of the nodes of \a state, as of the monitor's
+  /// answer to LoadMtimes().  Does nothing if there was none.
+  bool SaveMtimes(const State& state, string* err);
+
+  /// Ask the monitor to exit.  Used for tests.
+  bool StopMonitor(string* err);
+
+ private:
+  enum Answer {
+    /// No monitor answered.
+    FAILED,
+    /// The monitor can't tell what changed since the given token.
+    RESET,
+    /// Like RESET, but because it failed to watch some directory.
+    UNWATCHED,
+    /// The monitor listed the paths that changed.
+    CHANGES,
+  };
+
+  /// Send \a request to the monitor and read its reply into \a reply.
+  bool Send(const string& request, bool start_monitor, string* reply,
+            string* err);
+  /// Start a monitor process in the background.
+  bool StartMonitor(string* err);
+  /// Ask which paths changed since \a since, making sure the monitor
+  /// watches \a dirs.  Sets token_ and fills \a changed with the paths
+  /// (for CHANGES) or \a reason with why not (for RESET and UNWATCHED).
+  Answer Query(const MonitorToken& since, const vector<StringPiece>& dirs,
+               bool start_monitor, string* reply,
+               vector<StringPiece>* changed, string* reason, string* err);
+
+  string socket_path_;
+  string snapshot_path_;
+  /// The monitor's latest answer; epoch 0 if there was none.
+  MonitorToken token_;
+  /// The records in the snapshot LoadMtimes() read, and how many of them
+  /// it gave to nodes.
+  int snapshot_records_;
+  int trusted_records_;
+  /// The epoch of that snapshot.
+  uint64_t snapshot_epoch_;
+};
+
+#ifdef __linux__
+/// The file monitor process behind "ninja -t monitor": watches the
+/// directories clients ask about with inotify, keeping a journal of the
+/// paths that change in them, and answers queries over a Unix socket.
+struct FileMonitorServer {
+  FileMonitorServer();
+  ~FileMonitorServer();
+
+  /// Listen on \a socket_path, unless another monitor already does.
+  bool Start(const string& socket_path, string* err);
+
+  /// Answer queries until asked to stop, after \a idle_seconds without
+  /// any, or once the socket is removed.
+  void Serve(int idle_seconds);
+
+ private:
+  /// Whether the socket path still leads to the socket listened on.
+  bool OwnsSocket() const;
+  /// Read the queued inotify events into the journal.
+  void ReadEvents();
+  /// Read a request from the client on \a fd and answer it.
+  void Handle(int fd);
+  /// Answer the request made of \a fields.
+  void Answer(const vector<StringPiece>& fields, string* reply);
+  /// Start watching \a dir if not yet.  Sets \a reason if changes in it
+  /// may have been missed, and \a failed too if it can't be watched.
+  void Watch(const string& dir, string* reason, bool* failed);
+  /// Note a change to \a path.
+  void Record(const string& path);
+  /// Drop the journal and take a new epoch, as changes may have been
+  /// missed.
+  void Restart();
+
+  string socket_path_;
+  int listen_fd_;
+  /// The device and inode of the socket file.
+  uint64_t socket_dev_;
+  uint64_t socket_ino_;
+  int inotify_fd_;
+  MonitorToken token_;
+  int restarts_;
+  bool stop_;
+  /// The watch descriptor of each watched directory, and the
+  /// directories of each watch descriptor; symlinks can give the same
+  /// directory several names.
+  map<string, int> watches_;
+  map<int, vector<string> > watch_dirs_;
+  /// The changed paths: the change numbered n is journal_[n - 1].
+  vector<string> journal_;
+  /// The latest change number of each path in the journal.
+  map<string, uint64_t> latest_;
+  /// The change number as of the last answer; a path changed since then
+  /// need not go in the journal again.
+  uint64_t answered_seq_;
+};
+#endif  // __linux__
+
+#endif  // NINJA_FILE_MONITOR_H_
@@ -0,0 +1,179 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "file_monitor.h"
+
+#ifdef __linux__
+
+#include <stdio.h>
+#include <sys/stat.h>
+
+#include "graph.h"
+#include "metrics.h"
+#include "thread_pool.h"
+#include "test.h"
+
+namespace {
+
+const char kManifest[] =
+"build out: phony src/a.h src/b.h src/missing.h\n";
+
+struct ServeTask : public ThreadPool::Task {
+  explicit ServeTask(FileMonitorServer* server) : server_(server) {}
+  virtual void Run() { server_->Serve(60); }
+  FileMonitorServer* server_;
+};
+
+struct FileMonitorTest : public testing::Test {
+  FileMonitorTest()
+      : monitor_(".ninja_monitor", ".ninja_mtimes"), pool_(1),
+        serve_(&server_), serving_(false) {}
+
+  virtual void SetUp() {
+    // These tests do real disk accesses, so create a temp dir.
+    temp_dir_.CreateAndEnter("Ninja-FileMonitorTest");
+    ASSERT_EQ(0, mkdir("src", 0777));
+    ASSERT_TRUE(Write("src/a.h"));
+    ASSERT_TRUE(Write("src/b.h"));
+    string err;
+    ASSERT_TRUE(server_.Start(".ninja_monitor", &err)) << err;
+    pool_.Post(&serve_);
+    serving_ = true;
+  }
+
+  virtual void TearDown() {
+    if (serving_) {
+      string err;
+      EXPECT_TRUE(monitor_.StopMonitor(&err)) << err;
+      pool_.Wait(&serve_);
+    }
+    temp_dir_.Cleanup();
+  }
+
+  bool Write(const char* path) {
+    FILE* f = fopen(path, "a");
+    if (!f)
+      return false;
+    fputs("x", f);
+    return fclose(f) == 0;
+  }
+
+  /// Load the manifest into \a state and give it the saved mtimes, as a
+  /// build does before its scan.  Returns the number of nodes given one.
+  int Load(State* state) {
+    AssertParse(state, kManifest);
+    string err;
+    int loaded = monitor_.LoadMtimes(state, false, &err);
+    EXPECT_EQ("", err);
+    return loaded;
+  }
+
+  /// Stat the rest of the nodes of \a state and save their mtimes, as a
+  /// build does after its scan.
+  void Save(State* state) {
+    for (State::Paths::iterator i = state->paths_.begin();
+         i != state->paths_.end(); ++i)
+      i->second->StatIfNecessary(&disk_);
+    string err;
+    EXPECT_TRUE(monitor_.SaveMtimes(*state, &err));
+    EXPECT_EQ("", err);
+  }
+
+  ScopedTempDir temp_dir_;
+  RealDiskInterface disk_;
+  FileMonitorServer server_;
+  FileMonitor monitor_;
+  ThreadPool pool_;
+  ServeTask serve_;
+  bool serving_;
+};
+
+TEST_F(FileMonitorTest, UnchangedFilesKeepMtimes) {
+  // Nothing is saved before the first scan.
+  State state1;
+  EXPECT_EQ(0, Load(&state1));
+  Save(&state1);
+
+  // Only files that exist are saved.
+  State state2;
+  EXPECT_EQ(2, Load(&state2));
+  Node* a = state2.LookupNode("src/a.h");
+  EXPECT_EQ(disk_.Stat("src/a.h"), a->mtime());
+  EXPECT_FALSE(state2.LookupNode("src/missing.h")->status_known());
+  EXPECT_FALSE(state2.LookupNode("out")->status_known());
+  Save(&state2);
+
+  // A changed file gets stat()ed again.
+  ASSERT_TRUE(Write("src/a.h"));
+  State state3;
+  EXPECT_EQ(1, Load(&state3));
+  EXPECT_FALSE(state3.LookupNode("src/a.h")->status_known());
+  EXPECT_TRUE(state3.LookupNode("src/b.h")->status_known());
+  Save(&state3);
+
+  // So does a file that comes into existence.
+  ASSERT_TRUE(Write("src/missing.h"));
+  State state4;
+  EXPECT_EQ(2, Load(&state4));
+  EXPECT_FALSE(state4.LookupNode("src/missing.h")->status_known());
+  Save(&state4);
+
+  State state5;
+  EXPECT_EQ(3, Load(&state5));
+}
+
+TEST_F(FileMonitorTest, ReplacedDirectory) {
+  State state1;
+  Load(&state1);
+  Save(&state1);
+  State state2;
+  EXPECT_EQ(2, Load(&state2));
+  Save(&state2);
+
+  // A directory moved away takes its watch along; the monitor must not
+  // vouch for what comes to be at its path.
+  ASSERT_EQ(0, rename("src", "old"));
+  ASSERT_EQ(0, mkdir("src", 0777));
+  ASSERT_TRUE(Write("src/a.h"));
+  ASSERT_TRUE(Write("src/b.h"));
+  State state3;
+  EXPECT_EQ(0, Load(&state3));
+  Save(&state3);
+
+  State state4;
+  EXPECT_EQ(2, Load(&state4));
+}
+
+TEST_F(FileMonitorTest, SocketRemoved) {
+  // The monitor goes once its build directory does, rather than wait out
+  // its idle period.
+  int64_t start = GetTimeMillis();
+  ASSERT_EQ(0, unlink(".ninja_monitor"));
+  pool_.Wait(&serve_);
+  serving_ = false;
+  EXPECT_LT(GetTimeMillis() - start, 30 * 1000);
+}
+
+TEST_F(FileMonitorTest, NoMonitor) {
+  State state;
+  AssertParse(&state, kManifest);
+  FileMonitor monitor(".ninja_nosuchmonitor", ".ninja_mtimes");
+  string err;
+  EXPECT_EQ(0, monitor.LoadMtimes(&state, false, &err));
+  EXPECT_NE("", err);
+}
+
+}  // namespace
+
+#endif  // __linux__
@@ -17,51 +17,435 @@
 #include <assert.h>
 #include <stdio.h>
 
+#include <algorithm>
+#include <deque>
+
 #include "build_log.h"
 #include "depfile_parser.h"
+#include "deps_log.h"
 #include "disk_interface.h"
 #include "explain.h"
 #include "manifest_parser.h"
 #include "metrics.h"
 #include "state.h"
+#include "thread_pool.h"
 #include "util.h"
 
+namespace {
+
+/// Depfile deps are cut into runs of at most this many nodes.
+const int kMaxDepSetSize = 64;
+
+/// Whether a run of depfile deps ends after the node for \a path, which
+/// is so for about one node in 16.  Cutting where the nodes say rather
+/// than every so many nodes means that lists that differ in places still
+/// line up, and share, the runs in between.
+bool EndsDepSet(const string& path) {
+  return (MurmurHash64A(path.data(), path.size()) >> 60) == 0;
+}
+
+}  // namespace
+
+Node::Node(const string& path)
+    : path_(path),
+      mtime_(-1),
+      dirty_(false),
+      ends_dep_set_(EndsDepSet(path)),
+      in_edge_(NULL),
+      id_(-1) {}
+
 bool Node::Stat(DiskInterface* disk_interface) {
   METRIC_RECORD("node stat");
   mtime_ = disk_interface->Stat(path_);
   return mtime_ > 0;
 }
 
+void DepSet::RemoveOutEdge(Edge* edge) {
+  vector<Edge*>::iterator i = find(out_edges_.begin(), out_edges_.end(), edge);
+  if (i != out_edges_.end())
+    out_edges_.erase(i);
+}
+
+DependencyScan::DependencyScan(State* state, BuildLog* build_log,
+                               DepsLog* deps_log,
+                               DiskInterface* disk_interface)
+    : state_(state), build_log_(build_log), deps_log_(deps_log),
+      disk_interface_(disk_interface), scan_pool_(NULL), pending_edges_(0),
+      idle_tasks_(0) {}
+
+/// One of the threads of PrepareScan(): prepares the edges on its own
+/// deque, newest first, so as to go depth first, and once out of them
+/// steals the oldest of another task's.
+struct DependencyScan::PrepareTask : public ThreadPool::Task {
+  explicit PrepareTask(DependencyScan* scan)
+      : scan_(scan), edge_count_(0), micros_(0) {}
+
+  virtual void Run() {
+    Stopwatch stopwatch;
+    for (;;) {
+      Edge* edge = NULL;
+      {
+        MutexLock lock(&deque_mutex_);
+        if (!deque_.empty()) {
+          edge = deque_.back();
+          deque_.pop_back();
+        }
+      }
+      if (!edge && !(edge = scan_->StealEdge()))
+        break;
+      stopwatch.Restart();
+      scan_->PrepareEdge(edge, this);
+      micros_ += (int64_t)(stopwatch.Elapsed() * 1e6);
+      ++edge_count_;
+    }
+  }
+
+  DependencyScan* scan_;
+  /// Guards deque_, which other tasks steal from.  Taken after the
+  /// scan's mutex_ when both are.
+  Mutex deque_mutex_;
+  deque<Edge*> deque_;
+  /// The nodes without in-edges come across, to stat after the edges.
+  vector<Node*> leaves_;
+  /// How many edges Run() prepared, and how long that took, leaving out
+  /// the waits for work.
+  int edge_count_;
+  int64_t micros_;
+};
+
+/// Stats a slice of the nodes PrepareScan() found without in-edges.
+struct DependencyScan::StatTask : public ThreadPool::Task {
+  StatTask(DiskInterface* disk_interface, Node** begin, Node** end)
+      : disk_interface_(disk_interface), begin_(begin), end_(end),
+        micros_(0) {}
+
+  virtual void Run() {
+    Stopwatch stopwatch;
+    stopwatch.Restart();
+    for (Node** i = begin_; i != end_; ++i)
+      (*i)->set_mtime(disk_interface_->Stat((*i)->path()));
+    micros_ = (int64_t)(stopwatch.Elapsed() * 1e6);
+  }
+
+  DiskInterface* disk_interface_;
+  Node** begin_;
+  Node** end_;
+  /// How long Run() took.
+  int64_t micros_;
+};
+
+namespace {
+
+/// Slices per thread: more than one, so that a thread stuck on a slow
+/// directory doesn't hold up the rest.
+const int kStatTasksPerThread = 4;
+/// Nodes below which a slice isn't worth handing to another thread.
+const int kMinStatTaskSize = 64;
+
+/// Serializes lookups in the edges' binding envs, which evaluate their
+/// bindings lazily and so change as they are read.
+Mutex g_env_mutex;
+
+}  // namespace
+
+void DependencyScan::PrepareScan(const vector<Node*>& targets) {
+  if (!scan_pool_)
+    return;
+  METRIC_RECORD("scan prepare");
+
+  // Each edge is taken on by the first task to come across it, which
+  // hands the in-edges of its inputs and depfile deps to itself in turn;
+  // tasks left without work steal some.  Nodes without in-edges may come
+  // up many times, and are statted once all edges are done.
+  unsigned generation = state_->scan_generation();
+  int task_count = scan_pool_->size() + 1;
+  for (int i = 0; i < task_count; ++i)
+    tasks_.push_back(new PrepareTask(this));
+  pending_edges_ = 0;
+  idle_tasks_ = 0;
+  vector<Node*> nodes;
+  for (vector<Node*>::const_iterator i = targets.begin();
+       i != targets.end(); ++i) {
+    Edge* edge = (*i)->in_edge();
+    if (!edge) {
+      nodes.push_back(*i);
+    } else if (edge->prepare_generation_ != generation) {
+      edge->prepare_generation_ = generation;
+      tasks_[pending_edges_ % task_count]->deque_.push_back(edge);
+      ++pending_edges_;
+    }
+  }
+  for (vector<PrepareTask*>::iterator i = tasks_.begin();
+       i != tasks_.end(); ++i)
+    scan_pool_->Post(*i);
+
+  // Report the time the threads spent working next to the wall time of
+  // the whole preparation.
+  static Metric* edge_metric =
+      g_metrics ? g_metrics->NewMetric("scan prepare edges (thread time)")
+                : NULL;
+  // A task may steal from the others until the last one is done.
+  for (vector<PrepareTask*>::iterator i = tasks_.begin();
+       i != tasks_.end(); ++i)
+    scan_pool_->Wait(*i);
+  for (vector<PrepareTask*>::iterator i = tasks_.begin();
+       i != tasks_.end(); ++i) {
+    if (edge_metric) {
+      edge_metric->count += (*i)->edge_count_;
+      edge_metric->sum += (*i)->micros_;
+    }
+    nodes.insert(nodes.end(), (*i)->leaves_.begin(), (*i)->leaves_.end());
+    delete *i;
+  }
+  tasks_.clear();
+
+  sort(nodes.begin(), nodes.end());
+  nodes.erase(unique(nodes.begin(), nodes.end()), nodes.end());
+  // Some may have got a phony in-edge since, and been statted with it.
+  vector<Node*>::iterator end = nodes.begin();
+  for (vector<Node*>::iterator i = nodes.begin(); i != nodes.end(); ++i) {
+    if (!(*i)->status_known())
+      *end++ = *i;
+  }
+  nodes.erase(end, nodes.end());
+  if (nodes.empty())
+    return;
+
+  task_count = (scan_pool_->size() + 1) * kStatTasksPerThread;
+  task_count = min(task_count, ((int)nodes.size() + kMinStatTaskSize - 1) /
+                               kMinStatTaskSize);
+  vector<StatTask*> tasks;
+  Node** begin = &nodes[0];
+  for (int i = 0; i < task_count; ++i) {
+    Node** end = &nodes[0] + (long long)nodes.size() * (i + 1) / task_count;
+    tasks.push_back(new StatTask(disk_interface_, begin, end));
+    scan_pool_->Post(tasks.back());
+    begin = end;
+  }
+
+  static Metric* stat_metric =
+      g_metrics ? g_metrics->NewMetric("scan prepare stats (thread time)")
+                : NULL;
+  for (vector<StatTask*>::iterator i = tasks.begin(); i != tasks.end(); ++i) {
+    scan_pool_->Wait(*i);
+    if (stat_metric) {
+      stat_metric->count += (int)((*i)->end_ - (*i)->begin_);
+      stat_metric->sum += (*i)->micros_;
+    }
+    delete *i;
+  }
+}
+
+Edge* DependencyScan::StealEdge() {
+  MutexLock lock(&mutex_);
+  for (;;) {
+    for (vector<PrepareTask*>::iterator i = tasks_.begin();
+         i != tasks_.end(); ++i) {
+      MutexLock deque_lock(&(*i)->deque_mutex_);
+      if (!(*i)->deque_.empty()) {
+        Edge* edge = (*i)->deque_.front();
+        (*i)->deque_.pop_front();
+        return edge;
+      }
+    }
+    // With no edges queued, the ones pending are being prepared, and may
+    // bring more.
+    if (pending_edges_ == 0)
+      return NULL;
+    ++idle_tasks_;
+    work_cond_.Wait(&mutex_);
+    --idle_tasks_;
+  }
+}
+
+void DependencyScan::PrepareEdge(Edge* edge, PrepareTask* task) {
+  // The outputs are the edge's own; no other task touches them.
+  for (vector<Node*>::iterator i = edge->outputs_.begin();
+       i != edge->outputs_.end(); ++i) {
+    if (!(*i)->status_known())
+      (*i)->set_mtime(disk_interface_->Stat((*i)->path()));
+  }
+
+  // As LoadDeps(), but errors are left for RecomputeDirty() to run into
+  // again and report.
+  unsigned generation = state_->scan_generation();
+  if (!edge->rule().depfile().empty()) {
+    bool loaded = LoadDepsFromLog(edge);
+    bool missing = false;
+    if (!loaded) {
+      vector<Node*> nodes;
+      string err;
+      if (ReadDepFile(edge, &nodes, &err)) {
+        SetDepfileDeps(edge, nodes.empty() ? NULL : &nodes[0],
+                       (int)nodes.size());
+        loaded = true;
+      } else if (err.empty()) {
+        SetDepfileDeps(edge, NULL, 0);
+        loaded = missing = true;
+      }
+    }
+    if (loaded) {
+      edge->deps_missing_ = missing;
+      edge->deps_generation_ = generation;
+    }
+  }
+
+  // The command is compared with the build log's only if the edge would
+  // be clean otherwise, which is likelier when its outputs exist.
+  if (build_log_ && !edge->is_phony() && !edge->rule().generator() &&
+      edge->outputs_[0]->exists())
+    edge->GetCommandHash();
+
+  MutexLock lock(&mutex_);
+  int pushed = 0;
+  for (vector<Node*>::iterator i = edge->inputs_.begin();
+       i != edge->inputs_.end(); ++i)
+    pushed += ClaimInput(*i, task);
+  for (vector<DepSet*>::iterator i = edge->dep_sets_.begin();
+       i != edge->dep_sets_.end(); ++i) {
+    DepSet* dep_set = *i;
+    if (dep_set->prepare_generation_ == generation)
+      continue;
+    dep_set->prepare_generation_ = generation;
+    for (Node** n = dep_set->begin(); n != dep_set->end(); ++n)
+      pushed += ClaimInput(*n, task);
+  }
+  pending_edges_ += pushed - 1;
+  if ((pushed > 0 && idle_tasks_ > 0) || pending_edges_ == 0)
+    work_cond_.Broadcast();
+}
+
+int DependencyScan::ClaimInput(Node* input, PrepareTask* task) {
+  Edge* in_edge = input->in_edge();
+  if (!in_edge) {
+    task->leaves_.push_back(input);
+    return 0;
+  }
+  if (in_edge->prepare_generation_ == state_->scan_generation())
+    return 0;
+  in_edge->prepare_generation_ = state_->scan_generation();
+  MutexLock lock(&task->deque_mutex_);
+  task->deque_.push_back(in_edge);
+  return 1;
+}
+
+/// An entry on the stack of RecomputeDirty(): an input or dep set to
+/// visit, or an edge or dep set to judge.
+struct DependencyScan::Visit {
+  explicit Visit(Node* input)
+      : input(input), edge(NULL), dep_set(NULL), dirty(false),
+        judge(false) {}
+  Visit(Edge* edge, bool dirty)
+      : input(NULL), edge(edge), dep_set(NULL), dirty(dirty), judge(true) {}
+  Visit(DepSet* dep_set, bool judge)
+      : input(NULL), edge(NULL), dep_set(dep_set), dirty(false),
+        judge(judge) {}
+
+  Node* input;
+  Edge* edge;
+  DepSet* dep_set;
+  /// Whether the edge is known to be dirty before judging it.
+  bool dirty;
+  /// Whether to judge the dep set rather than visit it.
+  bool judge;
+};
+
 bool DependencyScan::RecomputeDirty(Edge* edge, string* err) {
-  bool dirty = false;
+  if (edge->scan_generation_ == state_->scan_generation())
+    return true;
+
+  // Go depth first, with a stack of our own rather than the call stack,
+  // which very deep graphs would overflow.  An edge is marked as visited
+  // when it is pushed to be judged, below its inputs, and so is judged
+  // once they all are.  One found marked but not judged yet is further
+  // down the stack: a dependency cycle, which the plan reports.
+  vector<Visit> stack;
+  if (!VisitEdge(edge, &stack, err))
+    return false;
+  while (!stack.empty()) {
+    Visit visit = stack.back();
+    stack.pop_back();
+    if (visit.input) {
+      if (!VisitInput(visit.input, &stack, err))
+        return false;
+    } else if (visit.dep_set) {
+      if (visit.judge)
+        JudgeDepSet(visit.dep_set);
+      else
+        VisitDepSet(visit.dep_set, &stack);
+    } else {
+      JudgeEdge(visit.edge, visit.dirty);
+    }
+  }
+  return true;
+}
+
+bool DependencyScan::VisitEdge(Edge* edge, vector<Visit>* stack,
+                               string* err) {
+  unsigned generation = state_->scan_generation();
+  edge->scan_generation_ = generation;
   edge->outputs_ready_ = true;
 
+  bool dirty = false;
   if (!edge->rule_->depfile().empty()) {
-    if (!LoadDepFile(edge, err)) {
-      if (!err->empty())
-        return false;
+    if (edge->deps_generation_ != generation && !LoadDeps(edge, err))
+      return false;
+    if (edge->deps_missing_) {
       EXPLAIN("Edge targets are dirty because depfile '%s' is missing",
               edge->EvaluateDepFile().c_str());
       dirty = true;
     }
   }
+  stack->push_back(Visit(edge, dirty));
+
+  // Push the inputs so that they come off the stack in order, and then
+  // the depfile deps.  Their runs are shared, and each is only looked at
+  // once per scan.  A run is only marked when it comes off the stack, as
+  // another edge sharing it may get to it first, through the inputs.
+  for (vector<DepSet*>::reverse_iterator i = edge->dep_sets_.rbegin();
+       i != edge->dep_sets_.rend(); ++i) {
+    if ((*i)->scan_generation_ != generation)
+      stack->push_back(Visit(*i, false));
+  }
+  for (vector<Node*>::reverse_iterator i = edge->inputs_.rbegin();
+       i != edge->inputs_.rend(); ++i) {
+    stack->push_back(Visit(*i));
+  }
+  return true;
+}
+
+void DependencyScan::VisitDepSet(DepSet* dep_set, vector<Visit>* stack) {
+  unsigned generation = state_->scan_generation();
+  if (dep_set->scan_generation_ == generation)
+    return;
+  dep_set->scan_generation_ = generation;
+  dep_set->dirty_ = false;
+  dep_set->ready_ = true;
+  dep_set->most_recent_input_ = NULL;
+  stack->push_back(Visit(dep_set, true));
+  for (Node** n = dep_set->end(); n != dep_set->begin(); )
+    stack->push_back(Visit(*--n));
+}
 
-  // Visit all inputs; we're dirty if any of the inputs are dirty.
+bool DependencyScan::VisitInput(Node* input, vector<Visit>* stack,
+                                string* err) {
+  input->StatIfNecessary(disk_interface_);
+  if (Edge* in_edge = input->in_edge()) {
+    if (in_edge->scan_generation_ != state_->scan_generation())
+      return VisitEdge(in_edge, stack, err);
+  } else if (!input->exists() && !input->dirty()) {
+    // This input has no in-edge; it is dirty if it is missing.
+    EXPLAIN("%s has no in-edge and is missing", input->path().c_str());
+    input->MarkDirty();
+  }
+  return true;
+}
+
+void DependencyScan::JudgeEdge(Edge* edge, bool dirty) {
+  // We're dirty if any of the inputs are dirty.
   Node* most_recent_input = NULL;
   for (vector<Node*>::iterator i = edge->inputs_.begin();
        i != edge->inputs_.end(); ++i) {
-    if ((*i)->StatIfNecessary(disk_interface_)) {
-      if (Edge* in_edge = (*i)->in_edge()) {
-        if (!RecomputeDirty(in_edge, err))
-          return false;
-      } else {
-        // This input has no in-edge; it is dirty if it is missing.
-        if (!(*i)->exists())
-          EXPLAIN("%s has no in-edge and is missing", (*i)->path().c_str());
-        (*i)->set_dirty(!(*i)->exists());
-      }
-    }
-
     // If an input is not ready, neither are our outputs.
     if (Edge* in_edge = (*i)->in_edge()) {
       if (!in_edge->outputs_ready_)
@@ -82,15 +466,27 @@ bool DependencyScan::RecomputeDirty(Edge* edge, string* err) {
     }
   }
 
+  // Depfile deps count as implicit inputs.
+  for (vector<DepSet*>::iterator i = edge->dep_sets_.begin();
+       i != edge->dep_sets_.end(); ++i) {
+    DepSet* dep_set = *i;
+    if (!dep_set->ready_)
+      edge->outputs_ready_ = false;
+    if (dep_set->dirty_) {
+      dirty = true;
+    } else if (Node* input = dep_set->most_recent_input_) {
+      if (!most_recent_input || input->mtime() > most_recent_input->mtime())
+        most_recent_input = input;
+    }
+  }
+
   // We may also be dirty due to output state: missing outputs, out of
   // date outputs, etc.  Visit all outputs and determine whether they're dirty.
   if (!dirty) {
-    string command = edge->EvaluateCommand(true);
-
     for (vector<Node*>::iterator i = edge->outputs_.begin();
          i != edge->outputs_.end(); ++i) {
       (*i)->StatIfNecessary(disk_interface_);
-      if (RecomputeOutputDirty(edge, most_recent_input, command, *i)) {
+      if (RecomputeOutputDirty(edge, most_recent_input, *i)) {
         dirty = true;
         break;
       }
@@ -113,13 +509,24 @@ bool DependencyScan::RecomputeDirty(Edge* edge, string* err) {
   // ready.
   if (dirty && !(edge->is_phony() && edge->inputs_.empty()))
     edge->outputs_ready_ = false;
+}
 
-  return true;
+void DependencyScan::JudgeDepSet(DepSet* dep_set) {
+  for (Node** i = dep_set->begin(); i != dep_set->end(); ++i) {
+    if ((*i)->in_edge() && !(*i)->in_edge()->outputs_ready_)
+      dep_set->ready_ = false;
+    if ((*i)->dirty()) {
+      EXPLAIN("%s is dirty", (*i)->path().c_str());
+      dep_set->dirty_ = true;
+    } else if (!dep_set->most_recent_input_ ||
+               (*i)->mtime() > dep_set->most_recent_input_->mtime()) {
+      dep_set->most_recent_input_ = *i;
+    }
+  }
 }
 
 bool DependencyScan::RecomputeOutputDirty(Edge* edge,
                                           Node* most_recent_input,
-                                          const string& command,
                                           Node* output) {
   if (edge->is_phony()) {
     // Phony edges don't write any output.  Outputs are only dirty if
@@ -145,13 +552,15 @@ bool DependencyScan::RecomputeOutputDirty(Edge* edge,
     if (edge->rule_->restat() && build_log() &&
         (entry = build_log()->LookupByOutput(output->path()))) {
       if (entry->restat_mtime < most_recent_stamp) {
-        EXPLAIN("restat of output %s older than most recent input %s (%d vs %d)",
+        EXPLAIN("restat of output %s older than most recent input %s "
+                "(%" PRId64 " vs %" PRId64 ")",
             output->path().c_str(), most_recent_input->path().c_str(),
             entry->restat_mtime, most_recent_stamp);
         return true;
       }
     } else {
-      EXPLAIN("output %s older than most recent input %s (%d vs %d)",
+      EXPLAIN("output %s older than most recent input %s "
+              "(%" PRId64 " vs %" PRId64 ")",
           output->path().c_str(), most_recent_input->path().c_str(),
           output->mtime(), most_recent_stamp);
       return true;
@@ -163,7 +572,7 @@ bool DependencyScan::RecomputeOutputDirty(Edge* edge,
   // dirty.
   if (!edge->rule_->generator() && build_log()) {
     if (entry || (entry = build_log()->LookupByOutput(output->path()))) {
-      if (BuildLog::LogEntry::HashCommand(command) != entry->command_hash) {
+      if (edge->GetCommandHash() != entry->command_hash) {
         EXPLAIN("command line changed for %s", output->path().c_str());
         return true;
       }
@@ -183,68 +592,113 @@ bool Edge::AllInputsReady() const {
     if ((*i)->in_edge() && !(*i)->in_edge()->outputs_ready())
       return false;
   }
+  for (vector<DepSet*>::const_iterator s = dep_sets_.begin();
+       s != dep_sets_.end(); ++s) {
+    for (Node** i = (*s)->begin(); i != (*s)->end(); ++i) {
+      if ((*i)->in_edge() && !(*i)->in_edge()->outputs_ready())
+        return false;
+    }
+  }
   return true;
 }
 
 /// An Env for an Edge, providing $in and $out.
 struct EdgeEnv : public Env {
   explicit EdgeEnv(Edge* edge) : edge_(edge) {}
-  virtual string LookupVariable(const string& var);
+  virtual void AppendVariable(Symbol var, EvalSink* sink);
 
-  /// Given a span of Nodes, construct a list of paths suitable for a command
-  /// line.
-  string MakePathList(vector<Node*>::iterator begin,
+  /// Given a span of Nodes, append a list of paths suitable for a command
+  /// line to \a sink.
+  void AppendPathList(vector<Node*>::iterator begin,
                       vector<Node*>::iterator end,
-                      char sep);
+                      char sep, EvalSink* sink);
 
   Edge* edge_;
 };
 
-string EdgeEnv::LookupVariable(const string& var) {
-  if (var == "in" || var == "in_newline") {
+void EdgeEnv::AppendVariable(Symbol var, EvalSink* sink) {
+  static const Symbol kIn = Symbols::Intern("in");
+  static const Symbol kInNewline = Symbols::Intern("in_newline");
+  static const Symbol kOut = Symbols::Intern("out");
+
+  if (var == kIn || var == kInNewline) {
     int explicit_deps_count = edge_->inputs_.size() - edge_->implicit_deps_ -
       edge_->order_only_deps_;
-    return MakePathList(edge_->inputs_.begin(),
-                        edge_->inputs_.begin() + explicit_deps_count,
-                        var == "in" ? ' ' : '\n');
-  } else if (var == "out") {
-    return MakePathList(edge_->outputs_.begin(),
-                        edge_->outputs_.end(),
-                        ' ');
+    AppendPathList(edge_->inputs_.begin(),
+                   edge_->inputs_.begin() + explicit_deps_count,
+                   var == kIn ? ' ' : '\n', sink);
+  } else if (var == kOut) {
+    AppendPathList(edge_->outputs_.begin(),
+                   edge_->outputs_.end(),
+                   ' ', sink);
   } else if (edge_->env_) {
-    return edge_->env_->LookupVariable(var);
-  } else {
-    return string();
+    MutexLock lock(&g_env_mutex);
+    edge_->env_->AppendVariable(var, sink);
   }
 }
 
-string EdgeEnv::MakePathList(vector<Node*>::iterator begin,
+void EdgeEnv::AppendPathList(vector<Node*>::iterator begin,
                              vector<Node*>::iterator end,
-                             char sep) {
-  string result;
+                             char sep, EvalSink* sink) {
   for (vector<Node*>::iterator i = begin; i != end; ++i) {
-    if (!result.empty())
-      result.push_back(sep);
+    if (i != begin)
+      sink->Append(StringPiece(&sep, 1));
     const string& path = (*i)->path();
-    if (path.find(" ") != string::npos) {
-      result.append("\"");
-      result.append(path);
-      result.append("\"");
+    if (path.find(' ') != string::npos) {
+      sink->Append("\"");
+      sink->Append(path);
+      sink->Append("\"");
     } else {
-      result.append(path);
+      sink->Append(path);
     }
   }
-  return result;
 }
 
 string Edge::EvaluateCommand(bool incl_rsp_file) {
   EdgeEnv env(this);
   string command = rule_->command().Evaluate(&env);
-  if (incl_rsp_file && HasRspFile())
-    command += ";rspfile=" + GetRspFileContent();
+  if (incl_rsp_file && HasRspFile()) {
+    command.append(";rspfile=");
+    rule_->rspfile_content().Evaluate(&env, &command);
+  }
   return command;
 }
 
+void Edge::EvaluateCommand(EvalSink* sink, bool incl_rsp_file) {
+  EdgeEnv env(this);
+  rule_->command().Evaluate(&env, sink);
+  if (incl_rsp_file && HasRspFile()) {
+    sink->Append(";rspfile=");
+    rule_->rspfile_content().Evaluate(&env, sink);
+  }
+}
+
+namespace {
+
+/// Hashes an evaluated string.
+struct HashSink : public EvalSink {
+  explicit HashSink(MurmurHasher* hasher) : hasher_(hasher) {}
+  virtual void Append(StringPiece piece) {
+    hasher_->Update(piece.str_, piece.len_);
+  }
+  MurmurHasher* hasher_;
+};
+
+}  // namespace
+
+uint64_t Edge::GetCommandHash() {
+  if (command_hash_known_)
+    return command_hash_;
+  // The command isn't kept anywhere, which matters for the megabytes of a
+  // long link's response file.
+  MurmurHasher hasher;
+  HashSink sink(&hasher);
+  EvaluateCommand(&sink, true);
+  command_hash_ = hasher.Finish();
+  command_hash_known_ = true;
+  return command_hash_;
+}
+
 string Edge::EvaluateDepFile() {
   EdgeEnv env(this);
   return rule_->depfile().Evaluate(&env);
@@ -269,8 +723,29 @@ string Edge::GetRspFileContent() {
   return rule_->rspfile_content().Evaluate(&env);
 }
 
+bool DependencyScan::LoadDeps(Edge* edge, string* err) {
+  edge->deps_missing_ = false;
+  if (!LoadDepsFromLog(edge) && !LoadDepFile(edge, err)) {
+    if (!err->empty())
+      return false;
+    SetDepfileDeps(edge, NULL, 0);
+    edge->deps_missing_ = true;
+  }
+  edge->deps_generation_ = state_->scan_generation();
+  return true;
+}
+
 bool DependencyScan::LoadDepFile(Edge* edge, string* err) {
   METRIC_RECORD("depfile load");
+  vector<Node*> nodes;
+  if (!ReadDepFile(edge, &nodes, err))
+    return false;
+  SetDepfileDeps(edge, nodes.empty() ? NULL : &nodes[0], (int)nodes.size());
+  return true;
+}
+
+bool DependencyScan::ReadDepFile(Edge* edge, vector<Node*>* nodes,
+                                 string* err) {
   string path = edge->EvaluateDepFile();
   string content = disk_interface_->ReadFile(path, err);
   if (!err->empty())
@@ -295,22 +770,56 @@ bool DependencyScan::LoadDepFile(Edge* edge, string* err) {
     return false;
   }
 
-  // Preallocate space in edge->inputs_ to be filled in below.
-  edge->inputs_.insert(edge->inputs_.end() - edge->order_only_deps_,
-                       depfile.ins_.size(), 0);
-  edge->implicit_deps_ += depfile.ins_.size();
-  vector<Node*>::iterator implicit_dep =
-      edge->inputs_.end() - edge->order_only_deps_ - depfile.ins_.size();
-
-  // Add all its in-edges.
+  nodes->reserve(depfile.ins_.size());
   for (vector<StringPiece>::iterator i = depfile.ins_.begin();
-       i != depfile.ins_.end(); ++i, ++implicit_dep) {
+       i != depfile.ins_.end(); ++i) {
     if (!CanonicalizePath(const_cast<char*>(i->str_), &i->len_, err))
       return false;
+    nodes->push_back(state_->GetNode(*i));
+  }
+  return true;
+}
 
-    Node* node = state_->GetNode(*i);
-    *implicit_dep = node;
-    node->AddOutEdge(edge);
+bool DependencyScan::LoadDepsFromLog(Edge* edge) {
+  if (!deps_log_)
+    return false;
+  Node* output = edge->outputs_[0];
+  DepsLog::Deps* deps = deps_log_->GetDeps(output);
+  if (!deps)
+    return false;
+
+  // The deps are those of the output as it was when they were recorded;
+  // if it has been rebuilt since, they may be out of date.
+  output->StatIfNecessary(disk_interface_);
+  if (output->mtime() > deps->mtime) {
+    EXPLAIN("stored deps info out of date for '%s' "
+            "(%" PRId64 " vs %" PRId64 ")",
+            output->path().c_str(), deps->mtime, output->mtime());
+    return false;
+  }
+
+  SetDepfileDeps(edge, deps->nodes, deps->node_count);
+  return true;
+}
+
+void DependencyScan::SetDepfileDeps(Edge* edge, Node** nodes, int count) {
+  // Other edges' deps may be set at the same time by PrepareScan().
+  MutexLock lock(&mutex_);
+
+  // Drop what an earlier scan found.
+  for (vector<DepSet*>::iterator i = edge->dep_sets_.begin();
+       i != edge->dep_sets_.end(); ++i)
+    (*i)->RemoveOutEdge(edge);
+  edge->dep_sets_.clear();
+
+  // Depfiles list the edge's source too, which is best left out: being
+  // particular to the edge, it would keep the run it's in from being
+  // shared.
+  vector<Node*>::iterator explicit_end = edge->inputs_.end() -
+      edge->implicit_deps_ - edge->order_only_deps_;
+  int start = 0;
+  for (int i = 0; i < count; ++i) {
+    Node* node = nodes[i];
 
     // If we don't have a edge that generates this input already,
     // create one; this makes us not abort if the input is missing,
@@ -320,17 +829,31 @@ bool DependencyScan::LoadDepFile(Edge* edge, string* err) {
       node->set_in_edge(phony_edge);
       phony_edge->outputs_.push_back(node);
 
-      // RecomputeDirty might not be called for phony_edge if a previous call
-      // to RecomputeDirty had caused the file to be stat'ed.  Because previous
-      // invocations of RecomputeDirty would have seen this node without an
-      // input edge (and therefore ready), we have to set outputs_ready_ to true
-      // to avoid a potential stuck build.  If we do call RecomputeDirty for
-      // this node, it will simply set outputs_ready_ to the correct value.
+      // The scan may already have judged edges that use this node, and
+      // seen it without an input edge (and therefore ready), so we have
+      // to set outputs_ready_ to true to avoid a potential stuck build.
+      // If the scan does visit phony_edge, it will simply set
+      // outputs_ready_ to the correct value.
       phony_edge->outputs_ready_ = true;
     }
-  }
 
-  return true;
+    // An explicit input ends the run before it; otherwise the run ends
+    // after a node that says so, or at the size limit or the end.
+    int end;
+    if (find(edge->inputs_.begin(), explicit_end, node) != explicit_end)
+      end = i;
+    else if (node->ends_dep_set() || i + 1 - start == kMaxDepSetSize ||
+             i + 1 == count)
+      end = i + 1;
+    else
+      continue;
+    if (end > start) {
+      DepSet* dep_set = state_->GetDepSet(nodes + start, end - start);
+      dep_set->AddOutEdge(edge);
+      edge->dep_sets_.push_back(dep_set);
+    }
+    start = i + 1;
+  }
 }
 
 void Edge::Dump(const char* prefix) const {
@@ -339,6 +862,11 @@ void Edge::Dump(const char* prefix) const {
        i != inputs_.end() && *i != NULL; ++i) {
     printf("%s ", (*i)->path().c_str());
   }
+  for (vector<DepSet*>::const_iterator s = dep_sets_.begin();
+       s != dep_sets_.end(); ++s) {
+    for (Node** i = (*s)->begin(); i != (*s)->end(); ++i)
+      printf("%s ", (*i)->path().c_str());
+  }
   printf("--%s-> ", rule_->name().c_str());
   for (vector<Node*>::const_iterator i = outputs_.begin();
        i != outputs_.end() && *i != NULL; ++i) {
@@ -352,7 +880,7 @@ bool Edge::is_phony() const {
 }
 
 void Node::Dump(const char* prefix) const {
-  printf("%s <%s 0x%p> mtime: %d%s, (:%s), ",
+  printf("%s <%s 0x%p> mtime: %" PRId64 "%s, (:%s), ",
          prefix, path().c_str(), this,
          mtime(), mtime() ? "" : " (:missing)",
          dirty() ? " dirty" : " clean");
@@ -20,19 +20,18 @@
 using namespace std;
 
 #include "eval_env.h"
+#include "mutex.h"
 #include "timestamp.h"
 
+struct DepSet;
 struct DiskInterface;
 struct Edge;
+struct ThreadPool;
 
 /// Information about a node in the dependency graph: the file, whether
 /// it's dirty, mtime, etc.
 struct Node {
-  explicit Node(const string& path)
-      : path_(path),
-        mtime_(-1),
-        dirty_(false),
-        in_edge_(NULL) {}
+  explicit Node(const string& path);
 
   /// Return true if the file exists (mtime_ got a value).
   bool Stat(DiskInterface* disk_interface);
@@ -56,6 +55,12 @@ struct Node {
     mtime_ = 0;
   }
 
+  /// Take the result of a stat() done elsewhere, as by
+  /// DependencyScan::PrepareScan().
+  void set_mtime(TimeStamp mtime) {
+    mtime_ = mtime;
+  }
+
   bool exists() const {
     return mtime_ != 0;
   }
@@ -71,12 +76,23 @@ struct Node {
   void set_dirty(bool dirty) { dirty_ = dirty; }
   void MarkDirty() { dirty_ = true; }
 
+  /// Whether a run of depfile deps ends after this node; see DepSet.
+  bool ends_dep_set() const { return ends_dep_set_; }
+
   Edge* in_edge() const { return in_edge_; }
   void set_in_edge(Edge* edge) { in_edge_ = edge; }
 
   const vector<Edge*>& out_edges() const { return out_edges_; }
   void AddOutEdge(Edge* edge) { out_edges_.push_back(edge); }
 
+  /// The runs of depfile deps this Node is in; their edges use it too.
+  const vector<DepSet*>& out_dep_sets() const { return out_dep_sets_; }
+  void AddOutDepSet(DepSet* dep_set) { out_dep_sets_.push_back(dep_set); }
+
+  /// The node's number in the deps log, or -1 if the log doesn't know it.
+  int id() const { return id_; }
+  void set_id(int id) { id_ = id; }
+
   void Dump(const char* prefix="") const;
 
 private:
@@ -92,23 +108,74 @@ private:
   /// edges to build.
   bool dirty_;
 
+  /// Picked from a hash of the path, so that the same deps are cut the
+  /// same way whatever order the nodes were made in.
+  bool ends_dep_set_;
+
   /// The Edge that produces this Node, or NULL when there is no
   /// known edge to produce it.
   Edge* in_edge_;
 
   /// All Edges that use this Node as an input.
   vector<Edge*> out_edges_;
+
+  vector<DepSet*> out_dep_sets_;
+
+  int id_;
+};
+
+/// A run of implicit dependencies read from depfiles, kept once for all
+/// the edges whose deps include it.  Translation units include much the
+/// same headers, so an edge's deps are cut into runs at points picked by
+/// the nodes themselves, and runs that come out the same are shared (see
+/// State::GetDepSet()).  The scan then judges each run once rather than
+/// once per edge.
+struct DepSet {
+  DepSet(Node** nodes, int node_count)
+      : nodes_(nodes), node_count_(node_count), scan_generation_(0),
+        prepare_generation_(0), dirty_(false), ready_(false),
+        most_recent_input_(NULL) {}
+
+  Node** begin() const { return nodes_; }
+  Node** end() const { return nodes_ + node_count_; }
+  int size() const { return node_count_; }
+
+  /// The edges whose deps include this run.
+  const vector<Edge*>& out_edges() const { return out_edges_; }
+  void AddOutEdge(Edge* edge) { out_edges_.push_back(edge); }
+  void RemoveOutEdge(Edge* edge);
+
+ private:
+  friend struct DependencyScan;
+
+  /// node_count_ nodes, owned by the State.
+  Node** nodes_;
+  int node_count_;
+  vector<Edge*> out_edges_;
+
+  /// What the scan numbered scan_generation_ found: whether any node is
+  /// dirty, whether all their in-edges are ready, and the newest node.
+  /// See State::scan_generation().
+  unsigned scan_generation_;
+  /// The scan that last had the nodes prepared ahead of time, or 0.
+  unsigned prepare_generation_;
+  bool dirty_;
+  bool ready_;
+  Node* most_recent_input_;
 };
 
 /// An invokable build command and associated metadata (description, etc.).
 struct Rule {
   explicit Rule(const string& name)
-      : name_(name), generator_(false), restat_(false) {}
+      : name_(name), generator_(false), restat_(false),
+        delete_depfile_(false) {}
 
   const string& name() const { return name_; }
 
   bool generator() const { return generator_; }
   bool restat() const { return restat_; }
+  /// Whether to delete the depfile once the deps log has its contents.
+  bool delete_depfile() const { return delete_depfile_; }
 
   const EvalString& command() const { return command_; }
   const EvalString& description() const { return description_; }
@@ -122,11 +189,13 @@ struct Rule {
  private:
   // Allow the parsers to reach into this object and fill out its fields.
   friend struct ManifestParser;
+  friend struct ManifestCache;
 
   string name_;
 
   bool generator_;
   bool restat_;
+  bool delete_depfile_;
 
   EvalString command_;
   EvalString description_;
@@ -136,13 +205,16 @@ struct Rule {
 };
 
 struct BuildLog;
+struct DepsLog;
 struct Node;
 struct State;
 
 /// An edge in the dependency graph; links between Nodes using Rules.
 struct Edge {
-  Edge() : rule_(NULL), env_(NULL), outputs_ready_(false), implicit_deps_(0),
-           order_only_deps_(0) {}
+  Edge() : rule_(NULL), env_(NULL), outputs_ready_(false),
+           scan_generation_(0), prepare_generation_(0), deps_generation_(0),
+           deps_missing_(false), command_hash_(0), command_hash_known_(false),
+           implicit_deps_(0), order_only_deps_(0) {}
 
   /// Return true if all inputs' in-edges are ready.
   bool AllInputsReady() const;
@@ -151,6 +223,11 @@ struct Edge {
   /// If incl_rsp_file is enabled, the string will also contain the
   /// full contents of a response file (if applicable)
   string EvaluateCommand(bool incl_rsp_file = false);  // XXX move to env, take env ptr
+  /// Like the above, but in pieces into \a sink.
+  void EvaluateCommand(EvalSink* sink, bool incl_rsp_file = false);
+  /// The hash of EvaluateCommand(true), as the build log keeps it, without
+  /// putting the command together.  Only computed once.
+  uint64_t GetCommandHash();
   string EvaluateDepFile();
   string GetDescription();
 
@@ -167,9 +244,25 @@ struct Edge {
 
   const Rule* rule_;
   vector<Node*> inputs_;
+  /// Implicit deps read from the depfile or the deps log, which come on
+  /// top of those in inputs_.
+  vector<DepSet*> dep_sets_;
   vector<Node*> outputs_;
   Env* env_;
   bool outputs_ready_;
+  /// The generation of the scan that last visited this edge, or 0; see
+  /// State::scan_generation().
+  unsigned scan_generation_;
+  /// The generation of the scan that last prepared this edge ahead of
+  /// time, or 0; see DependencyScan::PrepareScan().
+  unsigned prepare_generation_;
+  /// The generation of the scan that last loaded the edge's depfile
+  /// deps, or 0; and whether it found none, the depfile being missing.
+  unsigned deps_generation_;
+  bool deps_missing_;
+  /// GetCommandHash(), once known.
+  uint64_t command_hash_;
+  bool command_hash_known_;
 
   const Rule& rule() const { return *rule_; }
   bool outputs_ready() const { return outputs_ready_; }
@@ -202,21 +295,33 @@ struct Edge {
 /// DependencyScan manages the process of scanning the files in a graph
 /// and updating the dirty/outputs_ready state of all the nodes and edges.
 struct DependencyScan {
-  DependencyScan(State* state, BuildLog* build_log,
-                 DiskInterface* disk_interface)
-      : state_(state), build_log_(build_log),
-        disk_interface_(disk_interface) {}
+  DependencyScan(State* state, BuildLog* build_log, DepsLog* deps_log,
+                 DiskInterface* disk_interface);
 
   /// Examine inputs, outputs, and command lines to judge whether an edge
   /// needs to be re-run, and update outputs_ready_ and each outputs' |dirty_|
-  /// state accordingly.
+  /// state accordingly.  The edges under it are judged first, each once
+  /// until the State is Reset(); so is \a edge itself.
   /// Returns false on failure.
   bool RecomputeDirty(Edge* edge, string* err);
 
+  /// Do the slow part of what RecomputeDirty() will for the edges under
+  /// \a targets, on the threads of the scan pool: stat their nodes, load
+  /// their depfile deps, and hash their commands, so that it finds all
+  /// that done.  Edges that don't depend on one another are prepared at
+  /// the same time.  What RecomputeDirty() then judges is the same as
+  /// without preparing.  Does nothing without a scan pool.
+  void PrepareScan(const vector<Node*>& targets);
+
   /// Recompute whether a given single output should be marked dirty.
   /// Returns true if so.
   bool RecomputeOutputDirty(Edge* edge, Node* most_recent_input,
-                            const string& command, Node* output);
+                            Node* output);
+
+  /// Make the dependencies the deps log has for \a edge's output its
+  /// depfile deps.  Returns false if the log has none for the output as
+  /// it is now.
+  bool LoadDepsFromLog(Edge* edge);
 
   bool LoadDepFile(Edge* edge, string* err);
 
@@ -227,10 +332,76 @@ struct DependencyScan {
     build_log_ = log;
   }
 
+  DepsLog* deps_log() const {
+    return deps_log_;
+  }
+
+  /// Have PrepareScan() work on the threads of \a pool, which must
+  /// outlive the scan; with NULL, the scan is all done as edges come up.
+  /// The disk interface's Stat() and ReadFile() must then be safe to call
+  /// from several threads at once.
+  void set_scan_pool(ThreadPool* pool) {
+    scan_pool_ = pool;
+  }
+
  private:
+  struct Visit;
+  struct PrepareTask;
+  struct StatTask;
+
+  /// Load \a edge's depfile deps, from the deps log if it has them as of
+  /// the output's mtime, or else from the depfile.  Returns false on
+  /// error.
+  bool LoadDeps(Edge* edge, string* err);
+  /// Read \a edge's depfile into \a nodes.  Returns false if it is
+  /// missing or on error, filling in \a err in that case.
+  bool ReadDepFile(Edge* edge, vector<Node*>* nodes, string* err);
+  /// Prepare \a edge as PrepareScan() does, on \a task's thread.
+  void PrepareEdge(Edge* edge, PrepareTask* task);
+  /// Take an edge from some task's deque for a task that ran out,
+  /// waiting while others may yet queue some.  Returns NULL once all
+  /// edges are prepared.
+  Edge* StealEdge();
+  /// Queue \a input's in-edge on \a task if no task has taken it on yet,
+  /// returning 1 if so; an input without one is noted for statting.
+  /// Called with mutex_ held.
+  int ClaimInput(Node* input, PrepareTask* task);
+
+  /// Mark \a edge as visited, load its depfile deps, and push it onto
+  /// \a stack to be judged once its inputs, pushed above it, are.
+  bool VisitEdge(Edge* edge, vector<Visit>* stack, string* err);
+  /// Stat \a input if it hasn't been yet, and visit its in-edge if this
+  /// scan hasn't; an input without one is dirty if it is missing.
+  bool VisitInput(Node* input, vector<Visit>* stack, string* err);
+  /// Mark \a dep_set as visited, unless this scan has already, and push
+  /// it onto \a stack to be judged once its nodes, pushed above it, are.
+  void VisitDepSet(DepSet* dep_set, vector<Visit>* stack);
+  /// Judge \a edge from the state of its inputs, which have been judged
+  /// already, and its outputs.  \a dirty is set if it is known to be
+  /// dirty already.
+  void JudgeEdge(Edge* edge, bool dirty);
+  /// Find out what \a dep_set's nodes make of the edges using it.
+  void JudgeDepSet(DepSet* dep_set);
+  /// Make the \a count nodes at \a nodes the depfile deps of \a edge.
+  void SetDepfileDeps(Edge* edge, Node** nodes, int count);
+
   State* state_;
   BuildLog* build_log_;
+  DepsLog* deps_log_;
   DiskInterface* disk_interface_;
+  ThreadPool* scan_pool_;
+
+  /// While PrepareScan() runs, guards the links between nodes, edges and
+  /// dep sets, which loading deps changes, and what its tasks share.
+  Mutex mutex_;
+  /// Signalled when there is work to steal, or none left.
+  ConditionVariable work_cond_;
+  /// The tasks of the running PrepareScan(), which steal from each other.
+  vector<PrepareTask*> tasks_;
+  /// The edges taken on but not yet prepared, and the tasks waiting for
+  /// work.
+  int pending_edges_;
+  int idle_tasks_;
 };
 
 #endif  // NINJA_GRAPH_H_
@@ -14,10 +14,13 @@
 
 #include "graph.h"
 
+#include "build_log.h"
+#include "deps_log.h"
 #include "test.h"
+#include "thread_pool.h"
 
 struct GraphTest : public StateTestWithBuiltinRules {
-  GraphTest() : scan_(&state_, NULL, &fs_) {}
+  GraphTest() : scan_(&state_, NULL, NULL, &fs_) {}
 
   VirtualFileSystem fs_;
   DependencyScan scan_;
@@ -144,6 +147,23 @@ TEST_F(GraphTest, VarInOutQuoteSpaces) {
       edge->EvaluateCommand());
 }
 
+TEST_F(GraphTest, CommandHash) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"rule link\n"
+"  command = link @$out.rsp -o $out\n"
+"  rspfile = $out.rsp\n"
+"  rspfile_content = $in $flags\n"
+"build a$ b: link nospace with$ space\n"
+"  flags = -g\n"));
+
+  // The hash is that of the whole command, as the build log keeps it.
+  Edge* edge = GetNode("a b")->in_edge();
+  string command = edge->EvaluateCommand(true);
+  EXPECT_EQ("link @\"a b\".rsp -o \"a b\";rspfile=nospace \"with space\" -g",
+            command);
+  EXPECT_EQ(BuildLog::LogEntry::HashCommand(command), edge->GetCommandHash());
+}
+
 // Regression test for https://github.com/martine/ninja/issues/380
 TEST_F(GraphTest, DepfileWithCanonicalizablePath) {
   ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
@@ -187,3 +207,304 @@ TEST_F(GraphTest, DepfileRemoved) {
   ASSERT_EQ("", err);
   EXPECT_TRUE(GetNode("out.o")->dirty());
 }
+
+TEST_F(GraphTest, DepsFromLog) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"rule catdep\n"
+"  depfile = $out.d\n"
+"  command = cat $in > $out\n"
+"build out.o: catdep foo.cc\n"));
+  fs_.Create("foo.h", 1, "");
+  fs_.Create("foo.cc", 1, "");
+  fs_.Create("out.o.d", 2, "out.o: bar.h\n");
+  fs_.Create("out.o", 2, "");
+
+  DepsLog deps_log;
+  vector<Node*> deps;
+  deps.push_back(GetNode("foo.h"));
+  deps_log.RecordDeps(GetNode("out.o"), 2, deps);
+  DependencyScan scan(&state_, NULL, &deps_log, &fs_);
+
+  // The deps come from the log rather than the depfile.
+  Edge* edge = GetNode("out.o")->in_edge();
+  string err;
+  EXPECT_TRUE(scan.RecomputeDirty(edge, &err));
+  ASSERT_EQ("", err);
+  EXPECT_EQ(0u, fs_.files_read_.size());
+  ASSERT_EQ(1u, DepfileDeps(edge).size());
+  EXPECT_EQ("foo.h", DepfileDeps(edge)[0]->path());
+  EXPECT_FALSE(GetNode("out.o")->dirty());
+
+  // Once the output is newer than the deps, the depfile is read instead.
+  state_.Reset();
+  fs_.Create("out.o", 3, "");
+  EXPECT_TRUE(scan.RecomputeDirty(edge, &err));
+  ASSERT_EQ("", err);
+  ASSERT_EQ(1u, fs_.files_read_.size());
+  EXPECT_EQ("out.o.d", fs_.files_read_[0]);
+  ASSERT_EQ(1u, DepfileDeps(edge).size());
+  EXPECT_EQ("bar.h", DepfileDeps(edge)[0]->path());
+}
+
+TEST_F(GraphTest, DepSetsShared) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"rule catdep\n"
+"  depfile = $out.d\n"
+"  command = cat $in > $out\n"
+"build a.o: catdep a.cc\n"
+"build b.o: catdep b.cc\n"));
+  string headers;
+  for (int i = 0; i < 200; ++i) {
+    char buf[32];
+    sprintf(buf, " h%d.h", i);
+    headers += buf;
+    fs_.Create(buf + 1, 1, "");
+  }
+  fs_.Create("a.cc", 1, "");
+  fs_.Create("b.cc", 1, "");
+  fs_.Create("a.o.d", 2, "a.o: a.cc" + headers + "\n");
+  fs_.Create("b.o.d", 2, "b.o: b.cc" + headers + "\n");
+  fs_.Create("a.o", 2, "");
+  fs_.Create("b.o", 2, "");
+
+  Edge* a = GetNode("a.o")->in_edge();
+  Edge* b = GetNode("b.o")->in_edge();
+  string err;
+  EXPECT_TRUE(scan_.RecomputeDirty(a, &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(scan_.RecomputeDirty(b, &err));
+  ASSERT_EQ("", err);
+  EXPECT_FALSE(GetNode("a.o")->dirty());
+  EXPECT_FALSE(GetNode("b.o")->dirty());
+
+  // The same headers make up the same runs, which both edges share; the
+  // sources, being inputs already, are left out.
+  ASSERT_EQ(200u, DepfileDeps(a).size());
+  EXPECT_GT(a->dep_sets_.size(), 1u);
+  EXPECT_EQ(a->dep_sets_, b->dep_sets_);
+  EXPECT_EQ(2u, a->dep_sets_[0]->out_edges().size());
+
+  // The runs end after headers picked by their paths, so the cuts don't
+  // depend on where the nodes happen to be allocated.
+  for (size_t i = 0; i + 1 < a->dep_sets_.size(); ++i) {
+    const DepSet* dep_set = a->dep_sets_[i];
+    Node* last = *(dep_set->end() - 1);
+    EXPECT_EQ(last->ends_dep_set(), Node(last->path()).ends_dep_set());
+    EXPECT_TRUE(last->ends_dep_set() || dep_set->size() == 64);
+  }
+
+  // A newer header dirties both.
+  state_.Reset();
+  fs_.Create("h150.h", 3, "");
+  EXPECT_TRUE(scan_.RecomputeDirty(a, &err));
+  EXPECT_TRUE(scan_.RecomputeDirty(b, &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(GetNode("a.o")->dirty());
+  EXPECT_TRUE(GetNode("b.o")->dirty());
+}
+
+// An edge reached through another's inputs judges the dep sets they share
+// before it is judged itself.
+TEST_F(GraphTest, DepSetsSharedWithInput) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"rule catdep\n"
+"  depfile = $out.d\n"
+"  command = cat $in > $out\n"
+"build o0: catdep s0\n"
+"build o1: catdep s1 || o0\n"));
+  fs_.Create("s0", 1, "");
+  fs_.Create("s1", 1, "");
+  fs_.Create("o0.d", 1, "o0: s0 h0\n");
+  fs_.Create("o1.d", 1, "o1: s1 h0\n");
+  fs_.Create("o0", 2, "");
+  fs_.Create("o1", 2, "");
+  fs_.Create("h0", 3, "");
+
+  string err;
+  EXPECT_TRUE(scan_.RecomputeDirty(GetNode("o1")->in_edge(), &err));
+  ASSERT_EQ("", err);
+  EXPECT_EQ(GetNode("o0")->in_edge()->dep_sets_,
+            GetNode("o1")->in_edge()->dep_sets_);
+  EXPECT_TRUE(GetNode("o0")->dirty());
+  EXPECT_TRUE(GetNode("o1")->dirty());
+}
+
+TEST_F(GraphTest, PrepareScan) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"rule catdep\n"
+"  depfile = $out.d\n"
+"  command = cat $in > $out\n"
+"build out.o: catdep foo.cc | gen.h\n"
+"build gen.h: cat gen.in\n"
+"build other: cat other.in\n"));
+  fs_.Create("foo.cc", 1, "");
+  fs_.Create("gen.in", 1, "");
+  fs_.Create("gen.h", 1, "");
+  fs_.Create("foo.h", 1, "");
+  fs_.Create("out.o", 2, "");
+  fs_.Create("out.o.d", 2, "out.o: foo.cc foo.h\n");
+
+  DepsLog deps_log;
+  vector<Node*> deps;
+  deps.push_back(GetNode("foo.h"));
+  deps_log.RecordDeps(GetNode("out.o"), 2, deps);
+  DependencyScan scan(&state_, NULL, &deps_log, &fs_);
+
+  // Without a pool, nothing is done ahead of time.
+  vector<Node*> targets(1, GetNode("out.o"));
+  scan.PrepareScan(targets);
+  EXPECT_FALSE(GetNode("out.o")->status_known());
+  EXPECT_TRUE(GetNode("out.o")->in_edge()->dep_sets_.empty());
+
+  // With one, everything under the target is statted, whether a file
+  // exists or not, and the deps are loaded from the log.
+  ThreadPool pool(2);
+  scan.set_scan_pool(&pool);
+  scan.PrepareScan(targets);
+  EXPECT_EQ(2, GetNode("out.o")->mtime());
+  EXPECT_EQ(1, GetNode("foo.cc")->mtime());
+  EXPECT_EQ(1, GetNode("gen.h")->mtime());
+  EXPECT_EQ(1, GetNode("gen.in")->mtime());
+  EXPECT_EQ(1, GetNode("foo.h")->mtime());
+  EXPECT_FALSE(GetNode("other")->status_known());
+  ASSERT_EQ(1u, DepfileDeps(GetNode("out.o")->in_edge()).size());
+
+  string err;
+  EXPECT_TRUE(scan.RecomputeDirty(GetNode("out.o")->in_edge(), &err));
+  ASSERT_EQ("", err);
+  EXPECT_FALSE(GetNode("out.o")->dirty());
+  EXPECT_EQ(0u, fs_.files_read_.size());
+}
+
+TEST_F(GraphTest, PreparedInputsStillScanned) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"build out: cat mid\n"
+"build mid: cat in\n"));
+  fs_.Create("in", 2, "");
+  fs_.Create("mid", 1, "");
+  fs_.Create("out", 3, "");
+
+  // Having been statted ahead of time, mid is not taken to have been
+  // scanned already.
+  ThreadPool pool(1);
+  scan_.set_scan_pool(&pool);
+  scan_.PrepareScan(vector<Node*>(1, GetNode("out")));
+  string err;
+  EXPECT_TRUE(scan_.RecomputeDirty(GetNode("out")->in_edge(), &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(GetNode("mid")->dirty());
+  EXPECT_TRUE(GetNode("out")->dirty());
+}
+
+/// Scan "all" of \a manifest, prepared on \a pool if not NULL, and
+/// describe what the scan made of each node, in path order.
+static string ScanAll(VirtualFileSystem* fs, BuildLog* build_log,
+                      const char* manifest, ThreadPool* pool) {
+  State state;
+  AssertParse(&state, manifest);
+  DependencyScan scan(&state, build_log, NULL, fs);
+  scan.set_scan_pool(pool);
+  Node* all = state.LookupNode("all");
+  scan.PrepareScan(vector<Node*>(1, all));
+  string err;
+  EXPECT_TRUE(scan.RecomputeDirty(all->in_edge(), &err));
+  EXPECT_EQ("", err);
+
+  map<string, string> nodes;
+  for (State::Paths::iterator i = state.paths_.begin();
+       i != state.paths_.end(); ++i) {
+    Node* node = i->second;
+    string& line = nodes[node->path()];
+    line = node->dirty() ? "dirty" : "clean";
+    if (Edge* edge = node->in_edge()) {
+      line += edge->outputs_ready() ? " ready" : " unready";
+      vector<Node*> deps = DepfileDeps(edge);
+      for (vector<Node*>::iterator j = deps.begin(); j != deps.end(); ++j)
+        line += " " + (*j)->path();
+    }
+  }
+  string result;
+  for (map<string, string>::iterator i = nodes.begin(); i != nodes.end(); ++i)
+    result += i->first + ": " + i->second + "\n";
+  return result;
+}
+
+TEST_F(GraphTest, PrepareScanMatchesSerialScan) {
+  const char kManifest[] =
+"rule cat\n"
+"  command = cat $in > $out\n"
+"rule catdep\n"
+"  depfile = $out.d\n"
+"  command = cat $in > $out\n"
+"build a.o: catdep a.c\n"
+"build b.o: catdep b.c\n"
+"build c.o: catdep c.c\n"
+"build d.o: catdep d.c\n"
+"build gen.h: cat gen.in\n"
+"build lib: cat a.o b.o c.o\n"
+"build all: phony lib d.o\n";
+  fs_.Create("a.c", 1, "");
+  fs_.Create("b.c", 1, "");
+  fs_.Create("c.c", 1, "");
+  fs_.Create("d.c", 1, "");
+  fs_.Create("common.h", 1, "");
+  fs_.Create("gen.in", 3, "");
+  fs_.Create("gen.h", 2, "");
+  fs_.Create("a.o", 4, "");
+  fs_.Create("a.o.d", 4, "a.o: a.c common.h gen.h\n");
+  fs_.Create("b.o", 4, "");
+  fs_.Create("b.o.d", 4, "b.o: b.c common.h\n");
+  fs_.Create("c.o", 4, "");
+  fs_.Create("d.o", 4, "");
+  fs_.Create("d.o.d", 4, "d.o: d.c common.h missing.h\n");
+  fs_.Create("lib", 5, "");
+
+  // b.o was last built with the command it has now.
+  State log_state;
+  AssertParse(&log_state, kManifest);
+  BuildLog build_log;
+  build_log.RecordCommand(log_state.LookupNode("b.o")->in_edge(), 1, 2);
+
+  string serial = ScanAll(&fs_, &build_log, kManifest, NULL);
+  EXPECT_EQ(
+"a.c: clean ready\n"
+"a.o: dirty unready common.h gen.h\n"
+"all: dirty unready\n"
+"b.c: clean ready\n"
+"b.o: clean ready common.h\n"
+"c.c: clean\n"
+"c.o: dirty unready\n"
+"common.h: clean ready\n"
+"d.c: clean ready\n"
+"d.o: dirty unready common.h missing.h\n"
+"gen.h: dirty unready\n"
+"gen.in: clean\n"
+"lib: dirty unready\n"
+"missing.h: dirty ready\n", serial);
+
+  // However the edges fall to the threads.
+  ThreadPool pool(3);
+  for (int i = 0; i < 10; ++i)
+    EXPECT_EQ(serial, ScanAll(&fs_, &build_log, kManifest, &pool));
+}
+
+TEST_F(GraphTest, DeepChain) {
+  // Deep enough to overflow the stack if the scan recursed.
+  const int kDepth = 100000;
+  string manifest;
+  char buf[64];
+  for (int i = 0; i < kDepth; ++i) {
+    sprintf(buf, "build n%d: cat n%d\n", i + 1, i);
+    manifest += buf;
+  }
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_, manifest.c_str()));
+  fs_.Create("n0", 1, "");
+  sprintf(buf, "n%d", kDepth);
+
+  string err;
+  EXPECT_TRUE(scan_.RecomputeDirty(GetNode(buf)->in_edge(), &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(GetNode("n1")->dirty());
+  EXPECT_TRUE(GetNode(buf)->dirty());
+  EXPECT_FALSE(GetNode(buf)->in_edge()->outputs_ready());
+}
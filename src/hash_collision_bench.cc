@@ -12,13 +12,39 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+// With no arguments, looks for collisions of the build log's command
+// hash among random commands.
+//
+// With -p, measures the path maps (ExternalStringHashMap) against the
+// node-based hash_map they used to be, inserting and looking up a corpus
+// of paths: either the lines of the given file (e.g. the output of
+// "ninja -t targets all | cut -d: -f1"), or a generated corpus shaped
+// like a large Chromium build.
+
 #include "build_log.h"
+#include "hash_map.h"
+#include "metrics.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include <algorithm>
+#include <string>
+#include <vector>
 using namespace std;
 
 #include <time.h>
 
+#ifdef _MSC_VER
+#include <hash_map>
+#else
+#include <ext/hash_map>
+#endif
+
+namespace {
+
 int random(int low, int high) {
   return int(low + (rand() / double(RAND_MAX)) * (high - low) + 0.5);
 }
@@ -30,7 +56,7 @@ void RandomCommand(char** s) {
     (*s)[i] = (char)random(32, 127);
 }
 
-int main() {
+int CheckCollisions() {
   const int N = 20 * 1000 * 1000;
 
   // Leak these, else 10% of the runtime is spent destroying strings.
@@ -59,4 +85,219 @@ int main() {
     }
   }
   printf("\n\n%d collisions after %d runs\n", num_collisions, N);
+  return 0;
+}
+
+/// Bytes and blocks currently held through CountingAllocator.
+size_t g_allocated_bytes;
+size_t g_allocations;
+
+/// An allocator that keeps g_allocated_bytes up to date, so the memory
+/// of the node-based map can be measured.
+template<typename T>
+struct CountingAllocator {
+  typedef T value_type;
+  typedef T* pointer;
+  typedef const T* const_pointer;
+  typedef T& reference;
+  typedef const T& const_reference;
+  typedef size_t size_type;
+  typedef ptrdiff_t difference_type;
+  template<typename U> struct rebind { typedef CountingAllocator<U> other; };
+
+  CountingAllocator() {}
+  template<typename U> CountingAllocator(const CountingAllocator<U>&) {}
+
+  pointer address(reference x) const { return &x; }
+  const_pointer address(const_reference x) const { return &x; }
+  pointer allocate(size_type n, const void* = 0) {
+    g_allocated_bytes += n * sizeof(T);
+    ++g_allocations;
+    return static_cast<pointer>(::operator new(n * sizeof(T)));
+  }
+  void deallocate(pointer p, size_type n) {
+    g_allocated_bytes -= n * sizeof(T);
+    --g_allocations;
+    ::operator delete(p);
+  }
+  size_type max_size() const { return size_t(-1) / sizeof(T); }
+  void construct(pointer p, const T& val) { new(p) T(val); }
+  void destroy(pointer p) { p->~T(); }
+
+  bool operator==(const CountingAllocator&) const { return true; }
+  bool operator!=(const CountingAllocator&) const { return false; }
+};
+
+#ifdef _MSC_VER
+struct StringPieceCmp : public stdext::hash_compare<StringPiece> {
+  size_t operator()(const StringPiece& key) const {
+    return MurmurHash2(key.str_, key.len_);
+  }
+  bool operator()(const StringPiece& a, const StringPiece& b) const {
+    int cmp = strncmp(a.str_, b.str_, min(a.len_, b.len_));
+    if (cmp < 0) {
+      return true;
+    } else if (cmp > 0) {
+      return false;
+    } else {
+      return a.len_ < b.len_;
+    }
+  }
+};
+typedef stdext::hash_map<StringPiece, int, StringPieceCmp,
+                         CountingAllocator<pair<const StringPiece, int> > >
+    OldMap;
+#else
+struct StringPieceHash {
+  size_t operator()(StringPiece key) const {
+    return MurmurHash2(key.str_, key.len_);
+  }
+};
+/// The map ExternalStringHashMap used to be.
+typedef __gnu_cxx::hash_map<StringPiece, int, StringPieceHash,
+                            equal_to<StringPiece>,
+                            CountingAllocator<int> > OldMap;
+#endif
+typedef ExternalStringHashMap<int>::Type NewMap;
+
+// Count a header word per block too, as malloc needs one.
+size_t MemoryUsage(const OldMap&) {
+  return g_allocated_bytes + g_allocations * sizeof(void*);
+}
+size_t MemoryUsage(const NewMap& map) { return map.memory_usage(); }
+
+/// Append a corpus of paths shaped like those of a large C++ build:
+/// sources and headers under deep directory trees, with object files,
+/// generated files and stamps in the build directory.
+void GeneratePaths(int count, vector<string>* paths) {
+  static const char* const kRoots[] = {
+    "../../base", "../../chrome/browser", "../../content/renderer",
+    "../../third_party/WebKit/Source/core", "../../net", "../../v8/src",
+    "../../ui/views", "../../third_party/skia/src", "gen", "obj",
+  };
+  static const char* const kWords[] = {
+    "android", "cache", "client", "common", "controller", "delegate",
+    "dom", "events", "frame", "gpu", "host", "impl", "input", "layout",
+    "loader", "media", "message", "platform", "policy", "resource",
+    "service", "socket", "sync", "test", "util", "view", "worker",
+  };
+  static const char* const kExtensions[] = {
+    ".cc", ".h", ".o", ".h", ".cc", ".o", ".stamp", ".d",
+  };
+  const int kNumRoots = sizeof(kRoots) / sizeof(kRoots[0]);
+  const int kNumWords = sizeof(kWords) / sizeof(kWords[0]);
+  const int kNumExtensions = sizeof(kExtensions) / sizeof(kExtensions[0]);
+
+  srand(1);
+  char buf[32];
+  for (int i = 0; i < count; ++i) {
+    string path = kRoots[rand() % kNumRoots];
+    for (int depth = random(1, 4); depth > 0; --depth) {
+      path += '/';
+      path += kWords[rand() % kNumWords];
+    }
+    path += '/';
+    path += kWords[rand() % kNumWords];
+    path += '_';
+    path += kWords[rand() % kNumWords];
+    // A counter makes the paths unique, like the names of real files.
+    snprintf(buf, sizeof(buf), "_%d", i);
+    path += buf;
+    path += kExtensions[rand() % kNumExtensions];
+    paths->push_back(path);
+  }
+}
+
+bool ReadPaths(const char* filename, vector<string>* paths) {
+  FILE* f = fopen(filename, "r");
+  if (!f)
+    return false;
+  char line[4096];
+  while (fgets(line, sizeof(line), f)) {
+    size_t len = strcspn(line, "\r\n");
+    if (len)
+      paths->push_back(string(line, len));
+  }
+  fclose(f);
+  return true;
+}
+
+/// Insert every path into a fresh map, then look each of them up, and
+/// as many paths that aren't there.
+template<typename Map>
+void Measure(const char* name, const vector<StringPiece>& keys,
+             const vector<StringPiece>& misses) {
+  const int kLookupRounds = 5;
+
+  Map* map = new Map;
+  int64_t start = GetTimeMillis();
+  for (size_t i = 0; i < keys.size(); ++i)
+    map->insert(typename Map::value_type(keys[i], (int)i));
+  int64_t inserted = GetTimeMillis();
+
+  size_t found = 0;
+  for (int round = 0; round < kLookupRounds; ++round) {
+    for (size_t i = 0; i < keys.size(); ++i)
+      found += map->find(keys[i]) != map->end();
+  }
+  int64_t looked_up = GetTimeMillis();
+
+  for (int round = 0; round < kLookupRounds; ++round) {
+    for (size_t i = 0; i < misses.size(); ++i)
+      found += map->find(misses[i]) != map->end();
+  }
+  int64_t missed = GetTimeMillis();
+
+  if (found != keys.size() * kLookupRounds)
+    Fatal("%s: found %d of %d", name, (int)found,
+          (int)(keys.size() * kLookupRounds));
+
+  double lookups = (double)keys.size() * kLookupRounds;
+  printf("%-8s insert %5dms  hit %6.1fns  miss %6.1fns  %7.1fMB\n", name,
+         (int)(inserted - start),
+         (looked_up - inserted) * 1e6 / lookups,
+         (missed - looked_up) * 1e6 / lookups,
+         MemoryUsage(*map) / (1024.0 * 1024.0));
+  delete map;
+}
+
+int MeasurePaths(const char* filename) {
+  vector<string> paths;
+  if (filename) {
+    if (!ReadPaths(filename, &paths))
+      Fatal("%s: %s", filename, strerror(errno));
+  } else {
+    GeneratePaths(1000 * 1000, &paths);
+  }
+
+  sort(paths.begin(), paths.end());
+  paths.erase(unique(paths.begin(), paths.end()), paths.end());
+  // Shuffle, so the lookups don't follow the order of the corpus.  The
+  // misses are the same paths with a suffix added.
+  srand(2);
+  random_shuffle(paths.begin(), paths.end());
+  vector<string> missing_paths;
+  for (size_t i = 0; i < paths.size(); ++i)
+    missing_paths.push_back(paths[i] + ".tmp");
+
+  vector<StringPiece> keys(paths.begin(), paths.end());
+  vector<StringPiece> misses(missing_paths.begin(), missing_paths.end());
+
+  printf("%d paths\n", (int)keys.size());
+  Measure<OldMap>("hash_map", keys, misses);
+  Measure<NewMap>("flat", keys, misses);
+  return 0;
+}
+
+}  // anonymous namespace
+
+int main(int argc, char* argv[]) {
+  if (argc > 1) {
+    if (strcmp(argv[1], "-p") != 0) {
+      printf("usage: %s [-p [paths file]]\n", argv[0]);
+      return 1;
+    }
+    return MeasurePaths(argc > 2 ? argv[2] : NULL);
+  }
+  return CheckCollisions();
 }
@@ -15,8 +15,24 @@
 #ifndef NINJA_MAP_H_
 #define NINJA_MAP_H_
 
+#include <stdlib.h>
+#include <string.h>
+
+#include <new>
+#include <utility>
+using namespace std;
+
 #include "string_piece.h"
 
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define NINJA_HASH_MAP_SSE2
+#include <emmintrin.h>
+#endif
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
 // MurmurHash2, by Austin Appleby
 static inline
 unsigned int MurmurHash2(const void* key, size_t len) {
@@ -47,51 +63,277 @@ unsigned int MurmurHash2(const void* key, size_t len) {
   return h;
 }
 
-#ifdef _MSC_VER
-#include <hash_map>
-
-using stdext::hash_map;
-using stdext::hash_compare;
-
-struct StringPieceCmp : public hash_compare<StringPiece> {
-  size_t operator()(const StringPiece& key) const {
-    return MurmurHash2(key.str_, key.len_);
-  }
-  bool operator()(const StringPiece& a, const StringPiece& b) const {
-    int cmp = strncmp(a.str_, b.str_, min(a.len_, b.len_));
-    if (cmp < 0) {
-      return true;
-    } else if (cmp > 0) {
-      return false;
-    } else {
-      return a.len_ < b.len_;
+/// A hash map from StringPiece to V using open addressing, for maps
+/// with many entries that are looked up far more often than they change.
+///
+/// Entries live in one flat array of slots, each holding the key's full
+/// hash next to the entry, so neither a lookup nor a rehash ever hashes
+/// a key twice or follows a pointer to compare a key that can't match.
+/// A parallel array holds one control byte per slot: kEmpty, or the top
+/// seven bits of the hash of the key in the slot.  Lookups scan the
+/// control bytes sixteen at a time (with SSE2 where available) starting
+/// at the key's home slot, and only compare keys whose byte matches.
+///
+/// The API is the subset of hash_map that ninja uses.  Entries cannot be
+/// erased, and as with any open-addressing table, inserting invalidates
+/// iterators and pointers to entries.  Iteration order is unspecified.
+template<typename V>
+struct FlatHashMap {
+  typedef StringPiece key_type;
+  typedef V mapped_type;
+  typedef pair<StringPiece, V> value_type;
+
+ private:
+  struct Slot {
+    value_type value;
+    unsigned int hash;
+  };
+
+  /// Iterates over the full slots; the template covers const and
+  /// non-const iterators.
+  template<typename Value, typename SlotType>
+  struct Iterator {
+    Iterator() : ctrl_(NULL), end_(NULL), slot_(NULL) {}
+    Iterator(const unsigned char* ctrl, const unsigned char* end,
+             SlotType* slot) : ctrl_(ctrl), end_(end), slot_(slot) {
+      SkipEmpty();
+    }
+    template<typename V2, typename S2>
+    Iterator(const Iterator<V2, S2>& other)
+        : ctrl_(other.ctrl_), end_(other.end_), slot_(other.slot_) {}
+
+    Value& operator*() const { return slot_->value; }
+    Value* operator->() const { return &slot_->value; }
+    Iterator& operator++() {
+      ++ctrl_;
+      ++slot_;
+      SkipEmpty();
+      return *this;
+    }
+    bool operator==(const Iterator& other) const {
+      return slot_ == other.slot_;
     }
+    bool operator!=(const Iterator& other) const {
+      return slot_ != other.slot_;
+    }
+
+    void SkipEmpty() {
+      while (ctrl_ != end_ && *ctrl_ == kEmpty) {
+        ++ctrl_;
+        ++slot_;
+      }
+    }
+
+    const unsigned char* ctrl_;
+    const unsigned char* end_;
+    SlotType* slot_;
+  };
+
+ public:
+  typedef Iterator<value_type, Slot> iterator;
+  typedef Iterator<const value_type, const Slot> const_iterator;
+
+  FlatHashMap() : ctrl_(NULL), slots_(NULL), capacity_(0), size_(0) {}
+  ~FlatHashMap() {
+    Destroy();
   }
-};
 
-#else
+  iterator begin() { return iterator(ctrl_, ctrl_ + capacity_, slots_); }
+  iterator end() {
+    return iterator(ctrl_ + capacity_, ctrl_ + capacity_, slots_ + capacity_);
+  }
+  const_iterator begin() const {
+    return const_iterator(ctrl_, ctrl_ + capacity_, slots_);
+  }
+  const_iterator end() const {
+    return const_iterator(ctrl_ + capacity_, ctrl_ + capacity_,
+                          slots_ + capacity_);
+  }
+
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+  /// The number of slots, for reporting the load factor.
+  size_t bucket_count() const { return capacity_; }
+  /// The bytes allocated by the table, not counting what keys point to.
+  size_t memory_usage() const {
+    return capacity_ ? capacity_ * (sizeof(Slot) + 1) + kGroupSize : 0;
+  }
 
-#include <ext/hash_map>
+  iterator find(StringPiece key) {
+    size_t index = Find(key, MurmurHash2(key.str_, key.len_));
+    return index == kNotFound ? end() : IteratorAt(index);
+  }
+  const_iterator find(StringPiece key) const {
+    size_t index = Find(key, MurmurHash2(key.str_, key.len_));
+    if (index == kNotFound)
+      return end();
+    return const_iterator(ctrl_ + index, ctrl_ + capacity_, slots_ + index);
+  }
 
-using __gnu_cxx::hash_map;
+  /// Insert \a value unless its key is already present.  Returns the
+  /// entry for the key and whether it was inserted.
+  pair<iterator, bool> insert(const value_type& value) {
+    unsigned int hash = MurmurHash2(value.first.str_, value.first.len_);
+    size_t index = Find(value.first, hash);
+    if (index != kNotFound)
+      return make_pair(IteratorAt(index), false);
+    return make_pair(IteratorAt(Insert(value, hash)), true);
+  }
 
-namespace __gnu_cxx {
-template<>
-struct hash<std::string> {
-  size_t operator()(const std::string& s) const {
-    return hash<const char*>()(s.c_str());
+  V& operator[](StringPiece key) {
+    unsigned int hash = MurmurHash2(key.str_, key.len_);
+    size_t index = Find(key, hash);
+    if (index == kNotFound)
+      index = Insert(value_type(key, V()), hash);
+    return slots_[index].value.second;
   }
-};
 
-template<>
-struct hash<StringPiece> {
-  size_t operator()(StringPiece key) const {
-    return MurmurHash2(key.str_, key.len_);
+  void clear() {
+    Destroy();
+    ctrl_ = NULL;
+    slots_ = NULL;
+    capacity_ = size_ = 0;
   }
-};
 
-}
+  void swap(FlatHashMap& other) {
+    std::swap(ctrl_, other.ctrl_);
+    std::swap(slots_, other.slots_);
+    std::swap(capacity_, other.capacity_);
+    std::swap(size_, other.size_);
+  }
+
+ private:
+  enum { kGroupSize = 16, kMinCapacity = 16 };
+  static const unsigned char kEmpty = 0x80;
+  static const size_t kNotFound = (size_t)-1;
+
+  static unsigned char Tag(unsigned int hash) { return hash >> 25; }
+
+  /// Bitmask of the bytes in the kGroupSize bytes at \a ctrl equal to
+  /// \a byte.
+  static unsigned int MatchByte(const unsigned char* ctrl,
+                                unsigned char byte) {
+#ifdef NINJA_HASH_MAP_SSE2
+    __m128i group = _mm_loadu_si128((const __m128i*)ctrl);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8(byte)));
+#else
+    unsigned int mask = 0;
+    for (int i = 0; i < kGroupSize; ++i) {
+      if (ctrl[i] == byte)
+        mask |= 1u << i;
+    }
+    return mask;
 #endif
+  }
+
+  static int LowestBit(unsigned int mask) {
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return (int)index;
+#else
+    return __builtin_ctz(mask);
+#endif
+  }
+
+  /// Control bytes are followed by a copy of the first kGroupSize, so a
+  /// group starting near the end can be read without wrapping.
+  void SetCtrl(size_t index, unsigned char byte) {
+    ctrl_[index] = byte;
+    if (index < kGroupSize)
+      ctrl_[capacity_ + index] = byte;
+  }
+
+  iterator IteratorAt(size_t index) {
+    return iterator(ctrl_ + index, ctrl_ + capacity_, slots_ + index);
+  }
+
+  /// Return the slot holding \a key, or kNotFound.
+  size_t Find(StringPiece key, unsigned int hash) const {
+    if (!capacity_)
+      return kNotFound;
+    size_t mask = capacity_ - 1;
+    unsigned char tag = Tag(hash);
+    for (size_t pos = hash & mask; ; pos = (pos + kGroupSize) & mask) {
+      const unsigned char* group = ctrl_ + pos;
+      for (unsigned int m = MatchByte(group, tag); m; m &= m - 1) {
+        size_t index = (pos + LowestBit(m)) & mask;
+        const Slot& slot = slots_[index];
+        if (slot.hash == hash && slot.value.first == key)
+          return index;
+      }
+      // The key would have gone into the first empty slot on its way.
+      if (MatchByte(group, kEmpty))
+        return kNotFound;
+    }
+  }
+
+  /// Return the first empty slot on \a hash's probe sequence.
+  size_t FindEmpty(unsigned int hash) const {
+    size_t mask = capacity_ - 1;
+    for (size_t pos = hash & mask; ; pos = (pos + kGroupSize) & mask) {
+      unsigned int m = MatchByte(ctrl_ + pos, kEmpty);
+      if (m)
+        return (pos + LowestBit(m)) & mask;
+    }
+  }
+
+  /// Add \a value, whose key isn't present, and return its slot.
+  size_t Insert(const value_type& value, unsigned int hash) {
+    // Keep at least one slot in eight empty so probes stay short.
+    if ((size_ + 1) * 8 > capacity_ * 7)
+      Rehash(capacity_ ? capacity_ * 2 : (size_t)kMinCapacity);
+    size_t index = FindEmpty(hash);
+    Slot* slot = &slots_[index];
+    new (&slot->value) value_type(value);
+    slot->hash = hash;
+    SetCtrl(index, Tag(hash));
+    ++size_;
+    return index;
+  }
+
+  void Rehash(size_t capacity) {
+    unsigned char* old_ctrl = ctrl_;
+    Slot* old_slots = slots_;
+    size_t old_capacity = capacity_;
+
+    capacity_ = capacity;
+    ctrl_ = static_cast<unsigned char*>(malloc(capacity + kGroupSize));
+    memset(ctrl_, kEmpty, capacity + kGroupSize);
+    slots_ = static_cast<Slot*>(malloc(capacity * sizeof(Slot)));
+
+    for (size_t i = 0; i < old_capacity; ++i) {
+      if (old_ctrl[i] == kEmpty)
+        continue;
+      Slot* old_slot = &old_slots[i];
+      size_t index = FindEmpty(old_slot->hash);
+      new (&slots_[index].value) value_type(old_slot->value);
+      slots_[index].hash = old_slot->hash;
+      SetCtrl(index, old_ctrl[i]);
+      old_slot->value.~value_type();
+    }
+    free(old_ctrl);
+    free(old_slots);
+  }
+
+  void Destroy() {
+    for (size_t i = 0; i < capacity_; ++i) {
+      if (ctrl_[i] != kEmpty)
+        slots_[i].value.~value_type();
+    }
+    free(ctrl_);
+    free(slots_);
+  }
+
+  unsigned char* ctrl_;
+  Slot* slots_;
+  size_t capacity_;
+  size_t size_;
+
+  // Not copyable.
+  FlatHashMap(const FlatHashMap&);
+  void operator=(const FlatHashMap&);
+};
 
 /// A template for hash_maps keyed by a StringPiece whose string is
 /// owned externally (typically by the values).  Use like:
@@ -99,11 +341,7 @@ struct hash<StringPiece> {
 /// mapping StringPiece => Foo*.
 template<typename V>
 struct ExternalStringHashMap {
-#ifdef _MSC_VER
-  typedef hash_map<StringPiece, V, StringPieceCmp> Type;
-#else
-  typedef hash_map<StringPiece, V> Type;
-#endif
+  typedef FlatHashMap<V> Type;
 };
 
 #endif // NINJA_MAP_H_
@@ -0,0 +1,99 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "hash_map.h"
+
+#include <stdio.h>
+
+#include <set>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+namespace {
+
+typedef ExternalStringHashMap<int>::Type Map;
+
+TEST(FlatHashMapTest, Empty) {
+  Map map;
+  EXPECT_TRUE(map.empty());
+  EXPECT_EQ(0u, map.size());
+  EXPECT_TRUE(map.find("a") == map.end());
+  EXPECT_TRUE(map.begin() == map.end());
+}
+
+TEST(FlatHashMapTest, InsertFind) {
+  Map map;
+  EXPECT_TRUE(map.insert(Map::value_type("a", 1)).second);
+  EXPECT_TRUE(map.insert(Map::value_type("", 2)).second);
+  pair<Map::iterator, bool> result = map.insert(Map::value_type("a", 3));
+  EXPECT_FALSE(result.second);
+  EXPECT_EQ(1, result.first->second);
+  EXPECT_EQ(2u, map.size());
+
+  EXPECT_EQ(2, map.find("")->second);
+  EXPECT_TRUE(map.find("b") == map.end());
+  map["b"] = 4;
+  map["a"] = 5;
+  EXPECT_EQ(3u, map.size());
+  EXPECT_EQ(4, map.find("b")->second);
+  EXPECT_EQ(5, map.find("a")->second);
+}
+
+TEST(FlatHashMapTest, Grow) {
+  // Enough keys to rehash many times, many of which share a control
+  // byte and so have to be told apart by comparing keys.
+  const int kCount = 20000;
+  vector<string> keys;
+  char buf[32];
+  for (int i = 0; i < kCount; ++i) {
+    snprintf(buf, sizeof(buf), "dir/file%d.o", i);
+    keys.push_back(buf);
+  }
+
+  Map map;
+  for (int i = 0; i < kCount; ++i) {
+    map[keys[i]] = i;
+    ASSERT_EQ((size_t)i + 1, map.size());
+  }
+  EXPECT_GE(map.bucket_count(), (size_t)kCount);
+  for (int i = 0; i < kCount; ++i) {
+    Map::const_iterator it =
+        static_cast<const Map&>(map).find(keys[i]);
+    ASSERT_TRUE(it != static_cast<const Map&>(map).end());
+    EXPECT_EQ(i, it->second);
+  }
+  EXPECT_TRUE(map.find("dir/file.o") == map.end());
+
+  // Iteration visits every entry once.
+  set<int> seen;
+  for (Map::iterator i = map.begin(); i != map.end(); ++i) {
+    EXPECT_EQ(keys[i->second], i->first.AsString());
+    EXPECT_TRUE(seen.insert(i->second).second);
+  }
+  EXPECT_EQ((size_t)kCount, seen.size());
+}
+
+TEST(FlatHashMapTest, Clear) {
+  Map map;
+  map["a"] = 1;
+  map.clear();
+  EXPECT_TRUE(map.empty());
+  EXPECT_TRUE(map.find("a") == map.end());
+  map["a"] = 2;
+  EXPECT_EQ(2, map.find("a")->second);
+}
+
+}  // anonymous namespace
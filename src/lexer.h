@@ -86,7 +86,16 @@ struct Lexer {
   }
 
   /// Construct an error message with context.
-  bool Error(const string& message, string* err);
+  bool Error(const string& message, string* err) {
+    return ErrorAt(last_token_, message, err);
+  }
+
+  /// The position of the last token read, to report an error at later.
+  const char* last_token() const { return last_token_; }
+
+  /// Construct an error message with context pointing at \a pos, a
+  /// position previously returned by last_token().
+  bool ErrorAt(const char* pos, const string& message, string* err);
 
 private:
   /// Skip past whitespace (called after each read token/ident/etc.).
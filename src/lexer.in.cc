@@ -16,20 +16,29 @@
 
 #include <stdio.h>
 
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define NINJA_LEXER_SSE2
+#include <emmintrin.h>
+#endif
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
 #include "eval_env.h"
 #include "util.h"
 
-bool Lexer::Error(const string& message, string* err) {
+bool Lexer::ErrorAt(const char* pos, const string& message, string* err) {
   // Compute line/column.
   int line = 1;
   const char* context = input_.str_;
-  for (const char* p = input_.str_; p < last_token_; ++p) {
+  for (const char* p = input_.str_; p < pos; ++p) {
     if (*p == '\n') {
       ++line;
       context = p + 1;
     }
   }
-  int col = last_token_ ? (int)(last_token_ - context) : 0;
+  int col = pos ? (int)(pos - context) : 0;
 
   char buf[1024];
   snprintf(buf, sizeof(buf), "%s:%d: ", filename_.AsString().c_str(), line);
@@ -194,11 +203,57 @@ bool Lexer::ReadIdent(string* out) {
   return true;
 }
 
+/// Return the end of the run of plain text -- anything but '$', ' ',
+/// ':', '|', '\r', '\n' and NUL -- that starts at \a p, or where the run
+/// reaches the last 16 bytes before \a end.  Paths and values are mostly
+/// such runs, and this checks 16 bytes at a time where the lexer checks
+/// one; the lexer itself takes over from wherever this stops.
+static const char* SkipPlainText(const char* p, const char* end) {
+#ifdef NINJA_LEXER_SSE2
+  const __m128i dollar = _mm_set1_epi8('$');
+  const __m128i space = _mm_set1_epi8(' ');
+  const __m128i colon = _mm_set1_epi8(':');
+  const __m128i pipe = _mm_set1_epi8('|');
+  const __m128i cr = _mm_set1_epi8('\r');
+  const __m128i lf = _mm_set1_epi8('\n');
+  const __m128i nul = _mm_setzero_si128();
+  while (end - p >= 16) {
+    __m128i chunk = _mm_loadu_si128((const __m128i*)p);
+    __m128i special = _mm_or_si128(
+        _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, dollar),
+                                  _mm_cmpeq_epi8(chunk, space)),
+                     _mm_or_si128(_mm_cmpeq_epi8(chunk, colon),
+                                  _mm_cmpeq_epi8(chunk, pipe))),
+        _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, cr),
+                                  _mm_cmpeq_epi8(chunk, lf)),
+                     _mm_cmpeq_epi8(chunk, nul)));
+    int mask = _mm_movemask_epi8(special);
+    if (mask) {
+#ifdef _MSC_VER
+      unsigned long index;
+      _BitScanForward(&index, mask);
+      return p + index;
+#else
+      return p + __builtin_ctz(mask);
+#endif
+    }
+    p += 16;
+  }
+#endif
+  return p;
+}
+
 bool Lexer::ReadEvalString(EvalString* eval, bool path, string* err) {
   const char* p = ofs_;
   const char* q;
   const char* start;
+  const char* end = input_.str_ + input_.len_;
   for (;;) {
+    q = SkipPlainText(p, end);
+    if (q != p) {
+      eval->AddText(StringPiece(p, q - p));
+      p = q;
+    }
     start = p;
     /*!re2c
     [^$ :\r\n|\000]+ {
@@ -38,6 +38,36 @@ TEST(Lexer, ReadEvalStringEscapes) {
             eval.Serialize());
 }
 
+TEST(Lexer, ReadLongPaths) {
+  // Runs of plain text longer than the lexer's fast path reads at once,
+  // ending in each kind of delimiter at every offset within a chunk.
+  const char kDelimiters[] = "$ :|\n";
+  for (int len = 1; len < 40; ++len) {
+    for (const char* d = kDelimiters; *d; ++d) {
+      string path(len, 'a');
+      string input = path + (*d == '$' ? "$$x" : string(1, *d)) + "\n";
+      Lexer lexer(input.c_str());
+      EvalString eval;
+      string err;
+      EXPECT_TRUE(lexer.ReadPath(&eval, &err));
+      EXPECT_EQ("", err);
+      if (*d == '$')
+        EXPECT_EQ("[" + path + "$x]", eval.Serialize());
+      else
+        EXPECT_EQ("[" + path + "]", eval.Serialize());
+    }
+  }
+
+  // A path that runs right up to the end of the input.
+  string path(37, 'b');
+  Lexer lexer(path.c_str());
+  EvalString eval;
+  string err;
+  EXPECT_FALSE(lexer.ReadPath(&eval, &err));
+  EXPECT_EQ("input:1: unexpected EOF\n" + path + "\n" + string(37, ' ') +
+            "^ near here", err);
+}
+
 TEST(Lexer, ReadIdent) {
   Lexer lexer("foo baR baz_123 foo-bar");
   string ident;
@@ -0,0 +1,564 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "manifest_cache.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+#include <map>
+
+#include "disk_interface.h"
+#include "eval_env.h"
+#include "graph.h"
+#include "manifest_parser.h"
+#include "metrics.h"
+#include "state.h"
+#include "util.h"
+
+// Implementation details:
+// The image is a flat sequence of records: 32-bit integers and
+// length-prefixed strings, in native byte order (the image is never
+// shared between machines).  Rules, scopes and nodes are written first
+// and referred to by index from the edges and history that follow them.
+
+namespace {
+
+const char kFileSignature[] = "# ninja manifest cache\n";
+const uint32_t kCurrentVersion = 5;
+
+/// Read a whole file in binary mode.  Returns -errno on failure.
+int ReadBinaryFile(const string& path, string* contents) {
+  FILE* f = fopen(path.c_str(), "rb");
+  if (!f)
+    return -errno;
+  char buf[64 << 10];
+  size_t len;
+  while ((len = fread(buf, 1, sizeof(buf), f)) > 0)
+    contents->append(buf, len);
+  int ret = ferror(f) ? -errno : 0;
+  fclose(f);
+  return ret;
+}
+
+}  // anonymous namespace
+
+struct ManifestCache::Writer {
+  void WriteInt(uint32_t value) {
+    buf_.append((const char*)&value, sizeof(value));
+  }
+  void WriteString(const string& str) {
+    WriteInt(str.size());
+    buf_.append(str);
+  }
+  void WriteInt64(uint64_t value) {
+    WriteInt((uint32_t)value);
+    WriteInt((uint32_t)(value >> 32));
+  }
+  void WriteEvalString(const EvalString& eval) {
+    WriteInt(eval.tokens_.size());
+    const char* text = eval.text_.data();
+    for (vector<EvalString::Token>::const_iterator i = eval.tokens_.begin();
+         i != eval.tokens_.end(); ++i) {
+      WriteInt(i->type);
+      if (i->type == EvalString::RAW) {
+        WriteString(string(text, i->value));
+        text += i->value;
+      } else {
+        WriteString(Symbols::Name(i->value));
+      }
+    }
+  }
+
+  string buf_;
+};
+
+struct ManifestCache::Reader {
+  explicit Reader(const string& buf)
+      : pos_(buf.data()), end_(buf.data() + buf.size()), ok_(true) {}
+
+  uint32_t ReadInt() {
+    uint32_t value = 0;
+    if (end_ - pos_ < (ptrdiff_t)sizeof(value)) {
+      ok_ = false;
+      return 0;
+    }
+    memcpy(&value, pos_, sizeof(value));
+    pos_ += sizeof(value);
+    return value;
+  }
+  string ReadString() {
+    uint32_t len = ReadInt();
+    if (end_ - pos_ < (ptrdiff_t)len) {
+      ok_ = false;
+      return string();
+    }
+    pos_ += len;
+    return string(pos_ - len, len);
+  }
+  uint64_t ReadInt64() {
+    uint64_t low = ReadInt();
+    return low | ((uint64_t)ReadInt() << 32);
+  }
+  /// Read a count of items of at least \a item_size bytes each.  If they
+  /// can't fit in the rest of the image, sets ok_ to false and returns 0.
+  uint32_t ReadCount(size_t item_size) {
+    uint32_t count = ReadInt();
+    if ((size_t)(end_ - pos_) / item_size < count) {
+      ok_ = false;
+      return 0;
+    }
+    return count;
+  }
+  /// Read an index into a table of \a size entries.  On a bad index,
+  /// sets ok_ to false and returns false.
+  bool ReadIndex(size_t size, uint32_t* index) {
+    *index = ReadInt();
+    if (*index >= size)
+      ok_ = false;
+    return ok_;
+  }
+  void ReadEvalString(EvalString* eval) {
+    uint32_t count = ReadInt();
+    for (uint32_t i = 0; i < count && ok_; ++i) {
+      uint32_t type = ReadInt();
+      if (type != EvalString::RAW && type != EvalString::SPECIAL) {
+        ok_ = false;
+        return;
+      }
+      string text = ReadString();
+      if (type == EvalString::RAW)
+        eval->AddText(text);
+      else
+        eval->AddSpecial(text);
+    }
+  }
+
+  const char* pos_;
+  const char* end_;
+  bool ok_;
+};
+
+// static
+int ManifestCache::NumberEnv(const BindingEnv* env,
+                             map<const BindingEnv*, int>* index,
+                             vector<const BindingEnv*>* envs) {
+  map<const BindingEnv*, int>::iterator i = index->find(env);
+  if (i != index->end())
+    return i->second;
+  // Number parents before their children, so the reader can resolve
+  // them as it goes.
+  if (env->parent_)
+    NumberEnv(static_cast<const BindingEnv*>(env->parent_), index, envs);
+  int id = envs->size();
+  (*index)[env] = id;
+  envs->push_back(env);
+  return id;
+}
+
+// static
+void ManifestCache::WriteState(Writer* out, const State& state,
+                               const ManifestHistory* history) {
+  // Rules; the builtin phony rule is always index 0.
+  map<const Rule*, int> rule_index;
+  rule_index[&State::kPhonyRule] = 0;
+  out->WriteInt(state.rules_.size() - 1);
+  for (map<string, const Rule*>::const_iterator i = state.rules_.begin();
+       i != state.rules_.end(); ++i) {
+    const Rule* rule = i->second;
+    if (rule == &State::kPhonyRule)
+      continue;
+    int id = rule_index.size();
+    rule_index[rule] = id;
+    out->WriteString(rule->name_);
+    out->WriteInt(rule->generator_);
+    out->WriteInt(rule->restat_);
+    out->WriteInt(rule->delete_depfile_);
+    out->WriteEvalString(rule->command_);
+    out->WriteEvalString(rule->description_);
+    out->WriteEvalString(rule->depfile_);
+    out->WriteEvalString(rule->rspfile_);
+    out->WriteEvalString(rule->rspfile_content_);
+  }
+
+  // Scopes; the toplevel scope is always index 0.  The parser only ever
+  // gives edges BindingEnvs.
+  map<const BindingEnv*, int> env_index;
+  vector<const BindingEnv*> envs;
+  NumberEnv(&state.bindings_, &env_index, &envs);
+  for (vector<Edge*>::const_iterator e = state.edges_.begin();
+       e != state.edges_.end(); ++e) {
+    NumberEnv(static_cast<const BindingEnv*>((*e)->env_), &env_index, &envs);
+  }
+  if (history) {
+    for (vector<ManifestHistory::Subninja>::const_iterator i =
+             history->subninjas_.begin(); i != history->subninjas_.end();
+         ++i) {
+      NumberEnv(i->env, &env_index, &envs);
+    }
+  }
+  out->WriteInt(envs.size());
+  for (vector<const BindingEnv*>::iterator i = envs.begin();
+       i != envs.end(); ++i) {
+    const BindingEnv* env = *i;
+    if (env->parent_)
+      out->WriteInt(env_index[static_cast<const BindingEnv*>(env->parent_)]);
+    else
+      out->WriteInt((uint32_t)-1);
+    out->WriteInt(env->bindings_.size());
+    for (map<Symbol, string>::const_iterator b = env->bindings_.begin();
+         b != env->bindings_.end(); ++b) {
+      out->WriteString(Symbols::Name(b->first));
+      out->WriteString(b->second);
+    }
+    // Pending bindings stay unevaluated in the image too.
+    out->WriteInt(env->pending_.size());
+    for (vector<pair<Symbol, EvalString> >::const_iterator b =
+             env->pending_.begin(); b != env->pending_.end(); ++b) {
+      out->WriteString(b->first == Symbols::kNone ?
+                       string() : Symbols::Name(b->first));
+      out->WriteEvalString(b->second);
+    }
+  }
+
+  // Nodes.
+  map<const Node*, int> node_index;
+  out->WriteInt(state.paths_.size());
+  for (State::Paths::const_iterator i = state.paths_.begin();
+       i != state.paths_.end(); ++i) {
+    int id = node_index.size();
+    node_index[i->second] = id;
+    out->WriteString(i->second->path());
+  }
+
+  // Edges, in their original order.
+  out->WriteInt(state.edges_.size());
+  for (vector<Edge*>::const_iterator e = state.edges_.begin();
+       e != state.edges_.end(); ++e) {
+    const Edge* edge = *e;
+    out->WriteInt(rule_index[edge->rule_]);
+    out->WriteInt(env_index[static_cast<const BindingEnv*>(edge->env_)]);
+    out->WriteInt(edge->inputs_.size());
+    for (vector<Node*>::const_iterator i = edge->inputs_.begin();
+         i != edge->inputs_.end(); ++i)
+      out->WriteInt(node_index[*i]);
+    out->WriteInt(edge->outputs_.size());
+    for (vector<Node*>::const_iterator i = edge->outputs_.begin();
+         i != edge->outputs_.end(); ++i)
+      out->WriteInt(node_index[*i]);
+    out->WriteInt(edge->implicit_deps_);
+    out->WriteInt(edge->order_only_deps_);
+  }
+
+  out->WriteInt(state.defaults_.size());
+  for (vector<Node*>::const_iterator i = state.defaults_.begin();
+       i != state.defaults_.end(); ++i)
+    out->WriteInt(node_index[*i]);
+
+  // What each subninja added, for reloading the manifest once it is
+  // regenerated.
+  if (!history) {
+    out->WriteInt(0);
+    return;
+  }
+  out->WriteInt(history->subninjas_.size());
+  for (vector<ManifestHistory::Subninja>::const_iterator i =
+           history->subninjas_.begin(); i != history->subninjas_.end(); ++i) {
+    out->WriteString(i->path);
+    out->WriteInt64(i->scope_hash);
+    out->WriteInt(i->files.size());
+    for (vector<pair<string, uint64_t> >::const_iterator f =
+             i->files.begin(); f != i->files.end(); ++f) {
+      out->WriteString(f->first);
+      out->WriteInt64(f->second);
+    }
+    out->WriteInt(env_index[i->env]);
+    out->WriteInt(i->edges_begin);
+    out->WriteInt(i->edges_end);
+    out->WriteInt(i->rules.size());
+    for (vector<const Rule*>::const_iterator r = i->rules.begin();
+         r != i->rules.end(); ++r)
+      out->WriteInt(rule_index[*r]);
+    out->WriteInt(i->defaults.size());
+    for (vector<pair<Node*, size_t> >::const_iterator d =
+             i->defaults.begin(); d != i->defaults.end(); ++d) {
+      out->WriteInt(node_index[d->first]);
+      out->WriteInt(d->second);
+    }
+    out->WriteInt(i->subninjas_end);
+  }
+}
+
+// static
+bool ManifestCache::ReadState(Reader* in, State* state,
+                              ManifestHistory* history) {
+  vector<const Rule*> rules;
+  rules.push_back(&State::kPhonyRule);
+  uint32_t rule_count = in->ReadInt();
+  for (uint32_t i = 0; i < rule_count && in->ok_; ++i) {
+    Rule* rule = new Rule(in->ReadString());
+    rule->generator_ = in->ReadInt() != 0;
+    rule->restat_ = in->ReadInt() != 0;
+    rule->delete_depfile_ = in->ReadInt() != 0;
+    in->ReadEvalString(&rule->command_);
+    in->ReadEvalString(&rule->description_);
+    in->ReadEvalString(&rule->depfile_);
+    in->ReadEvalString(&rule->rspfile_);
+    in->ReadEvalString(&rule->rspfile_content_);
+    if (!in->ok_ || state->LookupRule(rule->name()) != NULL) {
+      delete rule;
+      return false;
+    }
+    state->AddRule(rule);
+    rules.push_back(rule);
+  }
+
+  vector<BindingEnv*> envs;
+  uint32_t env_count = in->ReadInt();
+  for (uint32_t i = 0; i < env_count && in->ok_; ++i) {
+    uint32_t parent = in->ReadInt();
+    BindingEnv* env;
+    if (i == 0) {
+      if (parent != (uint32_t)-1)
+        return false;
+      env = &state->bindings_;
+    } else {
+      if (parent >= envs.size())
+        return false;
+      env = new BindingEnv(envs[parent]);
+    }
+    envs.push_back(env);
+    uint32_t binding_count = in->ReadInt();
+    for (uint32_t b = 0; b < binding_count && in->ok_; ++b) {
+      string key = in->ReadString();
+      env->AddBinding(key, in->ReadString());
+    }
+    uint32_t pending_count = in->ReadInt();
+    for (uint32_t b = 0; b < pending_count && in->ok_; ++b) {
+      string key = in->ReadString();
+      EvalString value;
+      in->ReadEvalString(&value);
+      if (!key.empty())
+        env->AddLazyBinding(Symbols::Intern(key), &value);
+    }
+  }
+  if (envs.empty())
+    return false;
+
+  vector<Node*> nodes;
+  uint32_t node_count = in->ReadInt();
+  for (uint32_t i = 0; i < node_count && in->ok_; ++i)
+    nodes.push_back(state->GetNode(in->ReadString()));
+  if (nodes.size() != state->paths_.size())
+    return false;  // Duplicate paths.
+
+  uint32_t edge_count = in->ReadInt();
+  for (uint32_t e = 0; e < edge_count && in->ok_; ++e) {
+    uint32_t rule, env;
+    if (!in->ReadIndex(rules.size(), &rule) ||
+        !in->ReadIndex(envs.size(), &env))
+      return false;
+    Edge* edge = state->AddEdge(rules[rule]);
+    edge->env_ = envs[env];
+
+    uint32_t input_count = in->ReadCount(sizeof(uint32_t));
+    edge->inputs_.reserve(input_count);
+    for (uint32_t i = 0; i < input_count; ++i) {
+      uint32_t node;
+      if (!in->ReadIndex(nodes.size(), &node))
+        return false;
+      edge->inputs_.push_back(nodes[node]);
+      nodes[node]->AddOutEdge(edge);
+    }
+    uint32_t output_count = in->ReadCount(sizeof(uint32_t));
+    edge->outputs_.reserve(output_count);
+    for (uint32_t i = 0; i < output_count; ++i) {
+      uint32_t node;
+      if (!in->ReadIndex(nodes.size(), &node))
+        return false;
+      edge->outputs_.push_back(nodes[node]);
+      nodes[node]->set_in_edge(edge);
+    }
+    edge->implicit_deps_ = in->ReadInt();
+    edge->order_only_deps_ = in->ReadInt();
+    if (edge->implicit_deps_ + edge->order_only_deps_ >
+        (int)edge->inputs_.size())
+      return false;
+  }
+
+  uint32_t default_count = in->ReadInt();
+  for (uint32_t i = 0; i < default_count; ++i) {
+    uint32_t node;
+    if (!in->ReadIndex(nodes.size(), &node))
+      return false;
+    state->defaults_.push_back(nodes[node]);
+  }
+
+  ManifestHistory ignored;
+  if (!history)
+    history = &ignored;
+  history->state_ = state;
+  history->subninjas_.clear();
+  uint32_t subninja_count = in->ReadInt();
+  for (uint32_t i = 0; i < subninja_count && in->ok_; ++i) {
+    history->subninjas_.push_back(ManifestHistory::Subninja());
+    ManifestHistory::Subninja* subninja = &history->subninjas_.back();
+    subninja->path = in->ReadString();
+    subninja->scope_hash = in->ReadInt64();
+    uint32_t file_count = in->ReadCount(2 * sizeof(uint32_t));
+    for (uint32_t f = 0; f < file_count; ++f) {
+      string path = in->ReadString();
+      subninja->files.push_back(make_pair(path, in->ReadInt64()));
+    }
+    uint32_t env;
+    if (!in->ReadIndex(envs.size(), &env))
+      return false;
+    subninja->env = envs[env];
+    subninja->edges_begin = in->ReadInt();
+    subninja->edges_end = in->ReadInt();
+    if (subninja->edges_begin > subninja->edges_end ||
+        subninja->edges_end > state->edges_.size())
+      return false;
+    uint32_t rule_count = in->ReadCount(sizeof(uint32_t));
+    for (uint32_t r = 0; r < rule_count; ++r) {
+      uint32_t rule;
+      if (!in->ReadIndex(rules.size(), &rule))
+        return false;
+      subninja->rules.push_back(rules[rule]);
+    }
+    uint32_t default_count = in->ReadCount(2 * sizeof(uint32_t));
+    for (uint32_t d = 0; d < default_count; ++d) {
+      uint32_t node;
+      if (!in->ReadIndex(nodes.size(), &node))
+        return false;
+      size_t edges = in->ReadInt();
+      if (edges > subninja->edges_end - subninja->edges_begin)
+        return false;
+      subninja->defaults.push_back(make_pair(nodes[node], edges));
+    }
+    subninja->subninjas_end = in->ReadInt();
+    if (subninja->subninjas_end <= i ||
+        subninja->subninjas_end > subninja_count)
+      return false;
+  }
+
+  return in->ok_ && in->pos_ == in->end_;
+}
+
+// static
+bool ManifestCache::Load(const string& path, const string& manifest,
+                         DiskInterface* disk_interface, State* state,
+                         ManifestHistory* history, string* err) {
+  METRIC_RECORD(".ninja_manifest load");
+  string contents;
+  int ret = ReadBinaryFile(path, &contents);
+  if (ret == -ENOENT)
+    return false;
+  if (ret < 0) {
+    *err = strerror(-ret);
+    return false;
+  }
+
+  Reader in(contents);
+  if (contents.compare(0, strlen(kFileSignature), kFileSignature) != 0)
+    return false;
+  in.pos_ += strlen(kFileSignature);
+  if (in.ReadInt() != kCurrentVersion)
+    return false;
+  if (in.ReadString() != manifest)
+    return false;
+
+  // The image is only valid if no manifest file changed since it was
+  // written.
+  uint32_t file_count = in.ReadInt();
+  for (uint32_t i = 0; i < file_count && in.ok_; ++i) {
+    string file = in.ReadString();
+    TimeStamp mtime = (TimeStamp)in.ReadInt64();
+    if (!in.ok_ || disk_interface->Stat(file) != mtime)
+      return false;
+  }
+
+  if (!in.ok_ || !ReadState(&in, state, history)) {
+    *err = "manifest cache is corrupt";
+    return false;
+  }
+  return true;
+}
+
+// static
+bool ManifestCache::Save(const string& path, const vector<string>& files,
+                         DiskInterface* disk_interface, const State& state,
+                         const ManifestHistory* history, string* err) {
+  METRIC_RECORD(".ninja_manifest save");
+  if (files.empty()) {
+    *err = "no manifest files";
+    return false;
+  }
+
+  Writer out;
+  out.buf_ = kFileSignature;
+  out.WriteInt(kCurrentVersion);
+  out.WriteString(files[0]);
+
+  TimeStamp newest = 0;
+  out.WriteInt(files.size());
+  for (vector<string>::const_iterator i = files.begin(); i != files.end();
+       ++i) {
+    TimeStamp mtime = disk_interface->Stat(*i);
+    if (mtime <= 0) {
+      *err = "can't stat " + *i;
+      return false;
+    }
+    if (mtime > newest)
+      newest = mtime;
+    out.WriteString(*i);
+    out.WriteInt64((uint64_t)mtime);
+  }
+
+  WriteState(&out, state, history);
+
+  string temp_path = path + ".tmp";
+  FILE* f = fopen(temp_path.c_str(), "wb");
+  if (!f) {
+    *err = strerror(errno);
+    return false;
+  }
+  if (fwrite(out.buf_.data(), 1, out.buf_.size(), f) != out.buf_.size()) {
+    *err = strerror(errno);
+    fclose(f);
+    unlink(temp_path.c_str());
+    return false;
+  }
+  fclose(f);
+
+  // A manifest written in the same timestamp tick as the image could
+  // still be modified again without its mtime changing, in which case we
+  // would never notice.  Don't keep an image we can't trust.
+  if (disk_interface->Stat(temp_path) <= newest) {
+    unlink(temp_path.c_str());
+    return true;
+  }
+
+  unlink(path.c_str());
+  if (rename(temp_path.c_str(), path.c_str()) < 0) {
+    *err = strerror(errno);
+    return false;
+  }
+  return true;
+}
@@ -0,0 +1,70 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef NINJA_MANIFEST_CACHE_H_
+#define NINJA_MANIFEST_CACHE_H_
+
+#include <map>
+#include <string>
+#include <vector>
+using namespace std;
+
+struct BindingEnv;
+struct DiskInterface;
+struct ManifestHistory;
+struct State;
+
+/// A binary image of a fully loaded State (rules, nodes, edges, scopes
+/// and defaults), and optionally the ManifestHistory of the parse that
+/// built it, written after a successful manifest parse and used in place
+/// of re-parsing on later runs.
+///
+/// The image records the mtime of the top-level manifest and of every
+/// file pulled in by include and subninja; it is only used if none of
+/// them changed since it was written.
+struct ManifestCache {
+  /// Load the image at \a path into \a state, which must be freshly
+  /// constructed.  \a manifest is the top-level manifest name the image
+  /// must have been written for.
+  /// If \a history is not NULL, it is filled in with the history saved
+  /// with the image, if any.
+  /// Returns false if the image is missing, stale or unreadable, filling
+  /// in \a err only in the last case.  \a state may then be partially
+  /// filled and must be discarded before parsing the manifest.
+  static bool Load(const string& path, const string& manifest,
+                   DiskInterface* disk_interface, State* state,
+                   ManifestHistory* history, string* err);
+
+  /// Write an image of \a state to \a path.  \a files lists every file
+  /// that was read to build \a state, the top-level manifest first.
+  /// \a history, if not NULL, must describe \a state.
+  /// If any of those files was modified too recently for its mtime to
+  /// be trusted, no image is written.
+  static bool Save(const string& path, const vector<string>& files,
+                   DiskInterface* disk_interface, const State& state,
+                   const ManifestHistory* history, string* err);
+
+ private:
+  struct Reader;
+  struct Writer;
+
+  static int NumberEnv(const BindingEnv* env,
+                       map<const BindingEnv*, int>* index,
+                       vector<const BindingEnv*>* envs);
+  static void WriteState(Writer* out, const State& state,
+                         const ManifestHistory* history);
+  static bool ReadState(Reader* in, State* state, ManifestHistory* history);
+};
+
+#endif  // NINJA_MANIFEST_CACHE_H_
@@ -0,0 +1,236 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "manifest_cache.h"
+
+#include <stdio.h>
+
+#ifdef _WIN32
+#include <sys/utime.h>
+#else
+#include <utime.h>
+#endif
+
+#include "disk_interface.h"
+#include "graph.h"
+#include "manifest_parser.h"
+#include "state.h"
+#include "test.h"
+
+namespace {
+
+const char kCachePath[] = "ManifestCacheTest-tempfile";
+
+struct ManifestCacheTest : public StateTestWithBuiltinRules {
+  virtual void SetUp() {
+    temp_dir_.CreateAndEnter("Ninja-ManifestCacheTest");
+    files_.push_back("build.ninja");
+    files_.push_back("sub.ninja");
+    // Pretend the manifest was generated long ago, so its mtime can be
+    // trusted.
+    for (vector<string>::iterator i = files_.begin(); i != files_.end(); ++i)
+      CreateFile(*i, 1000000);
+  }
+  virtual void TearDown() {
+    temp_dir_.Cleanup();
+  }
+
+  void CreateFile(const string& path, time_t mtime) {
+    FILE* f = fopen(path.c_str(), "w");
+    ASSERT_TRUE(f);
+    fclose(f);
+    struct utimbuf times = { mtime, mtime };
+    ASSERT_EQ(0, utime(path.c_str(), &times));
+  }
+
+  ScopedTempDir temp_dir_;
+  RealDiskInterface disk_interface_;
+  vector<string> files_;
+};
+
+TEST_F(ManifestCacheTest, RoundTrip) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"cflags = -O2\n"
+"rule cc\n"
+"  command = cc $cflags -c $in -o $out\n"
+"  depfile = $out.d\n"
+"  restat = 1\n"
+"build a.o: cc a.c | a.h || gen\n"
+"  cflags = $cflags -g\n"
+"build b.o: cc b.c\n"
+"build gen: phony\n"
+"default b.o\n"));
+
+  string err;
+  ASSERT_TRUE(ManifestCache::Save(kCachePath, files_, &disk_interface_,
+                                  state_, NULL, &err));
+  ASSERT_EQ("", err);
+
+  State state;
+  ASSERT_TRUE(ManifestCache::Load(kCachePath, "build.ninja",
+                                  &disk_interface_, &state, NULL, &err));
+  ASSERT_EQ("", err);
+
+  EXPECT_EQ(state_.rules_.size(), state.rules_.size());
+  const Rule* rule = state.LookupRule("cc");
+  ASSERT_TRUE(rule);
+  EXPECT_TRUE(rule->restat());
+  EXPECT_FALSE(rule->generator());
+  EXPECT_EQ("[cc ][$cflags][ -c ][$in][ -o ][$out]",
+            rule->command().Serialize());
+  EXPECT_EQ("[$out][.d]", rule->depfile().Serialize());
+
+  EXPECT_EQ(state_.paths_.size(), state.paths_.size());
+  ASSERT_EQ(3u, state.edges_.size());
+  Edge* edge = state.edges_[0];
+  EXPECT_EQ("cc -O2 -g -c a.c -o a.o", edge->EvaluateCommand());
+  ASSERT_EQ(3u, edge->inputs_.size());
+  EXPECT_EQ("a.h", edge->inputs_[1]->path());
+  EXPECT_TRUE(edge->is_implicit(1));
+  EXPECT_TRUE(edge->is_order_only(2));
+  EXPECT_EQ(edge, state.LookupNode("a.o")->in_edge());
+  EXPECT_EQ("cc -O2 -c b.c -o b.o", state.edges_[1]->EvaluateCommand());
+  EXPECT_TRUE(state.edges_[2]->is_phony());
+  EXPECT_EQ(state.edges_[0], state.LookupNode("gen")->out_edges()[0]);
+
+  ASSERT_EQ(1u, state.defaults_.size());
+  EXPECT_EQ("b.o", state.defaults_[0]->path());
+  EXPECT_EQ("-O2", state.bindings_.LookupVariable("cflags"));
+}
+
+struct MapFileReader : public ManifestParser::FileReader {
+  virtual bool ReadFile(const string& path, string* content, string* err) {
+    map<string, string>::iterator i = files.find(path);
+    if (i == files.end()) {
+      *err = "No such file or directory";
+      return false;
+    }
+    *content = i->second;
+    return true;
+  }
+  map<string, string> files;
+};
+
+TEST_F(ManifestCacheTest, History) {
+  MapFileReader reader;
+  reader.files["build.ninja"] =
+"rule cat\n"
+"  command = cat $in > $out\n"
+"subninja sub.ninja\n";
+  reader.files["sub.ninja"] =
+"rule cp\n"
+"  command = cp $in $out\n"
+"build out: cp in\n"
+"default out\n";
+  State state;
+  ManifestHistory history;
+  string err;
+  {
+    ManifestParser parser(&state, &reader);
+    parser.SetHistory(NULL, &history);
+    ASSERT_TRUE(parser.Load("build.ninja", &err));
+  }
+  ASSERT_TRUE(ManifestCache::Save(kCachePath, files_, &disk_interface_,
+                                  state, &history, &err));
+  ASSERT_EQ("", err);
+
+  State loaded;
+  ManifestHistory loaded_history;
+  ASSERT_TRUE(ManifestCache::Load(kCachePath, "build.ninja",
+                                  &disk_interface_, &loaded, &loaded_history,
+                                  &err));
+  ASSERT_EQ("", err);
+  EXPECT_EQ(&loaded, loaded_history.state_);
+  ASSERT_EQ(1u, loaded_history.subninjas_.size());
+  const ManifestHistory::Subninja& subninja = loaded_history.subninjas_[0];
+  EXPECT_EQ("sub.ninja", subninja.path);
+  EXPECT_EQ(history.subninjas_[0].scope_hash, subninja.scope_hash);
+  EXPECT_EQ(history.subninjas_[0].files, subninja.files);
+  EXPECT_EQ(loaded.edges_[0]->env_, subninja.env);
+  EXPECT_EQ(0u, subninja.edges_begin);
+  EXPECT_EQ(1u, subninja.edges_end);
+  ASSERT_EQ(1u, subninja.rules.size());
+  EXPECT_EQ(loaded.LookupRule("cp"), subninja.rules[0]);
+  ASSERT_EQ(1u, subninja.defaults.size());
+  EXPECT_EQ(loaded.LookupNode("out"), subninja.defaults[0].first);
+  EXPECT_EQ(1u, subninja.subninjas_end);
+
+  // A reload of the regenerated manifest copies the subninja from it.
+  reader.files["build.ninja"] += "build other: cat in\n";
+  State reloaded;
+  ManifestParser parser(&reloaded, &reader);
+  parser.SetHistory(&loaded_history, NULL);
+  ASSERT_TRUE(parser.Load("build.ninja", &err));
+  EXPECT_TRUE(loaded_history.subninjas_[0].used);
+  ASSERT_EQ(2u, reloaded.edges_.size());
+  EXPECT_EQ("cp in out", reloaded.edges_[0]->EvaluateCommand());
+  ASSERT_EQ(1u, reloaded.defaults_.size());
+}
+
+TEST_F(ManifestCacheTest, ModifiedManifestInvalidates) {
+  string err;
+  ASSERT_TRUE(ManifestCache::Save(kCachePath, files_, &disk_interface_,
+                                  state_, NULL, &err));
+
+  {
+    State state;
+    EXPECT_TRUE(ManifestCache::Load(kCachePath, "build.ninja",
+                                    &disk_interface_, &state, NULL, &err));
+  }
+  {
+    // A different toplevel manifest doesn't match.
+    State state;
+    EXPECT_FALSE(ManifestCache::Load(kCachePath, "other.ninja",
+                                     &disk_interface_, &state, NULL, &err));
+    EXPECT_EQ("", err);
+  }
+
+  CreateFile("sub.ninja", 1000001);
+  State state;
+  EXPECT_FALSE(ManifestCache::Load(kCachePath, "build.ninja",
+                                   &disk_interface_, &state, NULL, &err));
+  EXPECT_EQ("", err);
+}
+
+TEST_F(ManifestCacheTest, RecentManifestNotCached) {
+  // A manifest modified just now might be modified again within the same
+  // timestamp tick, so it must not be cached.
+  CreateFile("sub.ninja", time(NULL) + 10);
+
+  string err;
+  ASSERT_TRUE(ManifestCache::Save(kCachePath, files_, &disk_interface_,
+                                  state_, NULL, &err));
+  ASSERT_EQ("", err);
+  EXPECT_EQ(0, disk_interface_.Stat(kCachePath));
+}
+
+TEST_F(ManifestCacheTest, Corrupt) {
+  string err;
+  ASSERT_TRUE(ManifestCache::Save(kCachePath, files_, &disk_interface_,
+                                  state_, NULL, &err));
+
+  // Chop off the end of the image.
+  string contents;
+  ASSERT_EQ(0, ReadFile(kCachePath, &contents, &err));
+  FILE* f = fopen(kCachePath, "wb");
+  fwrite(contents.data(), 1, contents.size() - 4, f);
+  fclose(f);
+
+  State state;
+  EXPECT_FALSE(ManifestCache::Load(kCachePath, "build.ninja",
+                                   &disk_interface_, &state, NULL, &err));
+  EXPECT_EQ("manifest cache is corrupt", err);
+}
+
+}  // anonymous namespace
@@ -14,108 +14,311 @@
 
 #include "manifest_parser.h"
 
+#include <algorithm>
+
 #include <assert.h>
 #include <errno.h>
 #include <stdio.h>
 #include <string.h>
 
 #include "graph.h"
+#include "mapped_file.h"
 #include "metrics.h"
 #include "state.h"
+#include "thread_pool.h"
 #include "util.h"
 
-ManifestParser::ManifestParser(State* state, FileReader* file_reader)
-  : state_(state), file_reader_(file_reader) {
-  env_ = &state->bindings_;
+/// One statement of a manifest, lexed but not yet evaluated.
+struct ManifestParser::Statement {
+  Statement() : rule(NULL) { Reset(); }
+  ~Statement() { delete rule; }
+
+  void Reset() {
+    kind = Lexer::TEOF;
+    name.clear();
+    value.Clear();
+    paths.clear();
+    outs = implicit = order_only = 0;
+    bindings.clear();
+    delete rule;
+    rule = NULL;
+    pos = end = NULL;
+    path_pos.clear();
+  }
+
+  /// BUILD, RULE, DEFAULT, IDENT (a variable binding), INCLUDE, SUBNINJA,
+  /// or TEOF past the end of the file.
+  Lexer::Token kind;
+  /// The rule name of a build statement, or the variable a binding sets.
+  string name;
+  /// The value of a binding, or the path of an include or subninja.
+  EvalString value;
+  /// The outputs and then the inputs of a build statement, or the targets
+  /// of a default statement.
+  vector<EvalString> paths;
+  int outs, implicit, order_only;
+  /// The indented bindings of a build statement.
+  vector<pair<Symbol, EvalString> > bindings;
+  /// The rule a rule statement defines, until it is added to the State.
+  Rule* rule;
+
+  /// Where to report errors only found during evaluation: the rule name
+  /// of a build statement or the path of an include, the end of a build
+  /// statement, and each target of a default statement.
+  const char* pos;
+  const char* end;
+  vector<const char*> path_pos;
+
+ private:
+  Statement(const Statement&);
+  void operator=(const Statement&);
+};
+
+/// A manifest file being parsed.
+struct ManifestParser::File {
+  string path;
+  MappedFile contents;
+  Lexer lexer;
+  /// Plain paths of the include and subninja lines in the file.
+  vector<string> includes;
+
+  /// Fill in includes by scanning contents for lines that look like an
+  /// include or subninja of a path without $-escapes.  This doesn't
+  /// understand the full syntax, so it may find lines that are part of
+  /// some other statement, but prefetching those only wastes a read.
+  void ScanIncludes();
+
+  /// Prepare the lexer once the contents have been read.  The lexer
+  /// stops at the NUL padding that follows them.
+  void StartLexer() {
+    lexer.Start(path, contents.contents());
+  }
+};
+
+void ManifestParser::File::ScanIncludes() {
+  const char* p = contents.data();
+  const char* end = p + contents.size();
+  while (p < end) {
+    const char* eol = (const char*)memchr(p, '\n', end - p);
+    if (!eol)
+      eol = end;
+
+    const char* q = NULL;
+    if (eol - p > 8 && memcmp(p, "include ", 8) == 0)
+      q = p + 8;
+    else if (eol - p > 9 && memcmp(p, "subninja ", 9) == 0)
+      q = p + 9;
+    if (q) {
+      while (q < eol && *q == ' ')
+        ++q;
+      const char* start = q;
+      while (q < eol && !strchr("$ :|\r", *q))
+        ++q;
+      const char* path_end = q;
+      while (q < eol && *q == ' ')
+        ++q;
+      if (q == eol && path_end > start && eol != end)
+        includes.push_back(string(start, path_end - start));
+    }
+    p = eol + 1;
+  }
 }
-bool ManifestParser::Load(const string& filename, string* err) {
+
+/// Reads and lexes a file on the thread pool.
+struct ManifestParser::Prefetch : public ThreadPool::Task {
+  Prefetch(FileReader* file_reader, const string& path)
+      : file_reader(file_reader), loaded(false) {
+    file.path = path;
+  }
+  virtual ~Prefetch() {
+    for (vector<Statement*>::iterator i = statements.begin();
+         i != statements.end(); ++i) {
+      delete *i;
+    }
+  }
+
+  virtual void Run();
+
+  FileReader* file_reader;
+
+  File file;
+  bool loaded;
+  string read_err;
+  /// The statements up to the first syntax error, if any.
+  vector<Statement*> statements;
+  /// The syntax error, to be reported once the statements before it have
+  /// been evaluated.
+  string error;
+};
+
+void ManifestParser::Prefetch::Run() {
+  loaded = file_reader->LoadFile(file.path, &file.contents, &read_err);
+  if (!loaded)
+    return;
+  file.ScanIncludes();
+  file.StartLexer();
+  for (;;) {
+    Statement* stmt = new Statement;
+    if (!Lex(&file, stmt, &error) || stmt->kind == Lexer::TEOF) {
+      delete stmt;
+      break;
+    }
+    statements.push_back(stmt);
+  }
+}
+
+bool ManifestParser::FileReader::LoadFile(const string& path,
+                                          MappedFile* file, string* err) {
   string contents;
+  if (!ReadFile(path, &contents, err))
+    return false;
+  file->Assign(contents);
+  return true;
+}
+
+ManifestParser::ManifestParser(State* state, FileReader* file_reader,
+                               ThreadPool* pool)
+  : state_(state), file_reader_(file_reader), pool_(pool),
+    previous_(NULL), history_(NULL) {}
+
+ManifestParser::~ManifestParser() {
+  // Drop the prefetches nothing asked for, e.g. after an error.
+  for (map<string, Prefetch*>::iterator i = prefetches_.begin();
+       i != prefetches_.end(); ++i) {
+    if (!pool_->Cancel(i->second))
+      pool_->Wait(i->second);
+    delete i->second;
+  }
+}
+
+void ManifestParser::SetHistory(ManifestHistory* previous,
+                                ManifestHistory* history) {
+  previous_ = previous;
+  history_ = history;
+  previous_paths_.clear();
+  if (previous_) {
+    for (size_t i = 0; i < previous_->subninjas_.size(); ++i) {
+      previous_paths_.insert(make_pair(previous_->subninjas_[i].path, i));
+    }
+  }
+  if (history_) {
+    history_->state_ = state_;
+    history_->subninjas_.clear();
+  }
+}
+
+bool ManifestParser::Load(const string& filename, string* err) {
+  File file;
+  file.path = filename;
   string read_err;
-  if (!file_reader_->ReadFile(filename, &contents, &read_err)) {
+  if (!file_reader_->LoadFile(filename, &file.contents, &read_err)) {
     *err = "loading '" + filename + "': " + read_err;
     return false;
   }
-  contents.resize(contents.size() + 10);
-  return Parse(filename, contents, err);
+  return Parse(&file, &state_->bindings_, err);
+}
+
+bool ManifestParser::ParseTest(const string& input, string* err) {
+  File file;
+  file.path = "input";
+  file.contents.Assign(input);
+  return Parse(&file, &state_->bindings_, err);
+}
+
+bool ManifestParser::Parse(File* file, BindingEnv* env, string* err) {
+  METRIC_RECORD(".ninja parse");
+  AddFile(file->path, file->contents.contents());
+  if (pool_) {
+    file->ScanIncludes();
+    QueuePrefetches(*file);
+  }
+  file->StartLexer();
+
+  Statement stmt;
+  for (;;) {
+    if (!Lex(file, &stmt, err))
+      return false;
+    if (stmt.kind == Lexer::TEOF)
+      return true;
+    if (!ApplyStatement(file, &stmt, env, err))
+      return false;
+  }
+  return false;  // not reached
 }
 
-bool ManifestParser::Parse(const string& filename, const string& input,
+bool ManifestParser::Apply(Prefetch* prefetch, BindingEnv* env,
                            string* err) {
   METRIC_RECORD(".ninja parse");
-  lexer_.Start(filename, input);
+  AddFile(prefetch->file.path, prefetch->file.contents.contents());
+  for (vector<Statement*>::iterator i = prefetch->statements.begin();
+       i != prefetch->statements.end(); ++i) {
+    if (!ApplyStatement(&prefetch->file, *i, env, err))
+      return false;
+  }
+  if (!prefetch->error.empty()) {
+    *err = prefetch->error;
+    return false;
+  }
+  return true;
+}
 
+// static
+bool ManifestParser::Lex(File* file, Statement* stmt, string* err) {
+  Lexer* lexer = &file->lexer;
+  stmt->Reset();
   for (;;) {
-    Lexer::Token token = lexer_.ReadToken();
+    Lexer::Token token = lexer->ReadToken();
+    stmt->kind = token;
     switch (token) {
     case Lexer::BUILD:
-      if (!ParseEdge(err))
-        return false;
-      break;
+      return LexEdge(lexer, stmt, err);
     case Lexer::RULE:
-      if (!ParseRule(err))
-        return false;
-      break;
+      return LexRule(lexer, stmt, err);
     case Lexer::DEFAULT:
-      if (!ParseDefault(err))
-        return false;
-      break;
-    case Lexer::IDENT: {
-      lexer_.UnreadToken();
-      string name;
-      EvalString value;
-      if (!ParseLet(&name, &value, err))
-        return false;
-      env_->AddBinding(name, value.Evaluate(env_));
-      break;
-    }
+      return LexDefault(lexer, stmt, err);
+    case Lexer::IDENT:
+      lexer->UnreadToken();
+      return LexLet(lexer, &stmt->name, &stmt->value, err);
     case Lexer::INCLUDE:
-      if (!ParseFileInclude(false, err))
-        return false;
-      break;
     case Lexer::SUBNINJA:
-      if (!ParseFileInclude(true, err))
-        return false;
-      break;
-    case Lexer::ERROR: {
-      return lexer_.Error(lexer_.DescribeLastError(), err);
-    }
+      return LexFileInclude(lexer, stmt, err);
+    case Lexer::ERROR:
+      return lexer->Error(lexer->DescribeLastError(), err);
     case Lexer::TEOF:
       return true;
     case Lexer::NEWLINE:
       break;
     default:
-      return lexer_.Error(string("unexpected ") + Lexer::TokenName(token),
+      return lexer->Error(string("unexpected ") + Lexer::TokenName(token),
                           err);
     }
   }
   return false;  // not reached
 }
 
-bool ManifestParser::ParseRule(string* err) {
+// static
+bool ManifestParser::LexRule(Lexer* lexer, Statement* stmt, string* err) {
   string name;
-  if (!lexer_.ReadIdent(&name))
-    return lexer_.Error("expected rule name", err);
+  if (!lexer->ReadIdent(&name))
+    return lexer->Error("expected rule name", err);
 
-  if (!ExpectToken(Lexer::NEWLINE, err))
+  if (!ExpectToken(lexer, Lexer::NEWLINE, err))
     return false;
 
-  if (state_->LookupRule(name) != NULL) {
-    *err = "duplicate rule '" + name + "'";
-    return false;
-  }
-
-  Rule* rule = new Rule(name);  // XXX scoped_ptr
+  Rule* rule = stmt->rule = new Rule(name);
 
-  while (lexer_.PeekToken(Lexer::INDENT)) {
+  while (lexer->PeekToken(Lexer::INDENT)) {
     string key;
     EvalString value;
-    if (!ParseLet(&key, &value, err))
+    if (!LexLet(lexer, &key, &value, err))
       return false;
 
     if (key == "command") {
       rule->command_ = value;
     } else if (key == "depfile") {
       rule->depfile_ = value;
+    } else if (key == "deletedepfile") {
+      rule->delete_depfile_ = true;
     } else if (key == "description") {
       rule->description_ = value;
     } else if (key == "generator") {
@@ -129,200 +332,509 @@ bool ManifestParser::ParseRule(string* err) {
     } else {
       // Die on other keyvals for now; revisit if we want to add a
       // scope here.
-      return lexer_.Error("unexpected variable '" + key + "'", err);
+      return lexer->Error("unexpected variable '" + key + "'", err);
     }
   }
 
   if (rule->rspfile_.empty() != rule->rspfile_content_.empty())
-    return lexer_.Error("rspfile and rspfile_content need to be both specified", err);
+    return lexer->Error("rspfile and rspfile_content need to be both specified", err);
+
+  if (rule->delete_depfile_ && rule->depfile_.empty())
+    return lexer->Error("deletedepfile needs a depfile", err);
 
   if (rule->command_.empty())
-    return lexer_.Error("expected 'command =' line", err);
+    return lexer->Error("expected 'command =' line", err);
 
-  state_->AddRule(rule);
   return true;
 }
 
-bool ManifestParser::ParseLet(string* key, EvalString* value, string* err) {
-  if (!lexer_.ReadIdent(key))
+// static
+bool ManifestParser::LexLet(Lexer* lexer, string* key, EvalString* value,
+                            string* err) {
+  if (!lexer->ReadIdent(key))
     return false;
-  if (!ExpectToken(Lexer::EQUALS, err))
+  if (!ExpectToken(lexer, Lexer::EQUALS, err))
     return false;
-  if (!lexer_.ReadVarValue(value, err))
+  if (!lexer->ReadVarValue(value, err))
     return false;
   return true;
 }
 
-bool ManifestParser::ParseDefault(string* err) {
-  EvalString eval;
-  if (!lexer_.ReadPath(&eval, err))
+// static
+bool ManifestParser::LexDefault(Lexer* lexer, Statement* stmt, string* err) {
+  for (;;) {
+    stmt->paths.push_back(EvalString());
+    if (!lexer->ReadPath(&stmt->paths.back(), err))
+      return false;
+    if (stmt->paths.back().empty()) {
+      stmt->paths.pop_back();
+      break;
+    }
+    stmt->path_pos.push_back(lexer->last_token());
+  }
+  if (stmt->paths.empty())
+    return lexer->Error("expected target name", err);
+
+  if (!ExpectToken(lexer, Lexer::NEWLINE, err))
     return false;
-  if (eval.empty())
-    return lexer_.Error("expected target name", err);
 
-  do {
-    string path = eval.Evaluate(env_);
-    string path_err;
-    if (!CanonicalizePath(&path, &path_err))
-      return lexer_.Error(path_err, err);
-    if (!state_->AddDefault(path, &path_err))
-      return lexer_.Error(path_err, err);
+  return true;
+}
 
-    eval.Clear();
-    if (!lexer_.ReadPath(&eval, err))
+/// Read paths into \a paths up to the next delimiter, returning how many
+/// were read in \a count.
+static bool ReadPaths(Lexer* lexer, vector<EvalString>* paths, int* count,
+                      string* err) {
+  *count = 0;
+  for (;;) {
+    paths->push_back(EvalString());
+    if (!lexer->ReadPath(&paths->back(), err))
       return false;
-  } while (!eval.empty());
+    if (paths->back().empty()) {
+      paths->pop_back();
+      return true;
+    }
+    ++*count;
+  }
+}
 
-  if (!ExpectToken(Lexer::NEWLINE, err))
+// static
+bool ManifestParser::LexEdge(Lexer* lexer, Statement* stmt, string* err) {
+  if (!ReadPaths(lexer, &stmt->paths, &stmt->outs, err))
     return false;
+  if (stmt->outs == 0)
+    return lexer->Error("expected path", err);
 
-  return true;
-}
+  if (!ExpectToken(lexer, Lexer::COLON, err))
+    return false;
 
-bool ManifestParser::ParseEdge(string* err) {
-  vector<EvalString> ins, outs;
+  if (!lexer->ReadIdent(&stmt->name))
+    return lexer->Error("expected build command name", err);
+  stmt->pos = lexer->last_token();
+
+  // XXX should we require one path here?
+  int explicit_ins;
+  if (!ReadPaths(lexer, &stmt->paths, &explicit_ins, err))
+    return false;
+
+  // Add all implicit deps, counting how many as we go.
+  if (lexer->PeekToken(Lexer::PIPE)) {
+    if (!ReadPaths(lexer, &stmt->paths, &stmt->implicit, err))
+      return false;
+  }
 
-  {
-    EvalString out;
-    if (!lexer_.ReadPath(&out, err))
+  // Add all order-only deps, counting how many as we go.
+  if (lexer->PeekToken(Lexer::PIPE2)) {
+    if (!ReadPaths(lexer, &stmt->paths, &stmt->order_only, err))
       return false;
-    if (out.empty())
-      return lexer_.Error("expected path", err);
+  }
 
-    do {
-      outs.push_back(out);
+  if (!ExpectToken(lexer, Lexer::NEWLINE, err))
+    return false;
 
-      out.Clear();
-      if (!lexer_.ReadPath(&out, err))
-        return false;
-    } while (!out.empty());
+  string key;
+  while (lexer->PeekToken(Lexer::INDENT)) {
+    stmt->bindings.push_back(make_pair(Symbols::kNone, EvalString()));
+    if (!LexLet(lexer, &key, &stmt->bindings.back().second, err))
+      return false;
+    stmt->bindings.back().first = Symbols::Intern(key);
   }
+  stmt->end = lexer->last_token();
+
+  return true;
+}
 
-  if (!ExpectToken(Lexer::COLON, err))
+// static
+bool ManifestParser::LexFileInclude(Lexer* lexer, Statement* stmt,
+                                    string* err) {
+  // XXX this should use ReadPath!
+  if (!lexer->ReadPath(&stmt->value, err))
     return false;
+  stmt->pos = lexer->last_token();
 
-  string rule_name;
-  if (!lexer_.ReadIdent(&rule_name))
-    return lexer_.Error("expected build command name", err);
+  if (!ExpectToken(lexer, Lexer::NEWLINE, err))
+    return false;
 
-  const Rule* rule = state_->LookupRule(rule_name);
-  if (!rule)
-    return lexer_.Error("unknown build rule '" + rule_name + "'", err);
+  return true;
+}
 
-  for (;;) {
-    // XXX should we require one path here?
-    EvalString in;
-    if (!lexer_.ReadPath(&in, err))
-      return false;
-    if (in.empty())
-      break;
-    ins.push_back(in);
+// static
+bool ManifestParser::ExpectToken(Lexer* lexer, Lexer::Token expected,
+                                 string* err) {
+  Lexer::Token token = lexer->ReadToken();
+  if (token != expected) {
+    string message = string("expected ") + Lexer::TokenName(expected);
+    message += string(", got ") + Lexer::TokenName(token);
+    message += Lexer::TokenErrorHint(expected);
+    return lexer->Error(message, err);
   }
+  return true;
+}
 
-  // Add all implicit deps, counting how many as we go.
-  int implicit = 0;
-  if (lexer_.PeekToken(Lexer::PIPE)) {
-    for (;;) {
-      EvalString in;
-      if (!lexer_.ReadPath(&in, err))
-        return err;
-      if (in.empty())
-        break;
-      ins.push_back(in);
-      ++implicit;
-    }
+bool ManifestParser::ApplyStatement(File* file, Statement* stmt,
+                                    BindingEnv* env, string* err) {
+  switch (stmt->kind) {
+  case Lexer::BUILD:
+    return ApplyEdge(file, stmt, env, err);
+  case Lexer::RULE:
+    return ApplyRule(stmt, err);
+  case Lexer::DEFAULT:
+    return ApplyDefault(file, *stmt, env, err);
+  case Lexer::IDENT:
+    env->AddBinding(stmt->name, stmt->value.Evaluate(env));
+    return true;
+  case Lexer::INCLUDE:
+  case Lexer::SUBNINJA:
+    return ApplyFileInclude(file, *stmt, env, err);
+  default:
+    assert(false);
+    return false;
   }
+}
 
-  // Add all order-only deps, counting how many as we go.
-  int order_only = 0;
-  if (lexer_.PeekToken(Lexer::PIPE2)) {
-    for (;;) {
-      EvalString in;
-      if (!lexer_.ReadPath(&in, err))
-        return false;
-      if (in.empty())
-        break;
-      ins.push_back(in);
-      ++order_only;
-    }
+bool ManifestParser::ApplyRule(Statement* stmt, string* err) {
+  if (state_->LookupRule(stmt->rule->name()) != NULL) {
+    *err = "duplicate rule '" + stmt->rule->name() + "'";
+    return false;
   }
 
-  if (!ExpectToken(Lexer::NEWLINE, err))
-    return false;
+  state_->AddRule(stmt->rule);
+  if (history_)
+    rules_.push_back(stmt->rule);
+  stmt->rule = NULL;
+  return true;
+}
+
+bool ManifestParser::ApplyDefault(File* file, const Statement& stmt,
+                                  BindingEnv* env, string* err) {
+  for (size_t i = 0; i < stmt.paths.size(); ++i) {
+    string path = stmt.paths[i].Evaluate(env);
+    string path_err;
+    if (!CanonicalizePath(&path, &path_err))
+      return file->lexer.ErrorAt(stmt.path_pos[i], path_err, err);
+    if (!state_->AddDefault(path, &path_err))
+      return file->lexer.ErrorAt(stmt.path_pos[i], path_err, err);
+    if (history_)
+      defaults_.push_back(make_pair(state_->defaults_.back(),
+                                    state_->edges_.size()));
+  }
+  return true;
+}
+
+bool ManifestParser::ApplyEdge(File* file, Statement* stmt,
+                               BindingEnv* env, string* err) {
+  const Rule* rule = state_->LookupRule(stmt->name);
+  if (!rule) {
+    return file->lexer.ErrorAt(stmt->pos,
+                               "unknown build rule '" + stmt->name + "'", err);
+  }
 
   // Default to using outer env.
-  BindingEnv* env = env_;
+  BindingEnv* edge_env = env;
 
   // But create and fill a nested env if there are variables in scope.
-  if (lexer_.PeekToken(Lexer::INDENT)) {
-    // XXX scoped_ptr to handle error case.
-    env = new BindingEnv(env_);
-    do {
-      string key;
-      EvalString val;
-      if (!ParseLet(&key, &val, err))
-        return false;
-      env->AddBinding(key, val.Evaluate(env_));
-    } while (lexer_.PeekToken(Lexer::INDENT));
+  // Most edges' bindings are only needed if the edge is built, so they
+  // are evaluated on first use.
+  if (!stmt->bindings.empty()) {
+    edge_env = new BindingEnv(env);
+    for (vector<pair<Symbol, EvalString> >::iterator i =
+             stmt->bindings.begin(); i != stmt->bindings.end(); ++i) {
+      edge_env->AddLazyBinding(i->first, &i->second);
+    }
   }
 
   Edge* edge = state_->AddEdge(rule);
-  edge->env_ = env;
-  for (vector<EvalString>::iterator i = ins.begin(); i != ins.end(); ++i) {
-    string path = i->Evaluate(env);
+  edge->env_ = edge_env;
+  edge->inputs_.reserve(stmt->paths.size() - stmt->outs);
+  edge->outputs_.reserve(stmt->outs);
+  string path;
+  for (vector<EvalString>::const_iterator i =
+           stmt->paths.begin() + stmt->outs; i != stmt->paths.end(); ++i) {
+    path.clear();
+    i->Evaluate(edge_env, &path);
     string path_err;
     if (!CanonicalizePath(&path, &path_err))
-      return lexer_.Error(path_err, err);
+      return file->lexer.ErrorAt(stmt->end, path_err, err);
     state_->AddIn(edge, path);
   }
-  for (vector<EvalString>::iterator i = outs.begin(); i != outs.end(); ++i) {
-    string path = i->Evaluate(env);
+  for (vector<EvalString>::const_iterator i = stmt->paths.begin();
+       i != stmt->paths.begin() + stmt->outs; ++i) {
+    path.clear();
+    i->Evaluate(edge_env, &path);
     string path_err;
     if (!CanonicalizePath(&path, &path_err))
-      return lexer_.Error(path_err, err);
+      return file->lexer.ErrorAt(stmt->end, path_err, err);
     state_->AddOut(edge, path);
   }
-  edge->implicit_deps_ = implicit;
-  edge->order_only_deps_ = order_only;
+  edge->implicit_deps_ = stmt->implicit;
+  edge->order_only_deps_ = stmt->order_only;
 
   return true;
 }
 
-bool ManifestParser::ParseFileInclude(bool new_scope, string* err) {
-  // XXX this should use ReadPath!
-  EvalString eval;
-  if (!lexer_.ReadPath(&eval, err))
+bool ManifestParser::ApplyFileInclude(File* file, const Statement& stmt,
+                                      BindingEnv* env, string* err) {
+  string path = stmt.value.Evaluate(env);
+  if (stmt.kind == Lexer::INCLUDE)
+    return ParseInclude(file, stmt, path, env, err);
+
+  uint64_t scope_hash = 0;
+  if (previous_ || history_)
+    scope_hash = env->HashScope();
+  if (previous_ && CopySubninja(path, env, scope_hash))
+    return true;
+
+  BindingEnv* subninja_env = new BindingEnv(env);
+  if (!history_)
+    return ParseInclude(file, stmt, path, subninja_env, err);
+
+  size_t index = history_->subninjas_.size();
+  history_->subninjas_.push_back(ManifestHistory::Subninja());
+  size_t files_begin = files_.size();
+  size_t edges_begin = state_->edges_.size();
+  size_t rules_begin = rules_.size();
+  size_t defaults_begin = defaults_.size();
+  if (!ParseInclude(file, stmt, path, subninja_env, err))
     return false;
-  string path = eval.Evaluate(env_);
 
-  string contents;
-  string read_err;
-  if (!file_reader_->ReadFile(path, &contents, &read_err))
-    return lexer_.Error("loading '" + path + "': " + read_err, err);
+  ManifestHistory::Subninja* subninja = &history_->subninjas_[index];
+  subninja->path = path;
+  subninja->scope_hash = scope_hash;
+  for (size_t i = files_begin; i < files_.size(); ++i)
+    subninja->files.push_back(make_pair(files_[i], file_hashes_[i]));
+  subninja->env = subninja_env;
+  subninja->edges_begin = edges_begin;
+  subninja->edges_end = state_->edges_.size();
+  subninja->rules.assign(rules_.begin() + rules_begin, rules_.end());
+  for (size_t i = defaults_begin; i < defaults_.size(); ++i) {
+    subninja->defaults.push_back(make_pair(defaults_[i].first,
+                                           defaults_[i].second - edges_begin));
+  }
+  subninja->subninjas_end = history_->subninjas_.size();
+  return true;
+}
 
-  ManifestParser subparser(state_, file_reader_);
-  if (new_scope) {
-    subparser.env_ = new BindingEnv(env_);
-  } else {
-    subparser.env_ = env_;
+bool ManifestParser::ParseInclude(File* file, const Statement& stmt,
+                                  const string& path, BindingEnv* env,
+                                  string* err) {
+  map<string, Prefetch*>::iterator i = prefetches_.find(path);
+  if (i == prefetches_.end()) {
+    // Not prefetched, or not yet: read it here.
+    deque<string>::iterator queued = find(queued_.begin(), queued_.end(),
+                                          path);
+    if (queued != queued_.end())
+      queued_.erase(queued);
+
+    File include;
+    include.path = path;
+    string read_err;
+    if (!file_reader_->LoadFile(path, &include.contents, &read_err)) {
+      return file->lexer.ErrorAt(stmt.pos,
+                                 "loading '" + path + "': " + read_err, err);
+    }
+    return Parse(&include, env, err);
   }
 
-  if (!subparser.Parse(path, contents, err))
+  Prefetch* prefetch = i->second;
+  prefetches_.erase(i);
+  pool_->Wait(prefetch);
+  if (!prefetch->loaded) {
+    file->lexer.ErrorAt(stmt.pos,
+                        "loading '" + path + "': " + prefetch->read_err, err);
+    delete prefetch;
     return false;
+  }
+  QueuePrefetches(prefetch->file);
+  bool success = Apply(prefetch, env, err);
+  delete prefetch;
+  return success;
+}
+
+void ManifestParser::AddFile(const string& path, StringPiece contents) {
+  files_.push_back(path);
+  if (history_)
+    file_hashes_.push_back(MurmurHash64A(contents.str_, contents.len_));
+}
 
-  if (!ExpectToken(Lexer::NEWLINE, err))
+bool ManifestParser::FileUnchanged(const string& path, uint64_t hash) {
+  map<string, uint64_t>::iterator i = current_hashes_.find(path);
+  if (i == current_hashes_.end()) {
+    MappedFile contents;
+    string err;
+    if (!file_reader_->LoadFile(path, &contents, &err))
+      return false;
+    i = current_hashes_.insert(make_pair(
+        path, MurmurHash64A(contents.data(), contents.size()))).first;
+  }
+  return i->second == hash;
+}
+
+bool ManifestParser::CanCopySubninja(size_t index, uint64_t scope_hash,
+                                     map<const Rule*, const Rule*>* rules) {
+  const ManifestHistory::Subninja& old = previous_->subninjas_[index];
+  if (old.used || old.scope_hash != scope_hash)
     return false;
+  for (vector<pair<string, uint64_t> >::const_iterator i = old.files.begin();
+       i != old.files.end(); ++i) {
+    if (!FileUnchanged(i->first, i->second))
+      return false;
+  }
 
+  // Where parsing it would fail, on a rule defined twice, an unknown rule
+  // or an unknown default target, leave reporting the error to the parse.
+  rules->clear();
+  for (vector<const Rule*>::const_iterator i = old.rules.begin();
+       i != old.rules.end(); ++i) {
+    if (state_->LookupRule((*i)->name()))
+      return false;
+    (*rules)[*i] = *i;
+  }
+  const vector<Edge*>& edges = previous_->state_->edges_;
+  for (size_t e = old.edges_begin; e < old.edges_end; ++e) {
+    const Rule* rule = edges[e]->rule_;
+    if (rules->count(rule))
+      continue;
+    const Rule* current = state_->LookupRule(rule->name());
+    if (!current)
+      return false;
+    (*rules)[rule] = current;
+  }
+  for (vector<pair<Node*, size_t> >::const_iterator i = old.defaults.begin();
+       i != old.defaults.end(); ++i) {
+    Node* node = i->first;
+    if (state_->LookupNode(node->path()))
+      continue;
+    // Otherwise one of the edges before it must add it.
+    bool found = false;
+    for (size_t e = old.edges_begin; e < old.edges_begin + i->second; ++e) {
+      const Edge* edge = edges[e];
+      if (find(edge->inputs_.begin(), edge->inputs_.end(), node) !=
+              edge->inputs_.end() ||
+          find(edge->outputs_.begin(), edge->outputs_.end(), node) !=
+              edge->outputs_.end()) {
+        found = true;
+        break;
+      }
+    }
+    if (!found)
+      return false;
+  }
   return true;
 }
 
-bool ManifestParser::ExpectToken(Lexer::Token expected, string* err) {
-  Lexer::Token token = lexer_.ReadToken();
-  if (token != expected) {
-    string message = string("expected ") + Lexer::TokenName(expected);
-    message += string(", got ") + Lexer::TokenName(token);
-    message += Lexer::TokenErrorHint(expected);
-    return lexer_.Error(message, err);
+bool ManifestParser::CopySubninja(const string& path, BindingEnv* env,
+                                  uint64_t scope_hash) {
+  METRIC_RECORD(".ninja subninja copy");
+  map<const Rule*, const Rule*> rules;
+  pair<multimap<string, size_t>::iterator,
+       multimap<string, size_t>::iterator> candidates =
+      previous_paths_.equal_range(path);
+  multimap<string, size_t>::iterator candidate = candidates.first;
+  for (; candidate != candidates.second; ++candidate) {
+    if (CanCopySubninja(candidate->second, scope_hash, &rules))
+      break;
+  }
+  if (candidate == candidates.second)
+    return false;
+  size_t index = candidate->second;
+  const ManifestHistory::Subninja* old = &previous_->subninjas_[index];
+  State* previous_state = previous_->state_;
+
+  // Drop any read of it started ahead.
+  map<string, Prefetch*>::iterator prefetch = prefetches_.find(path);
+  if (prefetch != prefetches_.end()) {
+    if (!pool_->Cancel(prefetch->second))
+      pool_->Wait(prefetch->second);
+    delete prefetch->second;
+    prefetches_.erase(prefetch);
+  }
+  deque<string>::iterator queued = find(queued_.begin(), queued_.end(), path);
+  if (queued != queued_.end())
+    queued_.erase(queued);
+
+  old->env->Reparent(env);
+  for (vector<pair<string, uint64_t> >::const_iterator i = old->files.begin();
+       i != old->files.end(); ++i) {
+    files_.push_back(i->first);
+    if (history_)
+      file_hashes_.push_back(i->second);
+  }
+  for (vector<const Rule*>::const_iterator r = old->rules.begin();
+       r != old->rules.end(); ++r) {
+    previous_state->rules_.erase((*r)->name());
+    state_->AddRule(*r);
+    if (history_)
+      rules_.push_back(*r);
+  }
+
+  // Add the edges and defaults in their original order, so the State
+  // comes out as if the subninja had been parsed.
+  size_t edges_begin = state_->edges_.size();
+  vector<pair<Node*, size_t> >::const_iterator d = old->defaults.begin();
+  for (size_t e = old->edges_begin; ; ++e) {
+    for (; d != old->defaults.end() && d->second == e - old->edges_begin;
+         ++d) {
+      string err;
+      state_->AddDefault(d->first->path(), &err);
+      if (history_) {
+        defaults_.push_back(make_pair(state_->defaults_.back(),
+                                      state_->edges_.size()));
+      }
+    }
+    if (e == old->edges_end)
+      break;
+
+    const Edge* old_edge = previous_state->edges_[e];
+    Edge* edge = state_->AddEdge(rules[old_edge->rule_]);
+    edge->env_ = old_edge->env_;
+    edge->inputs_.reserve(old_edge->inputs_.size());
+    edge->outputs_.reserve(old_edge->outputs_.size());
+    for (vector<Node*>::const_iterator i = old_edge->inputs_.begin();
+         i != old_edge->inputs_.end(); ++i) {
+      state_->AddIn(edge, (*i)->path());
+    }
+    for (vector<Node*>::const_iterator i = old_edge->outputs_.begin();
+         i != old_edge->outputs_.end(); ++i) {
+      state_->AddOut(edge, (*i)->path());
+    }
+    edge->implicit_deps_ = old_edge->implicit_deps_;
+    edge->order_only_deps_ = old_edge->order_only_deps_;
+  }
+
+  // The subninjas nested in it came along too.
+  for (size_t i = index; i < old->subninjas_end; ++i) {
+    ManifestHistory::Subninja* nested = &previous_->subninjas_[i];
+    nested->used = true;
+    if (!history_)
+      continue;
+    history_->subninjas_.push_back(*nested);
+    ManifestHistory::Subninja* copy = &history_->subninjas_.back();
+    copy->used = false;
+    copy->edges_begin += edges_begin - old->edges_begin;
+    copy->edges_end += edges_begin - old->edges_begin;
+    copy->subninjas_end += history_->subninjas_.size() - 1 - i;
+    for (vector<pair<Node*, size_t> >::iterator n = copy->defaults.begin();
+         n != copy->defaults.end(); ++n) {
+      n->first = state_->LookupNode(n->first->path());
+    }
   }
   return true;
 }
+
+void ManifestParser::QueuePrefetches(const File& file) {
+  queued_.insert(queued_.begin(), file.includes.begin(), file.includes.end());
+
+  // Keep enough files in flight for every worker to have the next one
+  // to lex, without lexing so far ahead that the statements of many
+  // files are held in memory at once.
+  size_t max_prefetches = 4 * pool_->size();
+  while (prefetches_.size() < max_prefetches && !queued_.empty()) {
+    string path = queued_.front();
+    queued_.pop_front();
+    if (prefetches_.count(path))
+      continue;
+    Prefetch* prefetch = new Prefetch(file_reader_, path);
+    prefetches_.insert(make_pair(path, prefetch));
+    pool_->Post(prefetch);
+  }
+}
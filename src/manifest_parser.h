@@ -15,6 +15,8 @@
 #ifndef NINJA_MANIFEST_PARSER_H_
 #define NINJA_MANIFEST_PARSER_H_
 
+#include <deque>
+#include <map>
 #include <string>
 #include <vector>
 #include <limits>
@@ -23,49 +25,183 @@ using namespace std;
 
 #include "lexer.h"
 #include "string_piece.h"
+#include "util.h"  // uint64_t
 
 struct BindingEnv;
 struct EvalString;
+struct MappedFile;
+struct Node;
+struct Rule;
 struct State;
+struct ThreadPool;
+
+/// What each subninja statement of one load added to its State, so that
+/// a load of the manifest after it was regenerated can copy the
+/// subninjas that didn't change instead of parsing them again.
+///
+/// A subninja is copied if the files it read (itself and whatever it
+/// includes) have the same contents and the variables in scope at its
+/// subninja statement have the same values, as parsing it again would
+/// then add the same rules, edges and defaults.  The copy shares the
+/// scopes and rules of the earlier load, which are never freed, and
+/// reads its edges, so the State the history describes must outlive any
+/// load that copies from it.
+struct ManifestHistory {
+  ManifestHistory() : state_(NULL) {}
+
+  struct Subninja {
+    Subninja() : scope_hash(0), env(NULL), edges_begin(0), edges_end(0),
+                 subninjas_end(0), used(false) {}
+
+    string path;
+    /// BindingEnv::HashScope() of the scope of the subninja statement.
+    uint64_t scope_hash;
+    /// The files read, the subninja itself first, with hashes of their
+    /// contents.
+    vector<pair<string, uint64_t> > files;
+    /// The scope the subninja's statements were evaluated in.
+    BindingEnv* env;
+    /// What was added to the State: state_->edges_[edges_begin,
+    /// edges_end), the rules defined, and the default targets, each with
+    /// how many of the edges came before it.
+    size_t edges_begin, edges_end;
+    vector<const Rule*> rules;
+    vector<pair<Node*, size_t> > defaults;
+    /// subninjas_[i + 1, subninjas_end) were nested in this one, i.
+    size_t subninjas_end;
+    /// Whether a later load copied this subninja.
+    bool used;
+  };
+
+  /// The State described.  Copying a subninja into a new State moves
+  /// its scope and rules out of this one.
+  State* state_;
+  /// In the order of their subninja statements.
+  vector<Subninja> subninjas_;
+};
 
 /// Parses .ninja files.
+///
+/// Each file is parsed in two steps: lexing it into Statements, which
+/// only needs its text, and then evaluating those in order against the
+/// current scope to add rules, bindings and edges to the State.  Given a
+/// ThreadPool, files named by include and subninja statements are read
+/// and lexed on it while the files including them are still being
+/// evaluated, so only the evaluation is serial and the State comes out
+/// the same as when parsing one file at a time.
 struct ManifestParser {
   struct FileReader {
     virtual ~FileReader() {}
+    /// With a thread pool, these may be called from any thread.
     virtual bool ReadFile(const string& path, string* content, string* err) = 0;
+    /// Load \a path for parsing.  Defaults to a copy of ReadFile()'s
+    /// result; override to map the file instead.
+    virtual bool LoadFile(const string& path, MappedFile* file, string* err);
   };
 
-  ManifestParser(State* state, FileReader* file_reader);
+  ManifestParser(State* state, FileReader* file_reader,
+                 ThreadPool* pool = NULL);
+  ~ManifestParser();
 
   /// Load and parse a file.
   bool Load(const string& filename, string* err);
 
   /// Parse a text string of input.  Used by tests.
-  bool ParseTest(const string& input, string* err) {
-    return Parse("input", input, err);
-  }
+  bool ParseTest(const string& input, string* err);
+
+  /// Record what each subninja adds to the State into \a history, and
+  /// copy the subninjas \a previous recorded that didn't change instead
+  /// of parsing them.  Either may be NULL.
+  void SetHistory(ManifestHistory* previous, ManifestHistory* history);
+
+  /// The files parsed so far, in the order they were loaded.
+  const vector<string>& files() const { return files_; }
 
 private:
-  /// Parse a file, given its contents as a string.
-  bool Parse(const string& filename, const string& input, string* err);
+  struct Statement;
+  struct File;
+  struct Prefetch;
+
+  /// Lex and evaluate \a file, whose contents have been read, one
+  /// statement at a time.
+  bool Parse(File* file, BindingEnv* env, string* err);
+  /// Evaluate a file lexed by a Prefetch.
+  bool Apply(Prefetch* prefetch, BindingEnv* env, string* err);
 
-  /// Parse various statement types.
-  bool ParseRule(string* err);
-  bool ParseLet(string* key, EvalString* val, string* err);
-  bool ParseEdge(string* err);
-  bool ParseDefault(string* err);
+  /// Lex the next statement of \a file into \a stmt.  Sets the statement
+  /// kind to Lexer::TEOF at the end of the file.
+  static bool Lex(File* file, Statement* stmt, string* err);
 
-  /// Parse either a 'subninja' or 'include' line.
-  bool ParseFileInclude(bool new_scope, string* err);
+  /// Lex various statement types.
+  static bool LexRule(Lexer* lexer, Statement* stmt, string* err);
+  static bool LexLet(Lexer* lexer, string* key, EvalString* val,
+                     string* err);
+  static bool LexEdge(Lexer* lexer, Statement* stmt, string* err);
+  static bool LexDefault(Lexer* lexer, Statement* stmt, string* err);
+  static bool LexFileInclude(Lexer* lexer, Statement* stmt, string* err);
 
   /// If the next token is not \a expected, produce an error string
   /// saying "expectd foo, got bar".
-  bool ExpectToken(Lexer::Token expected, string* err);
+  static bool ExpectToken(Lexer* lexer, Lexer::Token expected, string* err);
+
+  /// Evaluate various statement types.
+  bool ApplyStatement(File* file, Statement* stmt, BindingEnv* env,
+                      string* err);
+  bool ApplyRule(Statement* stmt, string* err);
+  bool ApplyEdge(File* file, Statement* stmt, BindingEnv* env,
+                 string* err);
+  bool ApplyDefault(File* file, const Statement& stmt, BindingEnv* env,
+                    string* err);
+  bool ApplyFileInclude(File* file, const Statement& stmt, BindingEnv* env,
+                        string* err);
+
+  /// Queue the include and subninja paths found in \a file for
+  /// prefetching, ahead of anything queued before, and start as many
+  /// prefetches as the pool has room for.
+  void QueuePrefetches(const File& file);
+
+  /// Note that \a file was read, for the history.
+  void AddFile(const string& path, StringPiece contents);
+
+  /// Copy the subninja at \a path from previous_ into \a env's scope, if
+  /// it is unchanged there.  Returns false if it must be parsed instead.
+  bool CopySubninja(const string& path, BindingEnv* env,
+                    uint64_t scope_hash);
+  /// Whether subninja \a index of previous_ can be copied into a scope
+  /// hashing to \a scope_hash: its files are unchanged, and its rules and
+  /// defaults would resolve as they would when parsing it.  Fills in
+  /// \a rules with the rule of this State for each rule its edges use.
+  bool CanCopySubninja(size_t index, uint64_t scope_hash,
+                       map<const Rule*, const Rule*>* rules);
+  /// Whether \a path still has contents hashing to \a hash.
+  bool FileUnchanged(const string& path, uint64_t hash);
+  /// Load the include or subninja \a path of \a stmt and evaluate it in
+  /// \a env.
+  bool ParseInclude(File* file, const Statement& stmt, const string& path,
+                    BindingEnv* env, string* err);
 
   State* state_;
-  BindingEnv* env_;
   FileReader* file_reader_;
-  Lexer lexer_;
+  ThreadPool* pool_;
+  vector<string> files_;
+
+  /// Started prefetches, by path.
+  map<string, Prefetch*> prefetches_;
+  /// Paths to prefetch once earlier prefetches are used up.
+  deque<string> queued_;
+
+  ManifestHistory* previous_;
+  ManifestHistory* history_;
+  /// previous_'s subninjas by path.
+  multimap<string, size_t> previous_paths_;
+  /// With a history_: the hash of each of files_, the rules defined so
+  /// far, and the defaults added so far with how many edges there were
+  /// at the time.
+  vector<uint64_t> file_hashes_;
+  vector<const Rule*> rules_;
+  vector<pair<Node*, size_t> > defaults_;
+  /// The current hashes of files checked for CopySubninja().
+  map<string, uint64_t> current_hashes_;
 };
 
 #endif  // NINJA_MANIFEST_PARSER_H_
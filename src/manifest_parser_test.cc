@@ -18,6 +18,7 @@
 
 #include "graph.h"
 #include "state.h"
+#include "thread_pool.h"
 
 struct ParserTest : public testing::Test,
                     public ManifestParser::FileReader {
@@ -28,6 +29,16 @@ struct ParserTest : public testing::Test,
     ASSERT_EQ("", err);
   }
 
+  /// Load build.ninja into \a state with the given histories.
+  void LoadWithHistory(State* state, ManifestHistory* previous,
+                       ManifestHistory* history) {
+    ManifestParser parser(state, this);
+    parser.SetHistory(previous, history);
+    string err;
+    ASSERT_TRUE(parser.Load("build.ninja", &err)) << err;
+    ASSERT_EQ("", err);
+  }
+
   virtual bool ReadFile(const string& path, string* content, string* err) {
     files_read_.push_back(path);
     map<string, string>::iterator i = files_.find(path);
@@ -70,6 +81,7 @@ TEST_F(ParserTest, RuleAttributes) {
 "rule cat\n"
 "  command = a\n"
 "  depfile = a\n"
+"  deletedepfile = a\n"
 "  description = a\n"
 "  generator = a\n"
 "  restat = a\n"
@@ -406,6 +418,17 @@ TEST_F(ParserTest, Errors) {
     EXPECT_EQ("input:2: expected 'command =' line\n", err);
   }
 
+  {
+    State state;
+    ManifestParser parser(&state, NULL);
+    string err;
+    EXPECT_FALSE(parser.ParseTest("rule cat\n"
+                                  "  command = cat\n"
+                                  "  deletedepfile = 1\n",
+                                  &err));
+    EXPECT_EQ("input:4: deletedepfile needs a depfile\n", err);
+  }
+
   {
     State state;
     ManifestParser parser(&state, NULL);
@@ -617,6 +640,195 @@ TEST_F(ParserTest, SubNinja) {
   EXPECT_EQ("varref outer", state.edges_[2]->EvaluateCommand());
 }
 
+TEST_F(ParserTest, CopyUnchangedSubninjas) {
+  files_["build.ninja"] =
+"rule cat\n"
+"  command = cat $flags $in > $out\n"
+"flags = -a\n"
+"subninja a.ninja\n"
+"subninja b.ninja\n"
+"build top: cat a_out b_out\n";
+  files_["a.ninja"] =
+"rule cp\n"
+"  command = cp $flags $in $out\n"
+"build a_out: cp a_in\n"
+"  flags = $flags -a\n"
+"default a_out\n";
+  files_["b.ninja"] = "build b_out: cat b_in\n";
+  ManifestHistory history;
+  ASSERT_NO_FATAL_FAILURE(LoadWithHistory(&state, NULL, &history));
+  ASSERT_EQ(2u, history.subninjas_.size());
+
+  // The generator rewrites the toplevel file and b.ninja.
+  files_["build.ninja"] += "build extra: cat top\n";
+  files_["b.ninja"] = "build b_out: cat b_in2\n";
+  State state2;
+  ManifestHistory history2;
+  ASSERT_NO_FATAL_FAILURE(LoadWithHistory(&state2, &history, &history2));
+
+  // a.ninja is copied, with the scopes of the first load.
+  EXPECT_TRUE(history.subninjas_[0].used);
+  EXPECT_FALSE(history.subninjas_[1].used);
+  ASSERT_EQ(4u, state2.edges_.size());
+  EXPECT_EQ(state.edges_[0]->env_, state2.edges_[0]->env_);
+  EXPECT_EQ("cp -a -a a_in a_out", state2.edges_[0]->EvaluateCommand());
+  EXPECT_EQ(state2.edges_[0], state2.LookupNode("a_out")->in_edge());
+  EXPECT_TRUE(state2.LookupRule("cp"));
+  ASSERT_EQ(1u, state2.defaults_.size());
+  EXPECT_EQ(state2.LookupNode("a_out"), state2.defaults_[0]);
+
+  // b.ninja is parsed again.
+  EXPECT_EQ("cat -a b_in2 > b_out", state2.edges_[1]->EvaluateCommand());
+  EXPECT_EQ("cat -a a_out b_out > top", state2.edges_[2]->EvaluateCommand());
+
+  // Both are recorded for the next load.
+  ASSERT_EQ(2u, history2.subninjas_.size());
+  EXPECT_EQ("a.ninja", history2.subninjas_[0].path);
+  EXPECT_EQ(0u, history2.subninjas_[0].edges_begin);
+  EXPECT_EQ(1u, history2.subninjas_[0].edges_end);
+  EXPECT_EQ(state2.LookupNode("a_out"),
+            history2.subninjas_[0].defaults[0].first);
+  EXPECT_EQ("b.ninja", history2.subninjas_[1].path);
+}
+
+TEST_F(ParserTest, CopiedSubninjaOutlivesPreviousState) {
+  files_["build.ninja"] =
+"flags = -a\n"
+"subninja a.ninja\n"
+"subninja b.ninja\n";
+  files_["a.ninja"] =
+"rule cp\n"
+"  command = cp $flags $in $out\n"
+"build a_out: cp a_in\n"
+"  flags = $flags -a\n";
+  files_["b.ninja"] =
+"rule cat\n"
+"  command = cat $in > $out\n"
+"build b_out: cat b_in\n";
+  State* state1 = new State;
+  ManifestHistory history;
+  ASSERT_NO_FATAL_FAILURE(LoadWithHistory(state1, NULL, &history));
+
+  // The new state takes over the scope and rule of the copied a.ninja,
+  // and the ones left behind go with the state before.
+  files_["b.ninja"] = "";
+  State state2;
+  ASSERT_NO_FATAL_FAILURE(LoadWithHistory(&state2, &history, NULL));
+  EXPECT_TRUE(history.subninjas_[0].used);
+  EXPECT_FALSE(state1->LookupRule("cp"));
+  EXPECT_TRUE(state1->LookupRule("cat"));
+  delete state1;
+
+  ASSERT_EQ(1u, state2.edges_.size());
+  EXPECT_EQ("cp", state2.edges_[0]->rule().name());
+  EXPECT_EQ("cp -a -a a_in a_out", state2.edges_[0]->EvaluateCommand());
+}
+
+TEST_F(ParserTest, ReparseSubninjaInChangedScope) {
+  files_["build.ninja"] =
+"rule cat\n"
+"  command = cat $flags $in > $out\n"
+"flags = -a\n"
+"subninja a.ninja\n";
+  files_["a.ninja"] = "build out: cat in\n";
+  ManifestHistory history;
+  ASSERT_NO_FATAL_FAILURE(LoadWithHistory(&state, NULL, &history));
+
+  files_["build.ninja"] =
+"rule cat\n"
+"  command = cat $flags $in > $out\n"
+"flags = -b\n"
+"subninja a.ninja\n";
+  State state2;
+  ASSERT_NO_FATAL_FAILURE(LoadWithHistory(&state2, &history, NULL));
+  EXPECT_FALSE(history.subninjas_[0].used);
+  ASSERT_EQ(1u, state2.edges_.size());
+  EXPECT_EQ("cat -b in > out", state2.edges_[0]->EvaluateCommand());
+}
+
+TEST_F(ParserTest, CopyNestedSubninja) {
+  files_["build.ninja"] =
+"rule cat\n"
+"  command = cat $in > $out\n"
+"subninja outer.ninja\n";
+  files_["outer.ninja"] =
+"build outer: cat in\n"
+"subninja inner.ninja\n";
+  files_["inner.ninja"] = "build inner: cat in\n";
+  ManifestHistory history;
+  ASSERT_NO_FATAL_FAILURE(LoadWithHistory(&state, NULL, &history));
+  ASSERT_EQ(2u, history.subninjas_.size());
+  EXPECT_EQ(2u, history.subninjas_[0].subninjas_end);
+
+  // Only the outer file changes: the inner one is copied into it.
+  files_["outer.ninja"] =
+"build outer2: cat in\n"
+"subninja inner.ninja\n";
+  State state2;
+  ManifestHistory history2;
+  ASSERT_NO_FATAL_FAILURE(LoadWithHistory(&state2, &history, &history2));
+  EXPECT_FALSE(history.subninjas_[0].used);
+  EXPECT_TRUE(history.subninjas_[1].used);
+  ASSERT_EQ(2u, state2.edges_.size());
+  EXPECT_TRUE(state2.LookupNode("outer2"));
+  EXPECT_EQ("cat in > inner", state2.edges_[1]->EvaluateCommand());
+
+  // A third load with nothing changed copies the outer file whole.
+  State state3;
+  ASSERT_NO_FATAL_FAILURE(LoadWithHistory(&state3, &history2, NULL));
+  EXPECT_TRUE(history2.subninjas_[0].used);
+  EXPECT_TRUE(history2.subninjas_[1].used);
+  ASSERT_EQ(2u, state3.edges_.size());
+  EXPECT_EQ("cat in > inner", state3.edges_[1]->EvaluateCommand());
+}
+
+TEST_F(ParserTest, LazyEdgeBindings) {
+  // Edge bindings are evaluated when first used, but must still see the
+  // variables as they were where the edge was defined.
+  files_["test.ninja"] =
+    "build inner: cat in\n"
+    "  flags = $flags -inner\n";
+  ASSERT_NO_FATAL_FAILURE(AssertParse(
+"rule cat\n"
+"  command = cat $flags $in > $out\n"
+"flags = -a\n"
+"build out: cat in\n"
+"  flags = $flags -b\n"
+"  flags = $flags -c\n"
+"subninja test.ninja\n"
+"flags = -d\n"
+"build out2: cat in\n"
+"  flags = $flags -e\n"));
+
+  ASSERT_EQ(3u, state.edges_.size());
+  EXPECT_EQ("cat -a -inner in > inner", state.edges_[1]->EvaluateCommand());
+  EXPECT_EQ("cat -a -c in > out", state.edges_[0]->EvaluateCommand());
+  EXPECT_EQ("cat -d -e in > out2", state.edges_[2]->EvaluateCommand());
+}
+
+TEST_F(ParserTest, LazyEdgeBindingsRebound) {
+  // Binding a variable only evaluates the edge bindings that refer to it,
+  // but each still sees the values from where its edge was defined.
+  ASSERT_NO_FATAL_FAILURE(AssertParse(
+"rule cat\n"
+"  command = cat $flags $in > $out\n"
+"a = 1\n"
+"b = 1\n"
+"build out: cat in\n"
+"  flags = $a $b\n"
+"build out2: cat in\n"
+"  flags = $b\n"
+"a = 2\n"
+"b = 2\n"
+"build out3: cat in\n"
+"  flags = $a $b\n"));
+
+  ASSERT_EQ(3u, state.edges_.size());
+  EXPECT_EQ("cat 1 1 in > out", state.edges_[0]->EvaluateCommand());
+  EXPECT_EQ("cat 1 in > out2", state.edges_[1]->EvaluateCommand());
+  EXPECT_EQ("cat 2 2 in > out3", state.edges_[2]->EvaluateCommand());
+}
+
 TEST_F(ParserTest, MissingSubNinja) {
   ManifestParser parser(&state, this);
   string err;
@@ -638,6 +850,124 @@ TEST_F(ParserTest, Include) {
   EXPECT_EQ("inner", state.bindings_.LookupVariable("var"));
 }
 
+namespace {
+
+/// A FileReader that is safe to use from several threads.
+struct ConstFileReader : public ManifestParser::FileReader {
+  explicit ConstFileReader(const map<string, string>& files) : files_(files) {}
+  virtual bool ReadFile(const string& path, string* content, string* err) {
+    map<string, string>::const_iterator i = files_.find(path);
+    if (i == files_.end()) {
+      *err = "No such file or directory";
+      return false;
+    }
+    *content = i->second;
+    return true;
+  }
+  const map<string, string>& files_;
+};
+
+}  // anonymous namespace
+
+TEST_F(ParserTest, ParallelSubNinja) {
+  // Subninjas and includes (some nested, one used twice, one with a
+  // computed path) parsed on a thread pool must give the same graph, in
+  // the same order, as parsing them one at a time.
+  string top = "rule cc\n  command = cc $in -o $out $flags\nflags = -top\n";
+  for (int i = 0; i < 20; ++i) {
+    char name[32];
+    sprintf(name, "dir%d.ninja", i);
+    top += string("subninja ") + name + "\n";
+    string& sub = files_[name];
+    sprintf(name, "%d", i);
+    sub = string("flags = -d") + name + "\n";
+    for (int j = 0; j < 10; ++j) {
+      char edge[64];
+      sprintf(edge, "build out%d_%d: cc in%d_%d\n", i, j, i, j);
+      sub += edge;
+    }
+    if (i % 5 == 0) {
+      sub += string("subninja nested") + name + ".ninja\n";
+      files_[string("nested") + name + ".ninja"] =
+          string("build nested") + name + ": cc $flags\n";
+    }
+    top += "build top" + string(name) + ": cc $flags\n";
+  }
+  top += "include flags.ninja\nbuild late1: cc\n";
+  top += "include flags.ninja\nbuild late2: cc\n";
+  files_["flags.ninja"] = "flags = $flags -more\n";
+  top += "n = 7\nsubninja extra$n.ninja\n";
+  files_["extra7.ninja"] = "build extra: cc $flags\n";
+  files_["build.ninja"] = top;
+
+  State serial_state;
+  {
+    ManifestParser parser(&serial_state, this);
+    string err;
+    ASSERT_TRUE(parser.Load("build.ninja", &err)) << err;
+  }
+
+  State state;
+  ConstFileReader reader(files_);
+  ThreadPool pool(4);
+  ManifestParser parser(&state, &reader, &pool);
+  string err;
+  ASSERT_TRUE(parser.Load("build.ninja", &err)) << err;
+  EXPECT_EQ("build.ninja", parser.files()[0]);
+  EXPECT_EQ(28u, parser.files().size());
+
+  ASSERT_EQ(serial_state.edges_.size(), state.edges_.size());
+  for (size_t i = 0; i < state.edges_.size(); ++i) {
+    EXPECT_EQ(serial_state.edges_[i]->EvaluateCommand(),
+              state.edges_[i]->EvaluateCommand());
+  }
+  EXPECT_EQ("cc -d10 -o nested10 -d10",
+            state.LookupNode("nested10")->in_edge()->EvaluateCommand());
+  EXPECT_EQ("cc  -o late2 -top -more -more",
+            state.LookupNode("late2")->in_edge()->EvaluateCommand());
+}
+
+TEST_F(ParserTest, ParallelSubNinjaErrors) {
+  files_["a.ninja"] = "build x: cc\n";
+  files_["b.ninja"] = "build y: nosuchrule\n";
+  files_["c.ninja"] = "build z: cc\nfoo\n";
+  const char* kTop = "rule cc\n  command = cc\nsubninja a.ninja\n";
+  ConstFileReader reader(files_);
+  ThreadPool pool(4);
+  {
+    State state;
+    ManifestParser parser(&state, &reader, &pool);
+    string err;
+    EXPECT_FALSE(parser.ParseTest(string(kTop) + "subninja b.ninja\n"
+                                  "subninja c.ninja\n", &err));
+    EXPECT_EQ("b.ninja:1: unknown build rule 'nosuchrule'\n"
+              "build y: nosuchrule\n"
+              "       ^ near here", err);
+  }
+  {
+    State state;
+    ManifestParser parser(&state, &reader, &pool);
+    string err;
+    EXPECT_FALSE(parser.ParseTest(string(kTop) + "subninja c.ninja\n",
+                                  &err));
+    EXPECT_EQ("c.ninja:2: expected '=', got newline\n"
+              "foo\n"
+              "   ^ near here", err);
+    // The statements before the error were still evaluated.
+    EXPECT_TRUE(state.LookupNode("z"));
+  }
+  {
+    State state;
+    ManifestParser parser(&state, &reader, &pool);
+    string err;
+    EXPECT_FALSE(parser.ParseTest(string(kTop) + "subninja d.ninja\n",
+                                  &err));
+    EXPECT_EQ("input:4: loading 'd.ninja': No such file or directory\n"
+              "subninja d.ninja\n"
+              "                ^ near here", err);
+  }
+}
+
 TEST_F(ParserTest, Implicit) {
   ASSERT_NO_FATAL_FAILURE(AssertParse(
 "rule cat\n"
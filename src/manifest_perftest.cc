@@ -0,0 +1,359 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Measures loading a manifest into a State: lexing, parsing and building
+// the graph.  By default it first writes out a synthetic manifest shaped
+// like Chromium's -- a small top-level file with the toolchain rules and
+// one subninja per component, each compiling its sources and archiving
+// the objects -- sized by the command line flags.
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <sys/resource.h>
+#include <unistd.h>
+#endif
+
+#include "manifest_parser.h"
+#include "mapped_file.h"
+#include "metrics.h"
+#include "state.h"
+#include "util.h"
+
+namespace {
+
+/// Calls to operator new, and the bytes they asked for, so far.
+size_t g_allocations;
+size_t g_allocated_bytes;
+
+}  // anonymous namespace
+
+void* operator new(size_t size) {
+  ++g_allocations;
+  g_allocated_bytes += size;
+  void* p = malloc(size ? size : 1);
+  if (!p)
+    Fatal("out of memory");
+  return p;
+}
+
+void* operator new[](size_t size) {
+  return operator new(size);
+}
+
+void operator delete(void* p) throw() {
+  free(p);
+}
+
+void operator delete[](void* p) throw() {
+  free(p);
+}
+
+void operator delete(void* p, size_t) throw() {
+  operator delete(p);
+}
+
+void operator delete[](void* p, size_t) throw() {
+  operator delete[](p);
+}
+
+namespace {
+
+const char kManifest[] = "manifest_perftest.ninja";
+
+struct Options {
+  Options() : edges(100000), fan_in(10), subninjas(100), depth(1),
+              variables(2), rebind_every(0), repetitions(5), keep(false) {}
+
+  /// Compile edges in total, spread over the subninjas.
+  int edges;
+  /// Inputs per compile edge: its source plus implicit headers.
+  int fan_in;
+  /// Number of subninja files, one per component.
+  int subninjas;
+  /// How deeply subninjas nest: with a depth of 3, every component's
+  /// file is pulled in by a chain of three subninja statements.
+  int depth;
+  /// Bindings per compile edge.
+  int variables;
+  /// Rebind a file-level variable after every this many compile edges, as
+  /// generators that set per-target variables before each target's
+  /// builds do; 0 for never.
+  int rebind_every;
+  int repetitions;
+  /// Whether to leave the generated files behind.
+  bool keep;
+};
+
+string SubninjaPath(int i) {
+  char buf[64];
+  sprintf(buf, "manifest_perftest-%d.ninja", i);
+  return buf;
+}
+
+bool WriteFile(const string& path, const string& contents, string* err) {
+  FILE* f = fopen(path.c_str(), "wb");
+  if (!f) {
+    *err = path + ": " + strerror(errno);
+    return false;
+  }
+  fwrite(contents.data(), 1, contents.size(), f);
+  fclose(f);
+  return true;
+}
+
+/// Write the synthetic manifest described by \a options to kManifest and
+/// the subninja files it includes.
+bool WriteManifest(const Options& options, string* err) {
+  string top =
+      "cc = clang\n"
+      "cxx = clang++\n"
+      "cflags = -fno-strict-aliasing -fstack-protector --param=ssp-buffer-"
+      "size=4 -pipe -fPIC -Wall -Wno-unused-parameter -O2 -g\n"
+      "cflags_cc = -fno-exceptions -fno-rtti -fno-threadsafe-statics "
+      "-fvisibility-inlines-hidden\n"
+      "\n"
+      "rule cxx\n"
+      "  command = $cxx -MMD -MF $out.d $defines $includes $cflags "
+      "$cflags_cc -c $in -o $out\n"
+      "  description = CXX $out\n"
+      "  depfile = $out.d\n"
+      "rule alink\n"
+      "  command = rm -f $out && ar rcs $out @$out.rsp\n"
+      "  description = AR $out\n"
+      "  rspfile = $out.rsp\n"
+      "  rspfile_content = $in\n"
+      "\n";
+
+  int subninjas = options.subninjas;
+  int depth = options.depth;
+  for (int i = 0; i < subninjas; ++i) {
+    char buf[256];
+    string file;
+
+    // The first file of each chain hangs off the top-level manifest; the
+    // rest each hang off the one before.
+    if (i % depth == 0)
+      top += "subninja " + SubninjaPath(i) + "\n";
+    if ((i + 1) % depth != 0 && i + 1 < subninjas)
+      file += "subninja " + SubninjaPath(i + 1) + "\n";
+
+    sprintf(buf, "defines = -DCOMPONENT_IMPLEMENTATION=%d -DUSE_NSS=1 "
+                 "-D_FILE_OFFSET_BITS=64 -DNDEBUG\n", i);
+    file += buf;
+    sprintf(buf, "includes = -Igen/component%d -I../../src/component%d "
+                 "-I../../third_party/component%d/include -I../..\n",
+            i, i, i);
+    file += buf;
+
+    int first = (int)((long long)options.edges * i / subninjas);
+    int last = (int)((long long)options.edges * (i + 1) / subninjas);
+    string objects;
+    for (int j = first; j < last; ++j) {
+      if (options.rebind_every > 0 && j > first &&
+          (j - first) % options.rebind_every == 0) {
+        sprintf(buf, "defines = -DCOMPONENT_IMPLEMENTATION=%d -DTARGET=%d\n",
+                i, j);
+        file += buf;
+      }
+      sprintf(buf, "obj/component%d/component%d.file%d.o", i, i, j);
+      objects += ' ';
+      objects += buf;
+      file += "build ";
+      file += buf;
+      sprintf(buf, ": cxx ../../src/component%d/file%d.cc", i, j);
+      file += buf;
+      for (int k = 1; k < options.fan_in; ++k) {
+        if (k == 1)
+          file += " |";
+        sprintf(buf, " ../../src/component%d/header%d.h", i,
+                (j * 7 + k) % 50);
+        file += buf;
+      }
+      file += '\n';
+      for (int k = 0; k < options.variables; ++k) {
+        if (k == 0)
+          sprintf(buf, "  cflags = $cflags -DFILE_ID=%d\n", j);
+        else
+          sprintf(buf, "  var%d = value%d\n", k, j);
+        file += buf;
+      }
+    }
+    sprintf(buf, "build obj/component%d/libcomponent%d.a: alink", i, i);
+    file += buf + objects + "\n";
+
+    if (!WriteFile(SubninjaPath(i), file, err))
+      return false;
+  }
+  return WriteFile(kManifest, top, err);
+}
+
+void RemoveManifest(const Options& options) {
+  unlink(kManifest);
+  for (int i = 0; i < options.subninjas; ++i)
+    unlink(SubninjaPath(i).c_str());
+}
+
+struct RealFileReader : public ManifestParser::FileReader {
+  virtual bool ReadFile(const string& path, string* content, string* err) {
+    return ::ReadFile(path, content, err) == 0;
+  }
+  virtual bool LoadFile(const string& path, MappedFile* file, string* err) {
+    return file->Load(path, err) == 0;
+  }
+};
+
+/// Load \a filename into a fresh State, returning the milliseconds it
+/// took and the allocations made along the way.
+int Measure(const char* filename, size_t* allocations, size_t* bytes,
+            int* edges) {
+  RealFileReader file_reader;
+  size_t allocations_start = g_allocations;
+  size_t bytes_start = g_allocated_bytes;
+  int64_t start = GetTimeMillis();
+  {
+    State state;
+    ManifestParser parser(&state, &file_reader);
+    string err;
+    if (!parser.Load(filename, &err))
+      Fatal("%s", err.c_str());
+    *edges = (int)state.edges_.size();
+    *allocations = g_allocations - allocations_start;
+    *bytes = g_allocated_bytes - bytes_start;
+  }
+  return (int)(GetTimeMillis() - start);
+}
+
+/// The process's peak resident set size in kilobytes, or -1 if unknown.
+long PeakMemoryKB() {
+#ifdef _WIN32
+  return -1;
+#else
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) < 0)
+    return -1;
+#ifdef __APPLE__
+  return usage.ru_maxrss / 1024;
+#else
+  return usage.ru_maxrss;
+#endif
+#endif
+}
+
+void Usage(const char* argv0) {
+  Options defaults;
+  printf(
+"usage: %s [options] [manifest]\n"
+"\n"
+"Times loading the given manifest, or a generated one shaped by:\n"
+"  -e N  compile edges in total (default %d)\n"
+"  -f N  inputs per compile edge (default %d)\n"
+"  -s N  subninja files (default %d)\n"
+"  -n N  subninja nesting depth (default %d)\n"
+"  -v N  bindings per compile edge (default %d)\n"
+"  -b N  rebind a file-level variable every N compile edges (default %d)\n"
+"options:\n"
+"  -r N  repetitions (default %d)\n"
+"  -k    keep the generated manifest\n",
+         argv0, defaults.edges, defaults.fan_in, defaults.subninjas,
+         defaults.depth, defaults.variables, defaults.rebind_every,
+         defaults.repetitions);
+}
+
+}  // anonymous namespace
+
+int main(int argc, char* argv[]) {
+  Options options;
+  const char* filename = NULL;
+  for (int i = 1; i < argc; ++i) {
+    const char* arg = argv[i];
+    if (strcmp(arg, "-k") == 0) {
+      options.keep = true;
+      continue;
+    }
+    if (arg[0] != '-') {
+      filename = arg;
+      continue;
+    }
+    if (strlen(arg) != 2 || i + 1 == argc) {
+      Usage(argv[0]);
+      return 1;
+    }
+    int value = atoi(argv[++i]);
+    switch (arg[1]) {
+      case 'e': options.edges = value; break;
+      case 'f': options.fan_in = value; break;
+      case 's': options.subninjas = value; break;
+      case 'n': options.depth = value; break;
+      case 'v': options.variables = value; break;
+      case 'b': options.rebind_every = value; break;
+      case 'r': options.repetitions = value; break;
+      default:
+        Usage(argv[0]);
+        return 1;
+    }
+  }
+  if (options.subninjas < 1)
+    options.subninjas = 1;
+  if (options.depth < 1)
+    options.depth = 1;
+  if (options.repetitions < 1)
+    options.repetitions = 1;
+
+  string err;
+  if (!filename) {
+    if (!WriteManifest(options, &err)) {
+      fprintf(stderr, "Failed to write test data: %s\n", err.c_str());
+      return 1;
+    }
+    filename = kManifest;
+  }
+
+  vector<int> times;
+  size_t allocations = 0, bytes = 0;
+  int edges = 0;
+  for (int i = 0; i < options.repetitions; ++i) {
+    int delta = Measure(filename, &allocations, &bytes, &edges);
+    printf("%dms\n", delta);
+    times.push_back(delta);
+  }
+
+  int min = times[0];
+  int max = times[0];
+  float total = 0;
+  for (size_t i = 0; i < times.size(); ++i) {
+    total += times[i];
+    if (times[i] < min)
+      min = times[i];
+    else if (times[i] > max)
+      max = times[i];
+  }
+
+  printf("%d edges\n", edges);
+  printf("min %dms  max %dms  avg %.1fms\n",
+         min, max, total / times.size());
+  printf("%lu allocations, %.1f MB allocated per load\n",
+         (unsigned long)allocations, bytes / (1024.0 * 1024.0));
+  long peak = PeakMemoryKB();
+  if (peak >= 0)
+    printf("peak memory %.1f MB\n", peak / 1024.0);
+
+  if (filename == kManifest && !options.keep)
+    RemoveManifest(options);
+
+  return 0;
+}
@@ -0,0 +1,97 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Compares the two ways of getting a manifest's text ready for the lexer:
+// reading it into a string and padding it with NULs, as the parser used
+// to, and mapping it with MappedFile.  Each load is followed by a pass
+// over every byte, so that lazily mapped pages are paid for too.
+
+#include <stdio.h>
+#include <string.h>
+
+#include "mapped_file.h"
+#include "metrics.h"
+#include "util.h"
+
+namespace {
+
+int CountLines(const char* data, size_t size) {
+  int lines = 0;
+  for (const char* end = data + size;
+       (data = (const char*)memchr(data, '\n', end - data)) != NULL; ++data) {
+    ++lines;
+  }
+  return lines;
+}
+
+bool LoadByReading(const char* filename, int* lines, string* err) {
+  string contents;
+  if (ReadFile(filename, &contents, err) < 0)
+    return false;
+  size_t size = contents.size();
+  contents.resize(size + 10);
+  *lines = CountLines(contents.data(), size);
+  return true;
+}
+
+bool LoadByMapping(const char* filename, int* lines, string* err) {
+  MappedFile file;
+  if (file.Load(filename, err) < 0)
+    return false;
+  *lines = CountLines(file.data(), file.size());
+  return true;
+}
+
+/// Time \a load on \a filename, in microseconds per load.
+float Measure(bool (*load)(const char*, int*, string*),
+              const char* filename) {
+  for (int limit = 1; limit < (1 << 20); limit *= 2) {
+    int64_t start = GetTimeMillis();
+    for (int rep = 0; rep < limit; ++rep) {
+      int lines;
+      string err;
+      if (!load(filename, &lines, &err))
+        Fatal("%s: %s", filename, err.c_str());
+    }
+    int64_t end = GetTimeMillis();
+
+    if (end - start > 100)
+      return (end - start) * 1000 / (float)limit;
+  }
+  return 0;
+}
+
+}  // anonymous namespace
+
+int main(int argc, char* argv[]) {
+  if (argc < 2) {
+    printf("usage: %s <file1> <file2...>\n", argv[0]);
+    return 1;
+  }
+
+  float total_read = 0, total_map = 0;
+  for (int i = 1; i < argc; ++i) {
+    const char* filename = argv[i];
+    float read = Measure(LoadByReading, filename);
+    float map = Measure(LoadByMapping, filename);
+    printf("%s: read %.1fus  map %.1fus\n", filename, read, map);
+    total_read += read;
+    total_map += map;
+  }
+  printf("total: read %.1fus  map %.1fus (%.0f%%)\n",
+         total_read, total_map,
+         total_read > 0 ? 100 * total_map / total_read : 0);
+
+  return 0;
+}
@@ -0,0 +1,108 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "mapped_file.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include "util.h"
+
+MappedFile::MappedFile() : data_(NULL), size_(0), mapped_size_(0) {
+  Clear();
+}
+
+MappedFile::~MappedFile() {
+  Clear();
+}
+
+int MappedFile::Load(const string& path, string* err) {
+  Clear();
+#ifndef _WIN32
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    err->assign(strerror(errno));
+    return -errno;
+  }
+  struct stat st;
+  bool mapped = fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+      Map(fd, st.st_size);
+  close(fd);
+  if (mapped)
+    return 0;
+#endif
+
+  string contents;
+  int ret = ::ReadFile(path, &contents, err);
+  if (ret < 0)
+    return ret;
+  Assign(contents);
+  return 0;
+}
+
+#ifndef _WIN32
+bool MappedFile::Map(int fd, size_t size) {
+  // Reserve zeroed anonymous memory for the file plus its padding, then
+  // map the file over the start of it.  The part of the file's last page
+  // past its end reads as zeros too, so the padding is NULs either way.
+  size_t page_size = sysconf(_SC_PAGESIZE);
+  size_t mapped_size =
+      (size + kPadding + page_size - 1) / page_size * page_size;
+  void* base = mmap(NULL, mapped_size, PROT_READ, MAP_PRIVATE | MAP_ANON,
+                    -1, 0);
+  if (base == MAP_FAILED)
+    return false;
+  if (size > 0 && mmap(base, size, PROT_READ, MAP_PRIVATE | MAP_FIXED,
+                       fd, 0) == MAP_FAILED) {
+    munmap(base, mapped_size);
+    return false;
+  }
+
+  data_ = static_cast<const char*>(base);
+  size_ = size;
+  mapped_size_ = mapped_size;
+  return true;
+}
+#endif
+
+void MappedFile::Assign(StringPiece contents) {
+  Clear();
+  copy_.clear();
+  copy_.reserve(contents.len_ + kPadding);
+  if (contents.len_)
+    copy_.append(contents.str_, contents.len_);
+  copy_.resize(contents.len_ + kPadding);
+  data_ = copy_.data();
+  size_ = contents.len_;
+}
+
+void MappedFile::Clear() {
+#ifndef _WIN32
+  if (mapped_size_)
+    munmap(const_cast<char*>(data_), mapped_size_);
+#endif
+  mapped_size_ = 0;
+  string().swap(copy_);
+  copy_.resize(kPadding);
+  data_ = copy_.data();
+  size_ = 0;
+}
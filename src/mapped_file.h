@@ -0,0 +1,70 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef NINJA_MAPPED_FILE_H_
+#define NINJA_MAPPED_FILE_H_
+
+#include <stddef.h>
+
+#include <string>
+using namespace std;
+
+#include "string_piece.h"
+
+/// The read-only contents of a file, followed by at least kPadding NUL
+/// bytes so that scanners like the lexer can run over it without bounds
+/// checks.
+///
+/// Regular files are mapped into memory rather than copied; anything that
+/// can't be mapped (pipes, or any file on Windows) is read into a buffer.
+struct MappedFile {
+  static const size_t kPadding = 16;
+
+  MappedFile();
+  ~MappedFile();
+
+  /// Load the file at \a path, replacing the current contents.
+  /// Returns -errno and fills in \a err on failure, like ReadFile().
+  int Load(const string& path, string* err);
+
+  /// Replace the contents with a copy of \a contents.
+  void Assign(StringPiece contents);
+
+  /// Discard the contents.
+  void Clear();
+
+  const char* data() const { return data_; }
+  size_t size() const { return size_; }
+  StringPiece contents() const { return StringPiece(data_, size_); }
+
+  /// True if the contents are mapped from the file rather than copied.
+  bool mapped() const { return mapped_size_ > 0; }
+
+ private:
+  /// Map the regular file open on \a fd whose size is \a size.
+  bool Map(int fd, size_t size);
+
+  const char* data_;
+  size_t size_;
+  /// The size of the mapping starting at data_, or 0 if not mapped.
+  size_t mapped_size_;
+  /// The contents if they were copied, padding included.
+  string copy_;
+
+  // Not copyable.
+  MappedFile(const MappedFile&);
+  void operator=(const MappedFile&);
+};
+
+#endif  // NINJA_MAPPED_FILE_H_
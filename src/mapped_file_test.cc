@@ -0,0 +1,101 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "mapped_file.h"
+
+#include <stdio.h>
+
+#include "test.h"
+
+namespace {
+
+const char kTestFilename[] = "MappedFileTest-tempfile";
+
+struct MappedFileTest : public testing::Test {
+  virtual void SetUp() {
+    temp_dir_.CreateAndEnter("Ninja-MappedFileTest");
+  }
+  virtual void TearDown() {
+    temp_dir_.Cleanup();
+  }
+
+  void WriteFile(const string& contents) {
+    FILE* f = fopen(kTestFilename, "wb");
+    ASSERT_TRUE(f);
+    fwrite(contents.data(), 1, contents.size(), f);
+    fclose(f);
+  }
+
+  void ExpectPadded(const MappedFile& file) {
+    for (size_t i = 0; i < MappedFile::kPadding; ++i)
+      EXPECT_EQ('\0', file.data()[file.size() + i]);
+  }
+
+  ScopedTempDir temp_dir_;
+};
+
+TEST_F(MappedFileTest, Load) {
+  ASSERT_NO_FATAL_FAILURE(WriteFile("build a: b\n"));
+  MappedFile file;
+  string err;
+  ASSERT_EQ(0, file.Load(kTestFilename, &err));
+  EXPECT_EQ("", err);
+  EXPECT_EQ("build a: b\n", file.contents().AsString());
+  ExpectPadded(file);
+#ifndef _WIN32
+  EXPECT_TRUE(file.mapped());
+#endif
+}
+
+TEST_F(MappedFileTest, PageSized) {
+  // A file filling whole pages still gets its padding.
+  string contents(64 << 10, 'x');
+  ASSERT_NO_FATAL_FAILURE(WriteFile(contents));
+  MappedFile file;
+  string err;
+  ASSERT_EQ(0, file.Load(kTestFilename, &err));
+  ASSERT_EQ(contents.size(), file.size());
+  EXPECT_EQ(0, memcmp(contents.data(), file.data(), contents.size()));
+  ExpectPadded(file);
+}
+
+TEST_F(MappedFileTest, Empty) {
+  ASSERT_NO_FATAL_FAILURE(WriteFile(""));
+  MappedFile file;
+  string err;
+  ASSERT_EQ(0, file.Load(kTestFilename, &err));
+  EXPECT_EQ(0u, file.size());
+  ExpectPadded(file);
+}
+
+TEST_F(MappedFileTest, Missing) {
+  MappedFile file;
+  file.Assign("stale");
+  string err;
+  EXPECT_GT(0, file.Load("nonexistent", &err));
+  EXPECT_NE("", err);
+  EXPECT_EQ(0u, file.size());
+  ExpectPadded(file);
+}
+
+TEST_F(MappedFileTest, Assign) {
+  MappedFile file;
+  ExpectPadded(file);
+  file.Assign("rule cc\n");
+  EXPECT_FALSE(file.mapped());
+  EXPECT_EQ("rule cc\n", file.contents().AsString());
+  ExpectPadded(file);
+}
+
+}  // anonymous namespace
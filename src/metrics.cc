@@ -82,9 +82,8 @@ ScopedMetric::ScopedMetric(Metric* metric) {
 ScopedMetric::~ScopedMetric() {
   if (!metric_)
     return;
-  metric_->count++;
   int64_t dt = TimerToMicros(HighResTimer() - start_);
-  metric_->sum += dt;
+  g_metrics->Record(metric_, dt);
 }
 
 Metric* Metrics::NewMetric(const string& name) {
@@ -92,11 +91,19 @@ Metric* Metrics::NewMetric(const string& name) {
   metric->name = name;
   metric->count = 0;
   metric->sum = 0;
+  MutexLock lock(&mutex_);
   metrics_.push_back(metric);
   return metric;
 }
 
+void Metrics::Record(Metric* metric, int64_t dt) {
+  MutexLock lock(&mutex_);
+  metric->count++;
+  metric->sum += dt;
+}
+
 void Metrics::Report() {
+  MutexLock lock(&mutex_);
   int width = 0;
   for (vector<Metric*>::iterator i = metrics_.begin();
        i != metrics_.end(); ++i) {
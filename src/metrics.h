@@ -19,6 +19,7 @@
 #include <vector>
 using namespace std;
 
+#include "mutex.h"
 #include "util.h"  // For int64_t.
 
 /// The Metrics module is used for the debug mode that dumps timing stats of
@@ -47,15 +48,22 @@ private:
   int64_t start_;
 };
 
-/// The singleton that stores metrics and prints the report.
+/// The singleton that stores metrics and prints the report.  Metrics may
+/// be recorded on ThreadPool workers too, as the scan's are; their times
+/// then add up across threads.
 struct Metrics {
   Metric* NewMetric(const string& name);
 
+  /// Count a run of \a metric that took \a dt micros.
+  void Record(Metric* metric, int64_t dt);
+
   /// Print a summary report to stdout.
   void Report();
 
 private:
   vector<Metric*> metrics_;
+  /// Guards metrics_ and the counts of the metrics in it.
+  Mutex mutex_;
 };
 
 /// Get the current time as relative to some epoch.
@@ -0,0 +1,95 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef NINJA_MUTEX_H_
+#define NINJA_MUTEX_H_
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+/// A lock for data shared with ThreadPool workers.
+struct Mutex {
+#ifdef _WIN32
+  Mutex() { InitializeCriticalSection(&section_); }
+  ~Mutex() { DeleteCriticalSection(&section_); }
+  void Lock() { EnterCriticalSection(&section_); }
+  void Unlock() { LeaveCriticalSection(&section_); }
+#else
+  Mutex() { pthread_mutex_init(&mutex_, NULL); }
+  ~Mutex() { pthread_mutex_destroy(&mutex_); }
+  void Lock() { pthread_mutex_lock(&mutex_); }
+  void Unlock() { pthread_mutex_unlock(&mutex_); }
+#endif
+
+ private:
+  friend struct ConditionVariable;
+
+#ifdef _WIN32
+  CRITICAL_SECTION section_;
+#else
+  pthread_mutex_t mutex_;
+#endif
+
+  // Not copyable.
+  Mutex(const Mutex&);
+  void operator=(const Mutex&);
+};
+
+/// Lets threads holding a Mutex wait for others to change what it guards.
+struct ConditionVariable {
+#ifdef _WIN32
+  ConditionVariable() { InitializeConditionVariable(&cond_); }
+  ~ConditionVariable() {}
+  /// Unlock \a mutex until woken, then lock it again.
+  void Wait(Mutex* mutex) {
+    SleepConditionVariableCS(&cond_, &mutex->section_, INFINITE);
+  }
+  void Broadcast() { WakeAllConditionVariable(&cond_); }
+#else
+  ConditionVariable() { pthread_cond_init(&cond_, NULL); }
+  ~ConditionVariable() { pthread_cond_destroy(&cond_); }
+  /// Unlock \a mutex until woken, then lock it again.
+  void Wait(Mutex* mutex) { pthread_cond_wait(&cond_, &mutex->mutex_); }
+  void Broadcast() { pthread_cond_broadcast(&cond_); }
+#endif
+
+ private:
+#ifdef _WIN32
+  CONDITION_VARIABLE cond_;
+#else
+  pthread_cond_t cond_;
+#endif
+
+  // Not copyable.
+  ConditionVariable(const ConditionVariable&);
+  void operator=(const ConditionVariable&);
+};
+
+/// Holds a Mutex locked for as long as it is in scope.
+struct MutexLock {
+  explicit MutexLock(Mutex* mutex) : mutex_(mutex) { mutex_->Lock(); }
+  ~MutexLock() { mutex_->Unlock(); }
+
+ private:
+  Mutex* mutex_;
+
+  // Not copyable.
+  MutexLock(const MutexLock&);
+  void operator=(const MutexLock&);
+};
+
+#endif  // NINJA_MUTEX_H_
@@ -15,10 +15,13 @@
 #include <errno.h>
 #include <limits.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
+#include <algorithm>
+
 #ifdef _WIN32
 #include "getopt.h"
 #include <direct.h>
@@ -32,14 +35,19 @@
 #include "build.h"
 #include "build_log.h"
 #include "clean.h"
+#include "deps_log.h"
 #include "disk_interface.h"
 #include "edit_distance.h"
 #include "explain.h"
+#include "file_monitor.h"
 #include "graph.h"
 #include "graphviz.h"
+#include "manifest_cache.h"
 #include "manifest_parser.h"
+#include "mapped_file.h"
 #include "metrics.h"
 #include "state.h"
+#include "thread_pool.h"
 #include "util.h"
 
 // Defined in msvc_helper_main-win32.cc.
@@ -51,10 +59,26 @@ namespace {
 /// be "git" on trunk.
 const char* kVersion = "git";
 
+/// The name of the deps log, in the build directory.
+const char kDepsLogPath[] = ".ninja_deps";
+
+/// How long a file monitor started by a build waits for the next one
+/// before exiting.
+const int kMonitorIdleSeconds = 15 * 60;
+
+/// Whether the scan may stat files through directory listings; see
+/// RealDiskInterface::AllowStatCache().
+bool g_stat_cache = true;
+
+/// Whether to scan the graph on one thread only; see
+/// DependencyScan::PrepareScan().
+bool g_serial_scan = false;
+
 /// Global information passed into subtools.
 struct Globals {
-  Globals() : state(new State()) {}
+  Globals() : state(new State()), history(new ManifestHistory) {}
   ~Globals() {
+    delete history;
     delete state;
   }
 
@@ -70,6 +94,8 @@ struct Globals {
   BuildConfig* config;
   /// Loaded state (rules, nodes). This is a pointer so it can be reset.
   State* state;
+  /// What each subninja added to state, for reloading the manifest.
+  ManifestHistory* history;
 };
 
 /// The type of functions that are the entry points to tools (subcommands).
@@ -143,11 +169,68 @@ struct RealFileReader : public ManifestParser::FileReader {
   virtual bool ReadFile(const string& path, string* content, string* err) {
     return ::ReadFile(path, content, err) == 0;
   }
+  virtual bool LoadFile(const string& path, MappedFile* file, string* err) {
+    return file->Load(path, err) == 0;
+  }
 };
 
+/// Load \a input_file into the global state, from the manifest cache if
+/// it is up to date, and refresh the cache otherwise.  When reloading a
+/// regenerated manifest, the subninjas that didn't change are copied from
+/// the state loaded before rather than parsed again.  The copied edges
+/// share their scopes and rules with the edges they were copied from, so
+/// the copy moves the ownership of those into the new state; what is left
+/// of the state before can then be deleted.
+bool LoadManifest(Globals* globals, const char* input_file,
+                  DiskInterface* disk_interface, string* err) {
+  const char kManifestCachePath[] = ".ninja_manifest";
+  State* previous_state = globals->state;
+  ManifestHistory* previous_history = globals->history;
+  globals->state = new State();
+  globals->history = new ManifestHistory;
+
+  string cache_err;
+  bool loaded = ManifestCache::Load(kManifestCachePath, input_file,
+                                    disk_interface, globals->state,
+                                    globals->history, &cache_err);
+  if (!loaded) {
+    if (!cache_err.empty())
+      Warning("%s; reparsing %s", cache_err.c_str(), input_file);
+    // A failed load may have left partial state behind.
+    globals->ResetState();
+
+    RealFileReader file_reader;
+    // The main thread evaluates statements while the workers lex.  With a
+    // single core, prefetching would only compete with it.
+    ThreadPool pool(GetProcessorCount() - 1);
+    ManifestParser parser(globals->state, &file_reader, &pool);
+    parser.SetHistory(previous_history, globals->history);
+    loaded = parser.Load(input_file, err);
+
+    // The cache is only an optimization; failing to write it is harmless.
+    if (loaded && !globals->config->dry_run) {
+      ManifestCache::Save(kManifestCachePath, parser.files(),
+                          disk_interface, *globals->state, globals->history,
+                          &cache_err);
+    }
+  }
+
+  delete previous_history;
+  delete previous_state;
+  return loaded;
+}
+
+/// The path of the file \a name in the build directory, if there is one.
+string BuildDirPath(Globals* globals, const char* name) {
+  const string build_dir =
+      globals->state->bindings_.LookupVariable("builddir");
+  return build_dir.empty() ? name : build_dir + "/" + name;
+}
+
 /// Rebuild the build manifest, if necessary.
 /// Returns true if the manifest was rebuilt.
-bool RebuildManifest(Builder* builder, const char* input_file, string* err) {
+bool RebuildManifest(Builder* builder, RealDiskInterface* disk_interface,
+                     const char* input_file, string* err) {
   string path = input_file;
   if (!CanonicalizePath(&path, err))
     return false;
@@ -155,7 +238,12 @@ bool RebuildManifest(Builder* builder, const char* input_file, string* err) {
   if (!node)
     return false;
 
-  if (!builder->AddTarget(node, err))
+  disk_interface->AllowStatCache(g_stat_cache);
+  builder->PrepareScan(vector<Node*>(1, node));
+  bool added = builder->AddTarget(node, err);
+  // Commands change files; stats from now on must see that.
+  disk_interface->AllowStatCache(false);
+  if (!added)
     return false;
 
   if (builder->AlreadyUpToDate())
@@ -282,6 +370,50 @@ int ToolQuery(Globals* globals, int argc, char* argv[]) {
   return 0;
 }
 
+int ToolDeps(Globals* globals, int argc, char** argv) {
+  DepsLog deps_log;
+  string err;
+  string path = BuildDirPath(globals, kDepsLogPath);
+  if (!deps_log.Load(path, globals->state, &err)) {
+    Error("loading deps log %s: %s", path.c_str(), err.c_str());
+    return 1;
+  }
+  if (!err.empty())
+    Warning("%s", err.c_str());
+
+  vector<Node*> nodes;
+  if (argc == 0) {
+    for (vector<Node*>::const_iterator ni = deps_log.nodes().begin();
+         ni != deps_log.nodes().end(); ++ni) {
+      if (deps_log.GetDeps(*ni))
+        nodes.push_back(*ni);
+    }
+  } else if (!CollectTargetsFromArgs(globals->state, argc, argv, &nodes,
+                                     &err)) {
+    Error("%s", err.c_str());
+    return 1;
+  }
+
+  RealDiskInterface disk_interface;
+  for (vector<Node*>::iterator it = nodes.begin(); it != nodes.end(); ++it) {
+    DepsLog::Deps* deps = deps_log.GetDeps(*it);
+    if (!deps) {
+      printf("%s: deps not found\n", (*it)->path().c_str());
+      continue;
+    }
+
+    TimeStamp mtime = disk_interface.Stat((*it)->path());
+    printf("%s: #deps %d, deps mtime %" PRId64 " (%s)\n",
+           (*it)->path().c_str(), deps->node_count, deps->mtime,
+           mtime > deps->mtime ? "STALE" : "VALID");
+    for (int i = 0; i < deps->node_count; ++i)
+      printf("    %s\n", deps->nodes[i]->path().c_str());
+    printf("\n");
+  }
+
+  return 0;
+}
+
 #if !defined(_WIN32) && !defined(NINJA_BOOTSTRAP)
 int ToolBrowse(Globals* globals, int argc, char* argv[]) {
   if (argc < 1) {
@@ -505,6 +637,23 @@ int ToolClean(Globals* globals, int argc, char* argv[]) {
   }
 }
 
+#ifdef __linux__
+int ToolMonitor(Globals* globals, int argc, char* argv[]) {
+  if (argc > 1) {
+    printf("usage: ninja -t monitor [socket]\n");
+    return 1;
+  }
+  FileMonitorServer server;
+  string err;
+  if (!server.Start(argc == 1 ? argv[0] : ".ninja_monitor", &err)) {
+    Error("%s", err.c_str());
+    return 1;
+  }
+  server.Serve(kMonitorIdleSeconds);
+  return 0;
+}
+#endif
+
 int ToolUrtle(Globals* globals, int argc, char** argv) {
   // RLE encoded.
   const char* urtle =
@@ -547,8 +696,14 @@ int ChooseTool(const string& tool_name, const Tool** tool_out) {
       Tool::RUN_AFTER_LOAD, ToolClean },
     { "commands", "list all commands required to rebuild given targets",
       Tool::RUN_AFTER_LOAD, ToolCommands },
+    { "deps", "show dependencies stored in the deps log",
+      Tool::RUN_AFTER_LOAD, ToolDeps },
     { "graph", "output graphviz dot file for targets",
       Tool::RUN_AFTER_LOAD, ToolGraph },
+#ifdef __linux__
+    { "monitor", "watch files for changes on behalf of later builds",
+      Tool::RUN_AFTER_FLAGS, ToolMonitor },
+#endif
     { "query", "show inputs/outputs for a path",
       Tool::RUN_AFTER_LOAD, ToolQuery },
     { "rules",    "list all rules",
@@ -596,6 +751,8 @@ bool DebugEnable(const string& name, Globals* globals) {
     printf("debugging modes:\n"
 "  stats    print operation counts/timing info\n"
 "  explain  explain what caused a command to execute\n"
+"  nostatcache  stat files one by one rather than via directory listings\n"
+"  serialscan   scan the graph on one thread, to debug the parallel scan\n"
 "multiple modes can be enabled via -d FOO -d BAR\n");
     return false;
   } else if (name == "stats") {
@@ -604,6 +761,12 @@ bool DebugEnable(const string& name, Globals* globals) {
   } else if (name == "explain") {
     g_explaining = true;
     return true;
+  } else if (name == "nostatcache") {
+    g_stat_cache = false;
+    return true;
+  } else if (name == "serialscan") {
+    g_serial_scan = true;
+    return true;
   } else {
     printf("ninja: unknown debug setting '%s'\n", name.c_str());
     return false;
@@ -614,10 +777,8 @@ bool OpenLog(BuildLog* build_log, Globals* globals,
              DiskInterface* disk_interface) {
   const string build_dir =
       globals->state->bindings_.LookupVariable("builddir");
-  const char* kLogPath = ".ninja_log";
-  string log_path = kLogPath;
+  string log_path = BuildDirPath(globals, ".ninja_log");
   if (!build_dir.empty()) {
-    log_path = build_dir + "/" + kLogPath;
     if (!disk_interface->MakeDirs(log_path) && errno != EEXIST) {
       Error("creating build directory %s: %s",
             build_dir.c_str(), strerror(errno));
@@ -625,6 +786,22 @@ bool OpenLog(BuildLog* build_log, Globals* globals,
     }
   }
 
+  // NINJA_LOG_FORMAT=binary opts in to the binary format, which older
+  // versions can't read.
+  const char* log_format = getenv("NINJA_LOG_FORMAT");
+  build_log->set_binary_format(log_format &&
+                               strcmp(log_format, "binary") == 0);
+  if (const char* sync_interval = getenv("NINJA_LOG_SYNC_INTERVAL"))
+    build_log->set_sync_interval(atoi(sync_interval));
+  if (const char* compaction = getenv("NINJA_LOG_COMPACTION")) {
+    int min_entries, ratio;
+    if (sscanf(compaction, "%d:%d", &min_entries, &ratio) == 2)
+      build_log->set_compaction_thresholds(min_entries, ratio);
+    else
+      Warning("ignoring NINJA_LOG_COMPACTION=%s, expected N:RATIO",
+              compaction);
+  }
+
   string err;
   if (!build_log->Load(log_path, &err)) {
     Error("loading build log %s: %s", log_path.c_str(), err.c_str());
@@ -646,6 +823,31 @@ bool OpenLog(BuildLog* build_log, Globals* globals,
   return true;
 }
 
+/// Load the deps log, and open it for writing unless this is a dry run.
+/// The build directory has been created by OpenLog().
+bool OpenDepsLog(DepsLog* deps_log, Globals* globals) {
+  string path = BuildDirPath(globals, kDepsLogPath);
+  string err;
+  if (!deps_log->Load(path, globals->state, &err)) {
+    Error("loading deps log %s: %s", path.c_str(), err.c_str());
+    return false;
+  }
+  if (!err.empty()) {
+    // Hack: Load() can return a warning via err by returning true.
+    Warning("%s", err.c_str());
+    err.clear();
+  }
+
+  if (!globals->config->dry_run) {
+    if (!deps_log->OpenForWrite(path, &err)) {
+      Error("opening deps log: %s", err.c_str());
+      return false;
+    }
+  }
+
+  return true;
+}
+
 /// Dump the output requested by '-d stats'.
 void DumpMetrics(Globals* globals) {
   g_metrics->Report();
@@ -657,7 +859,8 @@ void DumpMetrics(Globals* globals) {
          count / (double) buckets, count, buckets);
 }
 
-int RunBuild(Builder* builder, int argc, char** argv) {
+int RunBuild(Builder* builder, RealDiskInterface* disk_interface,
+             FileMonitor* monitor, int argc, char** argv) {
   string err;
   vector<Node*> targets;
   if (!CollectTargetsFromArgs(builder->state_, argc, argv, &targets, &err)) {
@@ -665,6 +868,15 @@ int RunBuild(Builder* builder, int argc, char** argv) {
     return 1;
   }
 
+  if (monitor) {
+    string monitor_err;
+    monitor->LoadMtimes(builder->state_, true, &monitor_err);
+    if (!monitor_err.empty())
+      Warning("%s", monitor_err.c_str());
+  }
+
+  disk_interface->AllowStatCache(g_stat_cache);
+  builder->PrepareScan(targets);
   for (size_t i = 0; i < targets.size(); ++i) {
     if (!builder->AddTarget(targets[i], &err)) {
       if (!err.empty()) {
@@ -676,6 +888,15 @@ int RunBuild(Builder* builder, int argc, char** argv) {
       }
     }
   }
+  // Commands change files; stats from now on must see that.
+  disk_interface->AllowStatCache(false);
+
+  if (monitor && !builder->config_.dry_run) {
+    if (!monitor->SaveMtimes(*builder->state_, &err)) {
+      Warning("%s", err.c_str());
+      err.clear();
+    }
+  }
 
   if (builder->AlreadyUpToDate()) {
     printf("ninja: no work to do.\n");
@@ -828,12 +1049,11 @@ int NinjaMain(int argc, char** argv) {
   }
 
   bool rebuilt_manifest = false;
+  RealDiskInterface disk_interface;
 
 reload:
-  RealFileReader file_reader;
-  ManifestParser parser(globals.state, &file_reader);
   string err;
-  if (!parser.Load(input_file, &err)) {
+  if (!LoadManifest(&globals, input_file, &disk_interface, &err)) {
     Error("%s", err.c_str());
     return 1;
   }
@@ -841,18 +1061,28 @@ reload:
   if (tool && tool->when == Tool::RUN_AFTER_LOAD)
     return tool->func(&globals, argc, argv);
 
-  BuildLog build_log;
-  RealDiskInterface disk_interface;
+  BuildLog build_log(globals.state);
   if (!OpenLog(&build_log, &globals, &disk_interface))
     return 1;
 
+  DepsLog deps_log;
+  if (!OpenDepsLog(&deps_log, &globals))
+    return 1;
+
+  // The main thread prepares its share of the scan too, so it takes one
+  // worker per other processor, like the manifest's lexing; with a single
+  // core, the scan stays on the main thread.
+  ThreadPool scan_pool(GetProcessorCount() - 1);
+
   if (!rebuilt_manifest) { // Don't get caught in an infinite loop by a rebuild
                            // target that is never up to date.
-    Builder manifest_builder(globals.state, config, &build_log,
+    Builder manifest_builder(globals.state, config, &build_log, &deps_log,
                              &disk_interface);
-    if (RebuildManifest(&manifest_builder, input_file, &err)) {
+    if (!g_serial_scan)
+      manifest_builder.SetScanPool(&scan_pool);
+    if (RebuildManifest(&manifest_builder, &disk_interface, input_file,
+                        &err)) {
       rebuilt_manifest = true;
-      globals.ResetState();
       goto reload;
     } else if (!err.empty()) {
       Error("rebuilding '%s': %s", input_file, err.c_str());
@@ -860,8 +1090,21 @@ reload:
     }
   }
 
-  Builder builder(globals.state, config, &build_log, &disk_interface);
-  int result = RunBuild(&builder, argc, argv);
+  Builder builder(globals.state, config, &build_log, &deps_log,
+                  &disk_interface);
+  if (!g_serial_scan)
+    builder.SetScanPool(&scan_pool);
+  // With NINJA_MONITOR set, files a monitor process saw no change to
+  // since the last build keep the mtimes that build found.
+  FileMonitor monitor(BuildDirPath(&globals, ".ninja_monitor"),
+                      BuildDirPath(&globals, ".ninja_mtimes"));
+  const char* use_monitor = getenv("NINJA_MONITOR");
+  if (use_monitor && strcmp(use_monitor, "1") != 0) {
+    Warning("ignoring NINJA_MONITOR=%s, expected 1", use_monitor);
+    use_monitor = NULL;
+  }
+  int result = RunBuild(&builder, &disk_interface,
+                        use_monitor ? &monitor : NULL, argc, argv);
   if (g_metrics)
     DumpMetrics(&globals);
   return result;
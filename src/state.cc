@@ -16,6 +16,9 @@
 
 #include <assert.h>
 #include <stdio.h>
+#include <string.h>
+
+#include <new>
 
 #include "edit_distance.h"
 #include "graph.h"
@@ -24,10 +27,30 @@
 
 const Rule State::kPhonyRule("phony");
 
-State::State() {
+State::State() : scan_generation_(1) {
   AddRule(&kPhonyRule);
 }
 
+State::~State() {
+  // The arena frees the memory, but the members still need destroying.
+  for (vector<Edge*>::iterator e = edges_.begin(); e != edges_.end(); ++e)
+    (*e)->~Edge();
+  for (DepSets::iterator i = dep_sets_.begin(); i != dep_sets_.end(); ++i)
+    i->second->~DepSet();
+  // Advancing the iterator may hash the current key, so only destroy the
+  // node (and so its path) after moving past it.
+  for (Paths::iterator i = paths_.begin(); i != paths_.end(); ) {
+    Node* node = i->second;
+    ++i;
+    node->~Node();
+  }
+  for (map<string, const Rule*>::iterator i = rules_.begin();
+       i != rules_.end(); ++i) {
+    if (i->second != &kPhonyRule)
+      delete i->second;
+  }
+}
+
 void State::AddRule(const Rule* rule) {
   assert(LookupRule(rule->name()) == NULL);
   rules_[rule->name()] = rule;
@@ -41,7 +64,8 @@ const Rule* State::LookupRule(const string& rule_name) {
 }
 
 Edge* State::AddEdge(const Rule* rule) {
-  Edge* edge = new Edge();
+  MutexLock lock(&mutex_);
+  Edge* edge = new (arena_.Alloc(sizeof(Edge))) Edge();
   edge->rule_ = rule;
   edge->env_ = &bindings_;
   edges_.push_back(edge);
@@ -49,14 +73,34 @@ Edge* State::AddEdge(const Rule* rule) {
 }
 
 Node* State::GetNode(StringPiece path) {
+  MutexLock lock(&mutex_);
   Node* node = LookupNode(path);
   if (node)
     return node;
-  node = new Node(path.AsString());
+  node = new (arena_.Alloc(sizeof(Node))) Node(path.AsString());
   paths_[node->path()] = node;
   return node;
 }
 
+DepSet* State::GetDepSet(Node** nodes, int node_count) {
+  MutexLock lock(&mutex_);
+  StringPiece key(reinterpret_cast<const char*>(nodes),
+                  node_count * sizeof(Node*));
+  DepSets::iterator i = dep_sets_.find(key);
+  if (i != dep_sets_.end())
+    return i->second;
+
+  Node** copy = static_cast<Node**>(arena_.Alloc(key.len_));
+  memcpy(copy, nodes, key.len_);
+  DepSet* dep_set = new (arena_.Alloc(sizeof(DepSet))) DepSet(copy,
+                                                              node_count);
+  dep_sets_.insert(make_pair(
+      StringPiece(reinterpret_cast<const char*>(copy), key.len_), dep_set));
+  for (int n = 0; n < node_count; ++n)
+    nodes[n]->AddOutDepSet(dep_set);
+  return dep_set;
+}
+
 Node* State::LookupNode(StringPiece path) {
   METRIC_RECORD("lookup node");
   Paths::iterator i = paths_.find(path);
@@ -115,7 +159,7 @@ vector<Node*> State::RootNodes(string* err) {
   for (vector<Edge*>::iterator e = edges_.begin(); e != edges_.end(); ++e) {
     for (vector<Node*>::iterator out = (*e)->outputs_.begin();
          out != (*e)->outputs_.end(); ++out) {
-      if ((*out)->out_edges().empty())
+      if ((*out)->out_edges().empty() && (*out)->out_dep_sets().empty())
         root_nodes.push_back(*out);
     }
   }
@@ -136,6 +180,7 @@ void State::Reset() {
     i->second->ResetState();
   for (vector<Edge*>::iterator e = edges_.begin(); e != edges_.end(); ++e)
     (*e)->outputs_ready_ = false;
+  ++scan_generation_;
 }
 
 void State::Dump() {
@@ -20,18 +20,26 @@
 #include <vector>
 using namespace std;
 
+#include "arena.h"
 #include "eval_env.h"
 #include "hash_map.h"
+#include "mutex.h"
 
+struct DepSet;
 struct Edge;
 struct Node;
 struct Rule;
 
 /// Global state (file status, loaded rules) for a single run.
+///
+/// GetNode(), AddEdge() and GetDepSet() may be called from several
+/// threads at once, as the scan does for the deps it loads; nothing else
+/// may be called meanwhile.
 struct State {
   static const Rule kPhonyRule;
 
   State();
+  ~State();
 
   void AddRule(const Rule* rule);
   const Rule* LookupRule(const string& rule_name);
@@ -40,6 +48,10 @@ struct State {
 
   Node* GetNode(StringPiece path);
   Node* LookupNode(StringPiece path);
+
+  /// Return the run of depfile deps made of the \a node_count nodes at
+  /// \a nodes, creating it if there's none yet.
+  DepSet* GetDepSet(Node** nodes, int node_count);
   Node* SpellcheckNode(const string& path);
 
   void AddIn(Edge* edge, StringPiece path);
@@ -50,6 +62,12 @@ struct State {
   /// state where we haven't yet examined the disk for dirty state.
   void Reset();
 
+  /// Numbers the current scan results apart from those before the last
+  /// Reset(), so that edges and dep sets can be marked as visited without
+  /// clearing the marks each time.  Starts from 1, as a mark of 0 stands
+  /// for none.
+  unsigned scan_generation() const { return scan_generation_; }
+
   /// Dump the nodes (useful for debugging).
   void Dump();
 
@@ -62,14 +80,27 @@ struct State {
   typedef ExternalStringHashMap<Node*>::Type Paths;
   Paths paths_;
 
-  /// All the rules used in the graph.
+  /// The runs of depfile deps, keyed by the bytes of their Node pointers.
+  typedef ExternalStringHashMap<DepSet*>::Type DepSets;
+  DepSets dep_sets_;
+
+  /// All the rules used in the graph.  Owned, other than kPhonyRule.
   map<string, const Rule*> rules_;
 
   /// All the edges of the graph.
   vector<Edge*> edges_;
 
+  /// The top-level scope, which owns the scopes nested in it and so those
+  /// of all the edges.
   BindingEnv bindings_;
   vector<Node*> defaults_;
+
+ private:
+  /// Holds all the nodes and edges.
+  Arena arena_;
+  /// Guards the arena and the tables that GetNode() and the like add to.
+  Mutex mutex_;
+  unsigned scan_generation_;
 };
 
 #endif  // NINJA_STATE_H_
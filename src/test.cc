@@ -19,6 +19,7 @@
 #include <errno.h>
 
 #include "build_log.h"
+#include "graph.h"
 #include "manifest_parser.h"
 #include "util.h"
 
@@ -94,7 +95,16 @@ void AssertHash(const char* expected, uint64_t actual) {
   ASSERT_EQ(BuildLog::LogEntry::HashCommand(expected), actual);
 }
 
-void VirtualFileSystem::Create(const string& path, int time,
+vector<Node*> DepfileDeps(const Edge* edge) {
+  vector<Node*> deps;
+  for (vector<DepSet*>::const_iterator i = edge->dep_sets_.begin();
+       i != edge->dep_sets_.end(); ++i) {
+    deps.insert(deps.end(), (*i)->begin(), (*i)->end());
+  }
+  return deps;
+}
+
+void VirtualFileSystem::Create(const string& path, TimeStamp time,
                                const string& contents) {
   files_[path].mtime = time;
   files_[path].contents = contents;
@@ -119,7 +129,10 @@ bool VirtualFileSystem::MakeDir(const string& path) {
 }
 
 string VirtualFileSystem::ReadFile(const string& path, string* err) {
-  files_read_.push_back(path);
+  {
+    MutexLock lock(&files_read_mutex_);
+    files_read_.push_back(path);
+  }
   FileMap::iterator i = files_.find(path);
   if (i != files_.end())
     return i->second.contents;
@@ -18,11 +18,13 @@
 #include <gtest/gtest.h>
 
 #include "disk_interface.h"
+#include "mutex.h"
 #include "state.h"
 #include "util.h"
 
 // Support utilites for tests.
 
+struct Edge;
 struct Node;
 
 /// A base test fixture that includes a State object with a
@@ -37,12 +39,15 @@ struct StateTestWithBuiltinRules : public testing::Test {
 void AssertParse(State* state, const char* input);
 void AssertHash(const char* expected, uint64_t actual);
 
+/// The depfile deps of \a edge, in order.
+vector<Node*> DepfileDeps(const Edge* edge);
+
 /// An implementation of DiskInterface that uses an in-memory representation
 /// of disk state.  It also logs file accesses and directory creations
 /// so it can be used by tests to verify disk access patterns.
 struct VirtualFileSystem : public DiskInterface {
   /// "Create" a file with a given mtime and contents.
-  void Create(const string& path, int time, const string& contents);
+  void Create(const string& path, TimeStamp time, const string& contents);
 
   // DiskInterface
   virtual TimeStamp Stat(const string& path);
@@ -53,12 +58,14 @@ struct VirtualFileSystem : public DiskInterface {
 
   /// An entry for a single in-memory file.
   struct Entry {
-    int mtime;
+    TimeStamp mtime;
     string contents;
   };
 
   vector<string> directories_made_;
   vector<string> files_read_;
+  /// Guards files_read_, as the scan reads depfiles on several threads.
+  Mutex files_read_mutex_;
   typedef map<string, Entry> FileMap;
   FileMap files_;
   set<string> files_removed_;
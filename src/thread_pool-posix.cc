@@ -0,0 +1,114 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "thread_pool.h"
+
+#include <algorithm>
+
+#include <string.h>
+
+#include "util.h"
+
+ThreadPool::ThreadPool(int num_threads) : shutdown_(false) {
+  pthread_mutex_init(&mutex_, NULL);
+  pthread_cond_init(&work_cond_, NULL);
+  pthread_cond_init(&done_cond_, NULL);
+  for (int i = 0; i < num_threads; ++i) {
+    pthread_t thread;
+    int ret = pthread_create(&thread, NULL, WorkerMain, this);
+    if (ret != 0) {
+      // Fewer workers only means less parallelism.
+      Warning("pthread_create: %s", strerror(ret));
+      break;
+    }
+    threads_.push_back(thread);
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  pthread_mutex_lock(&mutex_);
+  shutdown_ = true;
+  queue_.clear();
+  pthread_cond_broadcast(&work_cond_);
+  pthread_mutex_unlock(&mutex_);
+
+  for (vector<pthread_t>::iterator i = threads_.begin();
+       i != threads_.end(); ++i) {
+    pthread_join(*i, NULL);
+  }
+  pthread_cond_destroy(&done_cond_);
+  pthread_cond_destroy(&work_cond_);
+  pthread_mutex_destroy(&mutex_);
+}
+
+void ThreadPool::Post(Task* task) {
+  pthread_mutex_lock(&mutex_);
+  task->done_ = false;
+  queue_.push_back(task);
+  pthread_cond_signal(&work_cond_);
+  pthread_mutex_unlock(&mutex_);
+}
+
+void ThreadPool::Wait(Task* task) {
+  pthread_mutex_lock(&mutex_);
+  if (Unqueue(task)) {
+    pthread_mutex_unlock(&mutex_);
+    task->Run();
+    pthread_mutex_lock(&mutex_);
+    task->done_ = true;
+  }
+  while (!task->done_)
+    pthread_cond_wait(&done_cond_, &mutex_);
+  pthread_mutex_unlock(&mutex_);
+}
+
+bool ThreadPool::Cancel(Task* task) {
+  pthread_mutex_lock(&mutex_);
+  bool cancelled = Unqueue(task);
+  pthread_mutex_unlock(&mutex_);
+  return cancelled;
+}
+
+bool ThreadPool::Unqueue(Task* task) {
+  deque<Task*>::iterator i = find(queue_.begin(), queue_.end(), task);
+  if (i == queue_.end())
+    return false;
+  queue_.erase(i);
+  return true;
+}
+
+// static
+void* ThreadPool::WorkerMain(void* arg) {
+  static_cast<ThreadPool*>(arg)->Work();
+  return NULL;
+}
+
+void ThreadPool::Work() {
+  pthread_mutex_lock(&mutex_);
+  for (;;) {
+    while (queue_.empty() && !shutdown_)
+      pthread_cond_wait(&work_cond_, &mutex_);
+    if (shutdown_)
+      break;
+
+    Task* task = queue_.front();
+    queue_.pop_front();
+    pthread_mutex_unlock(&mutex_);
+    task->Run();
+    pthread_mutex_lock(&mutex_);
+    task->done_ = true;
+    pthread_cond_broadcast(&done_cond_);
+  }
+  pthread_mutex_unlock(&mutex_);
+}
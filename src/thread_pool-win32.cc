@@ -0,0 +1,48 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "thread_pool.h"
+
+#include <algorithm>
+
+// Condition variables only arrived with Vista, so on Windows the pool has
+// no workers and tasks run when they are waited for.
+
+ThreadPool::ThreadPool(int num_threads) {}
+
+ThreadPool::~ThreadPool() {}
+
+void ThreadPool::Post(Task* task) {
+  task->done_ = false;
+  queue_.push_back(task);
+}
+
+void ThreadPool::Wait(Task* task) {
+  if (Unqueue(task)) {
+    task->Run();
+    task->done_ = true;
+  }
+}
+
+bool ThreadPool::Cancel(Task* task) {
+  return Unqueue(task);
+}
+
+bool ThreadPool::Unqueue(Task* task) {
+  deque<Task*>::iterator i = find(queue_.begin(), queue_.end(), task);
+  if (i == queue_.end())
+    return false;
+  queue_.erase(i);
+  return true;
+}
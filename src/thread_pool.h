@@ -0,0 +1,85 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef NINJA_THREAD_POOL_H_
+#define NINJA_THREAD_POOL_H_
+
+#include <deque>
+#include <vector>
+using namespace std;
+
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+
+/// ThreadPool runs Tasks on a fixed set of worker threads.
+///
+/// Tasks are owned by the caller, who must Wait() for each one it posts
+/// before destroying it.  On platforms without thread support (currently
+/// Windows) the pool has no workers and tasks run on the thread that
+/// waits for them.
+struct ThreadPool {
+  struct Task {
+    Task() : done_(false) {}
+    virtual ~Task() {}
+
+    /// Do the work.  Called exactly once, on an arbitrary thread.
+    virtual void Run() = 0;
+
+   private:
+    friend struct ThreadPool;
+    bool done_;
+  };
+
+  /// Start \a num_threads workers.  With zero, every task runs in Wait().
+  explicit ThreadPool(int num_threads);
+  /// Waits for running tasks; queued ones are dropped unrun.
+  ~ThreadPool();
+
+  /// Queue \a task to be run.
+  void Post(Task* task);
+
+  /// Block until \a task has run.  If no worker picked it up yet, it is
+  /// run on the calling thread instead.
+  void Wait(Task* task);
+
+  /// Take \a task back out of the queue.  Returns false if a worker has
+  /// already started it, in which case it must still be waited for.
+  bool Cancel(Task* task);
+
+  /// The number of worker threads.
+  int size() const { return (int)threads_.size(); }
+
+ private:
+  /// Take \a task out of the queue if it is still there.
+  bool Unqueue(Task* task);
+
+  deque<Task*> queue_;
+#ifdef _WIN32
+  vector<int> threads_;
+#else
+  static void* WorkerMain(void* arg);
+  void Work();
+
+  vector<pthread_t> threads_;
+  pthread_mutex_t mutex_;
+  /// Signalled when a task is queued or the pool shuts down.
+  pthread_cond_t work_cond_;
+  /// Signalled when a task finishes running.
+  pthread_cond_t done_cond_;
+  bool shutdown_;
+#endif
+};
+
+#endif  // NINJA_THREAD_POOL_H_
@@ -0,0 +1,71 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "thread_pool.h"
+
+#include <gtest/gtest.h>
+
+namespace {
+
+struct SumTask : public ThreadPool::Task {
+  SumTask() : n(0), sum(0), runs(0) {}
+  virtual void Run() {
+    for (int i = 1; i <= n; ++i)
+      sum += i;
+    ++runs;
+  }
+  int n;
+  long long sum;
+  int runs;
+};
+
+TEST(ThreadPoolTest, RunsEveryTaskOnce) {
+  const int kTasks = 100;
+  SumTask tasks[kTasks];
+  ThreadPool pool(4);
+  for (int i = 0; i < kTasks; ++i) {
+    tasks[i].n = i * 1000;
+    pool.Post(&tasks[i]);
+  }
+  // Wait in reverse, so some tasks are likely still queued and get run
+  // by the waiting thread.
+  for (int i = kTasks - 1; i >= 0; --i) {
+    pool.Wait(&tasks[i]);
+    EXPECT_EQ(1, tasks[i].runs);
+    EXPECT_EQ((long long)i * 1000 * (i * 1000 + 1) / 2, tasks[i].sum);
+  }
+}
+
+TEST(ThreadPoolTest, NoThreads) {
+  ThreadPool pool(0);
+  EXPECT_EQ(0, pool.size());
+  SumTask task;
+  task.n = 10;
+  pool.Post(&task);
+  EXPECT_EQ(0, task.runs);
+  pool.Wait(&task);
+  EXPECT_EQ(1, task.runs);
+  EXPECT_EQ(55, task.sum);
+}
+
+TEST(ThreadPoolTest, Cancel) {
+  ThreadPool pool(0);
+  SumTask task;
+  pool.Post(&task);
+  EXPECT_TRUE(pool.Cancel(&task));
+  EXPECT_FALSE(pool.Cancel(&task));
+  EXPECT_EQ(0, task.runs);
+}
+
+}  // anonymous namespace
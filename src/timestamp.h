@@ -15,10 +15,20 @@
 #ifndef NINJA_TIMESTAMP_H_
 #define NINJA_TIMESTAMP_H_
 
+#ifdef _WIN32
+#include "win32port.h"
+#else
+#ifndef __STDC_FORMAT_MACROS
+#define __STDC_FORMAT_MACROS
+#endif
+#include <inttypes.h>
+#endif
+
 // When considering file modification times we only care to compare
 // them against one another -- we never convert them to an absolute
-// real time.  On POSIX we use time_t (seconds since epoch) and on
-// Windows we use a different value.  Both fit in an int.
-typedef int TimeStamp;
+// real time.  They count nanoseconds, so that files written within the
+// same second still tell which came first: on POSIX since the epoch,
+// and on Windows since 2000.
+typedef int64_t TimeStamp;
 
 #endif  // NINJA_TIMESTAMP_H_
@@ -32,8 +32,15 @@
 #include <sys/time.h>
 #endif
 
+#include <algorithm>
 #include <vector>
 
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define NINJA_UTIL_SSE2
+#include <emmintrin.h>
+#endif
+
 #if defined(__APPLE__) || defined(__FreeBSD__)
 #include <sys/sysctl.h>
 #elif defined(__SVR4) && defined(__sun)
@@ -94,6 +101,48 @@ bool CanonicalizePath(string* path, string* err) {
   return true;
 }
 
+namespace {
+
+/// Return the first component from \a p (which starts a component) on
+/// that CanonicalizePath() has to rewrite -- an empty, "." or ".."
+/// component -- or \a end if there is none.
+const char* SkipCanonicalComponents(const char* p, const char* end) {
+  // Whether p starts a component.
+  bool at_component = true;
+
+#ifdef NINJA_UTIL_SSE2
+  // A component can only need rewriting where a '/' or '.' starts it, so
+  // look for those sixteen bytes at a time and only walk a chunk byte by
+  // byte when one shows up.
+  const __m128i slash = _mm_set1_epi8('/');
+  const __m128i dot = _mm_set1_epi8('.');
+  while (end - p >= 16) {
+    __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+    unsigned slashes = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, slash));
+    unsigned dots = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, dot));
+    unsigned starts = (slashes << 1) | (at_component ? 1 : 0);
+    if (starts & (slashes | dots))
+      break;
+    at_component = (slashes & 0x8000) != 0;
+    p += 16;
+  }
+#endif
+
+  for (; p < end; ++p) {
+    if (at_component) {
+      if (*p == '/')
+        return p;
+      if (*p == '.' && (p + 1 == end || p[1] == '/' ||
+                        (p[1] == '.' && (p + 2 == end || p[2] == '/'))))
+        return p;
+    }
+    at_component = *p == '/';
+  }
+  return end;
+}
+
+}  // anonymous namespace
+
 bool CanonicalizePath(char* path, size_t* len, string* err) {
   // WARNING: this function is performance-critical; please benchmark
   // any changes you make to it.
@@ -103,30 +152,35 @@ bool CanonicalizePath(char* path, size_t* len, string* err) {
     return false;
   }
 
-  const int kMaxPathComponents = 30;
-  char* components[kMaxPathComponents];
-  int component_count = 0;
-
   char* start = path;
-  char* dst = start;
   const char* src = start;
   const char* end = start + *len;
 
   if (*src == '/') {
 #ifdef _WIN32
     // network path starts with //
-    if (*len > 1 && *(src + 1) == '/') {
+    if (*len > 1 && *(src + 1) == '/')
       src += 2;
-      dst += 2;
-    } else {
+    else
       ++src;
-      ++dst;
-    }
 #else
     ++src;
-    ++dst;
 #endif
   }
+  while (end - src >= 3 && src[0] == '.' && src[1] == '.' && src[2] == '/')
+    src += 3;
+
+  // Components before |floor| are the root and any leading '..'s, which
+  // a later '..' can't remove.  Everything between |floor| and |dst| is
+  // whole components, each followed by a '/'.
+  char* floor = start + (src - start);
+
+  // Most paths are already canonical, or nearly so: leave everything up to
+  // the first component that needs rewriting where it is.
+  src = SkipCanonicalComponents(src, end);
+  if (src == end && end[-1] != '/')
+    return true;
+  char* dst = start + (src - start);
 
   while (src < end) {
     if (*src == '.') {
@@ -136,14 +190,17 @@ bool CanonicalizePath(char* path, size_t* len, string* err) {
         continue;
       } else if (src[1] == '.' && (src + 2 == end || src[2] == '/')) {
         // '..' component.  Back up if possible.
-        if (component_count > 0) {
-          dst = components[component_count - 1];
+        if (dst > floor) {
+          // Step back over the last component's '/', then to its start.
+          --dst;
+          while (dst > floor && dst[-1] != '/')
+            --dst;
           src += 3;
-          --component_count;
         } else {
           *dst++ = *src++;
           *dst++ = *src++;
           *dst++ = *src++;
+          floor = dst;
         }
         continue;
       }
@@ -154,11 +211,6 @@ bool CanonicalizePath(char* path, size_t* len, string* err) {
       continue;
     }
 
-    if (component_count == kMaxPathComponents)
-      Fatal("path has too many components : %s", path);
-    components[component_count] = dst;
-    ++component_count;
-
     while (*src != '/' && src != end)
       *dst++ = *src++;
     *dst++ = *src++;  // Copy '/' or final \0 character as well.
@@ -173,6 +225,101 @@ bool CanonicalizePath(char* path, size_t* len, string* err) {
   return true;
 }
 
+// 64bit MurmurHash2, by Austin Appleby
+#if defined(_MSC_VER)
+#define BIG_CONSTANT(x) (x)
+#else   // defined(_MSC_VER)
+#define BIG_CONSTANT(x) (x##LLU)
+#endif // !defined(_MSC_VER)
+uint64_t MurmurHash64A(const void* key, size_t len) {
+  static const uint64_t seed = 0xDECAFBADDECAFBADull;
+  const uint64_t m = BIG_CONSTANT(0xc6a4a7935bd1e995);
+  const int r = 47;
+  uint64_t h = seed ^ (len * m);
+  const uint64_t * data = (const uint64_t *)key;
+  const uint64_t * end = data + (len/8);
+  while(data != end) {
+    uint64_t k = *data++;
+    k *= m;
+    k ^= k >> r;
+    k *= m;
+    h ^= k;
+    h *= m;
+  }
+  const unsigned char* data2 = (const unsigned char*)data;
+  switch(len & 7)
+  {
+  case 7: h ^= uint64_t(data2[6]) << 48;
+  case 6: h ^= uint64_t(data2[5]) << 40;
+  case 5: h ^= uint64_t(data2[4]) << 32;
+  case 4: h ^= uint64_t(data2[3]) << 24;
+  case 3: h ^= uint64_t(data2[2]) << 16;
+  case 2: h ^= uint64_t(data2[1]) << 8;
+  case 1: h ^= uint64_t(data2[0]);
+          h *= m;
+  };
+  h ^= h >> r;
+  h *= m;
+  h ^= h >> r;
+  return h;
+}
+
+namespace {
+const uint64_t kMurmurSeed = 0xDECAFBADDECAFBADull;
+const uint64_t kMurmurM = BIG_CONSTANT(0xc6a4a7935bd1e995);
+const int kMurmurR = 47;
+}  // namespace
+
+MurmurHasher::MurmurHasher() : h_(kMurmurSeed), tail_len_(0), len_(0) {}
+
+void MurmurHasher::Mix(uint64_t k) {
+  k *= kMurmurM;
+  k ^= k >> kMurmurR;
+  k *= kMurmurM;
+  h_ ^= k;
+  h_ *= kMurmurM;
+}
+
+void MurmurHasher::Update(const void* data, size_t len) {
+  const unsigned char* p = (const unsigned char*)data;
+  len_ += len;
+  if (tail_len_ > 0) {
+    size_t n = min(len, sizeof(tail_) - tail_len_);
+    memcpy(tail_ + tail_len_, p, n);
+    tail_len_ += n;
+    p += n;
+    len -= n;
+    if (tail_len_ < sizeof(tail_))
+      return;
+    uint64_t k;
+    memcpy(&k, tail_, sizeof(k));
+    Mix(k);
+    tail_len_ = 0;
+  }
+  // Like MurmurHash64A(), read blocks in the machine's byte order.
+  for (; len >= 8; p += 8, len -= 8) {
+    uint64_t k;
+    memcpy(&k, p, sizeof(k));
+    Mix(k);
+  }
+  memcpy(tail_, p, len);
+  tail_len_ = len;
+}
+
+uint64_t MurmurHasher::Finish() {
+  if (tail_len_ > 0) {
+    for (size_t i = tail_len_; i-- > 0; )
+      h_ ^= uint64_t(tail_[i]) << (8 * i);
+    h_ *= kMurmurM;
+  }
+  Mix(len_);
+  h_ ^= h_ >> kMurmurR;
+  h_ *= kMurmurM;
+  h_ ^= h_ >> kMurmurR;
+  return h_;
+}
+#undef BIG_CONSTANT
+
 int ReadFile(const string& path, string* contents, string* err) {
   FILE* f = fopen(path.c_str(), "r");
   if (!f) {
@@ -39,6 +39,35 @@ bool CanonicalizePath(string* path, string* err);
 
 bool CanonicalizePath(char* path, size_t* len, string* err);
 
+/// A 64-bit hash of \a len bytes at \a key, for fingerprinting commands
+/// and file contents.
+uint64_t MurmurHash64A(const void* key, size_t len);
+
+/// Hashes a string handed over in pieces, so that it need not be put
+/// together in one place, nor measured first.  This is MurmurHash64A()
+/// but for the string's length, which goes in as a last block rather
+/// than into the seed, so the two don't hash alike.
+struct MurmurHasher {
+  MurmurHasher();
+
+  /// Hash the next \a len bytes of the string.
+  void Update(const void* data, size_t len);
+
+  /// The hash, once all the string has been given to Update().
+  uint64_t Finish();
+
+ private:
+  /// Hash in an 8-byte block of the string.
+  void Mix(uint64_t k);
+
+  uint64_t h_;
+  /// The bytes given that don't make up a whole block yet.
+  unsigned char tail_[8];
+  size_t tail_len_;
+  /// The length of the string so far.
+  uint64_t len_;
+};
+
 /// Read a file to a string (in text mode: with CRLF conversion
 /// on Windows).
 /// Returns -errno and fills in \a err on error.
@@ -136,6 +136,69 @@ TEST(CanonicalizePath, NotNullTerminated) {
   EXPECT_EQ("file ./file bar/.", string(path));
 }
 
+TEST(CanonicalizePath, ManyComponents) {
+  // There's no limit on the number of components.
+  string path, expected, err;
+  for (int i = 0; i < 100; ++i) {
+    path += "dir/";
+    expected += "dir/";
+  }
+  path += "./x/../foo.h";
+  expected += "foo.h";
+  EXPECT_TRUE(CanonicalizePath(&path, &err));
+  EXPECT_EQ(expected, path);
+
+  path.clear();
+  for (int i = 0; i < 100; ++i)
+    path += "dir/";
+  for (int i = 0; i < 100; ++i)
+    path += "../";
+  path += "foo.h";
+  EXPECT_TRUE(CanonicalizePath(&path, &err));
+  EXPECT_EQ("foo.h", path);
+}
+
+TEST(CanonicalizePath, LongPaths) {
+  // Non-canonical pieces at every offset of a path long enough to be
+  // checked in chunks.
+  for (int i = 1; i < 40; ++i) {
+    string dir(i, 'a');
+    string file = string(20, 'b') + ".h";
+    string path, err;
+
+    path = dir + "/./" + file;
+    EXPECT_TRUE(CanonicalizePath(&path, &err));
+    EXPECT_EQ(dir + "/" + file, path);
+
+    path = dir + "//" + file;
+    EXPECT_TRUE(CanonicalizePath(&path, &err));
+    EXPECT_EQ(dir + "/" + file, path);
+
+    path = dir + "/../" + file;
+    EXPECT_TRUE(CanonicalizePath(&path, &err));
+    EXPECT_EQ(file, path);
+
+    path = file + "/" + dir + "/..";
+    EXPECT_TRUE(CanonicalizePath(&path, &err));
+    EXPECT_EQ(file, path);
+  }
+
+  // Names merely starting with dots are canonical.
+  for (int i = 1; i < 40; ++i) {
+    string path = string(i, 'a') + "/.hidden/..x/" + string(i, 'c');
+    string expected = path;
+    string err;
+    EXPECT_TRUE(CanonicalizePath(&path, &err));
+    EXPECT_EQ(expected, path);
+  }
+
+  // A trailing slash is dropped.
+  string path = string(33, 'a') + "/";
+  string err;
+  EXPECT_TRUE(CanonicalizePath(&path, &err));
+  EXPECT_EQ(string(33, 'a'), path);
+}
+
 TEST(StripAnsiEscapeCodes, EscapeAtEnd) {
   string stripped = StripAnsiEscapeCodes("foo\33");
   EXPECT_EQ("foo", stripped);
@@ -163,3 +226,36 @@ TEST(ElideMiddle, ElideInTheMiddle) {
   string elided = ElideMiddle(input, 10);
   EXPECT_EQ("012...789", elided);
 }
+
+TEST(MurmurHasher, SplitsHashAlike) {
+  string text;
+  for (int i = 0; i < 100; ++i)
+    text.push_back((char)('a' + i % 26));
+  // Every length, split at every point, hashes as the whole string does.
+  for (size_t len = 0; len <= text.size(); ++len) {
+    MurmurHasher whole;
+    whole.Update(text.data(), len);
+    uint64_t expected = whole.Finish();
+    for (size_t split = 0; split <= len; ++split) {
+      MurmurHasher hasher;
+      hasher.Update(text.data(), split);
+      hasher.Update(text.data() + split, len - split);
+      EXPECT_EQ(expected, hasher.Finish());
+    }
+  }
+
+  // So do single bytes.
+  MurmurHasher whole, bytes;
+  whole.Update(text.data(), text.size());
+  for (size_t i = 0; i < text.size(); ++i)
+    bytes.Update(&text[i], 1);
+  EXPECT_EQ(whole.Finish(), bytes.Finish());
+}
+
+TEST(MurmurHasher, HashesLength) {
+  // Trailing zeros would hash alike if the length didn't go in.
+  MurmurHasher short_hasher, long_hasher;
+  short_hasher.Update("ab", 2);
+  long_hasher.Update("ab\0", 3);
+  EXPECT_NE(short_hasher.Finish(), long_hasher.Finish());
+}